@@ -0,0 +1,210 @@
+/*
+
+Alarm rule parser and evaluator. Doesn't depend on AmigaOS, all state lives
+in the caller-provided AlarmEngine.
+
+*/
+
+#include "alarm.h"
+
+#include <string.h>
+
+void alarm_init(AlarmEngine *engine)
+{
+	memset(engine, 0, sizeof(AlarmEngine));
+}
+
+static const char *skip_spaces(const char *p)
+{
+	while (*p == ' ' || *p == '\t') {
+		p++;
+	}
+
+	return p;
+}
+
+static const char *parse_number(const char *p, long *value)
+{
+	long result = 0;
+	const char *start;
+
+	p = skip_spaces(p);
+	start = p;
+
+	while (*p >= '0' && *p <= '9') {
+		result = result * 10 + (*p - '0');
+		p++;
+	}
+
+	if (p == start) {
+		return NULL;
+	}
+
+	*value = result;
+
+	return skip_spaces(p);
+}
+
+static int find_metric(const char *name, int length, const char *const *metric_names, int metric_count)
+{
+	int i;
+	for (i = 0; i < metric_count; i++) {
+		if ((int)strlen(metric_names[i]) == length && strncmp(name, metric_names[i], length) == 0) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static const char *parse_actions(const char *p, unsigned *actions)
+{
+	*actions = 0;
+
+	while (*p) {
+		const char *end = p;
+
+		while (*end && *end != '+' && *end != ' ') {
+			end++;
+		}
+
+		const int length = end - p;
+
+		if (length == 5 && strncmp(p, "flash", 5) == 0) {
+			*actions |= ALARM_ACTION_FLASH;
+		} else if (length == 3 && strncmp(p, "log", 3) == 0) {
+			*actions |= ALARM_ACTION_LOG;
+		} else if (length == 3 && strncmp(p, "run", 3) == 0) {
+			*actions |= ALARM_ACTION_RUN;
+		} else {
+			return NULL;
+		}
+
+		p = end;
+
+		while (*p == '+' || *p == ' ') {
+			p++;
+		}
+	}
+
+	return p;
+}
+
+int alarm_add(AlarmEngine *engine, const char *text, const char *const *metric_names, int metric_count)
+{
+	AlarmRule rule;
+	const char *p = skip_spaces(text);
+	const char *name = p;
+	long value;
+
+	if (engine->count >= ALARM_MAX_RULES) {
+		return -1;
+	}
+
+	memset(&rule, 0, sizeof(rule));
+	rule.actions = ALARM_ACTION_FLASH;
+
+	while (*p && *p != '>' && *p != '<' && *p != ' ') {
+		p++;
+	}
+
+	rule.metric = find_metric(name, p - name, metric_names, metric_count);
+
+	if (rule.metric < 0) {
+		return -1;
+	}
+
+	p = skip_spaces(p);
+
+	if (*p == '>') {
+		rule.compare = ALARM_ABOVE;
+	} else if (*p == '<') {
+		rule.compare = ALARM_BELOW;
+	} else {
+		return -1;
+	}
+
+	if (!(p = parse_number(p + 1, &value))) {
+		return -1;
+	}
+
+	rule.threshold = value;
+
+	if (*p == ',') {
+		if (!(p = parse_number(p + 1, &value))) {
+			return -1;
+		}
+
+		rule.duration = value;
+	}
+
+	if (*p == ',') {
+		if (!(p = parse_number(p + 1, &value))) {
+			return -1;
+		}
+
+		rule.hysteresis = value;
+	}
+
+	if (*p == ',') {
+		if (!(p = parse_actions(skip_spaces(p + 1), &rule.actions))) {
+			return -1;
+		}
+	}
+
+	if (*p) {
+		return -1;
+	}
+
+	strncpy(rule.label, text, ALARM_LABEL_LEN - 1);
+
+	engine->rules[engine->count] = rule;
+
+	return engine->count++;
+}
+
+static int condition_holds(const AlarmRule *rule, int value)
+{
+	return (rule->compare == ALARM_ABOVE) ? value > rule->threshold : value < rule->threshold;
+}
+
+static int condition_cleared(const AlarmRule *rule, int value)
+{
+	return (rule->compare == ALARM_ABOVE) ?
+		value < rule->threshold - rule->hysteresis :
+		value > rule->threshold + rule->hysteresis;
+}
+
+void alarm_evaluate(AlarmEngine *engine, const unsigned char *values, unsigned long now,
+	unsigned *fired, unsigned *cleared)
+{
+	int i;
+
+	*fired = 0;
+	*cleared = 0;
+
+	for (i = 0; i < engine->count; i++) {
+		AlarmRule *rule = &engine->rules[i];
+		const int value = values[rule->metric];
+
+		if (rule->active) {
+			if (condition_cleared(rule, value)) {
+				rule->active = 0;
+				rule->pending = 0;
+				*cleared |= 1U << i;
+			}
+		} else if (condition_holds(rule, value)) {
+			if (!rule->pending) {
+				rule->pending = 1;
+				rule->since = now;
+			}
+
+			if (now - rule->since >= rule->duration) {
+				rule->active = 1;
+				*fired |= 1U << i;
+			}
+		} else {
+			rule->pending = 0;
+		}
+	}
+}
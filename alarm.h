@@ -0,0 +1,63 @@
+#ifndef ALARM_H
+#define ALARM_H
+
+/*
+
+Threshold alarms evaluated against the sample stream. The engine is a fixed
+table of rules, so evaluating a tick is O(rules) and never allocates.
+
+A rule fires when its condition has held for 'duration' seconds, and clears
+when the value has moved 'hysteresis' units back past the threshold.
+
+*/
+
+#define ALARM_MAX_RULES 8
+#define ALARM_LABEL_LEN 32
+
+#define ALARM_ACTION_FLASH 1
+#define ALARM_ACTION_LOG 2
+#define ALARM_ACTION_RUN 4
+
+typedef enum {
+	ALARM_ABOVE,
+	ALARM_BELOW
+} AlarmCompare;
+
+typedef struct {
+	// Configuration
+	int metric; // Index into the value array passed to alarm_evaluate
+	AlarmCompare compare;
+	int threshold;
+	int hysteresis;
+	unsigned long duration;
+	unsigned actions;
+	char label[ALARM_LABEL_LEN];
+
+	// State
+	int pending;
+	int active;
+	unsigned long since;
+} AlarmRule;
+
+typedef struct {
+	AlarmRule rules[ALARM_MAX_RULES];
+	int count;
+} AlarmEngine;
+
+void alarm_init(AlarmEngine *engine);
+
+/*
+
+Parses "<metric><'>'|'<'><threshold>[,<seconds>[,<hysteresis>[,<actions>]]]",
+for example "cpu>90,30,5,flash+log". Metric names are looked up from the
+given table. Returns the rule index or -1 if the text isn't valid or the
+table is full.
+
+*/
+int alarm_add(AlarmEngine *engine, const char *text, const char *const *metric_names, int metric_count);
+
+// Bit N of 'fired' / 'cleared' is set when rule N changed state on this tick
+void alarm_evaluate(AlarmEngine *engine, const unsigned char *values, unsigned long now,
+	unsigned *fired, unsigned *cleared);
+
+#endif
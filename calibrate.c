@@ -0,0 +1,229 @@
+/*
+
+Duty cycle and sweep helpers for the measurement comparison. No AmigaOS
+dependencies, the caller drives the sweep once per second.
+
+*/
+
+#include "calibrate.h"
+
+#include <string.h>
+
+void duty_split(unsigned period_us, unsigned duty, unsigned *busy_us, unsigned *idle_us)
+{
+	if (duty > 100) {
+		duty = 100;
+	}
+
+	*busy_us = (unsigned long)period_us * duty / 100;
+	*idle_us = period_us - *busy_us;
+}
+
+void sweep_init(Sweep *sweep, int modes, int step_size, int settle, int measure)
+{
+	memset(sweep, 0, sizeof(Sweep));
+
+	if (modes > SWEEP_MAX_MODES) {
+		modes = SWEEP_MAX_MODES;
+	}
+
+	if (step_size < 100 / (SWEEP_MAX_STEPS - 1)) {
+		step_size = 100 / (SWEEP_MAX_STEPS - 1);
+	}
+
+	sweep->modes = modes;
+	sweep->step_size = step_size;
+	sweep->steps = 100 / step_size + 1;
+	sweep->settle = settle;
+	sweep->measure = measure;
+}
+
+int sweep_duty(const Sweep *sweep)
+{
+	const int duty = sweep->step * sweep->step_size;
+
+	return (duty > 100) ? 100 : duty;
+}
+
+int sweep_mode(const Sweep *sweep)
+{
+	return sweep->mode;
+}
+
+int sweep_feed(Sweep *sweep, int reported)
+{
+	if (sweep->done) {
+		return 0;
+	}
+
+	if (sweep->second >= sweep->settle) {
+		sweep->sum[sweep->mode][sweep->step] += reported;
+	}
+
+	if (++sweep->second < sweep->settle + sweep->measure) {
+		return 0;
+	}
+
+	sweep->second = 0;
+
+	if (++sweep->mode >= sweep->modes) {
+		sweep->mode = 0;
+
+		if (++sweep->step >= sweep->steps) {
+			sweep->done = 1;
+		}
+	}
+
+	return 1;
+}
+
+float sweep_result(const Sweep *sweep, int mode, int step)
+{
+	if (sweep->measure <= 0) {
+		return 0.0f;
+	}
+
+	return (float)sweep->sum[mode][step] / sweep->measure;
+}
+
+/*
+
+Pool adjacent violators: averages neighbouring points until the sequence
+is non-decreasing, which is the least-squares monotone fit.
+
+*/
+void calib_fit(const Sweep *sweep, int mode, unsigned char *curve)
+{
+	float value[CALIB_MAX_POINTS];
+	int weight[CALIB_MAX_POINTS];
+	int blocks = 0;
+	int i, j, k;
+
+	for (i = 0; i < sweep->steps; i++) {
+		value[blocks] = sweep_result(sweep, mode, i);
+		weight[blocks] = 1;
+		blocks++;
+
+		while (blocks > 1 && value[blocks - 2] > value[blocks - 1]) {
+			const int w = weight[blocks - 2] + weight[blocks - 1];
+
+			value[blocks - 2] = (value[blocks - 2] * weight[blocks - 2] +
+				value[blocks - 1] * weight[blocks - 1]) / w;
+			weight[blocks - 2] = w;
+			blocks--;
+		}
+	}
+
+	k = 0;
+
+	for (i = 0; i < blocks; i++) {
+		float v = value[i] + 0.5f;
+
+		if (v < 0.0f) v = 0.0f;
+		if (v > 100.0f) v = 100.0f;
+
+		for (j = 0; j < weight[i]; j++) {
+			curve[k++] = (unsigned char)v;
+		}
+	}
+}
+
+void calib_table(const unsigned char *curve, int points, unsigned char table[101])
+{
+	const int step = 100 / (points - 1);
+	int reported;
+	int k = 0;
+
+	for (reported = 0; reported <= 100; reported++) {
+		int load;
+
+		// Last segment whose start is at or below the reported value
+		while (k < points - 2 && curve[k + 1] <= reported) {
+			k++;
+		}
+
+		const int low = curve[k];
+		const int high = curve[k + 1];
+
+		if (reported <= low) {
+			load = k * step;
+		} else if (reported >= high) {
+			load = (k + 1) * step;
+		} else {
+			load = k * step + ((reported - low) * step + (high - low) / 2) / (high - low);
+		}
+
+		table[reported] = (load > 100) ? 100 : load;
+	}
+}
+
+// A trailing comma or more points than fit are errors, not cut off
+int calib_parse(const char *text, unsigned char *curve)
+{
+	int points = 0;
+
+	while (*text) {
+		int value = 0;
+		const char *start = text;
+
+		while (*text >= '0' && *text <= '9' && value <= 100) {
+			value = value * 10 + (*text++ - '0');
+		}
+
+		if (text == start || value > 100 || points == CALIB_MAX_POINTS) {
+			return 0;
+		}
+
+		curve[points++] = value;
+
+		if (*text == ',' && text[1]) {
+			text++;
+		} else if (*text) {
+			return 0;
+		}
+	}
+
+	// Points must split 0...100 evenly
+	if (points < 2 || 100 % (points - 1)) {
+		return 0;
+	}
+
+	return points;
+}
+
+void calib_format(const unsigned char *curve, int points, char *buffer, int size)
+{
+	int i;
+	int length = 0;
+
+	if (size <= 0) {
+		return;
+	}
+
+	buffer[0] = '\0';
+
+	for (i = 0; i < points; i++) {
+		char digits[4];
+		int count = 0;
+		int value = curve[i];
+
+		do {
+			digits[count++] = '0' + value % 10;
+			value /= 10;
+		} while (value);
+
+		if (length + count + 2 > size) {
+			break;
+		}
+
+		if (i) {
+			buffer[length++] = ',';
+		}
+
+		while (count) {
+			buffer[length++] = digits[--count];
+		}
+
+		buffer[length] = '\0';
+	}
+}
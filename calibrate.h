@@ -0,0 +1,61 @@
+#ifndef CALIBRATE_H
+#define CALIBRATE_H
+
+/*
+
+Portable parts of the measurement comparison: splitting a duty cycle into
+busy and idle time, and a sweep that steps the load generator through duty
+cycles and measuring modes while collecting what each mode reports.
+
+*/
+
+#define SWEEP_MAX_MODES 4
+#define SWEEP_MAX_STEPS 21
+
+typedef struct {
+	int modes;
+	int steps;
+	int step_size; // Duty cycle increment in percent
+
+	int settle;  // Seconds ignored after every change
+	int measure; // Seconds averaged per mode and step
+
+	// Position
+	int step;
+	int mode;
+	int second;
+	int done;
+
+	long sum[SWEEP_MAX_MODES][SWEEP_MAX_STEPS];
+} Sweep;
+
+void duty_split(unsigned period_us, unsigned duty, unsigned *busy_us, unsigned *idle_us);
+
+void sweep_init(Sweep *sweep, int modes, int step_size, int settle, int measure);
+
+int sweep_duty(const Sweep *sweep);
+int sweep_mode(const Sweep *sweep);
+
+// Feeds one reading per second, returns nonzero when duty or mode changed
+int sweep_feed(Sweep *sweep, int reported);
+
+// Average reported load in percent
+float sweep_result(const Sweep *sweep, int mode, int step);
+
+/*
+
+Calibration curve: what a mode reports at evenly spaced true loads from 0
+to 100%. calib_fit makes it monotone with a least-squares isotonic fit,
+calib_table inverts it into a lookup from reported to corrected load.
+
+*/
+#define CALIB_MAX_POINTS SWEEP_MAX_STEPS
+
+void calib_fit(const Sweep *sweep, int mode, unsigned char *curve);
+void calib_table(const unsigned char *curve, int points, unsigned char table[101]);
+
+// "0,9,21,...,100" <-> curve, parse returns the number of points or 0
+int calib_parse(const char *text, unsigned char *curve);
+void calib_format(const unsigned char *curve, int points, char *buffer, int size);
+
+#endif
@@ -0,0 +1,164 @@
+#include "collect.h"
+
+#include <string.h>
+
+static const uint8_t magic[4] = { 'C', 'P', 'U', 'W' };
+
+#define VERSION 1
+
+void collect_init(Collector *c)
+{
+	memset(c, 0, sizeof(*c));
+}
+
+int collect_encode(uint8_t *packet, const char *name, uint32_t sequence, const uint8_t *samples, int count)
+{
+	const size_t name_length = strlen(name);
+
+	if (!name_length || name_length >= COLLECT_NAME_LEN || count < 1 || count > COLLECT_MAX_BATCH) {
+		return 0;
+	}
+
+	uint8_t *out = packet;
+
+	memcpy(out, magic, sizeof(magic));
+	out += sizeof(magic);
+	*out++ = VERSION;
+	*out++ = name_length;
+	memcpy(out, name, name_length);
+	out += name_length;
+
+	*out++ = sequence >> 24;
+	*out++ = sequence >> 16;
+	*out++ = sequence >> 8;
+	*out++ = sequence;
+	*out++ = count;
+
+	memcpy(out, samples, count * COLLECT_METRICS);
+	out += count * COLLECT_METRICS;
+
+	return out - packet;
+}
+
+// FNV-1a
+static uint32_t hash_name(const char *name, int length)
+{
+	uint32_t hash = 2166136261u;
+	int i;
+
+	for (i = 0; i < length; i++) {
+		hash = (hash ^ (uint8_t)name[i]) * 16777619u;
+	}
+
+	return hash;
+}
+
+// Linear probing, hosts are never removed
+static CollectHost *find_host(Collector *c, const char *name, int length)
+{
+	uint32_t slot = hash_name(name, length) & (COLLECT_TABLE_SIZE - 1);
+
+	while (c->table[slot]) {
+		CollectHost *host = c->table[slot];
+
+		if (strncmp(host->name, name, length) == 0 && host->name[length] == '\0') {
+			return host;
+		}
+
+		slot = (slot + 1) & (COLLECT_TABLE_SIZE - 1);
+	}
+
+	if (c->used == COLLECT_MAX_HOSTS) {
+		return NULL;
+	}
+
+	CollectHost *host = &c->hosts[c->used++];
+
+	memcpy(host->name, name, length);
+	host->name[length] = '\0';
+	host->newest = COLLECT_SAMPLES - 1;
+	c->table[slot] = host;
+
+	return host;
+}
+
+static void add_sample(CollectHost *host, const uint8_t *values)
+{
+	host->newest = (host->newest + 1) % COLLECT_SAMPLES;
+	memcpy(host->samples[host->newest], values, COLLECT_METRICS);
+}
+
+CollectHost *collect_receive(Collector *c, const uint8_t *packet, int length, uint32_t now)
+{
+	const uint8_t *end = packet + length;
+
+	if (length < 6 || memcmp(packet, magic, sizeof(magic)) != 0 || packet[4] != VERSION) {
+		goto reject;
+	}
+
+	const int name_length = packet[5];
+	const uint8_t *in = packet + 6;
+
+	if (!name_length || name_length >= COLLECT_NAME_LEN || in + name_length + 5 > end) {
+		goto reject;
+	}
+
+	const char *name = (const char *)in;
+	in += name_length;
+
+	uint32_t sequence = (uint32_t)in[0] << 24 | (uint32_t)in[1] << 16 | (uint32_t)in[2] << 8 | in[3];
+	int count = in[4];
+	in += 5;
+
+	if (!count || in + count * COLLECT_METRICS != end) {
+		goto reject;
+	}
+
+	CollectHost *host = find_host(c, name, name_length);
+
+	if (!host) {
+		goto reject;
+	}
+
+	if (host->received) {
+		const uint32_t behind = host->expected - sequence;
+
+		// Duplicated or reordered, unless the sender has restarted
+		if (sequence < host->expected && behind <= COLLECT_SAMPLES) {
+			if (behind >= (uint32_t)count) {
+				goto reject;
+			}
+
+			// Only the samples not seen yet
+			in += behind * COLLECT_METRICS;
+			count -= behind;
+			sequence = host->expected;
+		} else if (sequence > host->expected) {
+			uint32_t gap = sequence - host->expected;
+
+			host->lost += gap;
+
+			// Repeats the last sample, a full ring of them at most
+			const uint8_t *last = host->samples[host->newest];
+
+			for (gap = gap < COLLECT_SAMPLES ? gap : COLLECT_SAMPLES; gap; gap--) {
+				add_sample(host, last);
+			}
+		}
+	}
+
+	host->expected = sequence + count;
+	host->received += count;
+	host->heard = now;
+
+	while (count--) {
+		add_sample(host, in);
+		in += COLLECT_METRICS;
+	}
+
+	return host;
+
+reject:
+	c->rejected++;
+	return NULL;
+}
@@ -0,0 +1,53 @@
+#ifndef COLLECT_H
+#define COLLECT_H
+
+/*
+
+Sample datagrams from many watchers. A sender batches its samples into
+one datagram of at most COLLECT_MAX_BATCH samples:
+
+	"CPUW", version, name length, name, first sequence number (32-bit big
+	endian), sample count, count * COLLECT_METRICS values
+
+The collector files them into a fixed-capacity hash table of hosts keyed
+by name, each with a ring of its recent samples. Gaps in the sequence
+repeat the last sample, so a lost datagram shows as a flat stretch.
+
+*/
+
+#include <stdint.h>
+
+#define COLLECT_METRICS 11
+#define COLLECT_SAMPLES 300
+#define COLLECT_MAX_HOSTS 16
+#define COLLECT_TABLE_SIZE 32 // Power of two, at most half full
+#define COLLECT_NAME_LEN 32
+#define COLLECT_MAX_BATCH 30
+#define COLLECT_PACKET_MAX (6 + COLLECT_NAME_LEN + 5 + COLLECT_MAX_BATCH * COLLECT_METRICS)
+
+typedef struct {
+	char name[COLLECT_NAME_LEN];
+	uint32_t expected; // Sequence number of the next sample
+	uint32_t newest; // Ring index of the latest sample
+	uint32_t received;
+	uint32_t lost;
+	uint32_t heard; // Caller's clock at the last datagram
+	uint8_t samples[COLLECT_SAMPLES][COLLECT_METRICS];
+} CollectHost;
+
+typedef struct {
+	CollectHost *table[COLLECT_TABLE_SIZE];
+	CollectHost hosts[COLLECT_MAX_HOSTS]; // In order of first contact
+	int used;
+	uint32_t rejected; // Malformed, stale or over the host limit
+} Collector;
+
+void collect_init(Collector *c);
+
+// Returns the datagram length, 0 if the batch doesn't fit
+int collect_encode(uint8_t *packet, const char *name, uint32_t sequence, const uint8_t *samples, int count);
+
+// Files a datagram, returns the host it came from or NULL if rejected
+CollectHost *collect_receive(Collector *c, const uint8_t *packet, int length, uint32_t now);
+
+#endif
@@ -19,17 +19,40 @@ TODO:
 #include <proto/icon.h>
 #include <proto/dos.h>
 #include <proto/keymap.h>
+#include <proto/bsdsocket.h>
 
 #include <dos/dos.h>
 #include <workbench/startup.h>
 #include <intuition/menuclass.h>
 #include <classes/requester.h>
 #include <classes/window.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <netdb.h>
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <math.h>
+#include <time.h>
+
+#include "alarm.h"
+#include "calibrate.h"
+#include "collect.h"
+#include "diskio.h"
+#include "export.h"
+#include "feed.h"
+#include "format.h"
+#include "heatmap.h"
+#include "history.h"
+#include "latency.h"
+#include "queue.h"
+#include "scrape.h"
+#include "raster.h"
+#include "trace.h"
+#include "trend.h"
+#include "wheel.h"
 
 #define NAME_STRING "CPU Watcher"
 #define VERSION_STRING NAME_STRING " 0.7"
@@ -37,16 +60,20 @@ TODO:
 
 static __attribute__((used)) char *version_string = "$VER: " VERSION_STRING DATE_STRING;
 
-#define WINDOW_TITLE_FORMAT "CPU: %3d%% RAM: %3d%% VID: %3d%%"
-#define SCREEN_TITLE_FORMAT \
-"CPU load: %3d%%. Free memory: %3d%%. Free video memory: %3d%%. Download: %4.1fKiB/s. Upload: %4.1fKiB/s. Mode: %s"
-
 #define WINDOW_TITLE_LEN 64
-#define SCREEN_TITLE_LEN 128
+#define SCREEN_TITLE_LEN 192
 
+// Default graph span, also the most samples a service batch carries
 #define MINUTES 5
 #define XSIZE (60 * MINUTES)
 
+// Graph spans the menu offers, the tooltype takes any within the limits
+#define MAX_MINUTES 60
+#define SPAN_CHOICES 5
+
+static const int span_minutes[SPAN_CHOICES] = { 1, 5, 15, 30, 60 };
+static const char *const span_labels[SPAN_CHOICES] = { "1 minute", "5 minutes", "15 minutes", "30 minutes", "1 hour" };
+
 // 0...100 %
 #define YSIZE 101
 
@@ -57,59 +84,372 @@ static __attribute__((used)) char *version_string = "$VER: " VERSION_STRING DATE
 #define GRID_COL	0xFF003000 // Dark green
 #define DL_COL		0xFF00A000 // Green
 #define UL_COL		0xFFFF1010 // Red
+#define DR_COL		0xFFF0C010 // Yellow
+#define DW_COL		0xFFF01090 // Magenta
+#define P50_COL		0xFF00A000 // Green
+#define P99_COL		0xFFF0C010 // Yellow
+#define PMAX_COL	0xFFFF1010 // Red
+#define DISP_COL	0xFFC0C0C0 // Grey
 #define BG_COL		0xFF000000
 
 #define MAX_OPAQUENESS 255
 #define MIN_OPAQUENESS 20
 
+// Window inner size can't exceed the limits given to WindowLimits
+#define MAX_BITMAP_SIZE 1024
+
+// Seconds without resizing before an oversized bitmap is shrunk
+#define SHRINK_DELAY 10
+
+// Memory for the compressed history, 64 KiB keeps about a day of mostly idle samples
+#define HISTORY_KIB 64
+
+#define ALARM_COMMAND_LEN 128
+#define ALARM_LOG_FILE "T:CPU_Watcher.log"
+
+// Flashing alarms invert the graph color
+#define FLASH_MASK 0x00FFFFFF
+
+#define PREFS_MAX_SIZE 4096
+#define PREFS_MAX_LINES 64
+
+// Slow-moving metrics are probed at most this many seconds apart
+#define PROBE_MAX_PERIOD 8
+
+// Percentage change that brings a probe back to the fastest rate
+#define PROBE_FAST_CHANGE 2
+
+// Simple mode sleeps this many microseconds between idle task runs
+#define SIMPLE_PERIOD 10000
+
+// Zero-spin mode wakes up at randomised intervals averaging this period
+#define ZERO_SPIN_PERIOD 10000
+
+// A wake-up later than this (microseconds) means the CPU was busy at the deadline
+#define ZERO_SPIN_LATE 250
+
+// Load generator cycle length in microseconds
+#define LOAD_PERIOD 20000
+
+// Measuring mode comparison: duty cycle step, settle and measure seconds
+#define COMPARE_STEP 25
+#define COMPARE_SETTLE 2
+#define COMPARE_MEASURE 5
+
+// Calibration uses finer steps
+#define CALIBRATE_STEP 10
+
+// Free memory forecast: samples needed and t statistic of the slope
+#define FORECAST_MIN_SAMPLES 60
+#define FORECAST_MIN_T 5.0
+
+// Wake-up latency probe task priority and default rate
+#define LATENCY_PRI 15
+#define LATENCY_HZ 50
+
+// CPU heatmap sub-samples per second in busy mode
+#define HEAT_HZ 1000
+
+// Above the GUI, below the latency probe
+#define SAMPLER_PRI 10
+
+// Samples the GUI can fall behind by, a power of two
+#define SAMPLE_QUEUE_LEN 256
+
+// Timer wheel slot width and the period of the main task's jobs
+#define WHEEL_TICK 10000
+#define JOB_PERIOD 1000000
+
+// The window size must be stable this long before the bitmap follows it
+#define RESIZE_SETTLE 150000
+
+// Public port of the shared sampling service
+#define SERVICE_PORT_NAME "CPU Watcher sampler"
+#define SERVICE_MAX_VIEWERS 16
+#define ROLE_NAME_LEN 16
+
+// Stress test viewers detach after at most this many batches
+#define STRESS_MAX_BATCHES 5
+
+// On-demand export, the extension comes from the format
+#define EXPORT_FILE "RAM:CPU_Watcher"
+
+// Export stream is moved aside when it grows past this
+#define STREAM_KIB 1024
+
+// Amiga time counts from 1978, exports use Unix time
+#define UNIX_EPOCH_OFFSET 252460800
+
+// UDP port of the collector, samples per datagram from a sender
+#define COLLECT_PORT 7460
+#define SEND_BATCH 5
+
+// A host is labelled silent after this many seconds without a datagram
+#define COLLECT_SILENT 10
+
+#define PREFS_NAME_LEN 128
+#define CALIBRATION_LEN 96
+
 extern struct Library *GfxBase;
 struct TimerIFace *ITimer = NULL;
 
+// Metrics in sample order, see the provider table
+typedef enum {
+	METRIC_CPU,
+	METRIC_VIRTUAL_MEM,
+	METRIC_VIDEO_MEM,
+	METRIC_UPLOAD,
+	METRIC_DOWNLOAD,
+	METRIC_DISK_READ,
+	METRIC_DISK_WRITE,
+	METRIC_LATENCY_P50,
+	METRIC_LATENCY_P99,
+	METRIC_LATENCY_MAX,
+	METRIC_DISPATCHES,
+	METRIC_COUNT
+} EMetric;
+
+// Stacked from the top, the lower ones can be hidden
+typedef enum {
+	PANEL_MAIN,
+	PANEL_NET,
+	PANEL_DISK,
+	PANEL_LATENCY
+} EPanel;
+
 typedef struct {
-	BOOL cpu;
+	BOOL graph[METRIC_COUNT];
 	BOOL grid;
-	BOOL virtual_mem;
-	BOOL video_mem;
 	BOOL solid_draw;
 	BOOL net;
+	BOOL disk;
+	BOOL latency;
 	BOOL dragbar;
 	BOOL resize;
+	BOOL direct_render;
+	BOOL heatmap;
 } Features;
 
 typedef struct {
-	ULONG cpu;
-	ULONG virtual_mem;
-	ULONG video_mem;
+	ULONG metric[METRIC_COUNT];
 	ULONG grid;
 	ULONG background;
-	ULONG upload;
-	ULONG download;
 } Colors;
 
 typedef struct {
-	UBYTE cpu;
-	UBYTE virtual_mem;
-	UBYTE video_mem;
-	UBYTE upload;
-	UBYTE download;
+	UBYTE values[METRIC_COUNT];
 } Sample;
 
+// The history codec stores whole samples
+_Static_assert(sizeof(Sample) == HISTORY_METRICS, "history and sample layout differ");
+
+// Collected hosts are plotted like the local ring
+_Static_assert(sizeof(Sample) == COLLECT_METRICS, "datagram and sample layout differ");
+
+// Viewer feeds queue whole samples
+_Static_assert(METRIC_COUNT <= FEED_MAX_METRICS, "too many metrics for a feed");
+
+typedef enum {
+	PLOT_GRAPH, // Line over the full panel height
+	PLOT_NET // Half height line in a lower panel, like the network graph
+} EPlotStyle;
+
+typedef enum {
+	MODE_BUSY,
+	MODE_SIMPLE,
+	MODE_ZERO_SPIN,
+	MODE_COUNT
+} EMeasureMode;
+
+static const char *const mode_names[MODE_COUNT] = { "Busy", "Simple", "Zero-spin" };
+
+typedef enum {
+	ROLE_AUTO, // Viewer if a service is running, otherwise the service
+	ROLE_SERVICE,
+	ROLE_VIEWER,
+	ROLE_STANDALONE,
+	ROLE_COUNT
+} ERole;
+
+static const char *const role_names[ROLE_COUNT] = { "auto", "service", "viewer", "standalone" };
+
+// Tooltypes holding the calibration curve of each mode
+static const char *const calibration_names[MODE_COUNT] = { "calbusy", "calsimple", "calzerospin" };
+
+/*
+
+Settings the prefs file can change while running. A reload parses the file
+over a copy of the running ones and applies only what differs, the history
+and the probes stay as they are.
+
+*/
+typedef struct {
+	Features features;
+	Colors colors;
+	int x_pos;
+	int y_pos;
+	UBYTE opaqueness;
+	ULONG capacity;
+	EMeasureMode mode;
+} LiveConfig;
+
+/*
+
+Each probe runs every 'period' ticks, the skipped ticks carry the previous
+value forward. Periods double while the value stays put and drop back to
+the minimum as soon as it starts to move.
+
+*/
+typedef struct {
+	UBYTE period;
+	UBYTE min_period;
+	UBYTE max_period;
+	UBYTE countdown;
+	ULONG calls;
+} ProbeSchedule;
+
 typedef struct {
 	struct TimeVal start;
 	struct TimeVal finish;
 	struct TimeVal total;
+
+	// Free running, only my_launch writes it
+	volatile ULONG dispatches;
+
+	// Microseconds of all finished runs, never reset
+	uint64 run_us;
 } IdleTime;
 
 static IdleTime idle_time;
 
+typedef struct {
+	STRPTR shown; // Intuition keeps referring to this one
+	STRPTR next;
+} Title;
+
+// Self-instrumentation, reported once per minute when enabled
+typedef struct {
+	BOOL report;
+
+	ULONG seconds;
+
+	ULONG title_updates;
+	ULONG title_updates_per_minute;
+
+	// Microseconds spent in the last window chrome change, by path
+	ULONG chrome_reconfigure_us;
+	ULONG chrome_recreate_us;
+	BOOL chrome_recreate;
+
+	ULONG bitmap_allocs;
+	ULONG bitmap_bytes;
+
+	// Samples that were drawn in the same frame as the next one
+	ULONG coalesced;
+
+	// Worst timer wake-up after the earliest job deadline, microseconds
+	ULONG timer_late_max;
+
+	// From main to the first frame, or to the main loop without a window
+	struct TimeVal started;
+	ULONG startup_us;
+} Stats;
+
+// What is known of a sample beside its graph levels
+typedef struct {
+	struct TimeVal time;
+
+	// Raw network byte counters, for the trace
+	uint64 net_in;
+	uint64 net_out;
+
+	// Shown in the screen title
+	float dl_speed;
+	float ul_speed;
+	ULONG disk_read_rate;
+	ULONG disk_write_rate;
+	ULONG dispatch_rate;
+	ULONG latency_p50;
+	ULONG latency_p99;
+	ULONG latency_max;
+	BOOL disk; // Disk rates are measured
+	BOOL latency; // Latency probe is running
+	EMeasureMode mode;
+} SampleInfo;
+
+// A sample on its way from the probes to the ring
+typedef struct {
+	Sample sample;
+	float multiplier[METRIC_COUNT]; // Rescales of the samples already in the ring
+	SampleInfo info;
+	HeatColumn heat; // CPU sub-samples, empty if there were none
+} QueuedSample;
+
+typedef enum {
+	SERVICE_ATTACH,
+	SERVICE_DETACH,
+	SERVICE_SAMPLES,
+	SERVICE_SHUTDOWN // Samples message telling the viewer to stop
+} EServiceRequest;
+
+/*
+
+Viewers send attach and detach requests with their own message, the
+service replies to it. Sample batches go the other way, with a message
+owned by the service.
+
+*/
+typedef struct {
+	struct Message message;
+	EServiceRequest request;
+	BOOL accepted; // Reply to an attach request
+	struct MsgPort *viewer_port;
+
+	// Sequence number of the first sample, numbering starts from 1
+	uint32 first;
+	uint32 count;
+
+	// Applied to the viewer's ring before the batch is added
+	float multiplier[METRIC_COUNT];
+
+	SampleInfo info; // Of the last sample
+	Sample samples[XSIZE];
+} ServiceMsg;
+
+// Service side state of an attached viewer
+typedef struct {
+	struct MsgPort *port;
+	ServiceMsg *batch;
+	Feed feed;
+	Sample pending[XSIZE]; // Storage of the feed
+} Viewer;
+
 typedef struct {
 	struct Window *window;
 	struct BitMap *bm;
 	struct RastPort rastPort;
 
+	// Allocated bitmap size, may have headroom over the window size
+	ULONG bm_width;
+	ULONG bm_height;
+
+	// Video memory bitmap instead of a user private one
+	BOOL bm_displayable;
+
+	ULONG last_resize;
+	ULONG shrink_delay;
+
+	// Valid only while the bitmap is locked for direct rendering
+	Raster raster;
+	int pen_x;
+	int pen_y;
+
 	Object* windowObject;
 	Object* menu;
 
+	// Owned by us, window.class doesn't free it
+	struct DiskObject *icon;
+
 	ULONG width;
 	ULONG height;
 
@@ -124,12 +464,21 @@ typedef struct {
 	struct Task *idle_task;
 
 	BYTE idle_sig;
-	BYTE main_sig;
+	BYTE main_sig; // Raised by the idle task, the other tasks have their own
 
 	struct TimeRequest *timer_req;
 
 	BYTE timer_device;
-	struct TimeVal tv;
+
+	// Periodic jobs of the main task, the timer request waits for the earliest
+	Wheel wheel;
+	WheelJob shrink_job;
+	WheelJob replay_job;
+	WheelJob resize_job;
+	uint64 timer_due; // 0 when the request isn't out
+
+	// WINDOW_SigMask, queried when the window opens or iconifies
+	uint32 window_sig;
 
 	int x_pos;
 	int y_pos;
@@ -139,34 +488,239 @@ typedef struct {
 	 // Corresponds to seconds ran
 	ULONG iter;
 
+	// Ring slots, one per second of the graph span
+	ULONG capacity;
+	ULONG stored; // Samples in the ring, at most capacity
+
 	volatile BOOL running;
 
 	volatile BOOL idler_trouble;
 
-	// Simple mode switches to non-busy looping option when measuring the CPU usage.
-	volatile BOOL simple_mode;
+	// Simple and zero-spin modes switch to non-busy looping options when measuring the CPU usage.
+	volatile EMeasureMode mode;
 
 	// How many times idle task was ran during 1 second. Run count 0 means 100% cpu usage, 100 means 0 % CPU usage
 	volatile ULONG run_count;
 
-	STRPTR window_title;
-	STRPTR screen_title;
+	// Zero-spin mode: wake-ups of the idle task and how many of them were late
+	volatile ULONG wake_count;
+	volatile ULONG late_count;
+
+	// Synthetic load generator used by the measuring mode comparison
+	struct Task *load_task;
+	BYTE load_sig; // Only the load task raises it, when it's done
+	volatile BOOL load_running;
+	volatile UBYTE load_duty;
+
+	BOOL compare;
+	BOOL calibrate;
+	BOOL sweeping;
+	Sweep sweep;
+	EMeasureMode saved_mode;
+
+	// Maps reported load to corrected load, per measuring mode
+	BOOL calibrated[MODE_COUNT];
+	UBYTE correction[MODE_COUNT][101];
+
+	char prefs_file[PREFS_NAME_LEN];
+
+	// DOS notification of prefs file changes, NULL when not watching
+	struct NotifyRequest *prefs_notify;
+	BYTE prefs_sig;
+
+	// Raw network byte counters of the latest measurement
+	uint64 net_in;
+	uint64 net_out;
+
+	// Probes fill this one, the sampler task owns it. When replaying it's
+	// filled by the main task instead.
+	QueuedSample measured;
+
+	// Sampler task pushes measured samples to the main task
+	struct Task *sampler_task;
+	volatile BOOL sampler_running;
+	BYTE sample_sig;
+	BYTE sampler_exit_sig; // Only the sampler raises it, when it's done
+	Queue sample_queue;
+	QueuedSample *queued;
+	ULONG samples_dropped; // Queue was full, written by the sampler task
+
+	// Sample being taken into the ring, and what goes with the latest one
+	const Sample *incoming;
+	const HeatColumn *incoming_heat;
+	SampleInfo info;
+
+	// Sample trace recording and replay
+	char record_file[PREFS_NAME_LEN];
+	char replay_file[PREFS_NAME_LEN];
+	Trace record;
+	Trace replay;
+	BOOL replay_fast;
+	ULONG replay_frames;
+	struct TimeVal replay_start;
+
+	// Compressed long-term history, the samples ring above is the recent part
+	History history;
+	HistoryBlock *history_blocks;
+	int history_kib;
+	float history_scale[METRIC_COUNT]; // Product of the rescales so far
+	ULONG history_encode_us; // Spent encoding replayed samples
+
+	Title window_title;
+	Title screen_title;
+
+	// Forces the next title update, for example after the window was reopened
+	BOOL titles_invalid;
+
+	Stats stats;
 
 	Features features;
 
 	Colors colors;
 
+	// Buffers sized at startup share one allocation. A resized ring gets a
+	// block of its own.
+	UBYTE *arena;
+	UBYTE *ring_block;
+
 	Sample *samples;
+	SampleInfo *infos; // Parallel to samples
+	ULONG taken; // Samples taken into the ring
+
+	// Sample export, on demand and as a continuous stream
+	EExportFormat export_format;
+	const char *export_names[METRIC_COUNT];
+	char export_file[PREFS_NAME_LEN];
+	char stream_file[PREFS_NAME_LEN];
+	int stream_kib;
+	FILE *stream;
+	Exporter *streamer;
+	BOOL headless; // No window, samples go to the stream or to viewers
+
+	// Prometheus endpoint on the loopback interface, 0 port disables it
+	int metrics_port;
+	Scraper *scraper;
+
+	// Samples sent to a collector, send_batch per datagram
+	char send_host[PREFS_NAME_LEN];
+	char host_name[COLLECT_NAME_LEN];
+	int collect_port;
+	int send_batch;
+	LONG send_socket;
+	struct sockaddr_in send_addr;
+	ULONG send_base; // Sequence number of the first sample, restarts continue from a later one
+	ULONG send_failures;
+
+	// Collector mode draws the hosts instead of the local graphs
+	BOOL collect;
+	LONG collect_socket;
+	Collector *collector;
+	int sim_senders;
+	Sample *sim_batches; // One batch per simulated sender
+	ULONG sim_seed;
+
+	// CPU heatmap, a column per sample in the ring. The idle task fills the
+	// live column, the sampler task moves it to the queued sample.
+	int heat_hz;
+	HeatSlicer heat_slicer;
+	HeatColumn heat_live;
+	HeatColumn *heat_columns;
+	ULONG heat_painted; // Samples taken when the bitmap columns were painted
+	BOOL heat_valid; // Bitmap holds the painted columns
+
+	// Origin of the graph being drawn, a host cell in collector mode
+	int plot_left;
+	int plot_top;
+
+	AlarmEngine alarms;
+	char alarm_commands[ALARM_MAX_RULES][ALARM_COMMAND_LEN];
+	char alarm_log[ALARM_COMMAND_LEN];
+
+	// Bit per metric that has a firing alarm with the flash action
+	ULONG alarm_flash;
+
+	// Indexed by metric, used by the metrics that have a probe
+	ProbeSchedule probes[METRIC_COUNT];
+
+	// Doesn't change while running, queried once
+	ULONG total_memory;
 
 	float dl_speed;
 	float ul_speed;
 
+	// Disk activity, the source is either patched devices or a counter file
+	DiskStats disk;
+	DiskSource disk_source;
+	char disk_devices[PREFS_NAME_LEN];
+	char disk_file[PREFS_NAME_LEN];
+	BOOL disk_patched;
+	struct TimeVal disk_poll;
+
+	// Wake-up latency probe, the task fills the live histogram
+	struct Task *latency_task;
+	BYTE latency_sig; // Only the latency task raises it, when it's done
+	volatile BOOL latency_running;
+	int latency_hz;
+	LatencyHistogram latency_live;
+	ULONG latency_p50;
+	ULONG latency_p99;
+	ULONG latency_max;
+
+	// Least-squares trend of free virtual memory over the sample ring
+	Trend memory_trend;
+	ULONG memory_eta; // Seconds until exhausted, 0 if not declining
+
+	// Idle task dispatch rate, peak for scaling the graph
+	ULONG last_dispatches;
+	ULONG dispatch_rate;
+	ULONG max_dispatch_rate;
+
+	// Shared sampling service, the role is resolved at startup
+	ERole role;
+	struct MsgPort *service_port; // Public, owned by the service
+	struct MsgPort *service; // Service's port as seen by a viewer
+	struct MsgPort *viewer_port;
+	ServiceMsg *request_msg;
+	Viewer *viewers[SERVICE_MAX_VIEWERS];
+	ULONG published; // Sequence number of the latest sample
+	volatile BOOL service_closing;
+
+	// Stress test viewer tasks inside the service
+	int stress_viewers;
+	struct StressViewer *stress;
+	BYTE stress_sig;
+	volatile int stress_alive;
+
 } Context;
 
-#define get_ptr(name) &ctx->samples[0].name
-#define get_cur(name) ctx->samples[ctx->iter].name
+// Stress test viewer, run as a task against our own service
+typedef struct StressViewer {
+	Context *ctx;
+	struct Task *task;
+	ULONG attaches;
+	ULONG batches;
+	ULONG samples;
+	ULONG gaps;
+} StressViewer;
+
+#define get_ptr(metric) &ctx->samples[0].values[metric]
+#define get_cur(metric) ctx->samples[ctx->iter].values[metric]
+#define get_new(metric) ctx->measured.sample.values[metric]
+
+// Ring slot of the sample taken 'age' samples before the latest one
+static ULONG ring_slot(Context *ctx, ULONG age)
+{
+	return ctx->iter >= age ? ctx->iter - age : ctx->iter + ctx->capacity - age;
+}
+
+// Wraps without a division, the capacity changes at runtime
+static ULONG ring_next(Context *ctx, ULONG slot)
+{
+	return (slot + 1 == ctx->capacity) ? 0 : slot + 1;
+}
 
 #define MAX(a,b) ((a) > (b) ? (a) : (b))
+#define MIN(a,b) ((a) < (b) ? (a) : (b))
 
 #define SCALE_X(x) (int)roundf((float)(x) * ctx->scaleX)
 #define SCALE_Y(y) (int)roundf((float)(y) * ctx->scaleY)
@@ -174,20 +728,115 @@ typedef struct {
 typedef enum EMenu {
 	MID_Iconify = 1,
 	MID_About,
+	MID_Export,
 	MID_Quit,
-	// Options,
-	MID_CpuGraph,
-	MID_NetGraph,
+	// Options, graph toggles in EMetric order
+	MID_Graph,
+	MID_NetGraph = MID_Graph + METRIC_COUNT,
+	MID_DiskGraph,
+	MID_LatencyGraph,
 	MID_Grid,
-	MID_VirtualMem,
-	MID_VideoMem,
 	MID_DragBar,
-	MID_SimpleMode
+	MID_DirectRender,
+	MID_Heatmap,
+	// Mode, in EMeasureMode order
+	MID_BusyMode,
+	MID_SimpleMode,
+	MID_ZeroSpinMode,
+
+	MID_Span,
+	MID_SpanLast = MID_Span + SPAN_CHOICES - 1
 } EMenu;
 
 // network.c
-void init_netstats(void);
-BOOL update_netstats(UBYTE *, UBYTE *, float *, float *, float *, float *);
+BOOL open_netcounters(void);
+void close_netcounters(void);
+BOOL get_netcounters(uint64 *, uint64 *);
+void init_netstats(uint64, uint64);
+BOOL update_netstats(uint64, uint64, UBYTE *, UBYTE *, float *, float *, float *, float *);
+
+// diskpatch.c
+BOOL disk_patch_install(const char *);
+void disk_patch_remove(void);
+void disk_patch_source(DiskSource *);
+
+static void measure_cpu(Context *ctx);
+static void measure_virtual_mem(Context *ctx);
+static void measure_video_mem(Context *ctx);
+static void measure_network(Context *ctx);
+static void measure_disk(Context *ctx);
+static void measure_latency(Context *ctx);
+static void measure_dispatches(Context *ctx);
+static void scale_dispatches(Context *ctx);
+static void latency_levels(Context *ctx);
+
+static void service_rescale(Context *ctx, EMetric metric, float multiplier);
+static void export_history(Context *ctx);
+static void resize_later(Context *ctx);
+
+/*
+
+Metric providers. Adding a metric means adding an EMetric value and a row
+here; sampling, drawing, menus, keys, tooltypes and alarms iterate this
+table. A metric without a probe is filled in by the probe of another one,
+like upload by the network probe. Graph metrics are drawn in reverse table
+order, so the first one ends up on top.
+
+*/
+typedef struct {
+	const char *name; // Graph toggle tooltype and alarm rule name
+	const char *label; // Menu item, NULL if the graph can't be toggled alone
+	const char *title; // Window title, NULL if not shown there
+	const char *unit;
+	UBYTE min;
+	UBYTE max;
+	const char *color_name;
+	ULONG color;
+	char key;
+	EPlotStyle style;
+	EPanel panel;
+	int bottom; // Baseline of a PLOT_NET line from the top of its panel
+	UBYTE max_period; // Probe can slow down to this many ticks
+	void (*probe)(Context *ctx);
+} MetricProvider;
+
+static const MetricProvider metrics[METRIC_COUNT] = {
+	[METRIC_CPU] = {
+		"cpu", "CPU usage", "CPU", "%", 0, 100, "cpucol", CPU_COL, 'c',
+		PLOT_GRAPH, PANEL_MAIN, 0, 1, measure_cpu },
+	[METRIC_VIRTUAL_MEM] = {
+		"vmem", "Free virtual memory", "RAM", "%", 0, 100, "vmemcol", VIRT_COL, 'v',
+		PLOT_GRAPH, PANEL_MAIN, 0, PROBE_MAX_PERIOD, measure_virtual_mem },
+	[METRIC_VIDEO_MEM] = {
+		"gmem", "Free video memory", "VID", "%", 0, 100, "gmemcol", VID_COL, 'x',
+		PLOT_GRAPH, PANEL_MAIN, 0, PROBE_MAX_PERIOD, measure_video_mem },
+	[METRIC_UPLOAD] = {
+		"ul", NULL, NULL, "%", 0, 100, "ulcol", UL_COL, 0,
+		PLOT_NET, PANEL_NET, YSIZE / 2, 1, measure_network },
+	[METRIC_DOWNLOAD] = {
+		"dl", NULL, NULL, "%", 0, 100, "dlcol", DL_COL, 0,
+		PLOT_NET, PANEL_NET, YSIZE, 1, NULL },
+	[METRIC_DISK_READ] = {
+		"dr", NULL, NULL, "%", 0, 100, "drcol", DR_COL, 0,
+		PLOT_NET, PANEL_DISK, YSIZE / 2, 1, measure_disk },
+	[METRIC_DISK_WRITE] = {
+		"dw", NULL, NULL, "%", 0, 100, "dwcol", DW_COL, 0,
+		PLOT_NET, PANEL_DISK, YSIZE, 1, NULL },
+	// Wake-up latency on a log scale, see latency_level
+	[METRIC_LATENCY_P50] = {
+		"lat50", NULL, NULL, "dB us", 0, 100, "lat50col", P50_COL, 0,
+		PLOT_GRAPH, PANEL_LATENCY, 0, 1, measure_latency },
+	[METRIC_LATENCY_P99] = {
+		"lat99", NULL, NULL, "dB us", 0, 100, "lat99col", P99_COL, 0,
+		PLOT_GRAPH, PANEL_LATENCY, 0, 1, NULL },
+	[METRIC_LATENCY_MAX] = {
+		"latmax", NULL, NULL, "dB us", 0, 100, "latmaxcol", PMAX_COL, 0,
+		PLOT_GRAPH, PANEL_LATENCY, 0, 1, NULL },
+	// Idle task dispatches per second, relative to the peak
+	[METRIC_DISPATCHES] = {
+		"disp", "Idle dispatches", NULL, "%", 0, 100, "dispcol", DISP_COL, 'i',
+		PLOT_GRAPH, PANEL_MAIN, 0, 1, measure_dispatches }
+};
 
 static struct ClassLibrary* WindowBase;
 static struct ClassLibrary* RequesterBase;
@@ -203,11 +852,19 @@ static void OpenClasses()
     if (!WindowBase) {
         puts("Failed to open window.class");
     }
+}
+
+// Only the About requester needs it, so it's opened on first use
+static BOOL OpenRequesterClass()
+{
+    const int version = 53;
 
     RequesterBase = OpenClass("requester.class", version, &RequesterClass);
     if (!RequesterBase) {
         puts("Failed to open requester.class");
     }
+
+    return RequesterBase != NULL;
 }
 
 static void CloseClasses()
@@ -216,6 +873,11 @@ static void CloseClasses()
     CloseClass(RequesterBase);
 }
 
+static uint64 time_us(const struct TimeVal *tv)
+{
+	return (uint64)tv->Seconds * 1000000 + tv->Microseconds;
+}
+
 // Idle task gives up CPU
 static void my_switch(void)
 {
@@ -224,29 +886,34 @@ static void my_switch(void)
 	SubTime(&idle_time.finish, &idle_time.start);
 
 	AddTime(&idle_time.total, &idle_time.finish);
+
+	idle_time.run_us += time_us(&idle_time.finish);
 }
 
 // Idle task gets CPU
 static void my_launch(void)
 {
 	GetSysTime(&idle_time.start);
+
+	idle_time.dispatches++;
 }
 
-static void idle_sleep(struct TimeRequest *pause_req)
+// Sleeps until 'micros' from now, the wake-up deadline is returned in 'dest'
+static void idle_sleep(struct TimeRequest *pause_req, ULONG micros, struct TimeVal *dest)
 {
-	struct TimeVal dest, source;
+	struct TimeVal source;
 	BYTE error;
 
-	GetSysTime(&dest);
+	GetSysTime(dest);
 
-	source.Seconds = 0;
-	source.Microseconds = 10000;
+	source.Seconds = micros / 1000000;
+	source.Microseconds = micros % 1000000;
 
-	AddTime(&dest, &source);
+	AddTime(dest, &source);
 
 	pause_req->Request.io_Command = TR_ADDREQUEST;
-	pause_req->Time.Seconds = dest.Seconds;
-	pause_req->Time.Microseconds = dest.Microseconds;
+	pause_req->Time.Seconds = dest->Seconds;
+	pause_req->Time.Microseconds = dest->Microseconds;
 
 	error = DoIO((struct IORequest *) pause_req);
 
@@ -255,12 +922,65 @@ static void idle_sleep(struct TimeRequest *pause_req)
 	}
 }
 
+static LONG difference_us(const struct TimeVal *a, const struct TimeVal *b)
+{
+	return (LONG)(a->Seconds - b->Seconds) * 1000000 + (LONG)a->Microseconds - (LONG)b->Microseconds;
+}
+
+/*
+
+Zero-spin mode doesn't loop at all. A task at priority -127 only gets the
+CPU when nothing else wants it, so the launch hook's timestamp tells how
+late the task got dispatched after its timer expired. A late wake-up means
+the CPU was busy at that moment, and the share of late wake-ups over the
+period is the load. The interval is randomised to avoid locking onto
+periodic loads.
+
+This is an estimate from lateness, not an account of run time. About 100
+wake-ups a second make it a statistical sample with an error of several
+percent per period, busy stretches that end before the next wake-up aren't
+seen, and a wake-up that is late by less than ZERO_SPIN_LATE counts as idle
+however busy the CPU was before it.
+
+*/
+static void zero_spin_sample(Context *ctx, struct TimeRequest *pause_req, ULONG *seed)
+{
+	struct TimeVal deadline;
+
+	*seed = *seed * 1103515245 + 12345;
+
+	idle_sleep(pause_req, ZERO_SPIN_PERIOD / 2 + (*seed >> 16) % ZERO_SPIN_PERIOD, &deadline);
+
+	// Set by my_launch for the dispatch that followed the timer reply
+	const struct TimeVal launched = idle_time.start;
+
+	ctx->wake_count++;
+
+	if (difference_us(&launched, &deadline) > ZERO_SPIN_LATE) {
+		ctx->late_count++;
+	}
+}
+
+// Busy mode heatmap sub-samples, the current run counts as idle up to now
+static void slice_idle(Context *ctx)
+{
+	struct TimeVal now;
+
+	GetSysTime(&now);
+
+	Forbid();
+	heat_slice(&ctx->heat_slicer, time_us(&now), idle_time.run_us, time_us(&idle_time.start), &ctx->heat_live);
+	Permit();
+}
+
 static void idler(uint32 p1)
 {
 	// Used by idle task for 1/100 second pauses when running in non-busy looping mode
 	struct TimeRequest *pause_req = NULL;
 	struct MsgPort *idle_port = NULL;
 	Context *ctx = (Context *)p1;
+	struct TimeVal deadline;
+	ULONG seed = 1;
 
 	idle_port = AllocSysObjectTags(ASOT_PORT,
 		ASOPORT_Name, "idler_port",
@@ -305,9 +1025,20 @@ static void idler(uint32 p1)
 	SetTaskPri(ctx->idle_task, -127);
 
 	while (ctx->running) {
-		if (ctx->simple_mode) {
-			ctx->run_count++;
-			idle_sleep(pause_req);
+		switch (ctx->mode) {
+			case MODE_SIMPLE:
+				ctx->run_count++;
+				idle_sleep(pause_req, SIMPLE_PERIOD, &deadline);
+				break;
+			case MODE_ZERO_SPIN:
+				zero_spin_sample(ctx, pause_req, &seed);
+				break;
+			default:
+				// Busy looping, the hooks do the measuring
+				if (ctx->features.heatmap) {
+					slice_idle(ctx);
+				}
+				break;
 		}
 	}
 
@@ -338,6 +1069,137 @@ die:
 	Wait(0L);
 }
 
+// Burns the CPU until 'micros' have passed
+static void spin(ULONG micros)
+{
+	struct TimeVal start, now;
+
+	GetSysTime(&start);
+
+	do {
+		GetSysTime(&now);
+	} while (difference_us(&now, &start) < (LONG)micros);
+}
+
+/*
+
+Synthetic load generator. Alternates between busy looping and sleeping so
+that the busy share of every LOAD_PERIOD matches ctx->load_duty.
+
+*/
+static void load_worker(uint32 p1)
+{
+	Context *ctx = (Context *)p1;
+	struct TimeRequest *pause_req = NULL;
+	struct MsgPort *port = NULL;
+	struct TimeVal deadline;
+
+	port = AllocSysObjectTags(ASOT_PORT,
+		ASOPORT_Name, "load_port",
+		TAG_DONE);
+
+	if (!port) {
+		goto die;
+	}
+
+	pause_req = AllocSysObjectTags(ASOT_IOREQUEST,
+		ASOIOR_Size, sizeof(struct TimeRequest),
+		ASOIOR_ReplyPort, port,
+		ASOIOR_Duplicate, ctx->timer_req,
+		TAG_DONE);
+
+	if (!pause_req) {
+		goto die;
+	}
+
+	while (ctx->load_running) {
+		unsigned busy, idle;
+
+		duty_split(LOAD_PERIOD, ctx->load_duty, &busy, &idle);
+
+		if (busy) {
+			spin(busy);
+		}
+
+		if (idle) {
+			idle_sleep(pause_req, idle, &deadline);
+		}
+	}
+
+die:
+	if (pause_req) {
+		FreeSysObject(ASOT_IOREQUEST, pause_req);
+	}
+
+	if (port) {
+		FreeSysObject(ASOT_PORT, port);
+	}
+
+	// Tell the main task that we are done
+	Signal(ctx->main_task, 1L << ctx->load_sig);
+
+	// Waiting for termination
+	Wait(0L);
+}
+
+/*
+
+The latency probe sleeps until an absolute deadline and records how late
+it actually got to run. At a high priority the lateness is the scheduling
+and interrupt latency that any responsive task would see.
+
+*/
+static void latency_worker(uint32 p1)
+{
+	Context *ctx = (Context *)p1;
+	struct TimeRequest *pause_req = NULL;
+	struct MsgPort *port = NULL;
+	struct TimeVal deadline, now;
+
+	port = AllocSysObjectTags(ASOT_PORT,
+		ASOPORT_Name, "latency_port",
+		TAG_DONE);
+
+	if (!port) {
+		goto die;
+	}
+
+	pause_req = AllocSysObjectTags(ASOT_IOREQUEST,
+		ASOIOR_Size, sizeof(struct TimeRequest),
+		ASOIOR_ReplyPort, port,
+		ASOIOR_Duplicate, ctx->timer_req,
+		TAG_DONE);
+
+	if (!pause_req) {
+		goto die;
+	}
+
+	const ULONG period = 1000000 / ctx->latency_hz;
+
+	while (ctx->latency_running) {
+		idle_sleep(pause_req, period, &deadline);
+		GetSysTime(&now);
+
+		// The main task takes the histogram in Forbid, one add is never split
+		latency_add(&ctx->latency_live, MAX(0, difference_us(&now, &deadline)));
+	}
+
+die:
+	if (pause_req) {
+		FreeSysObject(ASOT_IOREQUEST, pause_req);
+	}
+
+	if (port) {
+		FreeSysObject(ASOT_PORT, port);
+	}
+
+	// Tell the main task that we are done
+	Signal(ctx->main_task, 1L << ctx->latency_sig);
+
+	// Waiting for termination
+	Wait(0L);
+}
+
 #if 0
 static void point(Context *ctx, int x, int y, ULONG color)
 {
@@ -354,6 +1216,11 @@ static void line(Context *ctx, int sx, int sy, int fx, int fy, ULONG color)
 
 static void vertical_line(Context *ctx, int x, int start, int end, ULONG color)
 {
+	if (ctx->raster.pixels) {
+		raster_vline(&ctx->raster, x, start, end, color);
+		return;
+	}
+
 	Move(&ctx->rastPort, x, start);
 	SetRPAttrs(&ctx->rastPort, RPTAG_APenColor, color, TAG_DONE);
 	Draw(&ctx->rastPort, x, end);
@@ -361,58 +1228,149 @@ static void vertical_line(Context *ctx, int x, int start, int end, ULONG color)
 
 static void horizontal_line(Context *ctx, int y, int start, int end, ULONG color)
 {
+	if (ctx->raster.pixels) {
+		raster_hline(&ctx->raster, y, start, end, color);
+		return;
+	}
+
 	Move(&ctx->rastPort, start, y);
 	SetRPAttrs(&ctx->rastPort, RPTAG_APenColor, color, TAG_DONE);
 	Draw(&ctx->rastPort, end, y);
 }
 
+static void move_to(Context *ctx, int x, int y)
+{
+	if (ctx->raster.pixels) {
+		ctx->pen_x = x;
+		ctx->pen_y = y;
+		return;
+	}
+
+	Move(&ctx->rastPort, x, y);
+}
+
 static void line_to(Context *ctx, int x, int y, ULONG color)
 {
+	if (ctx->raster.pixels) {
+		raster_line(&ctx->raster, ctx->pen_x, ctx->pen_y, x, y, color);
+		ctx->pen_x = x;
+		ctx->pen_y = y;
+		return;
+	}
+
 	SetRPAttrs(&ctx->rastPort, RPTAG_APenColor, color, TAG_DONE);
 	Draw(&ctx->rastPort, x, y);
 }
 
-static void plot(Context *ctx, const UBYTE* const array, const ULONG color)
+static BOOL panel_shown(Context *ctx, EPanel panel)
 {
-	int	x;
-	for (x = 0; x < XSIZE; x++) {
-		const int iter = (ctx->iter + 1 + x) % XSIZE;
-		const int level = *(array + iter * sizeof(Sample));
-		const int y = YSIZE - level;
-
-		if (x == 0) {
-			Move(&ctx->rastPort, 0, SCALE_Y(y) - 1);
-		} else {
-			line_to(ctx, SCALE_X(x), SCALE_Y(y) - 1, color);
-		}
+	switch (panel) {
+		case PANEL_NET:
+			return ctx->features.net;
+		case PANEL_DISK:
+			return ctx->features.disk;
+		case PANEL_LATENCY:
+			return ctx->features.latency;
+		default:
+			return TRUE;
 	}
 }
 
-static void plot_net(Context *ctx, UBYTE *array, const int bottom, const ULONG color)
+static int panel_count(Context *ctx)
 {
-	int x;
-	for (x = 0; x < XSIZE; x++) {
-		const int iter = (ctx->iter + 1 + x) % XSIZE;
-		const int level = *(array + iter * sizeof(Sample)) / 2;
-		const int start = bottom - level;
+	return 1 + (ctx->features.net ? 1 : 0) + (ctx->features.disk ? 1 : 0) + (ctx->features.latency ? 1 : 0);
+}
 
-		if (x == 0) {
-			Move(&ctx->rastPort, 0, SCALE_Y(start) - 1);
-		} else {
-			line_to(ctx, SCALE_X(x), SCALE_Y(start) - 1, color);
+// In unscaled graph coordinates
+static int panel_top(Context *ctx, EPanel panel)
+{
+	int top = 0;
+	int i;
+
+	for (i = PANEL_MAIN; i < (int)panel; i++) {
+		if (panel_shown(ctx, i)) {
+			top += YSIZE;
 		}
 	}
+
+	return top;
+}
+
+// Metric ranges are mapped to 0...100
+static int to_level(const MetricProvider *provider, UBYTE value)
+{
+	if (value <= provider->min) {
+		return 0;
+	}
+
+	if (value >= provider->max) {
+		return 100;
+	}
+
+	return (value - provider->min) * 100 / (provider->max - provider->min);
+}
+
+// Newest is the ring index of the latest sample in a ring of 'size' slots
+static void plot(Context *ctx, const MetricProvider *provider, const UBYTE* const array, ULONG newest, ULONG size, const ULONG color)
+{
+	const int bottom = panel_top(ctx, provider->panel) + YSIZE;
+	ULONG iter = newest;
+	ULONG x;
+	for (x = 0; x < size; x++) {
+		// Oldest first, wraps without a division
+		if (++iter == size) {
+			iter = 0;
+		}
+
+		const int level = to_level(provider, *(array + iter * sizeof(Sample)));
+		const int y = bottom - level;
+
+		if (x == 0) {
+			move_to(ctx, ctx->plot_left, ctx->plot_top + SCALE_Y(y) - 1);
+		} else {
+			line_to(ctx, ctx->plot_left + SCALE_X(x), ctx->plot_top + SCALE_Y(y) - 1, color);
+		}
+	}
+}
+
+static void plot_net(Context *ctx, const MetricProvider *provider, const UBYTE* const array, const ULONG color)
+{
+	const int bottom = panel_top(ctx, provider->panel) + provider->bottom;
+	ULONG iter = ctx->iter;
+	ULONG x;
+	for (x = 0; x < ctx->capacity; x++) {
+		iter = ring_next(ctx, iter);
+
+		const int level = to_level(provider, *(array + iter * sizeof(Sample))) / 2;
+		const int start = bottom - level;
+
+		if (x == 0) {
+			move_to(ctx, 0, SCALE_Y(start) - 1);
+		} else {
+			line_to(ctx, SCALE_X(x), SCALE_Y(start) - 1, color);
+		}
+	}
+}
+
+static void fill_rect(Context *ctx, int x0, int y0, int x1, int y1, ULONG color)
+{
+	if (ctx->raster.pixels) {
+		raster_fill(&ctx->raster, x0, y0, x1, y1, color);
+		return;
+	}
+
+	RectFillColor(&ctx->rastPort, x0, y0, x1, y1, color);
 }
 
 static void clear(Context *ctx)
 {
-	RectFillColor(&ctx->rastPort, 0, 0, ctx->width - 1, ctx->height - 1, ctx->colors.background);
+	fill_rect(ctx, 0, 0, ctx->width - 1, ctx->height - 1, ctx->colors.background);
 }
 
 static void draw_grid(Context *ctx)
 {
 	float y;
-	const float step = (ctx->features.net) ? ctx->height / 20.f : ctx->height / 10.f;
+	const float step = ctx->height / (10.f * panel_count(ctx));
 
 	for (y = 0; y < ctx->height; y += step) {
 		horizontal_line(ctx, y, 0, ctx->width - 1, ctx->colors.grid);
@@ -424,817 +1382,4421 @@ static void draw_grid(Context *ctx)
 	}
 }
 
-static void refresh_window(Context *ctx)
+/*
+
+Direct rendering locks the bitmap once per frame and lets the drawing
+primitives write into its pixel buffer. If the lock fails, the frame is
+drawn through graphics.library as usual.
+
+*/
+static APTR lock_bitmap(Context *ctx)
 {
-	clear(ctx);
+	APTR base = NULL;
+	ULONG bytes_per_row = 0;
 
-	if (ctx->features.grid) {
-		draw_grid(ctx);
-	}
+	APTR lock = LockBitMapTags(ctx->bm,
+		LBM_BaseAddress, &base,
+		LBM_BytesPerRow, &bytes_per_row,
+		TAG_DONE);
 
-	if (ctx->features.virtual_mem) {
-		plot(ctx, get_ptr(virtual_mem), ctx->colors.virtual_mem);
+	if (lock) {
+		ctx->raster.pixels = base;
+		ctx->raster.stride = bytes_per_row / sizeof(uint32);
+		ctx->raster.width = ctx->width;
+		ctx->raster.height = ctx->height;
 	}
 
-	if (ctx->features.video_mem) {
-		plot(ctx, get_ptr(video_mem), ctx->colors.video_mem);
-	}
+	return lock;
+}
 
-	if (ctx->features.cpu) {
-		plot(ctx, get_ptr(cpu), ctx->colors.cpu);
-	}
+static void unlock_bitmap(Context *ctx, APTR lock)
+{
+	ctx->raster.pixels = NULL;
+	UnlockBitMap(lock);
+}
 
-	if (ctx->features.net) {
-		plot_net(ctx, get_ptr(upload), YSIZE + YSIZE / 2, ctx->colors.upload);
-		plot_net(ctx, get_ptr(download), 2 * YSIZE, ctx->colors.download);
+// Like "2h05m", "14m" or "45s"
+static void fmt_duration(Formatter *f, ULONG seconds)
+{
+	if (seconds >= 3600) {
+		fmt_uint(f, seconds / 3600, 0);
+		fmt_char(f, 'h');
+		fmt_uint(f, seconds / 600 % 6, 0);
+		fmt_uint(f, seconds / 60 % 10, 0);
+		fmt_char(f, 'm');
+	} else if (seconds >= 60) {
+		fmt_uint(f, seconds / 60, 0);
+		fmt_char(f, 'm');
+	} else {
+		fmt_uint(f, seconds, 0);
+		fmt_char(f, 's');
 	}
+}
 
-	BltBitMapRastPort(ctx->bm, 0, 0,
-		ctx->window->RPort,
-		ctx->window->BorderLeft,
-		ctx->window->BorderTop,
-		ctx->window->Width - (ctx->window->BorderRight + ctx->window->BorderLeft),
-		ctx->window->Height - (ctx->window->BorderBottom + ctx->window->BorderTop),
-		0xC0);
+// "CPU: %3d%% RAM: %3d%% VID: %3d%%"
+static void build_window_title(Context *ctx, STRPTR buffer)
+{
+	Formatter f;
+	int i;
 
-	snprintf(ctx->window_title, WINDOW_TITLE_LEN, WINDOW_TITLE_FORMAT,
-		get_cur(cpu), get_cur(virtual_mem), get_cur(video_mem));
+	fmt_init(&f, buffer, WINDOW_TITLE_LEN);
 
-	snprintf(ctx->screen_title, SCREEN_TITLE_LEN, SCREEN_TITLE_FORMAT,
-		get_cur(cpu), get_cur(virtual_mem), get_cur(video_mem),
-		ctx->dl_speed, ctx->ul_speed, ctx->simple_mode ? "Simple" : "Busy");
+	for (i = 0; i < METRIC_COUNT; i++) {
+		if (!metrics[i].title) {
+			continue;
+		}
 
-	SetWindowTitles(ctx->window,
-		(ctx->features.dragbar) ? ctx->window_title : NULL, ctx->screen_title);
+		if (fmt_length(&f, buffer)) {
+			fmt_char(&f, ' ');
+		}
+
+		fmt_str(&f, metrics[i].title);
+		fmt_str(&f, ": ");
+		fmt_uint(&f, get_cur(i), 3);
+		fmt_str(&f, metrics[i].unit);
+	}
+
+	if (ctx->memory_eta) {
+		fmt_str(&f, " ETA ");
+		fmt_duration(&f, ctx->memory_eta);
+	}
 }
 
-static ULONG parse_hex(STRPTR str)
+// Speeds are shown with one decimal, like "%4.1f"
+static ULONG to_tenths(float value)
 {
-	return strtol(str, NULL, 16);
+	return (ULONG)(value * 10.0f + 0.5f);
 }
 
-static void set_int(struct DiskObject *disk_object, STRPTR name, int *value)
+static void build_screen_title(Context *ctx, STRPTR buffer)
 {
-	STRPTR tool_type = FindToolType(disk_object->do_ToolTypes, name);
+	Formatter f;
 
-	if (tool_type) {
-		const int temp = atoi(tool_type);
+	fmt_init(&f, buffer, SCREEN_TITLE_LEN);
 
-		if (temp >= 0) {
-			*value = temp;
-		}
+	fmt_str(&f, "CPU load: ");
+	fmt_uint(&f, get_cur(METRIC_CPU), 3);
+	fmt_str(&f, "%. Free memory: ");
+	fmt_uint(&f, get_cur(METRIC_VIRTUAL_MEM), 3);
+	fmt_char(&f, '%');
+
+	if (ctx->memory_eta) {
+		fmt_str(&f, " (runs out in ");
+		fmt_duration(&f, ctx->memory_eta);
+		fmt_char(&f, ')');
+	}
+
+	fmt_str(&f, ". Free video memory: ");
+	fmt_uint(&f, get_cur(METRIC_VIDEO_MEM), 3);
+	fmt_str(&f, "%. Download: ");
+	fmt_fixed(&f, to_tenths(ctx->info.dl_speed), 1, 4);
+	fmt_str(&f, "KiB/s. Upload: ");
+	fmt_fixed(&f, to_tenths(ctx->info.ul_speed), 1, 4);
+	fmt_str(&f, "KiB/s. ");
+
+	if (ctx->info.disk) {
+		fmt_str(&f, "Disk read: ");
+		fmt_fixed(&f, to_tenths(ctx->info.disk_read_rate / 1024.0f), 1, 4);
+		fmt_str(&f, "KiB/s. Write: ");
+		fmt_fixed(&f, to_tenths(ctx->info.disk_write_rate / 1024.0f), 1, 4);
+		fmt_str(&f, "KiB/s. ");
+	}
+
+	fmt_str(&f, "Idle dispatches: ");
+	fmt_uint(&f, ctx->info.dispatch_rate, 0);
+	fmt_str(&f, "/s. ");
+
+	if (ctx->info.latency) {
+		fmt_str(&f, "Latency p99: ");
+		fmt_uint(&f, ctx->info.latency_p99, 0);
+		fmt_str(&f, "us. ");
 	}
+
+	fmt_str(&f, "Mode: ");
+	fmt_str(&f, mode_names[ctx->mode]);
 }
 
-static void set_bool(struct DiskObject *disk_object, STRPTR name, BOOL *value)
+// Returns TRUE if the newly built title differs from the shown one
+static BOOL swap_title(Title *title)
 {
-	STRPTR tool_type = FindToolType(disk_object->do_ToolTypes, name);
+	if (strcmp(title->shown, title->next) == 0) {
+		return FALSE;
+	}
 
-	*value = (tool_type) ? TRUE : FALSE;
+	STRPTR temp = title->shown;
+	title->shown = title->next;
+	title->next = temp;
+
+	return TRUE;
 }
 
-static void set_color(struct DiskObject *disk_object, STRPTR name, ULONG *value)
+/*
+
+Titles are built into the back buffers and SetWindowTitles is called only
+when the text has changed, because every call re-renders the screen bar.
+Intuition treats ~0 as "leave this title alone".
+
+*/
+static void update_titles(Context *ctx)
 {
-	STRPTR tool_type = FindToolType(disk_object->do_ToolTypes, name);
+	build_window_title(ctx, ctx->window_title.next);
+	build_screen_title(ctx, ctx->screen_title.next);
 
-	if (tool_type) {
-		*value = parse_hex(tool_type);
+	const BOOL window_changed = swap_title(&ctx->window_title) || ctx->titles_invalid;
+	const BOOL screen_changed = swap_title(&ctx->screen_title) || ctx->titles_invalid;
+
+	ctx->titles_invalid = FALSE;
+
+	if (!window_changed && !screen_changed) {
+		return;
 	}
+
+	SetWindowTitles(ctx->window,
+		window_changed ? ((ctx->features.dragbar) ? ctx->window_title.shown : NULL) : (STRPTR)~0,
+		screen_changed ? ctx->screen_title.shown : (STRPTR)~0);
+
+	ctx->stats.title_updates++;
 }
 
-static UBYTE validate_opaqueness(int opaqueness)
+// Alternates between the normal and inverted color while a flash alarm is on
+static ULONG metric_color(Context *ctx, int metric)
 {
-	if (opaqueness > MAX_OPAQUENESS) {
-		opaqueness = MAX_OPAQUENESS;
-	} else if (opaqueness < MIN_OPAQUENESS) {
-		opaqueness = MIN_OPAQUENESS;
+	const ULONG color = ctx->colors.metric[metric];
+
+	if ((ctx->alarm_flash & (1L << metric)) && (ctx->stats.seconds & 1)) {
+		return color ^ FLASH_MASK;
 	}
 
-	return opaqueness;
+	return color;
 }
 
-static void read_config(Context *ctx, STRPTR file_name)
+static void draw_graphs(Context *ctx)
 {
-	if (file_name) {
+	if (ctx->features.grid) {
+		draw_grid(ctx);
+	}
 
-		struct DiskObject *disk_object = (struct DiskObject *)GetDiskObject(file_name);
+	int i;
+	for (i = METRIC_COUNT - 1; i >= 0; i--) {
+		const MetricProvider *provider = &metrics[i];
 
-		if (disk_object) {
-			int opaqueness = 255;
-
-			set_bool(disk_object, "cpu", &ctx->features.cpu);
-			set_bool(disk_object, "grid", &ctx->features.grid);
-			set_bool(disk_object, "vmem", &ctx->features.virtual_mem);
-			set_bool(disk_object, "gmem", &ctx->features.video_mem);
-			set_bool(disk_object, "solid", &ctx->features.solid_draw);
-			set_bool(disk_object, "dragbar", &ctx->features.dragbar);
-			set_bool(disk_object, "net", &ctx->features.net);
-			set_bool(disk_object, "simple", (BOOL *)&ctx->simple_mode);
-			set_bool(disk_object, "resize", &ctx->features.resize);
-
-			set_int(disk_object, "xpos", &ctx->x_pos);
-			set_int(disk_object, "ypos", &ctx->y_pos);
-			//set_int(disk_object, "width", &ctx->width); TODO?
-			//set_int(disk_object, "height", &ctx->height);
-			set_int(disk_object, "opaqueness", &opaqueness);
-
-			ctx->opaqueness = validate_opaqueness(opaqueness);
-
-			set_color(disk_object, "cpucol", &ctx->colors.cpu);
-			set_color(disk_object, "bgcol", &ctx->colors.background);
-			set_color(disk_object, "gmemcol", &ctx->colors.video_mem);
-			set_color(disk_object, "vmemcol", &ctx->colors.virtual_mem);
-			set_color(disk_object, "gridcol", &ctx->colors.grid);
-			set_color(disk_object, "ulcol", &ctx->colors.upload);
-			set_color(disk_object, "dlcol", &ctx->colors.download);
+		if (!panel_shown(ctx, provider->panel)) {
+			continue;
+		}
 
-			FreeDiskObject(disk_object);
+		if (provider->style == PLOT_GRAPH && ctx->features.graph[i]) {
+			plot(ctx, provider, get_ptr(i), ctx->iter, ctx->capacity, metric_color(ctx, i));
+		} else if (provider->style == PLOT_NET) {
+			plot_net(ctx, provider, get_ptr(i), metric_color(ctx, i));
 		}
 	}
 }
 
-static void handle_args(Context *ctx, int argc, char ** argv)
+/*
+
+Heatmap column of a ring slot, level 100 at the top. A row covers the
+levels between it and the next one, so a window lower than 101 pixels
+merges bands instead of dropping them. Runs of one colour are filled at
+once, mostly the background.
+
+*/
+static void paint_heat_column(Context *ctx, ULONG slot)
 {
-	if (! argc) {
-		struct WBStartup *wb_startup = (struct WBStartup *) argv;
-		struct WBArg *wb_arg = wb_startup->sm_ArgList;
+	const HeatColumn *column = &ctx->heat_columns[slot];
+	const int x0 = SCALE_X(slot);
+	const int x1 = SCALE_X(slot + 1) - 1;
+	const int height = ctx->height;
+	ULONG run_color = ctx->colors.background;
+	int run_start = 0;
+	int y;
+
+	if (x1 < x0) {
+		return;
+	}
 
-		if (wb_arg /*&& wb_arg->wa_Lock*/) {
-			read_config(ctx, wb_arg->wa_Name);
+	for (y = 0; y < height; y++) {
+		const int first = (height - 1 - y) * HEAT_LEVELS / height;
+		const int last = MAX(first, (height - y) * HEAT_LEVELS / height - 1);
+		const ULONG color = heat_color(column, first, last, ctx->colors.metric[METRIC_CPU], ctx->colors.background);
+
+		if (y == 0) {
+			run_color = color;
+		} else if (color != run_color) {
+			fill_rect(ctx, x0, run_start, x1, y - 1, run_color);
+			run_start = y;
+			run_color = color;
 		}
-	} else {
-		read_config(ctx, argv[0]);
 	}
-}
 
-static void *my_alloc(size_t size)
-{
-	return AllocVecTags(size,
-		AVT_ClearWithValue, 0,
-		TAG_DONE);
+	fill_rect(ctx, x0, run_start, x1, height - 1, run_color);
 }
 
-static void my_free(void *ptr)
-{
-	FreeVec(ptr);
-}
+/*
 
-static void set_menu_item(Context * ctx, enum EMenu id, BOOL state)
-{
-	if (!IDoMethod(ctx->menu, MM_SETSTATE, 0, id, MS_CHECKED, state ? MS_CHECKED : 0)) {
-		printf("Invalid menu id %d\n", id);
-	}
-}
+The bitmap is a ring of columns like the samples, each column stays at the
+position of its slot. Only the columns taken since the last frame are
+painted, everything after a resize or a mode change.
 
-static Object* create_menu(Context * ctx)
+*/
+static void draw_heatmap(Context *ctx)
 {
-	ctx->menu = NewObject(NULL, "menuclass",
-		MA_Type, T_ROOT,
-		// Main
-		MA_AddChild, NewObject(NULL, "menuclass",
-			MA_Type, T_MENU,
-			MA_Label, "Main",
-			MA_AddChild, NewObject(NULL, "menuclass",
-				MA_Type, T_ITEM,
-				MA_Label, "About",
-				MA_ID, MID_About,
-				TAG_DONE),
-			MA_AddChild, NewObject(NULL, "menuclass",
-				MA_Type, T_ITEM,
-				MA_Label, "Iconfiy",
-				MA_ID, MID_Iconify,
-				TAG_DONE),
-			MA_AddChild, NewObject(NULL, "menuclass",
-				MA_Type, T_ITEM,
-				MA_Label, "Quit",
-				MA_ID, MID_Quit,
-				TAG_DONE),
-			TAG_DONE),
-        // Options
-        MA_AddChild, NewObject(NULL, "menuclass",
-			MA_Type, T_MENU,
-			MA_Label, "Options",
-			MA_AddChild, NewObject(NULL, "menuclass",
-				MA_Type, T_ITEM,
-				MA_Label, "CPU usage",
-				MA_ID, MID_CpuGraph,
-				MA_Toggle, TRUE,
-				MA_Selected, ctx->features.cpu,
-				TAG_DONE),
-			MA_AddChild, NewObject(NULL, "menuclass",
-				MA_Type, T_ITEM,
-				MA_Label, "Net usage",
-				MA_ID, MID_NetGraph,
-				MA_Toggle, TRUE,
-				MA_Selected, ctx->features.net,
-				TAG_DONE),
-			MA_AddChild, NewObject(NULL, "menuclass",
-				MA_Type, T_ITEM,
-				MA_Label, "Grid",
-				MA_ID, MID_Grid,
-				MA_Toggle, TRUE,
-				MA_Selected, ctx->features.grid,
-				TAG_DONE),
-			MA_AddChild, NewObject(NULL, "menuclass",
-				MA_Type, T_ITEM,
-				MA_Label, "Free virtual memory",
-				MA_ID, MID_VirtualMem,
-				MA_Toggle, TRUE,
-				MA_Selected, ctx->features.virtual_mem,
-				TAG_DONE),
-			MA_AddChild, NewObject(NULL, "menuclass",
-				MA_Type, T_ITEM,
-				MA_Label, "Free video memory",
-				MA_ID, MID_VideoMem,
-				MA_Toggle, TRUE, ctx->features.video_mem,
-				MA_Selected,
-				TAG_DONE),
-			MA_AddChild, NewObject(NULL, "menuclass",
-				MA_Type, T_ITEM,
-				MA_Label, "Window dragbar",
-				MA_ID, MID_DragBar,
-				MA_Toggle, TRUE,
-				MA_Selected, ctx->features.dragbar,
-				TAG_DONE),
-			MA_AddChild, NewObject(NULL, "menuclass",
-				MA_Type, T_ITEM,
-				MA_Label, "Simple mode",
-				MA_ID, MID_SimpleMode,
-				MA_Toggle, TRUE, ctx->simple_mode,
-				MA_Selected,
-				TAG_DONE),
+	ULONG count = ctx->taken - ctx->heat_painted;
 
-            TAG_DONE),
-		TAG_DONE);
+	if (!ctx->heat_valid || count > ctx->capacity) {
+		count = ctx->capacity;
+		ctx->heat_valid = TRUE;
+	}
 
-	if (!ctx->menu) {
-		puts("Failed to create menu");
+	while (count--) {
+		paint_heat_column(ctx, ring_slot(ctx, count));
 	}
 
-	return ctx->menu;
+	ctx->heat_painted = ctx->taken;
 }
 
-static char* getApplicationName()
+// In two parts, the column after the newest one goes to the left edge
+static void blit_heatmap(Context *ctx)
 {
-	#define maxPathLen 255
-
-	static char pathBuffer[maxPathLen];
-
-	if (!GetCliProgramName(pathBuffer, maxPathLen - 1)) {
-		//puts("Failed to get CLI program name, checking task node");
-		snprintf(pathBuffer, maxPathLen, "%s", ((struct Node *)FindTask(NULL))->ln_Name);
+	struct Window *window = ctx->window;
+	const int split = SCALE_X(ctx->iter + 1);
+
+	if ((int)ctx->width > split) {
+		BltBitMapRastPort(ctx->bm, split, 0,
+			window->RPort,
+			window->BorderLeft,
+			window->BorderTop,
+			ctx->width - split,
+			ctx->height,
+			0xC0);
 	}
 
-	return pathBuffer;
+	if (split > 0) {
+		BltBitMapRastPort(ctx->bm, 0, 0,
+			window->RPort,
+			window->BorderLeft + ctx->width - split,
+			window->BorderTop,
+			split,
+			ctx->height,
+			0xC0);
+	}
 }
 
-static struct DiskObject* getDiskObject()
+// Square-ish grid of cells, filled row by row
+static int host_columns(int hosts)
 {
-	struct DiskObject *diskObject = NULL;
-
-	BPTR oldDir = SetCurrentDir(GetProgramDir());
-	diskObject = GetDiskObject(getApplicationName());
+	int columns = 1;
 
-	if (diskObject) {
-		diskObject->do_CurrentX = NO_ICON_POSITION;
-		diskObject->do_CurrentY = NO_ICON_POSITION;
+	while (columns * columns < hosts) {
+		columns++;
 	}
 
-	SetCurrentDir(oldDir);
-
-	return diskObject;
+	return columns;
 }
 
-static struct Window *open_window(Context *ctx, int x, int y)
-{
-	const int minWidth = XSIZE;
-	const int minHeight = (ctx->features.net) ? 2 * YSIZE : YSIZE;
+/*
 
-	int width = minWidth;
-	int height = minHeight;
+Collector mode shows one cell per host with the graphs of the main panel.
+The plot is the same as for the local graphs, only scaled into the cell.
 
-	if (ctx->windowObject) {
-		width = ctx->width;
-		height = ctx->height;
+*/
+static void draw_hosts(Context *ctx)
+{
+	const int hosts = ctx->collector->used;
 
-		DisposeObject(ctx->windowObject);
-		ctx->windowObject = NULL;
-		ctx->window = NULL;
+	if (!hosts) {
+		return;
 	}
 
-	 ctx->windowObject = NewObject(WindowClass, NULL,
-		WA_Activate, TRUE,
-		WA_Left, x,
-		WA_Top, y,
-		WA_InnerWidth, width,
-		WA_InnerHeight, height,
-		WA_IDCMP, IDCMP_CLOSEWINDOW | /*IDCMP_VANILLAKEY |*/ IDCMP_RAWKEY | IDCMP_NEWSIZE | IDCMP_MENUPICK,
-		WA_CloseGadget, ctx->features.dragbar,
-		WA_DragBar, ctx->features.dragbar,
-		WA_DepthGadget, ctx->features.dragbar,
-		WA_SizeGadget, ctx->features.resize,
-		WA_UserPort, ctx->user_port,
-		WA_Opaqueness, ctx->opaqueness,
-		WA_MenuStrip, create_menu(ctx),
-		WINDOW_IconifyGadget, ctx->features.dragbar,
-		WINDOW_Icon, getDiskObject(),
-		WINDOW_IconTitle, NAME_STRING,
-		WINDOW_AppPort, ctx->app_port, // Iconification needs it
-		TAG_DONE);
+	const int columns = host_columns(hosts);
+	const int rows = (hosts + columns - 1) / columns;
+	const int cell_width = ctx->width / columns;
+	const int cell_height = ctx->height / rows;
+	const float scale_x = ctx->scaleX;
+	const float scale_y = ctx->scaleY;
 
-	if (!ctx->windowObject) {
-		puts("Failed to create window object");
-		return NULL;
-	}
+	ctx->scaleX = (float)cell_width / COLLECT_SAMPLES;
+	ctx->scaleY = (float)cell_height / YSIZE;
 
-	struct Window* window = (struct Window *)IDoMethod(ctx->windowObject, WM_OPEN);
+	int h;
+	for (h = 0; h < hosts; h++) {
+		const CollectHost *host = &ctx->collector->hosts[h];
 
-	if (!window) {
-		puts("Failed to open window");
-		return NULL;
-	}
+		ctx->plot_left = (h % columns) * cell_width;
+		ctx->plot_top = (h / columns) * cell_height;
 
-	if (!WindowLimits(window, minWidth + window->BorderLeft + window->BorderRight,
-		minHeight + window->BorderTop + window->BorderBottom, 1024, 1024)) {
-		puts("Failed to set window limits");
-	}
+		if (ctx->features.grid) {
+			horizontal_line(ctx, ctx->plot_top, ctx->plot_left, ctx->plot_left + cell_width - 1, ctx->colors.grid);
+			vertical_line(ctx, ctx->plot_left, ctx->plot_top, ctx->plot_top + cell_height - 1, ctx->colors.grid);
+		}
 
-	return window;
-}
+		int i;
+		for (i = METRIC_COUNT - 1; i >= 0; i--) {
+			const MetricProvider *provider = &metrics[i];
 
-static void query_window_size(Context *ctx)
-{
-	if ((GetWindowAttrs(ctx->window,
-		WA_InnerWidth, &ctx->width,
-		WA_InnerHeight, &ctx->height,
-		TAG_DONE)) != 0)
-	{
-			puts("Failed get window attributes");
+			if (provider->panel == PANEL_MAIN && provider->style == PLOT_GRAPH && ctx->features.graph[i]) {
+				plot(ctx, provider, &host->samples[0][i], host->newest, COLLECT_SAMPLES, metric_color(ctx, i));
+			}
+		}
 	}
 
-	ctx->scaleX = (float)ctx->width / (float)XSIZE;
-	ctx->scaleY = (float)ctx->height / (ctx->features.net ? 2.0f * (float)YSIZE : (float)YSIZE);
+	ctx->plot_left = 0;
+	ctx->plot_top = 0;
+	ctx->scaleX = scale_x;
+	ctx->scaleY = scale_y;
 }
 
-static BOOL realloc_bitmap(Context *ctx)
+// Names go straight to the window, the bitmap has no font
+static void label_hosts(Context *ctx)
 {
-	ULONG w = 0;
-	ULONG h = 0;
+	struct RastPort *rp = ctx->window->RPort;
+	const int hosts = ctx->collector->used;
 
-	if (ctx->bm) {
-		w = GetBitMapAttr(ctx->bm, BMA_ACTUALWIDTH);
-		h = GetBitMapAttr(ctx->bm, BMA_HEIGHT);
+	if (!hosts) {
+		return;
 	}
 
+	const int columns = host_columns(hosts);
+	const int rows = (hosts + columns - 1) / columns;
+
+	SetRPAttrs(rp,
+		RPTAG_APenColor, ctx->colors.metric[METRIC_CPU],
+		RPTAG_DrawMode, JAM1,
+		TAG_DONE);
+
+	int h;
+	for (h = 0; h < hosts; h++) {
+		const CollectHost *host = &ctx->collector->hosts[h];
+		char label[COLLECT_NAME_LEN + 16];
+		Formatter f;
+
+		fmt_init(&f, label, sizeof(label));
+		fmt_str(&f, host->name);
+
+		if (ctx->stats.seconds - host->heard > COLLECT_SILENT) {
+			fmt_str(&f, " (silent)");
+		}
+
+		Move(rp,
+			ctx->window->BorderLeft + (h % columns) * (ctx->width / columns) + 2,
+			ctx->window->BorderTop + (h / columns) * (ctx->height / rows) + rp->Font->tf_Baseline + 1);
+		Text(rp, label, fmt_length(&f, label));
+	}
+}
+
+static void refresh_window(Context *ctx)
+{
+	// Collected hosts have no sub-samples
+	const BOOL heatmap = ctx->features.heatmap && !ctx->collector;
+	APTR lock = NULL;
+
+	if (ctx->features.direct_render) {
+		lock = lock_bitmap(ctx);
+	}
+
+	if (heatmap) {
+		draw_heatmap(ctx);
+	} else {
+		clear(ctx);
+
+		if (ctx->collector) {
+			draw_hosts(ctx);
+		} else {
+			draw_graphs(ctx);
+		}
+	}
+
+	if (lock) {
+		unlock_bitmap(ctx, lock);
+	}
+
+	if (heatmap) {
+		blit_heatmap(ctx);
+	} else {
+		BltBitMapRastPort(ctx->bm, 0, 0,
+			ctx->window->RPort,
+			ctx->window->BorderLeft,
+			ctx->window->BorderTop,
+			ctx->window->Width - (ctx->window->BorderRight + ctx->window->BorderLeft),
+			ctx->window->Height - (ctx->window->BorderBottom + ctx->window->BorderTop),
+			0xC0);
+	}
+
+	if (ctx->collector) {
+		label_hosts(ctx);
+	}
+
+	update_titles(ctx);
+}
+
+static void *my_alloc(size_t size)
+{
+	return AllocVecTags(size,
+		AVT_ClearWithValue, 0,
+		TAG_DONE);
+}
+
+static void my_free(void *ptr)
+{
+	FreeVec(ptr);
+}
+
+static ULONG parse_hex(STRPTR str)
+{
+	return strtol(str, NULL, 16);
+}
+
+static void set_int(STRPTR *tool_types, CONST_STRPTR name, int *value)
+{
+	STRPTR tool_type = FindToolType(tool_types, name);
+
+	if (tool_type) {
+		const int temp = atoi(tool_type);
+
+		if (temp >= 0) {
+			*value = temp;
+		}
+	}
+}
+
+static void set_bool(STRPTR *tool_types, CONST_STRPTR name, BOOL *value)
+{
+	STRPTR tool_type = FindToolType(tool_types, name);
+
+	*value = (tool_type) ? TRUE : FALSE;
+}
+
+static void set_color(STRPTR *tool_types, CONST_STRPTR name, ULONG *value)
+{
+	STRPTR tool_type = FindToolType(tool_types, name);
+
+	if (tool_type) {
+		*value = parse_hex(tool_type);
+	}
+}
+
+static void set_string(STRPTR *tool_types, CONST_STRPTR name, char *value, size_t size)
+{
+	STRPTR tool_type = FindToolType(tool_types, name);
+
+	if (tool_type) {
+		snprintf(value, size, "%s", tool_type);
+	}
+}
+
+static UBYTE validate_opaqueness(int opaqueness)
+{
+	if (opaqueness > MAX_OPAQUENESS) {
+		opaqueness = MAX_OPAQUENESS;
+	} else if (opaqueness < MIN_OPAQUENESS) {
+		opaqueness = MIN_OPAQUENESS;
+	}
+
+	return opaqueness;
+}
+
+// Rules are given as ALARM1...ALARM8, with optional ALARMCMD1...ALARMCMD8
+static void read_alarms(Context *ctx, STRPTR *tool_types)
+{
+	const char *names[METRIC_COUNT];
+	int i;
+
+	for (i = 0; i < METRIC_COUNT; i++) {
+		names[i] = metrics[i].name;
+	}
+
+	alarm_init(&ctx->alarms);
+
+	set_string(tool_types, "alarmlog", ctx->alarm_log, sizeof(ctx->alarm_log));
+
+	for (i = 1; i <= ALARM_MAX_RULES; i++) {
+		char name[16];
+
+		snprintf(name, sizeof(name), "alarm%d", i);
+
+		STRPTR rule = FindToolType(tool_types, name);
+
+		if (!rule) {
+			continue;
+		}
+
+		const int index = alarm_add(&ctx->alarms, rule, names, METRIC_COUNT);
+
+		if (index < 0) {
+			printf("Invalid alarm rule '%s'\n", rule);
+			continue;
+		}
+
+		snprintf(name, sizeof(name), "alarmcmd%d", i);
+
+		ctx->alarm_commands[index][0] = '\0';
+		set_string(tool_types, name, ctx->alarm_commands[index], ALARM_COMMAND_LEN);
+	}
+}
+
+static void read_calibration(Context *ctx, STRPTR *tool_types)
+{
+	int mode;
+
+	for (mode = 0; mode < MODE_COUNT; mode++) {
+		STRPTR text = FindToolType(tool_types, calibration_names[mode]);
+		UBYTE curve[CALIB_MAX_POINTS];
+		int points;
+
+		ctx->calibrated[mode] = FALSE;
+
+		if (!text) {
+			continue;
+		}
+
+		if (!(points = calib_parse(text, curve))) {
+			printf("Invalid calibration '%s'\n", text);
+			continue;
+		}
+
+		calib_table(curve, points, ctx->correction[mode]);
+		ctx->calibrated[mode] = TRUE;
+	}
+}
+
+static void current_config(Context *ctx, LiveConfig *config)
+{
+	config->features = ctx->features;
+	config->colors = ctx->colors;
+	config->x_pos = ctx->x_pos;
+	config->y_pos = ctx->y_pos;
+	config->opaqueness = ctx->opaqueness;
+	config->capacity = ctx->capacity;
+	config->mode = ctx->mode;
+}
+
+// Values missing from the tooltypes stay as they were, switches go off
+static void read_live_config(LiveConfig *config, STRPTR *tool_types)
+{
+	int opaqueness = config->opaqueness;
+	int minutes = config->capacity / 60;
+	BOOL simple = FALSE;
+	BOOL zero_spin = FALSE;
+	int i;
+
+	for (i = 0; i < METRIC_COUNT; i++) {
+		if (metrics[i].label) {
+			set_bool(tool_types, metrics[i].name, &config->features.graph[i]);
+		}
+
+		set_color(tool_types, metrics[i].color_name, &config->colors.metric[i]);
+	}
+
+	set_bool(tool_types, "grid", &config->features.grid);
+	set_bool(tool_types, "solid", &config->features.solid_draw);
+	set_bool(tool_types, "dragbar", &config->features.dragbar);
+	set_bool(tool_types, "net", &config->features.net);
+	set_bool(tool_types, "disk", &config->features.disk);
+	set_bool(tool_types, "latency", &config->features.latency);
+	set_bool(tool_types, "simple", &simple);
+	set_bool(tool_types, "zerospin", &zero_spin);
+	set_bool(tool_types, "resize", &config->features.resize);
+	set_bool(tool_types, "direct", &config->features.direct_render);
+	set_bool(tool_types, "heatmap", &config->features.heatmap);
+
+	set_int(tool_types, "xpos", &config->x_pos);
+	set_int(tool_types, "ypos", &config->y_pos);
+	set_int(tool_types, "opaqueness", &opaqueness);
+	set_int(tool_types, "minutes", &minutes);
+
+	set_color(tool_types, "bgcol", &config->colors.background);
+	set_color(tool_types, "gridcol", &config->colors.grid);
+
+	config->opaqueness = validate_opaqueness(opaqueness);
+	config->capacity = 60 * MAX(1, MIN(MAX_MINUTES, minutes));
+	config->mode = zero_spin ? MODE_ZERO_SPIN : (simple ? MODE_SIMPLE : MODE_BUSY);
+}
+
+static void apply_config(Context *ctx, STRPTR *tool_types)
+{
+	int shrink_delay = ctx->shrink_delay;
+	int history_kib = ctx->history_kib;
+	int latency_hz = ctx->latency_hz;
+	int heat_hz = ctx->heat_hz;
+	int stress_viewers = ctx->stress_viewers;
+	int send_batch = ctx->send_batch;
+	int sim_senders = ctx->sim_senders;
+	char role[ROLE_NAME_LEN] = "";
+	char export_format[8] = "";
+	LiveConfig config;
+	int i;
+
+	current_config(ctx, &config);
+	read_live_config(&config, tool_types);
+
+	ctx->features = config.features;
+	ctx->colors = config.colors;
+	ctx->x_pos = config.x_pos;
+	ctx->y_pos = config.y_pos;
+	ctx->opaqueness = config.opaqueness;
+	ctx->capacity = config.capacity;
+	ctx->mode = config.mode;
+
+	set_bool(tool_types, "compare", &ctx->compare);
+	set_bool(tool_types, "calibrate", &ctx->calibrate);
+	set_bool(tool_types, "replayfast", &ctx->replay_fast);
+	set_bool(tool_types, "stats", &ctx->stats.report);
+	set_bool(tool_types, "vrambitmap", &ctx->bm_displayable);
+	set_bool(tool_types, "headless", &ctx->headless);
+	set_bool(tool_types, "collect", &ctx->collect);
+
+	set_string(tool_types, "record", ctx->record_file, sizeof(ctx->record_file));
+	set_string(tool_types, "replay", ctx->replay_file, sizeof(ctx->replay_file));
+	set_string(tool_types, "disks", ctx->disk_devices, sizeof(ctx->disk_devices));
+	set_string(tool_types, "diskfile", ctx->disk_file, sizeof(ctx->disk_file));
+	set_string(tool_types, "role", role, sizeof(role));
+	set_string(tool_types, "exportfile", ctx->export_file, sizeof(ctx->export_file));
+	set_string(tool_types, "exportformat", export_format, sizeof(export_format));
+	set_string(tool_types, "stream", ctx->stream_file, sizeof(ctx->stream_file));
+	set_string(tool_types, "sendto", ctx->send_host, sizeof(ctx->send_host));
+	set_string(tool_types, "hostname", ctx->host_name, sizeof(ctx->host_name));
+
+	//set_int(tool_types, "width", &ctx->width); TODO?
+	//set_int(tool_types, "height", &ctx->height);
+	set_int(tool_types, "shrinkdelay", &shrink_delay);
+	set_int(tool_types, "historykib", &history_kib);
+	set_int(tool_types, "latencyhz", &latency_hz);
+	set_int(tool_types, "heatmaphz", &heat_hz);
+	set_int(tool_types, "stressviewers", &stress_viewers);
+	set_int(tool_types, "streamkib", &ctx->stream_kib);
+	set_int(tool_types, "metricsport", &ctx->metrics_port);
+	set_int(tool_types, "collectport", &ctx->collect_port);
+	set_int(tool_types, "sendbatch", &send_batch);
+	set_int(tool_types, "simsenders", &sim_senders);
+
+	ctx->shrink_delay = shrink_delay;
+	ctx->history_kib = MAX(0, history_kib);
+	ctx->latency_hz = MAX(0, MIN(1000, latency_hz));
+	ctx->heat_hz = MAX(10, MIN(10000, heat_hz));
+	ctx->stress_viewers = MIN(SERVICE_MAX_VIEWERS, stress_viewers);
+	ctx->send_batch = MAX(1, MIN(COLLECT_MAX_BATCH, send_batch));
+	ctx->sim_senders = MAX(0, MIN(COLLECT_MAX_HOSTS, sim_senders));
+
+	for (i = 0; i < ROLE_COUNT; i++) {
+		if (strcasecmp(role, role_names[i]) == 0) {
+			ctx->role = i;
+		}
+	}
+
+	if (export_format[0] && !export_parse_format(export_format, &ctx->export_format)) {
+		printf("Unknown export format '%s'\n", export_format);
+	}
+
+	read_alarms(ctx, tool_types);
+	read_calibration(ctx, tool_types);
+}
+
+/*
+
+A prefs file has one tooltype per line, for example "CPUCOL=FF00A000".
+Empty lines and lines starting with ';' or '#' are ignored. The lines are
+turned into a tooltype array so that the same code parses both sources.
+A reload parses only the live settings, into 'reload'.
+
+*/
+static BOOL read_prefs_file(Context *ctx, STRPTR file_name, LiveConfig *reload)
+{
+	STRPTR tool_types[PREFS_MAX_LINES + 1];
+	BOOL result = FALSE;
+	int lines = 0;
+
+	char *buffer = my_alloc(PREFS_MAX_SIZE + 1);
+
+	if (!buffer) {
+		puts("Couldn't allocate prefs buffer");
+		return FALSE;
+	}
+
+	BPTR file = Open(file_name, MODE_OLDFILE);
+
+	if (!file) {
+		printf("Couldn't open prefs file '%s'\n", file_name);
+		goto clean;
+	}
+
+	const LONG length = Read(file, buffer, PREFS_MAX_SIZE);
+
+	Close(file);
+
+	if (length < 0) {
+		printf("Couldn't read prefs file '%s'\n", file_name);
+		goto clean;
+	}
+
+	buffer[length] = '\0';
+
+	char *line = buffer;
+
+	while (*line && lines < PREFS_MAX_LINES) {
+		char *end = line;
+
+		while (*end && *end != '\n' && *end != '\r') {
+			end++;
+		}
+
+		const BOOL last = (*end == '\0');
+
+		*end = '\0';
+
+		if (*line && *line != ';' && *line != '#') {
+			tool_types[lines++] = line;
+		}
+
+		if (last) {
+			break;
+		}
+
+		line = end + 1;
+	}
+
+	tool_types[lines] = NULL;
+
+	if (reload) {
+		read_live_config(reload, tool_types);
+	} else {
+		apply_config(ctx, tool_types);
+	}
+
+	result = TRUE;
+
+clean:
+	my_free(buffer);
+
+	return result;
+}
+
+static void read_config(Context *ctx, STRPTR file_name)
+{
+	if (file_name) {
+
+		struct DiskObject *disk_object = (struct DiskObject *)GetDiskObject(file_name);
+
+		if (disk_object) {
+			set_string(disk_object->do_ToolTypes, "prefs", ctx->prefs_file, sizeof(ctx->prefs_file));
+
+			// A prefs file replaces the icon tooltypes
+			if (!ctx->prefs_file[0] || !read_prefs_file(ctx, ctx->prefs_file, NULL)) {
+				apply_config(ctx, disk_object->do_ToolTypes);
+			}
+
+			FreeDiskObject(disk_object);
+		}
+	}
+}
+
+static void handle_args(Context *ctx, int argc, char ** argv)
+{
+	if (! argc) {
+		struct WBStartup *wb_startup = (struct WBStartup *) argv;
+		struct WBArg *wb_arg = wb_startup->sm_ArgList;
+
+		if (wb_arg /*&& wb_arg->wa_Lock*/) {
+			read_config(ctx, wb_arg->wa_Name);
+		}
+	} else {
+		read_config(ctx, argv[0]);
+	}
+}
+
+static void set_menu_item(Context * ctx, enum EMenu id, BOOL state)
+{
+	if (!IDoMethod(ctx->menu, MM_SETSTATE, 0, id, MS_CHECKED, state ? MS_CHECKED : 0)) {
+		printf("Invalid menu id %d\n", id);
+	}
+}
+
+static void add_toggle(Object *menu, CONST_STRPTR label, ULONG id, BOOL selected)
+{
+	SetAttrs(menu,
+		MA_AddChild, NewObject(NULL, "menuclass",
+			MA_Type, T_ITEM,
+			MA_Label, label,
+			MA_ID, id,
+			MA_Toggle, TRUE,
+			MA_Selected, selected,
+			TAG_DONE),
+		TAG_DONE);
+}
+
+static Object* create_options_menu(Context *ctx)
+{
+	Object *options = NewObject(NULL, "menuclass",
+		MA_Type, T_MENU,
+		MA_Label, "Options",
+		TAG_DONE);
+
+	if (options) {
+		int i;
+
+		for (i = 0; i < METRIC_COUNT; i++) {
+			if (metrics[i].label) {
+				add_toggle(options, metrics[i].label, MID_Graph + i, ctx->features.graph[i]);
+			}
+		}
+
+		add_toggle(options, "Net usage", MID_NetGraph, ctx->features.net);
+		add_toggle(options, "Disk usage", MID_DiskGraph, ctx->features.disk);
+		add_toggle(options, "Wake-up latency", MID_LatencyGraph, ctx->features.latency);
+		add_toggle(options, "Grid", MID_Grid, ctx->features.grid);
+		add_toggle(options, "Window dragbar", MID_DragBar, ctx->features.dragbar);
+		add_toggle(options, "Direct rendering", MID_DirectRender, ctx->features.direct_render);
+		add_toggle(options, "CPU heatmap", MID_Heatmap, ctx->features.heatmap);
+	}
+
+	return options;
+}
+
+static Object* create_span_menu(Context *ctx)
+{
+	Object *span = NewObject(NULL, "menuclass",
+		MA_Type, T_MENU,
+		MA_Label, "Span",
+		TAG_DONE);
+
+	if (span) {
+		int i;
+
+		for (i = 0; i < SPAN_CHOICES; i++) {
+			add_toggle(span, span_labels[i], MID_Span + i, ctx->capacity == 60 * (ULONG)span_minutes[i]);
+		}
+	}
+
+	return span;
+}
+
+static Object* create_menu(Context * ctx)
+{
+	if (ctx->menu) {
+		return ctx->menu;
+	}
+
+	Object *options = create_options_menu(ctx);
+	Object *span = create_span_menu(ctx);
+
+	ctx->menu = NewObject(NULL, "menuclass",
+		MA_Type, T_ROOT,
+		// Main
+		MA_AddChild, NewObject(NULL, "menuclass",
+			MA_Type, T_MENU,
+			MA_Label, "Main",
+			MA_AddChild, NewObject(NULL, "menuclass",
+				MA_Type, T_ITEM,
+				MA_Label, "About",
+				MA_ID, MID_About,
+				TAG_DONE),
+			MA_AddChild, NewObject(NULL, "menuclass",
+				MA_Type, T_ITEM,
+				MA_Label, "Iconfiy",
+				MA_ID, MID_Iconify,
+				TAG_DONE),
+			MA_AddChild, NewObject(NULL, "menuclass",
+				MA_Type, T_ITEM,
+				MA_Label, "Export history",
+				MA_ID, MID_Export,
+				TAG_DONE),
+			MA_AddChild, NewObject(NULL, "menuclass",
+				MA_Type, T_ITEM,
+				MA_Label, "Quit",
+				MA_ID, MID_Quit,
+				TAG_DONE),
+			TAG_DONE),
+        // Options
+        MA_AddChild, options,
+		// Mode
+		MA_AddChild, NewObject(NULL, "menuclass",
+			MA_Type, T_MENU,
+			MA_Label, "Mode",
+			MA_AddChild, NewObject(NULL, "menuclass",
+				MA_Type, T_ITEM,
+				MA_Label, "Busy looping",
+				MA_ID, MID_BusyMode,
+				MA_Toggle, TRUE,
+				MA_Selected, ctx->mode == MODE_BUSY,
+				TAG_DONE),
+			MA_AddChild, NewObject(NULL, "menuclass",
+				MA_Type, T_ITEM,
+				MA_Label, "Simple",
+				MA_ID, MID_SimpleMode,
+				MA_Toggle, TRUE,
+				MA_Selected, ctx->mode == MODE_SIMPLE,
+				TAG_DONE),
+			MA_AddChild, NewObject(NULL, "menuclass",
+				MA_Type, T_ITEM,
+				MA_Label, "Zero-spin",
+				MA_ID, MID_ZeroSpinMode,
+				MA_Toggle, TRUE,
+				MA_Selected, ctx->mode == MODE_ZERO_SPIN,
+				TAG_DONE),
+			TAG_DONE),
+		// Span
+		MA_AddChild, span,
+		TAG_DONE);
+
+	if (!ctx->menu) {
+		puts("Failed to create menu");
+	}
+
+	return ctx->menu;
+}
+
+static char* getApplicationName()
+{
+	#define maxPathLen 255
+
+	static char pathBuffer[maxPathLen];
+
+	if (!GetCliProgramName(pathBuffer, maxPathLen - 1)) {
+		//puts("Failed to get CLI program name, checking task node");
+		snprintf(pathBuffer, maxPathLen, "%s", ((struct Node *)FindTask(NULL))->ln_Name);
+	}
+
+	return pathBuffer;
+}
+
+static struct DiskObject* getDiskObject()
+{
+	struct DiskObject *diskObject = NULL;
+
+	BPTR oldDir = SetCurrentDir(GetProgramDir());
+	diskObject = GetDiskObject(getApplicationName());
+
+	if (diskObject) {
+		diskObject->do_CurrentX = NO_ICON_POSITION;
+		diskObject->do_CurrentY = NO_ICON_POSITION;
+	}
+
+	SetCurrentDir(oldDir);
+
+	return diskObject;
+}
+
+/*
+
+Border gadgets can't be changed on an open Intuition window, so the window
+is closed and reopened. The window object, its menu strip and the icon are
+kept and only the changed attributes are set in between.
+
+*/
+static void reconfigure_window(Context *ctx, int x, int y)
+{
+	IDoMethod(ctx->windowObject, WM_CLOSE);
+	ctx->window = NULL;
+
+	SetAttrs(ctx->windowObject,
+		WA_Left, x,
+		WA_Top, y,
+		WA_InnerWidth, ctx->width,
+		WA_InnerHeight, ctx->height,
+		WA_Opaqueness, ctx->opaqueness,
+		WA_CloseGadget, ctx->features.dragbar,
+		WA_DragBar, ctx->features.dragbar,
+		WA_DepthGadget, ctx->features.dragbar,
+		WINDOW_IconifyGadget, ctx->features.dragbar,
+		TAG_DONE);
+}
+
+/*
+
+The old way of changing the chrome, the window object is disposed and
+created again. With stats on, every other toggle takes this path so that
+both can be timed on the same machine.
+
+*/
+static void recreate_window(Context *ctx)
+{
+	DisposeObject(ctx->windowObject);
+	ctx->windowObject = NULL;
+	ctx->window = NULL;
+}
+
+// The main loop waits on this, so it's not queried on every round
+static void update_window_sig(Context *ctx)
+{
+	ctx->window_sig = 0;
+
+	if (!GetAttr(WINDOW_SigMask, ctx->windowObject, &ctx->window_sig)) {
+		puts("GetAttr failed");
+	}
+}
+
+static struct Window *open_window(Context *ctx, int x, int y)
+{
+	const int minWidth = XSIZE;
+	const int minHeight = panel_count(ctx) * YSIZE;
+
+	if (ctx->windowObject) {
+		reconfigure_window(ctx, x, y);
+	} else {
+		ctx->windowObject = NewObject(WindowClass, NULL,
+			WA_Activate, TRUE,
+			WA_Left, x,
+			WA_Top, y,
+			WA_InnerWidth, ctx->width ? ctx->width : (ULONG)minWidth,
+			WA_InnerHeight, ctx->height ? ctx->height : (ULONG)minHeight,
+			WA_IDCMP, IDCMP_CLOSEWINDOW | /*IDCMP_VANILLAKEY |*/ IDCMP_RAWKEY | IDCMP_NEWSIZE | IDCMP_MENUPICK,
+			WA_CloseGadget, ctx->features.dragbar,
+			WA_DragBar, ctx->features.dragbar,
+			WA_DepthGadget, ctx->features.dragbar,
+			WA_SizeGadget, ctx->features.resize,
+			WA_UserPort, ctx->user_port,
+			WA_Opaqueness, ctx->opaqueness,
+			WA_MenuStrip, create_menu(ctx),
+			WINDOW_IconifyGadget, ctx->features.dragbar,
+			ctx->icon ? WINDOW_Icon : TAG_IGNORE, ctx->icon,
+			WINDOW_IconTitle, NAME_STRING,
+			WINDOW_AppPort, ctx->app_port, // Iconification needs it
+			TAG_DONE);
+
+		if (!ctx->windowObject) {
+			puts("Failed to create window object");
+			return NULL;
+		}
+	}
+
+	struct Window* window = (struct Window *)IDoMethod(ctx->windowObject, WM_OPEN);
+
+	if (!window) {
+		puts("Failed to open window");
+		return NULL;
+	}
+
+	if (!WindowLimits(window, minWidth + window->BorderLeft + window->BorderRight,
+		minHeight + window->BorderTop + window->BorderBottom, 1024, 1024)) {
+		puts("Failed to set window limits");
+	}
+
+	update_window_sig(ctx);
+
+	return window;
+}
+
+static void query_window_size(Context *ctx)
+{
+	if ((GetWindowAttrs(ctx->window,
+		WA_InnerWidth, &ctx->width,
+		WA_InnerHeight, &ctx->height,
+		TAG_DONE)) != 0)
+	{
+			puts("Failed get window attributes");
+	}
+
+	ctx->scaleX = (float)ctx->width / (float)ctx->capacity;
+	ctx->scaleY = (float)ctx->height / (panel_count(ctx) * (float)YSIZE);
+}
+
+static BOOL alloc_bitmap(Context *ctx, ULONG width, ULONG height)
+{
+	// There doesn't seem to be much difference whether bitmap is in RAM or VRAM
+	struct BitMap *bm = AllocBitMapTags(width, height, 32,
+		BMATags_PixelFormat, PIXF_A8R8G8B8,
+		BMATags_Clear, TRUE,
+		ctx->bm_displayable ? BMATags_Displayable : BMATags_UserPrivate, TRUE,
+		TAG_DONE);
+
+	if (!bm) {
+		puts("Couldn't allocate bitmap");
+		return FALSE;
+	}
+
+	if (ctx->bm) {
+		FreeBitMap(ctx->bm);
+	}
+
+	ctx->bm = bm;
+	ctx->bm_width = width;
+	ctx->bm_height = height;
+	ctx->heat_valid = FALSE;
+
+	InitRastPort(&ctx->rastPort);
+	ctx->rastPort.BitMap = ctx->bm;
+
+	ctx->stats.bitmap_allocs++;
+	ctx->stats.bitmap_bytes = GetBitMapAttr(bm, BMA_BYTESPERROW) * height;
+
+	return TRUE;
+}
+
+// Growing by half again means an interactive drag reallocates only a few times
+static ULONG with_headroom(ULONG size)
+{
+	return MIN(size + size / 2, MAX_BITMAP_SIZE);
+}
+
+static BOOL realloc_bitmap(Context *ctx)
+{
 	query_window_size(ctx);
 
-	if (!ctx->bm || w < ctx->width || h < ctx->height) {
-		if (ctx->bm) {
-			FreeBitMap(ctx->bm);
-		}
+	// Columns move with the width
+	ctx->heat_valid = FALSE;
+
+	if (!ctx->bm) {
+		return alloc_bitmap(ctx, ctx->width, ctx->height);
+	}
+
+	if (ctx->bm_width < ctx->width || ctx->bm_height < ctx->height) {
+		return alloc_bitmap(ctx,
+			with_headroom(MAX(ctx->width, ctx->bm_width)),
+			with_headroom(MAX(ctx->height, ctx->bm_height)));
+	}
+
+	return TRUE;
+}
+
+/*
+
+Once resizing has settled for a while, give back the headroom (or the memory
+of a window that was made smaller) by reallocating to the exact size.
+
+*/
+static void shrink_bitmap(Context *ctx)
+{
+	if (!ctx->bm || ctx->stats.seconds - ctx->last_resize < ctx->shrink_delay) {
+		return;
+	}
+
+	if (ctx->bm_width > ctx->width || ctx->bm_height > ctx->height) {
+		alloc_bitmap(ctx, ctx->width, ctx->height);
+	}
+}
+
+// Pieces are 16-byte aligned. With a NULL base only the size is counted.
+static void *carve(UBYTE *base, size_t *used, size_t size)
+{
+	void *piece = base ? base + *used : NULL;
+
+	*used += (size + 15) & ~(size_t)15;
+
+	return piece;
+}
+
+static size_t carve_ring(UBYTE *base, size_t used, ULONG capacity, Sample **samples, SampleInfo **infos, HeatColumn **heat_columns)
+{
+	*samples = carve(base, &used, capacity * sizeof(Sample));
+	*infos = carve(base, &used, capacity * sizeof(SampleInfo));
+	*heat_columns = carve(base, &used, capacity * sizeof(HeatColumn));
+
+	return used;
+}
+
+static int history_block_count(Context *ctx)
+{
+	return ctx->history_kib * 1024 / sizeof(HistoryBlock);
+}
+
+// Everything whose size is known at startup, returns the total size
+static size_t carve_buffers(Context *ctx, UBYTE *base)
+{
+	size_t used = 0;
+
+	// Front and back buffer for each title
+	ctx->window_title.shown = carve(base, &used, 2 * WINDOW_TITLE_LEN);
+	ctx->screen_title.shown = carve(base, &used, 2 * SCREEN_TITLE_LEN);
+
+	ctx->history_blocks = NULL;
+
+	if (history_block_count(ctx)) {
+		ctx->history_blocks = carve(base, &used, history_block_count(ctx) * sizeof(HistoryBlock));
+	}
+
+	return carve_ring(base, used, ctx->capacity, &ctx->samples, &ctx->infos, &ctx->heat_columns);
+}
+
+// Opened first, the startup time is read from it
+static BOOL open_timer(Context *ctx)
+{
+	BOOL result = FALSE;
+
+	ctx->timer_port = AllocSysObjectTags(ASOT_PORT,
+		ASOPORT_Name, "timer_port",
+		TAG_DONE);
+
+	if (!ctx->timer_port) {
+		puts("Couldn't create timer port");
+		goto clean;
+	}
+
+	ctx->timer_req = AllocSysObjectTags(ASOT_IOREQUEST,
+		ASOIOR_Size, sizeof(struct TimeRequest),
+		ASOIOR_ReplyPort, ctx->timer_port,
+		TAG_DONE);
+
+	if (!ctx->timer_req) {
+		puts("Couldn't create IO request");
+		goto clean;
+	}
+
+	ctx->timer_device = OpenDevice(TIMERNAME, UNIT_WAITUNTIL,
+		(struct IORequest *) ctx->timer_req, 0);
+
+	if (ctx->timer_device) {
+		puts("Couldn't open timer.device");
+		goto clean;
+	}
+
+	ITimer = (struct TimerIFace *) GetInterface(
+		(struct Library *) ctx->timer_req->Request.io_Device, "main", 1, NULL);
+
+	if (!ITimer) {
+		puts("Couldn't get Timer interface");
+		goto clean;
+	}
+
+	result = TRUE;
+
+clean:
+
+	return result;
+}
+
+static BOOL allocate_resources(Context *ctx)
+{
+	BOOL result = FALSE;
+	int i;
+
+	ctx->main_sig = AllocSignal(-1);
+
+	if (ctx->main_sig == -1) {
+		puts("Couldn't allocate signal");
+		goto clean;
+	}
+
+	ctx->arena = my_alloc(carve_buffers(ctx, NULL));
+
+	if (!ctx->arena) {
+		puts("Couldn't allocate buffers");
+		goto clean;
+	}
+
+	carve_buffers(ctx, ctx->arena);
+
+	ctx->window_title.next = ctx->window_title.shown + WINDOW_TITLE_LEN;
+	ctx->screen_title.next = ctx->screen_title.shown + SCREEN_TITLE_LEN;
+
+	trend_init(&ctx->memory_trend, ctx->capacity);
+
+	if (ctx->history_blocks) {
+		history_init(&ctx->history, ctx->history_blocks, history_block_count(ctx));
+	}
+
+	for (i = 0; i < METRIC_COUNT; i++) {
+		ctx->history_scale[i] = 1.0f;
+	}
+
+	ctx->user_port = AllocSysObjectTags(ASOT_PORT,
+		ASOPORT_Name, "user_port",
+		TAG_DONE);
+
+	if (!ctx->user_port) {
+		puts("Couldn't create user port");
+		goto clean;
+	}
+
+	ctx->app_port = AllocSysObjectTags(ASOT_PORT,
+		ASOPORT_Name, "app_port",
+		TAG_DONE);
+
+	if (!ctx->app_port) {
+		puts("Couldn't create app port");
+		goto clean;
+	}
+
+	ctx->total_memory = AvailMem(MEMF_VIRTUAL|MEMF_TOTAL);
+
+	// Viewers get their samples from the service
+	if (ctx->role != ROLE_VIEWER) {
+		heat_slicer_init(&ctx->heat_slicer, 1000000 / ctx->heat_hz);
+
+		ctx->idle_task = CreateTaskTags("Uuno", 0, idler, 4096,
+			AT_Param1, ctx,
+			TAG_DONE);
+
+		if (!ctx->idle_task) {
+			puts("Couldn't create idler task");
+			goto clean;
+		}
+	}
+
+	result = TRUE;
+
+clean:
+
+	return result;
+}
+
+// Grows or shrinks the window by one panel height
+static void panel_changed(Context *ctx, BOOL shown)
+{
+	const int panels = panel_count(ctx);
+
+	// Signed before dividing, the height is unsigned
+	SizeWindow(ctx->window, 0, shown ? (LONG)ctx->height / (panels - 1) : -(LONG)ctx->height / (panels + 1));
+    refresh_window(ctx);
+}
+
+static ULONG elapsed_us(const struct TimeVal *start)
+{
+	struct TimeVal now;
+
+	GetSysTime(&now);
+	SubTime(&now, (struct TimeVal *)start);
+
+	return now.Seconds * 1000000 + now.Microseconds;
+}
+
+static void dragbar_changed(Context *ctx)
+{
+	struct TimeVal start;
+
+	GetSysTime(&start);
+
+	// Remember old coordinates
+	const WORD x = ctx->window->LeftEdge;
+	const WORD y = ctx->window->TopEdge;
+
+	const BOOL recreate = ctx->stats.report && ctx->stats.chrome_recreate;
+
+	if (recreate) {
+		recreate_window(ctx);
+	}
+
+	ctx->window = open_window(ctx, x, y);
+
+	if (ctx->window) {
+		ctx->titles_invalid = TRUE;
+		ActivateWindow(ctx->window);
+		refresh_window(ctx);
+	} else {
+		puts("Panic - can't reopen window!");
+		ctx->running = FALSE;
+	}
+
+	if (recreate) {
+		ctx->stats.chrome_recreate_us = elapsed_us(&start);
+	} else {
+		ctx->stats.chrome_reconfigure_us = elapsed_us(&start);
+	}
+
+	ctx->stats.chrome_recreate = ctx->stats.report && !recreate;
+}
+
+// Mode menu items behave like radio buttons
+static void set_mode(Context *ctx, EMeasureMode mode)
+{
+	int i;
+
+	ctx->mode = mode;
+
+	for (i = 0; i < MODE_COUNT; i++) {
+		set_menu_item(ctx, MID_BusyMode + i, i == (int)mode);
+	}
+}
+
+/*
+
+Moves the ring into a block of 'capacity' slots. The live samples are
+copied oldest first in one pass, the newest ones that fit are kept and the
+ring continues from the end of the copy. The trend is rebuilt from them.
+Nothing changes if the block can't be allocated.
+
+*/
+/*
+
+A shorter ring keeps the newest samples. The dropped ones were added to the
+history when they were taken, so an export still has them as older rows as
+long as the history is on and hasn't dropped them itself.
+
+*/
+static BOOL resize_ring(Context *ctx, ULONG capacity)
+{
+	Sample *samples;
+	SampleInfo *infos;
+	HeatColumn *heat_columns;
+	UBYTE *block = my_alloc(carve_ring(NULL, 0, capacity, &samples, &infos, &heat_columns));
+	const ULONG kept = MIN(ctx->stored, capacity);
+	ULONG slot = ring_slot(ctx, kept ? kept - 1 : 0);
+	ULONG i;
+
+	if (!block) {
+		puts("Couldn't allocate sample data");
+		return FALSE;
+	}
+
+	carve_ring(block, 0, capacity, &samples, &infos, &heat_columns);
+
+	trend_init(&ctx->memory_trend, capacity);
+
+	for (i = 0; i < kept; i++) {
+		samples[i] = ctx->samples[slot];
+		infos[i] = ctx->infos[slot];
+		heat_columns[i] = ctx->heat_columns[slot];
+
+		trend_add(&ctx->memory_trend, samples[i].values[METRIC_VIRTUAL_MEM], 0);
+
+		slot = ring_next(ctx, slot);
+	}
+
+	// The startup ring stays in the arena
+	if (ctx->ring_block) {
+		my_free(ctx->ring_block);
+	}
+
+	ctx->ring_block = block;
+	ctx->samples = samples;
+	ctx->infos = infos;
+	ctx->heat_columns = heat_columns;
+	ctx->capacity = capacity;
+	ctx->stored = kept;
+	ctx->iter = kept ? kept - 1 : capacity - 1;
+	ctx->heat_valid = FALSE;
+
+	return TRUE;
+}
+
+static void set_capacity(Context *ctx, ULONG capacity)
+{
+	int i;
+
+	if (resize_ring(ctx, capacity) && ctx->window) {
+		query_window_size(ctx);
+	}
+
+	for (i = 0; ctx->menu && i < SPAN_CHOICES; i++) {
+		set_menu_item(ctx, MID_Span + i, ctx->capacity == 60 * (ULONG)span_minutes[i]);
+	}
+}
+
+// Returns TRUE if the switch changed, its menu item follows it
+static BOOL change_feature(Context *ctx, BOOL *feature, BOOL value, ULONG id)
+{
+	if (*feature == value) {
+		return FALSE;
+	}
+
+	*feature = value;
+
+	if (ctx->menu) {
+		set_menu_item(ctx, id, value);
+	}
+
+	return TRUE;
+}
+
+/*
+
+Applies the fields of a reloaded config that differ from the running ones.
+Panel and dragbar changes resize or reopen the window like their menu
+items do, the rest show up in the frame drawn at the end. A new span
+resizes the ring like the Span menu, a shorter one drops the oldest
+samples from the graph. The size gadget can't be changed on a window object, it needs a
+restart.
+
+*/
+static void apply_changes(Context *ctx, const LiveConfig *config)
+{
+	Features *features = &ctx->features;
+	int i;
+
+	for (i = 0; i < METRIC_COUNT; i++) {
+		change_feature(ctx, &features->graph[i], config->features.graph[i], MID_Graph + i);
+	}
+
+	change_feature(ctx, &features->grid, config->features.grid, MID_Grid);
+	change_feature(ctx, &features->direct_render, config->features.direct_render, MID_DirectRender);
+	features->solid_draw = config->features.solid_draw;
+
+	if (change_feature(ctx, &features->heatmap, config->features.heatmap, MID_Heatmap)) {
+		ctx->heat_valid = FALSE;
+	}
+
+	if (memcmp(&ctx->colors, &config->colors, sizeof(Colors)) != 0) {
+		ctx->colors = config->colors;
+		ctx->heat_valid = FALSE;
+	}
+
+	if (config->mode != ctx->mode) {
+		if (ctx->menu) {
+			set_mode(ctx, config->mode);
+		} else {
+			ctx->mode = config->mode;
+		}
+	}
+
+	if (config->capacity != ctx->capacity) {
+		set_capacity(ctx, config->capacity);
+	}
+
+	if (config->opaqueness != ctx->opaqueness) {
+		ctx->opaqueness = config->opaqueness;
+
+		if (ctx->window) {
+			SetWindowAttrs(ctx->window, WA_Opaqueness, ctx->opaqueness, TAG_DONE);
+		}
+	}
+
+	if (config->x_pos != ctx->x_pos || config->y_pos != ctx->y_pos) {
+		ctx->x_pos = config->x_pos;
+		ctx->y_pos = config->y_pos;
+
+		if (ctx->window) {
+			ChangeWindowBox(ctx->window, ctx->x_pos, ctx->y_pos, ctx->window->Width, ctx->window->Height);
+		}
+	}
+
+	if (!ctx->window) {
+		// Applied when the window opens
+		features->net = config->features.net;
+		features->disk = config->features.disk;
+		features->latency = config->features.latency;
+		features->dragbar = config->features.dragbar;
+		return;
+	}
+
+	if (change_feature(ctx, &features->net, config->features.net, MID_NetGraph)) {
+		panel_changed(ctx, features->net);
+	}
+
+	if (change_feature(ctx, &features->disk, config->features.disk, MID_DiskGraph)) {
+		panel_changed(ctx, features->disk);
+	}
+
+	if (change_feature(ctx, &features->latency, config->features.latency, MID_LatencyGraph)) {
+		panel_changed(ctx, features->latency);
+	}
+
+	if (change_feature(ctx, &features->dragbar, config->features.dragbar, MID_DragBar)) {
+		dragbar_changed(ctx);
+	}
+
+	refresh_window(ctx);
+}
+
+/*
+
+The prefs file is read the way it was at startup: it stands in for all of
+the icon tooltypes, and a switch is on only when its line is there. So a
+removed line turns its switch off, also one toggled from the menu since.
+
+*/
+static void reload_prefs(Context *ctx)
+{
+	LiveConfig config;
+
+	current_config(ctx, &config);
+
+	if (read_prefs_file(ctx, ctx->prefs_file, &config)) {
+		apply_changes(ctx, &config);
+	}
+}
+
+static void handle_keyboard(Context *ctx, UWORD key)
+{
+	BOOL update = TRUE;
+
+	int i;
+
+	for (i = 0; i < METRIC_COUNT; i++) {
+		if (metrics[i].key && metrics[i].key == key) {
+			ctx->features.graph[i] ^= TRUE;
+			set_menu_item(ctx, MID_Graph + i, ctx->features.graph[i]);
+			refresh_window(ctx);
+			return;
+		}
+	}
+
+	switch (key) {
+		case 'g':
+			ctx->features.grid ^= TRUE;
+			set_menu_item(ctx, MID_Grid, ctx->features.grid);
+			break;
+
+		case 's':
+			ctx->features.solid_draw ^= TRUE;
+			break;
+
+		case 'm':
+			set_mode(ctx, (ctx->mode + 1) % MODE_COUNT);
+			break;
+
+		case 'n':
+			ctx->features.net ^= TRUE;
+			set_menu_item(ctx, MID_NetGraph, ctx->features.net);
+			panel_changed(ctx, ctx->features.net);
+			break;
+
+		case 'k':
+			ctx->features.disk ^= TRUE;
+			set_menu_item(ctx, MID_DiskGraph, ctx->features.disk);
+			panel_changed(ctx, ctx->features.disk);
+			break;
+
+		case 'l':
+			ctx->features.latency ^= TRUE;
+			set_menu_item(ctx, MID_LatencyGraph, ctx->features.latency);
+			panel_changed(ctx, ctx->features.latency);
+			break;
+
+		case 'd':
+			ctx->features.dragbar ^= TRUE;
+			dragbar_changed(ctx);
+			break;
+
+		case 'r':
+			ctx->features.direct_render ^= TRUE;
+			set_menu_item(ctx, MID_DirectRender, ctx->features.direct_render);
+			break;
+
+		case 'h':
+			ctx->features.heatmap ^= TRUE;
+			ctx->heat_valid = FALSE;
+			set_menu_item(ctx, MID_Heatmap, ctx->features.heatmap);
+			break;
+
+		case 'e':
+			export_history(ctx);
+			update = FALSE;
+			break;
+
+		case 'q':
+			ctx->running = FALSE;
+			break;
+
+		default:
+			update = FALSE;
+			break;
+	}
+
+	if (update) {
+		refresh_window(ctx);
+	}
+}
+
+static void show_about_window(Context* ctx)
+{
+	if (!RequesterBase && !OpenRequesterClass()) {
+		return;
+	}
+
+	Object* o = NewObject(RequesterClass, NULL,
+		REQ_TitleText, "About CPU Watcher",
+		REQ_BodyText, VERSION_STRING DATE_STRING,
+		REQ_GadgetText, "_Ok",
+		REQ_Image, REQIMAGE_INFO,
+		TAG_DONE);
+
+	if (o) {
+		SetWindowPointer(ctx->window, WA_BusyPointer, TRUE, TAG_DONE);
+		IDoMethod(o, RM_OPENREQ, NULL, ctx->window, NULL, TAG_DONE);
+		SetWindowPointer(ctx->window, TAG_DONE);
+		DisposeObject(o);
+	}
+}
+
+// The icon is read from disk only when it's first needed
+static void handle_iconify(Context* ctx)
+{
+	if (!ctx->icon) {
+		ctx->icon = getDiskObject();
+
+		SetAttrs(ctx->windowObject, WINDOW_Icon, ctx->icon, TAG_DONE);
+	}
+
+	ctx->window = NULL;
+	IDoMethod(ctx->windowObject, WM_ICONIFY);
+	update_window_sig(ctx);
+}
+
+static void handle_uniconify(Context* ctx)
+{
+	ctx->window = (struct Window *)IDoMethod(ctx->windowObject, WM_OPEN);
+	update_window_sig(ctx);
+	ctx->titles_invalid = TRUE;
+	refresh_window(ctx);
+}
+
+static BOOL handle_menupick(Context *ctx)
+{
+	BOOL running = TRUE;
+
+	uint32 id = NO_MENU_ID;
+
+	while (ctx->window && ((id = IDoMethod(ctx->menu, MM_NEXTSELECT, 0, id))) != NO_MENU_ID) {
+		if (id >= MID_Graph && id < MID_Graph + METRIC_COUNT) {
+			ctx->features.graph[id - MID_Graph] = IDoMethod(ctx->menu, MM_GETSTATE, 0, id);
+			refresh_window(ctx);
+			continue;
+		}
+
+		if (id >= MID_Span && id <= MID_SpanLast) {
+			set_capacity(ctx, 60 * span_minutes[id - MID_Span]);
+			refresh_window(ctx);
+			continue;
+		}
+
+		switch(id) {
+			case MID_Quit:
+				running = FALSE;
+				break;
+			case MID_Iconify:
+				handle_iconify(ctx);
+				break;
+			case MID_About:
+				show_about_window(ctx);
+				break;
+			case MID_Export:
+				export_history(ctx);
+				break;
+
+			// Options
+			case MID_NetGraph:
+				ctx->features.net = IDoMethod(ctx->menu, MM_GETSTATE, 0, id);
+				panel_changed(ctx, ctx->features.net);
+				break;
+			case MID_DiskGraph:
+				ctx->features.disk = IDoMethod(ctx->menu, MM_GETSTATE, 0, id);
+				panel_changed(ctx, ctx->features.disk);
+				break;
+			case MID_LatencyGraph:
+				ctx->features.latency = IDoMethod(ctx->menu, MM_GETSTATE, 0, id);
+				panel_changed(ctx, ctx->features.latency);
+				break;
+			case MID_Grid:
+				ctx->features.grid = IDoMethod(ctx->menu, MM_GETSTATE, 0, id);
+				refresh_window(ctx);
+				break;
+			case MID_DragBar:
+				ctx->features.dragbar = IDoMethod(ctx->menu, MM_GETSTATE, 0, id);
+				dragbar_changed(ctx);
+				break;
+			case MID_BusyMode:
+			case MID_SimpleMode:
+			case MID_ZeroSpinMode:
+				set_mode(ctx, id - MID_BusyMode);
+				break;
+			case MID_DirectRender:
+				ctx->features.direct_render = IDoMethod(ctx->menu, MM_GETSTATE, 0, id);
+				refresh_window(ctx);
+				break;
+			case MID_Heatmap:
+				ctx->features.heatmap = IDoMethod(ctx->menu, MM_GETSTATE, 0, id);
+				ctx->heat_valid = FALSE;
+				refresh_window(ctx);
+				break;
+		}
+	}
+
+	return running;
+}
+
+static char getVanillaKey(Context *ctx)
+{
+	struct InputEvent *ie;
+	char vanilla;
+
+	if (!GetAttr(WINDOW_InputEvent, ctx->windowObject, (ULONG *)&ie)) {
+		puts("GetAttr failed");
+		return 0;
+	}
+
+	if (MapRawKey(ie, &vanilla, 1, NULL) == 1) {
+		return vanilla;
+	}
+
+	return 0;
+}
+
+static void handle_window_events(Context *ctx)
+{
+	uint32 result;
+	int16 code = 0;
+	BOOL resized = FALSE;
+
+	while ((result = IDoMethod(ctx->windowObject, WM_HANDLEINPUT, &code)) != WMHI_LASTMSG) {
+		switch (result & WMHI_CLASSMASK) {
+			case WMHI_CLOSEWINDOW:
+				ctx->running = FALSE;
+				break;
+#if 0 // Doesn't trigger?
+			case WMHI_VANILLAKEY:
+				handle_keyboard(ctx, result & WMHI_KEYMASK);
+				break;
+#endif
+			case WMHI_RAWKEY:
+				handle_keyboard(ctx, getVanillaKey(ctx));
+				break;
+			case WMHI_NEWSIZE:
+				// Debounced, a drag may queue many of these
+				resized = TRUE;
+				break;
+			case WMHI_ICONIFY:
+				handle_iconify(ctx);
+				break;
+			case WMHI_UNICONIFY:
+				handle_uniconify(ctx);
+				break;
+			case WMHI_MENUPICK:
+				ctx->running = handle_menupick(ctx);
+				break;
+			default:
+				//printf("unhandled result %lx, code %x\n", result, code);
+				break;
+		}
+	}
+
+	if (resized && ctx->window) {
+		resize_later(ctx);
+	}
+}
+
+static UBYTE clamp100(UBYTE value)
+{
+	if (value > 100) {
+		//printf("%d\n", value);
+		value = 100;
+	}
+
+	return value;
+}
+
+static void init_probe(ProbeSchedule *probe, UBYTE min_period, UBYTE max_period)
+{
+	probe->period = min_period;
+	probe->min_period = min_period;
+	probe->max_period = max_period;
+	probe->countdown = 0;
+	probe->calls = 0;
+}
+
+static BOOL probe_due(ProbeSchedule *probe)
+{
+	if (probe->countdown) {
+		probe->countdown--;
+		return FALSE;
+	}
+
+	probe->countdown = probe->period - 1;
+	probe->calls++;
+
+	return TRUE;
+}
+
+static void adapt_probe(ProbeSchedule *probe, int change)
+{
+	if (abs(change) >= PROBE_FAST_CHANGE) {
+		probe->period = probe->min_period;
+		probe->countdown = 0;
+	} else if (change == 0 && probe->period < probe->max_period) {
+		probe->period *= 2;
+	}
+}
+
+/*
+
+Every measuring mode reports how many percent of the last period the CPU
+was idle. measure_cpu resets the accumulators of all modes afterwards, so
+switching modes only affects one period.
+
+*/
+static UBYTE idle_busy(Context *ctx)
+{
+	(void)ctx;
+
+	return roundf(100.0f * (idle_time.total.Seconds * 1000000 + idle_time.total.Microseconds) / 1000000.0f);
+}
+
+static UBYTE idle_simple(Context *ctx)
+{
+	return ctx->run_count;
+}
+
+// Share of wake-ups that were on time, an estimate of the idle time
+static UBYTE idle_zero_spin(Context *ctx)
+{
+	const ULONG wakes = ctx->wake_count;
+
+	if (!wakes) {
+		// Didn't get the CPU at all
+		return 0;
+	}
+
+	return (100 * (wakes - ctx->late_count) + wakes / 2) / wakes;
+}
+
+static UBYTE (*const idle_meters[MODE_COUNT])(Context *) = {
+	idle_busy,
+	idle_simple,
+	idle_zero_spin
+};
+
+/*
+
+Sub-samples get the same correction as the sample. The idle task doesn't
+run under full load, so the slices it would have closed are closed here:
+it's switched out while this runs, there's no current run to count. When
+the heatmap isn't measured the slicer starts over, so the time spent in
+another mode doesn't come out as busy.
+
+*/
+static void take_heat(Context *ctx)
+{
+	HeatColumn *heat = &ctx->measured.heat;
+	struct TimeVal now;
+
+	GetSysTime(&now);
+
+	Forbid();
+
+	if (ctx->mode == MODE_BUSY && ctx->features.heatmap) {
+		heat_slice(&ctx->heat_slicer, time_us(&now), idle_time.run_us, time_us(&now), &ctx->heat_live);
+	} else {
+		ctx->heat_slicer.started = 0;
+	}
+
+	*heat = ctx->heat_live;
+	heat_clear(&ctx->heat_live);
+	Permit();
+
+	if (heat->total && ctx->calibrated[ctx->mode] && !ctx->sweeping) {
+		const HeatColumn raw = *heat;
+		int level;
+
+		heat_clear(heat);
+
+		for (level = 0; level < HEAT_LEVELS; level++) {
+			if (raw.counts[level]) {
+				heat_add(heat, ctx->correction[ctx->mode][level], raw.counts[level]);
+			}
+		}
+	}
+}
+
+static void measure_cpu(Context *ctx)
+{
+	UBYTE value = 100;
+
+	value -= MIN(idle_meters[ctx->mode](ctx), 100);
+
+	// Calibration sweeps need the raw values
+	if (ctx->calibrated[ctx->mode] && !ctx->sweeping) {
+		value = ctx->correction[ctx->mode][clamp100(value)];
+	}
+
+	ctx->run_count = 0;
+	ctx->wake_count = 0;
+	ctx->late_count = 0;
+	idle_time.total.Seconds = 0;
+	idle_time.total.Microseconds = 0;
+
+	get_new(METRIC_CPU) = clamp100(value);
+
+	take_heat(ctx);
+}
+
+static void measure_virtual_mem(Context *ctx)
+{
+	UBYTE value = roundf(100.0f * (float)AvailMem(MEMF_VIRTUAL) / (float)ctx->total_memory);
+
+	get_new(METRIC_VIRTUAL_MEM) = clamp100(value);
+}
+
+// Keeps the previous value if the board can't be queried
+static void measure_video_mem(Context *ctx)
+{
+	uint64 total_vid, free_vid;
+
+	if (GetBoardDataTags(0,
+		GBD_TotalMemory, &total_vid,
+		GBD_FreeMemory, &free_vid,
+		TAG_DONE) == 2) {
+
+		UBYTE value = roundf(100.0f * (float)free_vid / (float)total_vid);
+
+		get_new(METRIC_VIDEO_MEM) = clamp100(value);
+	}
+}
+
+// After a new peak, scales the history of an autoscaled metric down to it
+static void rescale_history(Context *ctx, EMetric metric, float multiplier)
+{
+	ULONG i;
+	for (i = 0; i < ctx->capacity; i++) {
+		ctx->samples[i].values[metric] *= multiplier;
+	}
+
+	// The peak was zero, and so were the samples
+	if (multiplier > 0.0f) {
+		ctx->history_scale[metric] *= multiplier;
+	}
+
+	service_rescale(ctx, metric, multiplier);
+}
+
+// Probes don't touch the ring, the rescale travels with the sample instead
+static void rescale_measured(Context *ctx, EMetric metric, float multiplier)
+{
+	ctx->measured.multiplier[metric] *= multiplier;
+	get_new(metric) *= multiplier;
+}
+
+static void clear_multipliers(QueuedSample *queued)
+{
+	int i;
+
+	for (i = 0; i < METRIC_COUNT; i++) {
+		queued->multiplier[i] = 1.0f;
+	}
+}
+
+static void update_network(Context *ctx, float *dl_speed, float *ul_speed)
+{
+	float dl_mult = 1.0f, ul_mult = 1.0f;
+	UBYTE dl_p, ul_p;
+
+	if (update_netstats(ctx->net_in, ctx->net_out, &dl_p, &ul_p, &dl_mult, &ul_mult, dl_speed, ul_speed)) {
+		rescale_measured(ctx, METRIC_DOWNLOAD, dl_mult);
+		rescale_measured(ctx, METRIC_UPLOAD, ul_mult);
+	}
+
+	get_new(METRIC_DOWNLOAD) = dl_p;
+	get_new(METRIC_UPLOAD) = ul_p;
+}
+
+// Fills in both upload and download
+static void measure_network(Context *ctx)
+{
+	if (!get_netcounters(&ctx->net_in, &ctx->net_out)) {
+		get_new(METRIC_DOWNLOAD) = 0;
+		get_new(METRIC_UPLOAD) = 0;
+		ctx->dl_speed = 0;
+		ctx->ul_speed = 0;
+		return;
+	}
+
+	update_network(ctx, &ctx->dl_speed, &ctx->ul_speed);
+}
+
+// Fills in both disk read and write
+static void measure_disk(Context *ctx)
+{
+	float read_mult = 1.0f, write_mult = 1.0f;
+	UBYTE read, write;
+
+	if (!ctx->disk_source.poll) {
+		return;
+	}
+
+	const ULONG elapsed = elapsed_us(&ctx->disk_poll);
+	GetSysTime(&ctx->disk_poll);
+
+	if (disk_update(&ctx->disk, &ctx->disk_source, elapsed, &read, &write, &read_mult, &write_mult) > 0) {
+		rescale_measured(ctx, METRIC_DISK_READ, read_mult);
+		rescale_measured(ctx, METRIC_DISK_WRITE, write_mult);
+	}
+
+	get_new(METRIC_DISK_READ) = read;
+	get_new(METRIC_DISK_WRITE) = write;
+}
+
+/*
+
+The launch hook only increments a counter, the interval is the difference
+to the value read on the previous tick. A single aligned read can't be
+torn, so no locking is needed on either side.
+
+*/
+static void measure_dispatches(Context *ctx)
+{
+	const ULONG dispatches = idle_time.dispatches;
+
+	ctx->dispatch_rate = dispatches - ctx->last_dispatches;
+	ctx->last_dispatches = dispatches;
+
+	scale_dispatches(ctx);
+}
+
+// Level of the current rate, a new peak rescales the graph
+static void scale_dispatches(Context *ctx)
+{
+	if (ctx->dispatch_rate > ctx->max_dispatch_rate) {
+		rescale_measured(ctx, METRIC_DISPATCHES, (float)ctx->max_dispatch_rate / ctx->dispatch_rate);
+		ctx->max_dispatch_rate = ctx->dispatch_rate;
+	}
+
+	get_new(METRIC_DISPATCHES) = ctx->max_dispatch_rate ?
+		100.0f * ctx->dispatch_rate / ctx->max_dispatch_rate : 0;
+}
+
+// Fills in all latency metrics from the histogram of the last period
+static void measure_latency(Context *ctx)
+{
+	LatencyHistogram period;
+
+	if (!ctx->latency_task) {
+		return;
+	}
+
+	Forbid();
+	period = ctx->latency_live;
+	latency_reset(&ctx->latency_live);
+	Permit();
+
+	ctx->latency_p50 = latency_percentile(&period, 50);
+	ctx->latency_p99 = latency_percentile(&period, 99);
+	ctx->latency_max = period.max;
+
+	latency_levels(ctx);
+}
+
+static void latency_levels(Context *ctx)
+{
+	get_new(METRIC_LATENCY_P50) = latency_level(ctx->latency_p50);
+	get_new(METRIC_LATENCY_P99) = latency_level(ctx->latency_p99);
+	get_new(METRIC_LATENCY_MAX) = latency_level(ctx->latency_max);
+}
+
+static void start_latency_probe(Context *ctx)
+{
+	if (!ctx->latency_hz) {
+		return;
+	}
+
+	ctx->latency_sig = AllocSignal(-1);
+
+	if (ctx->latency_sig == -1) {
+		puts("Couldn't allocate signal");
+		return;
+	}
+
+	ctx->latency_running = TRUE;
+
+	ctx->latency_task = CreateTaskTags("CPU Watcher latency", LATENCY_PRI, latency_worker, 4096,
+		AT_Param1, ctx,
+		TAG_DONE);
+
+	if (!ctx->latency_task) {
+		puts("Couldn't create latency probe task");
+		ctx->latency_running = FALSE;
+		FreeSignal(ctx->latency_sig);
+		ctx->latency_sig = -1;
+	}
+}
+
+static void stop_latency_probe(Context *ctx)
+{
+	if (!ctx->latency_task) {
+		return;
+	}
+
+	ctx->latency_running = FALSE;
+
+	// Not main_sig, another task may raise that while this one still runs
+	Wait(1L << ctx->latency_sig);
+
+	DeleteTask(ctx->latency_task);
+	ctx->latency_task = NULL;
+
+	FreeSignal(ctx->latency_sig);
+	ctx->latency_sig = -1;
+}
+
+static void start_disk_stats(Context *ctx)
+{
+	disk_init(&ctx->disk);
+
+	if (ctx->disk_file[0]) {
+		disk_file_source(&ctx->disk_source, ctx->disk_file);
+	} else if (ctx->disk_devices[0]) {
+		ctx->disk_patched = disk_patch_install(ctx->disk_devices);
+
+		if (ctx->disk_patched) {
+			disk_patch_source(&ctx->disk_source);
+		}
+	}
+
+	GetSysTime(&ctx->disk_poll);
+}
+
+/*
+
+The measured sample is kept between ticks, so skipped probes carry the
+previous value forward. One call per due probe, in table order.
+
+*/
+static void run_probes(Context *ctx)
+{
+	const Sample previous = ctx->measured.sample;
+	int i;
+
+	for (i = 0; i < METRIC_COUNT; i++) {
+		if (metrics[i].probe && probe_due(&ctx->probes[i])) {
+			metrics[i].probe(ctx);
+			adapt_probe(&ctx->probes[i], get_new(i) - previous.values[i]);
+		}
+	}
+}
+
+static void fill_info(Context *ctx, SampleInfo *info)
+{
+	GetSysTime(&info->time);
+
+	info->net_in = ctx->net_in;
+	info->net_out = ctx->net_out;
+	info->dl_speed = ctx->dl_speed;
+	info->ul_speed = ctx->ul_speed;
+	info->disk_read_rate = ctx->disk.read_rate;
+	info->disk_write_rate = ctx->disk.write_rate;
+	info->dispatch_rate = ctx->dispatch_rate;
+	info->latency_p50 = ctx->latency_p50;
+	info->latency_p99 = ctx->latency_p99;
+	info->latency_max = ctx->latency_max;
+
+	// Replayed, they are measured when the trace has them
+	if (ctx->replay.file) {
+		info->disk = (ctx->replay.last.fields & TRACE_DISK) != 0;
+		info->latency = (ctx->replay.last.fields & TRACE_LATENCY) != 0;
+	} else {
+		info->disk = ctx->disk_source.poll != NULL;
+		info->latency = ctx->latency_task != NULL;
+	}
+
+	info->mode = ctx->mode;
+}
+
+static void start_recording(Context *ctx)
+{
+	if (!trace_create(&ctx->record, ctx->record_file)) {
+		printf("Couldn't create trace '%s'\n", ctx->record_file);
+	}
+}
+
+static void record_sample(Context *ctx)
+{
+	TraceRecord record;
+
+	if (!ctx->record.file) {
+		return;
+	}
+
+	// When it was measured, however late the GUI takes it
+	record.time = time_us(&ctx->info.time);
+	record.cpu = get_cur(METRIC_CPU);
+	record.virtual_mem = get_cur(METRIC_VIRTUAL_MEM);
+	record.video_mem = get_cur(METRIC_VIDEO_MEM);
+	record.net_in = ctx->info.net_in;
+	record.net_out = ctx->info.net_out;
+
+	// Raw, a replay scales them again
+	record.fields = TRACE_DISPATCHES;
+	record.dispatches = ctx->info.dispatch_rate;
+
+	if (ctx->info.disk) {
+		record.fields |= TRACE_DISK;
+		record.disk_read = ctx->info.disk_read_rate;
+		record.disk_write = ctx->info.disk_write_rate;
+	}
+
+	if (ctx->info.latency) {
+		record.fields |= TRACE_LATENCY;
+		record.latency_p50 = ctx->info.latency_p50;
+		record.latency_p99 = ctx->info.latency_p99;
+		record.latency_max = ctx->info.latency_max;
+	}
+
+	if (!trace_write(&ctx->record, &record)) {
+		puts("Couldn't write trace, recording stopped");
+		trace_close(&ctx->record);
+	}
+}
+
+/*
+
+Exports go through an unbuffered file, the exporter hands it whole blocks.
+Samples in the ring have their own time and network rates. Older ones come
+from the compressed history, which has no rates. Their values are brought
+to the current scale and their time is placed between the first and last
+sample of their block, which are evenly spaced.
+
+*/
+static int write_export(void *handle, const char *data, uint32 length)
+{
+	return fwrite(data, length, 1, (FILE *)handle) == 1;
+}
+
+static FILE *open_export(Context *ctx, Exporter *exporter, const char *file_name)
+{
+	FILE *file = fopen(file_name, "w");
+
+	if (!file) {
+		return NULL;
+	}
+
+	setvbuf(file, NULL, _IONBF, 0);
+
+	export_init(exporter, ctx->export_format, ctx->export_names, METRIC_COUNT, write_export, file);
+	export_header(exporter);
+
+	return file;
+}
+
+static void export_sample(Exporter *exporter, const Sample *sample, const SampleInfo *info)
+{
+	ExportRow row;
+
+	row.seconds = info->time.Seconds + UNIX_EPOCH_OFFSET;
+	row.micros = info->time.Microseconds;
+	row.values = sample->values;
+	row.rates = TRUE;
+	row.download = (uint32)(info->dl_speed * 1024.0f + 0.5f);
+	row.upload = (uint32)(info->ul_speed * 1024.0f + 0.5f);
+
+	export_row(exporter, &row);
+}
+
+// Exports the history rows older than the ring, returns their count
+static ULONG export_older(Context *ctx, Exporter *exporter, ULONG recent)
+{
+	const ULONG stored = ctx->history.used ? history_samples(&ctx->history) : 0;
+	const ULONG older = stored > recent ? stored - recent : 0;
+	ULONG rows = 0;
+	int i;
+
+	for (i = 0; i < ctx->history.used && rows < older; i++) {
+		const HistoryBlock *block = history_block(&ctx->history, i);
+		HistoryReader reader;
+		Sample sample;
+		ExportRow row;
+		int r = 0;
+
+		history_read_block(&reader, &ctx->history, block);
+
+		while (rows < older && history_read(&reader, sample.values)) {
+			const uint64 time = history_time(block, r++);
+			int m;
+
+			for (m = 0; m < METRIC_COUNT; m++) {
+				if (block->scale[m] != ctx->history_scale[m]) {
+					sample.values[m] *= ctx->history_scale[m] / block->scale[m];
+				}
+			}
+
+			row.seconds = time / 1000000 + UNIX_EPOCH_OFFSET;
+			row.micros = time % 1000000;
+			row.values = sample.values;
+			row.rates = FALSE;
+
+			export_row(exporter, &row);
+			rows++;
+		}
+	}
+
+	return rows;
+}
+
+static void export_history(Context *ctx)
+{
+	char file_name[PREFS_NAME_LEN + 8];
+	const ULONG recent = ctx->stored;
+
+	if (!recent) {
+		puts("No samples to export yet");
+		return;
+	}
+
+	if (ctx->export_file[0]) {
+		snprintf(file_name, sizeof(file_name), "%s", ctx->export_file);
+	} else {
+		snprintf(file_name, sizeof(file_name), "%s.%s", EXPORT_FILE,
+			ctx->export_format == EXPORT_JSON ? "json" : "csv");
+	}
+
+	Exporter *exporter = my_alloc(sizeof(Exporter));
+
+	if (!exporter) {
+		puts("Couldn't allocate export buffer");
+		return;
+	}
+
+	FILE *file = open_export(ctx, exporter, file_name);
+
+	if (!file) {
+		printf("Couldn't create export '%s'\n", file_name);
+		my_free(exporter);
+		return;
+	}
+
+	ULONG rows = export_older(ctx, exporter, recent);
+	ULONG age;
+
+	for (age = recent; age-- > 0; ) {
+		const ULONG slot = ring_slot(ctx, age);
+
+		export_sample(exporter, &ctx->samples[slot], &ctx->infos[slot]);
+		rows++;
+	}
+
+	if (export_flush(exporter)) {
+		printf("Exported %lu samples to '%s'\n", rows, file_name);
+	} else {
+		printf("Couldn't write export '%s'\n", file_name);
+	}
+
+	fclose(file);
+	my_free(exporter);
+}
+
+static BOOL open_stream(Context *ctx)
+{
+	ctx->stream = open_export(ctx, ctx->streamer, ctx->stream_file);
+
+	if (!ctx->stream) {
+		printf("Couldn't create export stream '%s'\n", ctx->stream_file);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+// Returns FALSE if a write has failed
+static BOOL close_stream(Context *ctx)
+{
+	const BOOL written = export_flush(ctx->streamer);
+
+	fclose(ctx->stream);
+	ctx->stream = NULL;
+
+	return written;
+}
+
+static void start_stream(Context *ctx)
+{
+	ctx->streamer = my_alloc(sizeof(Exporter));
+
+	if (!ctx->streamer) {
+		puts("Couldn't allocate export buffer");
+		return;
+	}
+
+	open_stream(ctx);
+}
+
+static void stop_stream(Context *ctx)
+{
+	if (ctx->stream && !close_stream(ctx)) {
+		puts("Couldn't write export stream");
+	}
+
+	if (ctx->streamer) {
+		my_free(ctx->streamer);
+		ctx->streamer = NULL;
+	}
+}
+
+// Keeps one old file, NAME.old
+static void rotate_stream(Context *ctx)
+{
+	char old_name[PREFS_NAME_LEN + 8];
+
+	snprintf(old_name, sizeof(old_name), "%s.old", ctx->stream_file);
+
+	if (!close_stream(ctx)) {
+		puts("Couldn't write export stream, streaming stopped");
+		return;
+	}
+
+	// Rename doesn't replace an existing file
+	remove(old_name);
+
+	if (rename(ctx->stream_file, old_name) != 0) {
+		printf("Couldn't rename '%s', streaming stopped\n", ctx->stream_file);
+		return;
+	}
+
+	open_stream(ctx);
+}
+
+static void stream_sample(Context *ctx)
+{
+	if (!ctx->stream) {
+		return;
+	}
+
+	export_sample(ctx->streamer, &ctx->samples[ctx->iter], &ctx->info);
+
+	if (ctx->streamer->failed) {
+		puts("Couldn't write export stream, streaming stopped");
+		close_stream(ctx);
+	} else if (ctx->stream_kib > 0 && export_size(ctx->streamer) >= (ULONG)ctx->stream_kib * 1024) {
+		rotate_stream(ctx);
+	}
+}
+
+/*
+
+Collector and sender modes. A sender puts every send_batch samples from
+the ring into one UDP datagram, so the packet rate stays low however many
+machines report. Datagrams aren't acknowledged, a lost one is a gap.
+
+*/
+static LONG open_udp_socket(void)
+{
+	const LONG socket_fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (socket_fd >= 0) {
+		LONG on = 1;
+
+		IoctlSocket(socket_fd, FIONBIO, (char *)&on);
+	}
+
+	return socket_fd;
+}
+
+static BOOL resolve_host(const char *name, struct sockaddr_in *addr, int port)
+{
+	memset(addr, 0, sizeof(*addr));
+	addr->sin_family = AF_INET;
+	addr->sin_port = htons(port);
+	addr->sin_addr.s_addr = inet_addr(name);
+
+	if (addr->sin_addr.s_addr == INADDR_NONE) {
+		struct hostent *host = gethostbyname(name);
+
+		if (!host) {
+			return FALSE;
+		}
+
+		memcpy(&addr->sin_addr, host->h_addr, sizeof(addr->sin_addr));
+	}
+
+	return TRUE;
+}
+
+static void send_datagram(Context *ctx, const struct sockaddr_in *addr, const char *name, const Sample *batch, int count)
+{
+	UBYTE packet[COLLECT_PACKET_MAX];
+	const int length = collect_encode(packet, name, ctx->send_base + ctx->taken - count, batch->values, count);
+
+	if (sendto(ctx->send_socket, packet, length, 0, (struct sockaddr *)addr, sizeof(*addr)) != length) {
+		ctx->send_failures++;
+	}
+}
+
+static void send_samples(Context *ctx)
+{
+	Sample batch[COLLECT_MAX_BATCH];
+	int i;
+
+	for (i = 0; i < ctx->send_batch; i++) {
+		batch[i] = ctx->samples[ring_slot(ctx, ctx->send_batch - 1 - i)];
+	}
+
+	send_datagram(ctx, &ctx->send_addr, ctx->host_name, batch, ctx->send_batch);
+}
+
+/*
+
+Simulated senders wander around the local samples and send to the local
+collector over loopback, through the same path as real senders.
+
+*/
+static void simulate_senders(Context *ctx)
+{
+	struct sockaddr_in loopback;
+	const int slot = (ctx->taken - 1) % ctx->send_batch;
+	int s;
+
+	for (s = 0; s < ctx->sim_senders; s++) {
+		Sample *batch = &ctx->sim_batches[s * COLLECT_MAX_BATCH];
+		const Sample *previous = &batch[slot ? slot - 1 : ctx->send_batch - 1];
+		int i;
+
+		for (i = 0; i < METRIC_COUNT; i++) {
+			ctx->sim_seed = ctx->sim_seed * 1103515245 + 12345;
+
+			const int step = (int)((ctx->sim_seed >> 16) % 11) - 5;
+
+			batch[slot].values[i] = MAX(0, MIN(100, previous->values[i] + step));
+		}
+	}
+
+	if (slot != ctx->send_batch - 1) {
+		return;
+	}
+
+	memset(&loopback, 0, sizeof(loopback));
+	loopback.sin_family = AF_INET;
+	loopback.sin_port = htons(ctx->collect_port);
+	loopback.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	for (s = 0; s < ctx->sim_senders; s++) {
+		char name[COLLECT_NAME_LEN];
+
+		snprintf(name, sizeof(name), "sim%d", s + 1);
+		send_datagram(ctx, &loopback, name, &ctx->sim_batches[s * COLLECT_MAX_BATCH], ctx->send_batch);
+	}
+}
+
+static void start_sender(Context *ctx)
+{
+	struct TimeVal now;
+
+	if (ctx->send_host[0] && !resolve_host(ctx->send_host, &ctx->send_addr, ctx->collect_port)) {
+		printf("Couldn't resolve collector '%s'\n", ctx->send_host);
+		ctx->send_host[0] = '\0';
+	}
+
+	// Simulated senders use the socket too
+	if (!ctx->send_host[0] && !ctx->sim_batches) {
+		return;
+	}
+
+	if (!ctx->host_name[0] && gethostname(ctx->host_name, sizeof(ctx->host_name)) != 0) {
+		strcpy(ctx->host_name, "amiga");
+	}
+
+	ctx->host_name[sizeof(ctx->host_name) - 1] = '\0';
+
+	ctx->send_socket = open_udp_socket();
+
+	if (ctx->send_socket < 0) {
+		puts("Couldn't create sender socket");
+		return;
+	}
+
+	// Unrelated to the collector's clock, only has to grow over restarts
+	GetSysTime(&now);
+	ctx->send_base = now.Seconds;
+}
+
+static void stop_collect(Context *ctx)
+{
+	if (ctx->send_socket != -1) {
+		CloseSocket(ctx->send_socket);
+		ctx->send_socket = -1;
+	}
+
+	if (ctx->collect_socket != -1) {
+		CloseSocket(ctx->collect_socket);
+		ctx->collect_socket = -1;
+	}
+
+	if (ctx->sim_batches) {
+		my_free(ctx->sim_batches);
+		ctx->sim_batches = NULL;
+	}
+
+	if (ctx->collector) {
+		my_free(ctx->collector);
+		ctx->collector = NULL;
+	}
+}
+
+static void start_collector(Context *ctx)
+{
+	struct sockaddr_in addr;
+
+	ctx->collector = my_alloc(sizeof(Collector));
+
+	if (!ctx->collector) {
+		puts("Couldn't allocate collector");
+		return;
+	}
+
+	collect_init(ctx->collector);
+
+	ctx->collect_socket = open_udp_socket();
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(ctx->collect_port);
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+	if (ctx->collect_socket < 0 || bind(ctx->collect_socket, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		printf("Couldn't listen on collector port %d\n", ctx->collect_port);
+		stop_collect(ctx);
+		return;
+	}
+
+	if (ctx->sim_senders) {
+		ctx->sim_batches = my_alloc(ctx->sim_senders * COLLECT_MAX_BATCH * sizeof(Sample));
+		ctx->sim_seed = 1;
+
+		if (!ctx->sim_batches) {
+			puts("Couldn't allocate simulated senders");
+		}
+	}
+}
+
+static void receive_datagrams(Context *ctx)
+{
+	UBYTE packet[COLLECT_PACKET_MAX];
+	LONG length;
+
+	while ((length = recvfrom(ctx->collect_socket, packet, sizeof(packet), 0, NULL, NULL)) >= 0) {
+		collect_receive(ctx->collector, packet, length, ctx->stats.seconds);
+	}
+}
+
+/*
+
+Replay feeds a recorded trace through the same path as live probes. The
+first record is the network counter baseline, like init_netstats is for
+live sampling.
+
+*/
+// Graphs of what the trace doesn't have stay empty
+static void warn_missing_fields(Context *ctx, UBYTE fields)
+{
+	if (ctx->features.disk && !(fields & TRACE_DISK)) {
+		printf("Trace '%s' has no disk rates, the disk graphs stay empty\n", ctx->replay_file);
+	}
+
+	if (ctx->features.latency && !(fields & TRACE_LATENCY)) {
+		printf("Trace '%s' has no wake-up latencies, the latency graphs stay empty\n", ctx->replay_file);
+	}
+
+	if (ctx->features.graph[METRIC_DISPATCHES] && !(fields & TRACE_DISPATCHES)) {
+		printf("Trace '%s' has no idle dispatches, their graph stays empty\n", ctx->replay_file);
+	}
+}
+
+static BOOL start_replay(Context *ctx)
+{
+	TraceRecord record;
+
+	if (!trace_open(&ctx->replay, ctx->replay_file)) {
+		printf("Couldn't open trace '%s'\n", ctx->replay_file);
+		return FALSE;
+	}
+
+	if (!trace_read(&ctx->replay, &record)) {
+		printf("Trace '%s' is empty\n", ctx->replay_file);
+		trace_close(&ctx->replay);
+		return FALSE;
+	}
+
+	ctx->net_in = record.net_in;
+	ctx->net_out = record.net_out;
+
+	init_netstats(ctx->net_in, ctx->net_out);
+
+	warn_missing_fields(ctx, record.fields);
+
+	GetSysTime(&ctx->replay_start);
+
+	return TRUE;
+}
+
+static void store_history(Context *ctx)
+{
+	const UBYTE *values = (const UBYTE *)&ctx->samples[ctx->iter];
+	const uint64 time = time_us(&ctx->info.time);
+
+	if (ctx->replay.file) {
+		struct TimeVal start;
+
+		GetSysTime(&start);
+		history_add(&ctx->history, values, time, ctx->history_scale);
+		ctx->history_encode_us += elapsed_us(&start);
+	} else {
+		history_add(&ctx->history, values, time, ctx->history_scale);
+	}
+}
+
+// Decodes every stored block, returns the number of samples
+static ULONG decode_history(Context *ctx)
+{
+	UBYTE *values = my_alloc(UINT16_MAX * HISTORY_METRICS);
+	ULONG samples = 0;
+	int i;
+
+	if (!values) {
+		return 0;
+	}
+
+	for (i = 0; i < ctx->history.used; i++) {
+		samples += history_decode(&ctx->history, &ctx->history.blocks[i], values, UINT16_MAX);
+	}
+
+	my_free(values);
+
+	return samples;
+}
+
+static void report_history(Context *ctx)
+{
+	const ULONG samples = history_samples(&ctx->history);
+	const ULONG bytes = history_bytes(&ctx->history);
+
+	if (!bytes) {
+		return;
+	}
+
+	struct TimeVal start;
+	GetSysTime(&start);
+
+	const ULONG decoded = decode_history(ctx);
+	const ULONG decode_us = elapsed_us(&start);
+
+	printf("History: %lu samples in %lu bytes, compression ratio %.1f\n",
+		samples, bytes, (float)samples * sizeof(Sample) / bytes);
+
+	if (ctx->history_encode_us && decode_us) {
+		printf("History: encode %.0f, decode %.0f samples per second\n",
+			ctx->replay_frames * 1000000.0f / ctx->history_encode_us,
+			decoded * 1000000.0f / decode_us);
+	}
+}
+
+static void finish_replay(Context *ctx)
+{
+	const ULONG elapsed = elapsed_us(&ctx->replay_start);
+
+	printf("Replayed %lu frames in %lu ms, %.1f frames per second\n",
+		ctx->replay_frames, elapsed / 1000,
+		elapsed ? ctx->replay_frames * 1000000.0f / elapsed : 0.0f);
+
+	report_history(ctx);
+
+	trace_close(&ctx->replay);
+
+	ctx->running = FALSE;
+}
+
+static BOOL replay_sample(Context *ctx)
+{
+	float read_mult = 1.0f, write_mult = 1.0f;
+	UBYTE read, write;
+	TraceRecord record;
+
+	if (!trace_read(&ctx->replay, &record)) {
+		return FALSE;
+	}
+
+	get_new(METRIC_CPU) = record.cpu;
+	get_new(METRIC_VIRTUAL_MEM) = record.virtual_mem;
+	get_new(METRIC_VIDEO_MEM) = record.video_mem;
+
+	ctx->net_in = record.net_in;
+	ctx->net_out = record.net_out;
+
+	update_network(ctx, &ctx->dl_speed, &ctx->ul_speed);
+
+	// Missing fields are zero
+	ctx->disk.read_rate = record.disk_read;
+	ctx->disk.write_rate = record.disk_write;
+
+	if (disk_scale(&ctx->disk, &read, &write, &read_mult, &write_mult)) {
+		rescale_measured(ctx, METRIC_DISK_READ, read_mult);
+		rescale_measured(ctx, METRIC_DISK_WRITE, write_mult);
+	}
+
+	get_new(METRIC_DISK_READ) = read;
+	get_new(METRIC_DISK_WRITE) = write;
+
+	ctx->latency_p50 = record.latency_p50;
+	ctx->latency_p99 = record.latency_p99;
+	ctx->latency_max = record.latency_max;
+
+	latency_levels(ctx);
+
+	ctx->dispatch_rate = record.dispatches;
+
+	scale_dispatches(ctx);
+
+	return TRUE;
+}
+
+static void start_netstats(Context *ctx)
+{
+	if (get_netcounters(&ctx->net_in, &ctx->net_out)) {
+		init_netstats(ctx->net_in, ctx->net_out);
+	}
+}
+
+// The timer request always waits for the earliest job
+static void arm_timer(Context *ctx)
+{
+	uint64 due;
+
+	if (!wheel_next(&ctx->wheel, &due) || due == ctx->timer_due) {
+		return;
+	}
+
+	if (ctx->timer_due) {
+		AbortIO((struct IORequest *) ctx->timer_req);
+		WaitIO((struct IORequest *) ctx->timer_req);
+	}
+
+	ctx->timer_req->Request.io_Command = TR_ADDREQUEST;
+	ctx->timer_req->Time.Seconds = due / 1000000;
+	ctx->timer_req->Time.Microseconds = due % 1000000;
+
+	SendIO((struct IORequest *) ctx->timer_req);
+
+	ctx->timer_due = due;
+}
+
+static void log_alarm(Context *ctx, const AlarmRule *rule, int value, BOOL fired)
+{
+	FILE *file = fopen(ctx->alarm_log, "a");
+
+	if (!file) {
+		printf("Couldn't open alarm log '%s'\n", ctx->alarm_log);
+		return;
+	}
+
+	char stamp[32];
+	const time_t now = time(NULL);
+
+	strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+	fprintf(file, "%s %s: alarm '%s' %s, value %d\n", stamp, NAME_STRING,
+		rule->label, fired ? "fired" : "cleared", value);
+
+	fclose(file);
+}
+
+static void run_alarm_command(Context *ctx, int index)
+{
+	const char *command = ctx->alarm_commands[index];
+
+	if (!command[0]) {
+		return;
+	}
+
+	BPTR input = Open("NIL:", MODE_OLDFILE);
+	BPTR output = Open("NIL:", MODE_NEWFILE);
+
+	// Asynchronous commands close their handles themselves
+	if (SystemTags(command,
+		SYS_Input, input,
+		SYS_Output, output,
+		SYS_Asynch, TRUE,
+		TAG_DONE) == -1) {
+
+		printf("Couldn't run alarm command '%s'\n", command);
+
+		Close(input);
+		Close(output);
+	}
+}
+
+static void handle_alarms(Context *ctx)
+{
+	const UBYTE *values = (const UBYTE *)&ctx->samples[ctx->iter];
+	unsigned fired, cleared;
+	int i;
+
+	if (!ctx->alarms.count) {
+		return;
+	}
+
+	alarm_evaluate(&ctx->alarms, values, ctx->stats.seconds, &fired, &cleared);
+
+	if (!(fired | cleared)) {
+		return;
+	}
+
+	ctx->alarm_flash = 0;
+
+	for (i = 0; i < ctx->alarms.count; i++) {
+		const AlarmRule *rule = &ctx->alarms.rules[i];
+		const ULONG mask = 1L << i;
+
+		if (rule->active && (rule->actions & ALARM_ACTION_FLASH)) {
+			ctx->alarm_flash |= 1L << rule->metric;
+		}
+
+		if (!((fired | cleared) & mask)) {
+			continue;
+		}
+
+		if (rule->actions & ALARM_ACTION_LOG) {
+			log_alarm(ctx, rule, values[rule->metric], (fired & mask) != 0);
+		}
+
+		if ((rule->actions & ALARM_ACTION_RUN) && (fired & mask)) {
+			run_alarm_command(ctx, i);
+		}
+	}
+}
+
+static void report_stats(Context *ctx)
+{
+	DebugPrintF("%s: title updates %lu/min, last chrome change %lu us reconfigured, %lu us recreated\n", NAME_STRING,
+		ctx->stats.title_updates_per_minute,
+		ctx->stats.chrome_reconfigure_us,
+		ctx->stats.chrome_recreate_us);
+
+	DebugPrintF("%s: bitmap %lux%lu, %lu KiB %s memory, %lu allocations. Samples %lu KiB user memory\n", NAME_STRING,
+		ctx->bm_width, ctx->bm_height,
+		ctx->stats.bitmap_bytes / 1024,
+		ctx->bm_displayable ? "video" : "user",
+		ctx->stats.bitmap_allocs,
+		(ULONG)(ctx->capacity * sizeof(Sample)) / 1024);
+
+	char calls[128];
+	Formatter f;
+	int i;
+
+	fmt_init(&f, calls, sizeof(calls));
+
+	for (i = 0; i < METRIC_COUNT; i++) {
+		if (metrics[i].probe) {
+			fmt_char(&f, ' ');
+			fmt_str(&f, metrics[i].name);
+			fmt_char(&f, ' ');
+			fmt_uint(&f, ctx->probes[i].calls, 0);
+		}
+	}
+
+	DebugPrintF("%s: probe calls%s in %lu s\n", NAME_STRING, calls, ctx->stats.seconds);
+
+	DebugPrintF("%s: %lu samples drawn together with the next one, %lu dropped\n", NAME_STRING,
+		ctx->stats.coalesced, ctx->samples_dropped);
+
+	DebugPrintF("%s: timer wake-ups up to %lu us late, started in %lu us\n", NAME_STRING,
+		ctx->stats.timer_late_max, ctx->stats.startup_us);
+
+	if (ctx->history.used) {
+		DebugPrintF("%s: history %lu samples in %lu KiB\n", NAME_STRING,
+			history_samples(&ctx->history),
+			history_bytes(&ctx->history) / 1024);
+	}
+}
+
+static void update_stats(Context *ctx)
+{
+	if (++ctx->stats.seconds % 60) {
+		return;
+	}
+
+	ctx->stats.title_updates_per_minute = ctx->stats.title_updates;
+	ctx->stats.title_updates = 0;
+
+	if (ctx->stats.report) {
+		report_stats(ctx);
+	}
+}
+
+static BOOL start_load(Context *ctx, UBYTE duty)
+{
+	ctx->load_sig = AllocSignal(-1);
+
+	if (ctx->load_sig == -1) {
+		puts("Couldn't allocate signal");
+		return FALSE;
+	}
+
+	ctx->load_duty = duty;
+	ctx->load_running = TRUE;
+
+	ctx->load_task = CreateTaskTags("CPU Watcher load", 0, load_worker, 4096,
+		AT_Param1, ctx,
+		TAG_DONE);
+
+	if (!ctx->load_task) {
+		puts("Couldn't create load generator task");
+		ctx->load_running = FALSE;
+		FreeSignal(ctx->load_sig);
+		ctx->load_sig = -1;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/*
+
+The task is deleted only after its own exit signal. Waiting on main_sig,
+which the idle task raises, could delete the load task while it's still
+holding its timer request.
+
+*/
+static void stop_load(Context *ctx)
+{
+	if (!ctx->load_task) {
+		return;
+	}
+
+	ctx->load_running = FALSE;
+
+	Wait(1L << ctx->load_sig);
+
+	DeleteTask(ctx->load_task);
+	ctx->load_task = NULL;
+
+	FreeSignal(ctx->load_sig);
+	ctx->load_sig = -1;
+}
+
+/*
+
+Measuring mode comparison and calibration: the load generator steps
+through duty cycles and at every step each mode is measured in turn.
+A comparison prints the averages side by side, with the error of each
+mode against busy looping. Calibration uses finer steps, prints the error
+against the generated load and turns the results into correction tables.
+
+*/
+static void start_sweep(Context *ctx)
+{
+	sweep_init(&ctx->sweep, MODE_COUNT,
+		ctx->calibrate ? CALIBRATE_STEP : COMPARE_STEP,
+		COMPARE_SETTLE, COMPARE_MEASURE);
+
+	ctx->saved_mode = ctx->mode;
+	ctx->mode = sweep_mode(&ctx->sweep);
+	ctx->sweeping = TRUE;
+
+	if (!start_load(ctx, sweep_duty(&ctx->sweep))) {
+		ctx->sweeping = FALSE;
+		ctx->mode = ctx->saved_mode;
+	}
+}
+
+static void print_sweep(Context *ctx, BOOL against_load)
+{
+	int step, mode;
+
+	printf("Load  ");
+
+	for (mode = 0; mode < MODE_COUNT; mode++) {
+		printf("%16s", mode_names[mode]);
+	}
+
+	printf("\n");
+
+	for (step = 0; step < ctx->sweep.steps; step++) {
+		const int load = MIN(step * ctx->sweep.step_size, 100);
+		const float reference = against_load ? load : sweep_result(&ctx->sweep, MODE_BUSY, step);
+
+		printf("%3d%%  ", load);
+
+		for (mode = 0; mode < MODE_COUNT; mode++) {
+			const float value = sweep_result(&ctx->sweep, mode, step);
+
+			printf("%8.1f (%+5.1f)", value, value - reference);
+		}
+
+		printf("\n");
+	}
+}
+
+// Like FindToolType, "name" alone or "name=value"
+static BOOL is_tool_type(const char *line, const char *name)
+{
+	const size_t length = strlen(name);
+
+	return strncasecmp(line, name, length) == 0 && (line[length] == '\0' || line[length] == '=');
+}
+
+static BOOL is_calibration(const char *line)
+{
+	int mode;
+
+	for (mode = 0; mode < MODE_COUNT; mode++) {
+		if (is_tool_type(line, calibration_names[mode])) {
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/*
+
+Writes the prefs file back with the calibration lines replaced and the
+calibrate switch commented out, so the next start doesn't sweep again.
+Other lines, blank ones and comments included, are kept as they were.
+The new contents go to a temporary file that replaces the old one only
+once it has been written completely.
+
+*/
+static BOOL write_prefs_calibration(Context *ctx, char lines[MODE_COUNT][CALIBRATION_LEN])
+{
+	char temp_name[PREFS_NAME_LEN + 4];
+	BOOL result = FALSE;
+	size_t length = 0;
+	int mode;
+
+	char *buffer = my_alloc(PREFS_MAX_SIZE + 2);
+
+	if (!buffer) {
+		puts("Couldn't allocate prefs buffer");
+		return FALSE;
+	}
+
+	FILE *file = fopen(ctx->prefs_file, "r");
+
+	if (file) {
+		// One byte more than fits tells that the file would be cut short
+		length = fread(buffer, 1, PREFS_MAX_SIZE + 1, file);
+		fclose(file);
+	}
+
+	if (length > PREFS_MAX_SIZE) {
+		printf("Prefs file '%s' is larger than %d bytes, not rewriting it\n", ctx->prefs_file, PREFS_MAX_SIZE);
+		goto clean;
+	}
+
+	buffer[length] = '\0';
+
+	snprintf(temp_name, sizeof(temp_name), "%s.new", ctx->prefs_file);
+
+	file = fopen(temp_name, "w");
+
+	if (!file) {
+		printf("Couldn't write prefs file '%s'\n", temp_name);
+		goto clean;
+	}
+
+	char *line = buffer;
+
+	while (*line) {
+		char *end = line;
+
+		while (*end && *end != '\n') {
+			end++;
+		}
+
+		const BOOL last = (*end == '\0');
+
+		*end = '\0';
+
+		if (end > line && end[-1] == '\r') {
+			end[-1] = '\0';
+		}
+
+		if (is_tool_type(line, "calibrate")) {
+			fprintf(file, ";%s\n", line);
+		} else if (!is_calibration(line)) {
+			fprintf(file, "%s\n", line);
+		}
+
+		if (last) {
+			break;
+		}
+
+		line = end + 1;
+	}
+
+	for (mode = 0; mode < MODE_COUNT; mode++) {
+		fprintf(file, "%s\n", lines[mode]);
+	}
+
+	// A full disk shows up when the buffers are flushed
+	const BOOL failed = ferror(file);
+
+	if (fclose(file) != 0 || failed) {
+		printf("Couldn't write prefs file '%s'\n", temp_name);
+		Delete(temp_name);
+		goto clean;
+	}
+
+	// Rename doesn't replace an existing file
+	Delete(ctx->prefs_file);
+
+	if (!Rename(temp_name, ctx->prefs_file)) {
+		printf("Couldn't rename '%s' to '%s'\n", temp_name, ctx->prefs_file);
+		goto clean;
+	}
+
+	result = TRUE;
+
+clean:
+	my_free(buffer);
+
+	return result;
+}
+
+static void finish_calibration(Context *ctx)
+{
+	char lines[MODE_COUNT][CALIBRATION_LEN];
+	UBYTE curve[CALIB_MAX_POINTS];
+	int mode;
+
+	for (mode = 0; mode < MODE_COUNT; mode++) {
+		char *text = lines[mode];
+		const int prefix = snprintf(text, CALIBRATION_LEN, "%s=", calibration_names[mode]);
+
+		calib_fit(&ctx->sweep, mode, curve);
+		calib_format(curve, ctx->sweep.steps, text + prefix, CALIBRATION_LEN - prefix);
+
+		calib_table(curve, ctx->sweep.steps, ctx->correction[mode]);
+		ctx->calibrated[mode] = TRUE;
+	}
+
+	if (ctx->prefs_file[0] && write_prefs_calibration(ctx, lines)) {
+		printf("Calibration saved to '%s'\n", ctx->prefs_file);
+		return;
+	}
+
+	puts("Add these tooltypes to keep the calibration:");
+
+	for (mode = 0; mode < MODE_COUNT; mode++) {
+		puts(lines[mode]);
+	}
+}
+
+static void run_sweep(Context *ctx)
+{
+	if (!ctx->sweeping || !sweep_feed(&ctx->sweep, get_cur(METRIC_CPU))) {
+		return;
+	}
+
+	if (ctx->sweep.done) {
+		stop_load(ctx);
+		print_sweep(ctx, ctx->calibrate);
+
+		if (ctx->calibrate) {
+			finish_calibration(ctx);
+		}
+
+		ctx->sweeping = FALSE;
+		ctx->mode = ctx->saved_mode;
+		return;
+	}
+
+	ctx->load_duty = sweep_duty(&ctx->sweep);
+	ctx->mode = sweep_mode(&ctx->sweep);
+}
+
+/*
+
+The trend covers the same samples as the graph. A forecast is shown only
+when the decline is statistically clear, so noise around a flat line
+doesn't produce wild estimates.
+
+*/
+static void update_forecast(Context *ctx, UBYTE oldest)
+{
+	double slope, current, t;
+
+	trend_add(&ctx->memory_trend, get_cur(METRIC_VIRTUAL_MEM), oldest);
+
+	ctx->memory_eta = 0;
+
+	if (ctx->memory_trend.count < FORECAST_MIN_SAMPLES ||
+		!trend_fit(&ctx->memory_trend, &slope, &current, &t)) {
+		return;
+	}
+
+	if (slope < 0.0 && t < -FORECAST_MIN_T && current > 0.0) {
+		// One sample per second
+		ctx->memory_eta = MAX(1, (ULONG)(current / -slope));
+	}
+}
+
+// Takes the incoming sample into the ring
+static void take_sample(Context *ctx)
+{
+	ctx->iter = ring_next(ctx, ctx->iter);
+
+	// Leaves the ring with this sample
+	const UBYTE oldest = get_cur(METRIC_VIRTUAL_MEM);
+
+	ctx->samples[ctx->iter] = *ctx->incoming;
+	ctx->infos[ctx->iter] = ctx->info;
+	ctx->taken++;
+
+	if (ctx->stored < ctx->capacity) {
+		ctx->stored++;
+	}
+
+	// Without sub-samples the column holds the sample itself
+	HeatColumn *heat = &ctx->heat_columns[ctx->iter];
+
+	if (ctx->incoming_heat && ctx->incoming_heat->total) {
+		*heat = *ctx->incoming_heat;
+	} else {
+		heat_clear(heat);
+		heat_add(heat, get_cur(METRIC_CPU), 1);
+	}
+
+	update_forecast(ctx, oldest);
+
+	record_sample(ctx);
+
+	stream_sample(ctx);
+
+	if (ctx->send_host[0] && ctx->send_socket != -1 && ctx->taken % ctx->send_batch == 0) {
+		send_samples(ctx);
+	}
+
+	if (ctx->sim_batches) {
+		simulate_senders(ctx);
+	}
+
+	store_history(ctx);
+
+	handle_alarms(ctx);
+}
+
+/*
+
+Shared sampling service. The first instance owns the idle task and the
+probes and registers a public port. Later instances attach to it as viewers
+and get the samples in batches instead of measuring, so two watchers don't
+compete for the same idle cycles.
+
+Each viewer has one batch message owned by the service. While it's out, new
+samples queue up per viewer and go with the next batch after the reply.
+Rescales are applied to the queued samples in place and carried in the batch
+for the samples the viewer already has.
+
+*/
+static void choose_role(Context *ctx)
+{
+	// Replayed samples aren't worth sharing
+	if (ctx->replay_file[0]) {
+		ctx->role = ROLE_STANDALONE;
+		return;
+	}
+
+	if (ctx->role == ROLE_AUTO) {
+		Forbid();
+		const BOOL found = FindPort(SERVICE_PORT_NAME) != NULL;
+		Permit();
+
+		ctx->role = found ? ROLE_VIEWER : ROLE_SERVICE;
+	}
+
+	if (ctx->role == ROLE_VIEWER) {
+		// Nothing to compare or calibrate without the idle task
+		ctx->compare = ctx->calibrate = FALSE;
+
+		// Batches carry the counters of their last sample only, the service records
+		ctx->record_file[0] = '\0';
+	}
+}
+
+// Finds the slot of the viewer with the given port, NULL finds a free slot
+static int find_viewer(Context *ctx, struct MsgPort *port)
+{
+	int i;
+
+	for (i = 0; i < SERVICE_MAX_VIEWERS; i++) {
+		if ((ctx->viewers[i] ? ctx->viewers[i]->port : NULL) == port) {
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+static int count_viewers(Context *ctx)
+{
+	int count = 0;
+	int i;
+
+	for (i = 0; i < SERVICE_MAX_VIEWERS; i++) {
+		if (ctx->viewers[i]) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+static void send_batch(Context *ctx, Viewer *viewer, EServiceRequest request)
+{
+	ServiceMsg *batch = viewer->batch;
+
+	batch->request = request;
+	batch->count = feed_take(&viewer->feed, &batch->first, (uint8 *)batch->samples, batch->multiplier);
+	batch->info = ctx->info;
+
+	PutMsg(viewer->port, &batch->message);
+}
+
+static void free_viewer(Context *ctx, int slot)
+{
+	FreeSysObject(ASOT_MESSAGE, ctx->viewers[slot]->batch);
+	my_free(ctx->viewers[slot]);
+
+	ctx->viewers[slot] = NULL;
+}
+
+// A new viewer starts with the whole sample ring
+static void add_viewer(Context *ctx, ServiceMsg *request)
+{
+	const int slot = find_viewer(ctx, NULL);
+	Viewer *viewer = NULL;
+	ULONG i;
+
+	request->accepted = FALSE;
+
+	if (slot >= 0 && !ctx->service_closing) {
+		viewer = my_alloc(sizeof(Viewer));
+	}
+
+	if (viewer) {
+		viewer->batch = AllocSysObjectTags(ASOT_MESSAGE,
+			ASOMSG_Size, sizeof(ServiceMsg),
+			ASOMSG_ReplyPort, ctx->service_port,
+			TAG_DONE);
+
+		if (!viewer->batch) {
+			my_free(viewer);
+			viewer = NULL;
+		}
+	}
+
+	if (viewer) {
+		viewer->port = request->viewer_port;
+
+		feed_init(&viewer->feed, viewer->pending, METRIC_COUNT, XSIZE);
+
+		const ULONG count = MIN(ctx->stored, XSIZE);
+
+		for (i = 0; i < count; i++) {
+			const ULONG age = count - 1 - i;
+
+			feed_push(&viewer->feed, ctx->published - age, ctx->samples[ring_slot(ctx, age)].values);
+		}
+
+		ctx->viewers[slot] = viewer;
+		request->accepted = TRUE;
+	}
+
+	ReplyMsg(&request->message);
+
+	if (viewer && viewer->feed.count) {
+		send_batch(ctx, viewer, SERVICE_SAMPLES);
+	}
+}
+
+static void remove_viewer(Context *ctx, ServiceMsg *request)
+{
+	const int slot = find_viewer(ctx, request->viewer_port);
+
+	if (slot >= 0 && feed_detach(&ctx->viewers[slot]->feed)) {
+		free_viewer(ctx, slot);
+	}
+
+	ReplyMsg(&request->message);
+}
+
+static void batch_returned(Context *ctx, ServiceMsg *batch)
+{
+	int i;
+
+	for (i = 0; i < SERVICE_MAX_VIEWERS; i++) {
+		Viewer *viewer = ctx->viewers[i];
+
+		if (!viewer || viewer->batch != batch) {
+			continue;
+		}
+
+		const BOOL waiting = feed_returned(&viewer->feed);
+
+		if (viewer->feed.detached || batch->request == SERVICE_SHUTDOWN) {
+			free_viewer(ctx, i);
+		} else if (ctx->service_closing) {
+			send_batch(ctx, viewer, SERVICE_SHUTDOWN);
+		} else if (waiting) {
+			send_batch(ctx, viewer, SERVICE_SAMPLES);
+		}
+
+		break;
+	}
+}
+
+// Requests from viewers and our own batches coming back
+static void handle_service_port(Context *ctx)
+{
+	struct Message *msg;
+
+	while ((msg = GetMsg(ctx->service_port))) {
+		ServiceMsg *service_msg = (ServiceMsg *) msg;
+
+		switch (service_msg->request) {
+			case SERVICE_ATTACH:
+				add_viewer(ctx, service_msg);
+				break;
+			case SERVICE_DETACH:
+				remove_viewer(ctx, service_msg);
+				break;
+			default:
+				batch_returned(ctx, service_msg);
+				break;
+		}
+	}
+}
+
+static void publish_sample(Context *ctx)
+{
+	int i;
+
+	if (!ctx->service_port) {
+		return;
+	}
+
+	ctx->published++;
+
+	for (i = 0; i < SERVICE_MAX_VIEWERS; i++) {
+		Viewer *viewer = ctx->viewers[i];
+
+		if (viewer && feed_push(&viewer->feed, ctx->published, ctx->samples[ctx->iter].values)) {
+			send_batch(ctx, viewer, SERVICE_SAMPLES);
+		}
+	}
+}
+
+static void service_rescale(Context *ctx, EMetric metric, float multiplier)
+{
+	int i;
+
+	for (i = 0; i < SERVICE_MAX_VIEWERS; i++) {
+		if (ctx->viewers[i]) {
+			feed_rescale(&ctx->viewers[i]->feed, metric, multiplier);
+		}
+	}
+}
+
+/*
+
+Stress test of the service. Each task attaches, takes a random number of
+batches, detaches and attaches again until the service shuts down. A gap in
+the sequence numbers within one attachment means lost samples.
+
+*/
+static void stress_viewer(uint32 p1)
+{
+	StressViewer *stress = (StressViewer *)p1;
+	Context *ctx = stress->ctx;
+	ServiceMsg *request = NULL;
+	struct MsgPort *port = NULL;
+	ULONG seed = p1;
+
+	port = AllocSysObjectTags(ASOT_PORT,
+		ASOPORT_Name, "stress_port",
+		TAG_DONE);
+
+	if (!port) {
+		goto die;
+	}
+
+	request = AllocSysObjectTags(ASOT_MESSAGE,
+		ASOMSG_Size, sizeof(ServiceMsg),
+		ASOMSG_ReplyPort, port,
+		TAG_DONE);
+
+	if (!request) {
+		goto die;
+	}
+
+	BOOL running = TRUE;
+
+	while (running) {
+		request->request = SERVICE_ATTACH;
+		request->viewer_port = port;
+
+		// The service sets the flag in Forbid before it starts to close
+		Forbid();
+
+		running = !ctx->service_closing;
+
+		if (running) {
+			PutMsg(ctx->service_port, &request->message);
+		}
+
+		Permit();
+
+		if (!running) {
+			break;
+		}
+
+		WaitPort(port);
+		GetMsg(port);
+
+		if (!request->accepted) {
+			break;
+		}
+
+		stress->attaches++;
+
+		seed = seed * 1103515245 + 12345;
+
+		const ULONG batches = 1 + (seed >> 16) % STRESS_MAX_BATCHES;
+		ULONG received = 0;
+		ULONG expected = 0;
+		BOOL attached = TRUE;
+		BOOL detaching = FALSE;
+
+		while (attached) {
+			WaitPort(port);
+
+			struct Message *msg = GetMsg(port);
+
+			if (msg == &request->message) {
+				// Detach reply, no batches follow it
+				attached = FALSE;
+				continue;
+			}
+
+			ServiceMsg *batch = (ServiceMsg *) msg;
+
+			if (batch->request == SERVICE_SHUTDOWN) {
+				running = FALSE;
+				attached = detaching;
+			} else if (!detaching) {
+				if (expected && batch->first != expected) {
+					stress->gaps++;
+				}
+
+				expected = batch->first + batch->count;
+
+				stress->batches++;
+				stress->samples += batch->count;
+			}
+
+			ReplyMsg(msg);
+
+			if (running && !detaching && ++received == batches) {
+				request->request = SERVICE_DETACH;
+				PutMsg(ctx->service_port, &request->message);
+				detaching = TRUE;
+			}
+		}
+	}
+
+die:
+	if (request) {
+		FreeSysObject(ASOT_MESSAGE, request);
+	}
+
+	if (port) {
+		FreeSysObject(ASOT_PORT, port);
+	}
+
+	Forbid();
+	ctx->stress_alive--;
+	Permit();
+
+	// Tell the main task that we are done
+	Signal(ctx->main_task, 1L << ctx->stress_sig);
+
+	// Waiting for termination
+	Wait(0L);
+}
+
+static void start_stress_viewers(Context *ctx)
+{
+	int i;
+
+	if (!ctx->stress_viewers) {
+		return;
+	}
+
+	ctx->stress_sig = AllocSignal(-1);
+	ctx->stress = my_alloc(ctx->stress_viewers * sizeof(StressViewer));
+
+	if (ctx->stress_sig == -1 || !ctx->stress) {
+		puts("Couldn't start stress test");
+		return;
+	}
+
+	for (i = 0; i < ctx->stress_viewers; i++) {
+		StressViewer *stress = &ctx->stress[i];
+
+		stress->ctx = ctx;
+
+		Forbid();
+		ctx->stress_alive++;
+		Permit();
+
+		stress->task = CreateTaskTags("CPU Watcher stress viewer", 0, stress_viewer, 4096,
+			AT_Param1, stress,
+			TAG_DONE);
+
+		if (!stress->task) {
+			puts("Couldn't create stress viewer task");
+
+			Forbid();
+			ctx->stress_alive--;
+			Permit();
+			break;
+		}
+	}
+}
+
+static void stop_stress_viewers(Context *ctx)
+{
+	int i;
+
+	if (!ctx->stress) {
+		return;
+	}
+
+	for (i = 0; i < ctx->stress_viewers; i++) {
+		const StressViewer *stress = &ctx->stress[i];
+
+		if (!stress->task) {
+			continue;
+		}
+
+		DeleteTask(stress->task);
+
+		printf("Stress viewer %d: %lu attaches, %lu batches, %lu samples, %lu gaps\n",
+			i, stress->attaches, stress->batches, stress->samples, stress->gaps);
+	}
+
+	my_free(ctx->stress);
+	ctx->stress = NULL;
+}
+
+// Returns FALSE if another instance registered the port first
+static BOOL publish_service_port(Context *ctx)
+{
+	ctx->service_port = AllocSysObjectTags(ASOT_PORT,
+		ASOPORT_Name, SERVICE_PORT_NAME,
+		TAG_DONE);
+
+	if (!ctx->service_port) {
+		puts("Couldn't create service port");
+		return FALSE;
+	}
+
+	// Checked and added in one go, another instance may be starting up
+	Forbid();
+
+	const BOOL taken = FindPort(SERVICE_PORT_NAME) != NULL;
+
+	if (!taken) {
+		AddPort(ctx->service_port);
+	}
+
+	Permit();
+
+	if (taken) {
+		puts("Another sampling service is running");
+		FreeSysObject(ASOT_PORT, ctx->service_port);
+		ctx->service_port = NULL;
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static BOOL attach_viewer(Context *ctx)
+{
+	ctx->viewer_port = AllocSysObjectTags(ASOT_PORT,
+		ASOPORT_Name, "viewer_port",
+		TAG_DONE);
+
+	if (!ctx->viewer_port) {
+		puts("Couldn't create viewer port");
+		return FALSE;
+	}
+
+	ctx->request_msg = AllocSysObjectTags(ASOT_MESSAGE,
+		ASOMSG_Size, sizeof(ServiceMsg),
+		ASOMSG_ReplyPort, ctx->viewer_port,
+		TAG_DONE);
+
+	if (!ctx->request_msg) {
+		puts("Couldn't create service request");
+		return FALSE;
+	}
+
+	ctx->request_msg->request = SERVICE_ATTACH;
+	ctx->request_msg->viewer_port = ctx->viewer_port;
 
-		ctx->bm = AllocBitMapTags(ctx->width, ctx->height, 32,
-			BMATags_PixelFormat, PIXF_A8R8G8B8,
-			BMATags_Clear, TRUE,
-#if 0 // There doesn't seem to be much difference whether bitmap is in RAM or VRAM
-			BMATags_Displayable, TRUE,
-#else
-			BMATags_UserPrivate, TRUE,
-#endif
-			TAG_DONE);
+	// The service removes its port in Forbid, so it can't go away in between
+	Forbid();
 
-		if (!ctx->bm) {
-			puts("Couldn't allocate bitmap");
-			return FALSE;
-		}
+	ctx->service = FindPort(SERVICE_PORT_NAME);
+
+	if (ctx->service) {
+		PutMsg(ctx->service, &ctx->request_msg->message);
+	}
 
-		InitRastPort(&ctx->rastPort);
-		ctx->rastPort.BitMap = ctx->bm;
+	Permit();
+
+	if (!ctx->service) {
+		puts("Sampling service isn't running");
+		return FALSE;
+	}
+
+	// The reply comes before the first batch
+	WaitPort(ctx->viewer_port);
+	GetMsg(ctx->viewer_port);
+
+	if (!ctx->request_msg->accepted) {
+		puts("Sampling service has no room for another viewer");
+		ctx->service = NULL;
+		return FALSE;
 	}
 
 	return TRUE;
 }
 
-static BOOL allocate_resources(Context *ctx)
+// Returns FALSE if a viewer couldn't attach
+static BOOL start_service(Context *ctx)
 {
-	BOOL result = FALSE;
+	if (ctx->role == ROLE_SERVICE) {
+		if (publish_service_port(ctx)) {
+			start_stress_viewers(ctx);
+		} else {
+			// The idle task is already running, measure on our own
+			ctx->role = ROLE_STANDALONE;
+		}
+	} else if (ctx->role == ROLE_VIEWER) {
+		return attach_viewer(ctx);
+	}
 
-    OpenClasses();
+	return TRUE;
+}
 
-	ctx->main_sig = AllocSignal(-1);
+// Takes the batch as if the samples were measured here
+static void add_batch(Context *ctx, const ServiceMsg *batch)
+{
+	ULONG i;
 
-	if (ctx->main_sig == -1) {
-		puts("Couldn't allocate signal");
-		goto clean;
+	for (i = 0; i < METRIC_COUNT; i++) {
+		if (batch->multiplier[i] != 1.0f) {
+			rescale_history(ctx, i, batch->multiplier[i]);
+		}
 	}
 
-	ctx->samples = my_alloc(XSIZE * sizeof(Sample));
+	ctx->info = batch->info;
+	ctx->mode = ctx->info.mode;
 
-	if (!ctx->samples) {
-		puts("Couldn't allocate sample data");
-		goto clean;
+	for (i = 0; i < batch->count; i++) {
+		// The batch carries the time of its last sample, one second apart
+		ctx->info.time.Seconds = batch->info.time.Seconds - (batch->count - 1 - i);
+		ctx->incoming = &batch->samples[i];
+		take_sample(ctx);
+		update_stats(ctx);
 	}
 
-	ctx->user_port = AllocSysObjectTags(ASOT_PORT,
-		ASOPORT_Name, "user_port",
-		TAG_DONE);
+	ctx->incoming = NULL;
 
-	if (!ctx->user_port) {
-		puts("Couldn't create user port");
-		goto clean;
+	if (ctx->window) {
+		refresh_window(ctx);
 	}
+}
 
-	ctx->timer_port = AllocSysObjectTags(ASOT_PORT,
-		ASOPORT_Name, "timer_port",
-		TAG_DONE);
+static void handle_viewer_port(Context *ctx)
+{
+	struct Message *msg;
 
-	if (!ctx->timer_port) {
-		puts("Couldn't create timer port");
-		goto clean;
-	}
+	while ((msg = GetMsg(ctx->viewer_port))) {
+		const ServiceMsg *batch = (ServiceMsg *) msg;
 
-	ctx->app_port = AllocSysObjectTags(ASOT_PORT,
-		ASOPORT_Name, "app_port",
-		TAG_DONE);
+		if (batch->request == SERVICE_SHUTDOWN) {
+			puts("Sampling service has quit");
+			ctx->service = NULL;
+			ctx->running = FALSE;
+		} else {
+			add_batch(ctx, batch);
+		}
 
-	if (!ctx->app_port) {
-		puts("Couldn't create app port");
-		goto clean;
+		ReplyMsg(msg);
 	}
+}
 
-	ctx->timer_req = AllocSysObjectTags(ASOT_IOREQUEST,
-		ASOIOR_Size, sizeof(struct TimeRequest),
-		ASOIOR_ReplyPort, ctx->timer_port,
-		TAG_DONE);
+static void detach_viewer(Context *ctx)
+{
+	if (ctx->service) {
+		ctx->request_msg->request = SERVICE_DETACH;
+		PutMsg(ctx->service, &ctx->request_msg->message);
 
-	if (!ctx->timer_req) {
-		puts("Couldn't create IO request");
-		goto clean;
-	}
+		// Batches sent before the service saw the request are returned unread
+		for (;;) {
+			WaitPort(ctx->viewer_port);
 
-	ctx->timer_device = OpenDevice(TIMERNAME, UNIT_WAITUNTIL,
-		(struct IORequest *) ctx->timer_req, 0);
+			struct Message *msg = GetMsg(ctx->viewer_port);
 
-	if (ctx->timer_device) {
-		puts("Couldn't open timer.device");
-		goto clean;
-	}
+			if (msg == &ctx->request_msg->message) {
+				break;
+			}
 
-	ITimer = (struct TimerIFace *) GetInterface(
-		(struct Library *) ctx->timer_req->Request.io_Device, "main", 1, NULL);
+			ReplyMsg(msg);
+		}
 
-	if (!ITimer) {
-		puts("Couldn't get Timer interface");
-		goto clean;
+		ctx->service = NULL;
 	}
 
-	ctx->window = open_window(ctx, ctx->x_pos, ctx->y_pos);
+	if (ctx->request_msg) {
+		FreeSysObject(ASOT_MESSAGE, ctx->request_msg);
+	}
 
-	if (!ctx->window) {
-		puts("Couldn't open window");
-		goto clean;
+	FreeSysObject(ASOT_PORT, ctx->viewer_port);
+	ctx->viewer_port = NULL;
+}
+
+/*
+
+Viewers that have a batch out get the shutdown when it comes back. The port
+is freed only after every viewer has replied, since they keep referring to
+it until then.
+
+*/
+static void stop_service(Context *ctx)
+{
+	int i;
+
+	if (ctx->viewer_port) {
+		detach_viewer(ctx);
+	}
+
+	if (!ctx->service_port) {
+		return;
 	}
 
-	ctx->window_title = my_alloc(WINDOW_TITLE_LEN);
+	Forbid();
+	RemPort(ctx->service_port);
+	ctx->service_closing = TRUE;
+	Permit();
 
-	if (!ctx->window_title) {
-		puts("Couldn't allocate window title");
-		goto clean;
+	for (i = 0; i < SERVICE_MAX_VIEWERS; i++) {
+		if (ctx->viewers[i] && !ctx->viewers[i]->feed.in_flight) {
+			send_batch(ctx, ctx->viewers[i], SERVICE_SHUTDOWN);
+		}
 	}
 
-	ctx->screen_title = my_alloc(SCREEN_TITLE_LEN);
+	const ULONG stress_mask = (ctx->stress_sig != -1) ? 1L << ctx->stress_sig : 0;
 
-	if (!ctx->screen_title) {
-		puts("Couldn't allocate screen title");
-		goto clean;
+	while (count_viewers(ctx) || ctx->stress_alive) {
+		Wait(1L << ctx->service_port->mp_SigBit | stress_mask);
+		handle_service_port(ctx);
 	}
 
-	realloc_bitmap(ctx);
+	stop_stress_viewers(ctx);
 
-	if (!ctx->bm) {
-		puts("Couln't allocate bitmap");
-		goto clean;
+	if (ctx->stress_sig != -1) {
+		FreeSignal(ctx->stress_sig);
 	}
 
-	ctx->idle_task = CreateTaskTags("Uuno", 0, idler, 4096,
-		AT_Param1, ctx,
-		TAG_DONE);
+	FreeSysObject(ASOT_PORT, ctx->service_port);
+	ctx->service_port = NULL;
+}
 
-	if (!ctx->idle_task) {
-		puts("Couldn't create idler task");
-		goto clean;
+// Rescales first, they apply to the samples already in the ring
+static void add_sample(Context *ctx, const QueuedSample *queued)
+{
+	int i;
+
+	for (i = 0; i < METRIC_COUNT; i++) {
+		if (queued->multiplier[i] != 1.0f) {
+			rescale_history(ctx, i, queued->multiplier[i]);
+		}
 	}
 
-	result = TRUE;
+	ctx->info = queued->info;
+	ctx->incoming = &queued->sample;
+	ctx->incoming_heat = &queued->heat;
 
-clean:
+	take_sample(ctx);
 
-	return result;
+	ctx->incoming = NULL;
+	ctx->incoming_heat = NULL;
+
+	publish_sample(ctx);
+
+	run_sweep(ctx);
+
+	update_stats(ctx);
 }
 
-static void net_changed(Context *ctx)
+// Returns FALSE when the trace has ended
+static BOOL replay_next(Context *ctx)
 {
-	SizeWindow(ctx->window, 0, (ctx->features.net) ? ctx->height : -ctx->height / 2);
-    refresh_window(ctx);
+	if (!replay_sample(ctx)) {
+		finish_replay(ctx);
+		return FALSE;
+	}
+
+	ctx->replay_frames++;
+
+	fill_info(ctx, &ctx->measured.info);
+
+	add_sample(ctx, &ctx->measured);
+
+	clear_multipliers(&ctx->measured);
+
+	return TRUE;
 }
 
-static void dragbar_changed(Context *ctx)
+// Drains the queue and draws one frame for however many samples there were
+static void handle_samples(Context *ctx)
 {
-	// Remember old coordinates
-	const WORD x = ctx->window->LeftEdge;
-	const WORD y = ctx->window->TopEdge;
+	QueuedSample queued;
+	ULONG count = 0;
 
-	ctx->window = open_window(ctx, x, y);
+	while (queue_pop(&ctx->sample_queue, &queued)) {
+		add_sample(ctx, &queued);
+		count++;
+	}
+
+	if (!count) {
+		return;
+	}
+
+	ctx->stats.coalesced += count - 1;
 
 	if (ctx->window) {
-		ActivateWindow(ctx->window);
 		refresh_window(ctx);
-	} else {
-		puts("Panic - can't reopen window!");
-		ctx->running = FALSE;
 	}
 }
 
-static void handle_keyboard(Context *ctx, UWORD key)
+/*
+
+The sampler runs the probes on absolute one second deadlines, so a slow
+frame on the GUI side doesn't shift the sampling, and pushes the samples to
+the main task through a lock-free queue. If the GUI falls behind by more than
+the queue holds, samples are dropped and their rescales go with the next one.
+
+It's a process rather than a task, because the disk counter file and the
+error messages need dos.library.
+
+*/
+// Entry arguments are ignored, the context comes in tc_UserData
+static int32 sampler(void)
 {
-	BOOL update = TRUE;
+	Context *ctx = (Context *) FindTask(NULL)->tc_UserData;
+	struct TimeRequest *tick_req = NULL;
+	struct MsgPort *port = NULL;
+	struct TimeVal deadline, second, now;
 
-	switch (key) {
-		case 'c':
-			ctx->features.cpu ^= TRUE;
-			set_menu_item(ctx, MID_CpuGraph, ctx->features.cpu);
-			break;
+	port = AllocSysObjectTags(ASOT_PORT,
+		ASOPORT_Name, "sampler_port",
+		TAG_DONE);
 
-		case 'v':
-			ctx->features.virtual_mem ^= TRUE;
-			set_menu_item(ctx, MID_VirtualMem, ctx->features.virtual_mem);
-			break;
+	if (!port) {
+		goto die;
+	}
 
-		case 'x':
-			ctx->features.video_mem ^= TRUE;
-			set_menu_item(ctx, MID_VideoMem, ctx->features.video_mem);
-			break;
+	tick_req = AllocSysObjectTags(ASOT_IOREQUEST,
+		ASOIOR_Size, sizeof(struct TimeRequest),
+		ASOIOR_ReplyPort, port,
+		ASOIOR_Duplicate, ctx->timer_req,
+		TAG_DONE);
 
-		case 'g':
-			ctx->features.grid ^= TRUE;
-			set_menu_item(ctx, MID_Grid, ctx->features.grid);
-			break;
+	if (!tick_req) {
+		goto die;
+	}
 
-		case 's':
-			ctx->features.solid_draw ^= TRUE;
-			break;
+	if (!open_netcounters()) {
+		puts("Couldn't open bsdsocket.library");
+	}
 
-		case 'm':
-			ctx->simple_mode ^= TRUE;
-			set_menu_item(ctx, MID_SimpleMode, ctx->simple_mode);
-			break;
+	start_netstats(ctx);
 
-		case 'n':
-			ctx->features.net ^= TRUE;
-			set_menu_item(ctx, MID_NetGraph, ctx->features.net);
-			net_changed(ctx);
-			break;
+	// The idle task has been running since the sync
+	ctx->last_dispatches = idle_time.dispatches;
 
-		case 'd':
-			ctx->features.dragbar ^= TRUE;
-			dragbar_changed(ctx);
-			break;
+	second.Seconds = 1;
+	second.Microseconds = 0;
 
-		case 'q':
-			ctx->running = FALSE;
-			break;
+	GetSysTime(&deadline);
 
-		default:
-			update = FALSE;
-			break;
-	}
+	while (ctx->sampler_running) {
+		AddTime(&deadline, &second);
 
-	if (update) {
-		refresh_window(ctx);
-	}
-}
+		tick_req->Request.io_Command = TR_ADDREQUEST;
+		tick_req->Time.Seconds = deadline.Seconds;
+		tick_req->Time.Microseconds = deadline.Microseconds;
 
-static void show_about_window(Context* ctx)
-{
-	Object* o = NewObject(RequesterClass, NULL,
-		REQ_TitleText, "About CPU Watcher",
-		REQ_BodyText, VERSION_STRING DATE_STRING,
-		REQ_GadgetText, "_Ok",
-		REQ_Image, REQIMAGE_INFO,
-		TAG_DONE);
+		SendIO((struct IORequest *) tick_req);
 
-	if (o) {
-		SetWindowPointer(ctx->window, WA_BusyPointer, TRUE, TAG_DONE);
-		IDoMethod(o, RM_OPENREQ, NULL, ctx->window, NULL, TAG_DONE);
-		SetWindowPointer(ctx->window, TAG_DONE);
-		DisposeObject(o);
-	}
-}
+		// The main task breaks the wait when quitting
+		const ULONG sigs = Wait(1L << port->mp_SigBit | SIGBREAKF_CTRL_C);
 
-static void handle_iconify(Context* ctx)
-{
-	ctx->window = NULL;
-	IDoMethod(ctx->windowObject, WM_ICONIFY);
-}
+		if (sigs & SIGBREAKF_CTRL_C) {
+			AbortIO((struct IORequest *) tick_req);
+			WaitIO((struct IORequest *) tick_req);
+			break;
+		}
 
-static void handle_uniconify(Context* ctx)
-{
-	ctx->window = (struct Window *)IDoMethod(ctx->windowObject, WM_OPEN);
-	refresh_window(ctx);
-}
+		WaitIO((struct IORequest *) tick_req);
 
-static BOOL handle_menupick(Context *ctx)
-{
-	BOOL running = TRUE;
+		// After a long stall skip the missed seconds instead of sampling back to back
+		GetSysTime(&now);
 
-	uint32 id = NO_MENU_ID;
+		if (difference_us(&now, &deadline) > 1000000) {
+			deadline = now;
+		}
 
-	while (ctx->window && ((id = IDoMethod(ctx->menu, MM_NEXTSELECT, 0, id))) != NO_MENU_ID) {
-		switch(id) {
-			case MID_Quit:
-				running = FALSE;
-				break;
-			case MID_Iconify:
-				handle_iconify(ctx);
-				break;
-			case MID_About:
-				show_about_window(ctx);
-				break;
+		run_probes(ctx);
 
-			// Options
-			case MID_CpuGraph:
-				ctx->features.cpu = IDoMethod(ctx->menu, MM_GETSTATE, 0, id);
-				refresh_window(ctx);
-				break;
-			case MID_NetGraph:
-				ctx->features.net = IDoMethod(ctx->menu, MM_GETSTATE, 0, id);
-				net_changed(ctx);
-				break;
-			case MID_Grid:
-				ctx->features.grid = IDoMethod(ctx->menu, MM_GETSTATE, 0, id);
-				refresh_window(ctx);
-				break;
-			case MID_VirtualMem:
-				ctx->features.virtual_mem = IDoMethod(ctx->menu, MM_GETSTATE, 0, id);
-				refresh_window(ctx);
-				break;
-			case MID_VideoMem:
-				ctx->features.video_mem = IDoMethod(ctx->menu, MM_GETSTATE, 0, id);
-				refresh_window(ctx);
-				break;
-			case MID_DragBar:
-				ctx->features.dragbar = IDoMethod(ctx->menu, MM_GETSTATE, 0, id);
-				dragbar_changed(ctx);
-				break;
-			case MID_SimpleMode:
-				ctx->simple_mode = IDoMethod(ctx->menu, MM_GETSTATE, 0, id);
-				break;
+		fill_info(ctx, &ctx->measured.info);
+
+		if (queue_push(&ctx->sample_queue, &ctx->measured)) {
+			clear_multipliers(&ctx->measured);
+			Signal(ctx->main_task, 1L << ctx->sample_sig);
+		} else {
+			ctx->samples_dropped++;
 		}
 	}
 
-	return running;
-}
-
-static char getVanillaKey(Context *ctx)
-{
-	struct InputEvent *ie;
-	char vanilla;
+die:
+	close_netcounters();
 
-	if (!GetAttr(WINDOW_InputEvent, ctx->windowObject, (ULONG *)&ie)) {
-		puts("GetAttr failed");
-		return 0;
+	if (tick_req) {
+		FreeSysObject(ASOT_IOREQUEST, tick_req);
 	}
 
-	if (MapRawKey(ie, &vanilla, 1, NULL) == 1) {
-		return vanilla;
+	if (port) {
+		FreeSysObject(ASOT_PORT, port);
 	}
 
+	// Tell the main task that we are done. Forbid lasts until the process
+	// has exited, so the main task can't quit under it.
+	Forbid();
+	Signal(ctx->main_task, 1L << ctx->sampler_exit_sig);
+
 	return 0;
 }
 
-static void handle_window_events(Context *ctx)
+static void start_sampler(Context *ctx)
 {
-	uint32 result;
-	int16 code = 0;
+	ctx->sample_sig = AllocSignal(-1);
+	ctx->sampler_exit_sig = AllocSignal(-1);
+	ctx->queued = my_alloc(SAMPLE_QUEUE_LEN * sizeof(QueuedSample));
 
-	while ((result = IDoMethod(ctx->windowObject, WM_HANDLEINPUT, &code)) != WMHI_LASTMSG) {
-		switch (result & WMHI_CLASSMASK) {
-			case WMHI_CLOSEWINDOW:
-				ctx->running = FALSE;
-				break;
-#if 0 // Doesn't trigger?
-			case WMHI_VANILLAKEY:
-				handle_keyboard(ctx, result & WMHI_KEYMASK);
-				break;
-#endif
-			case WMHI_RAWKEY:
-				handle_keyboard(ctx, getVanillaKey(ctx));
-				break;
-			case WMHI_NEWSIZE:
-				realloc_bitmap(ctx);
-				refresh_window(ctx);
-				break;
-			case WMHI_ICONIFY:
-				handle_iconify(ctx);
-				break;
-			case WMHI_UNICONIFY:
-				handle_uniconify(ctx);
-				break;
-			case WMHI_MENUPICK:
-				ctx->running = handle_menupick(ctx);
-				break;
-			default:
-				//printf("unhandled result %lx, code %x\n", result, code);
-				break;
-		}
+	if (ctx->sample_sig == -1 || ctx->sampler_exit_sig == -1 || !ctx->queued) {
+		puts("Couldn't allocate sample queue");
+		ctx->running = FALSE;
+		return;
+	}
+
+	queue_init(&ctx->sample_queue, ctx->queued, sizeof(QueuedSample), SAMPLE_QUEUE_LEN);
+
+	ctx->sampler_running = TRUE;
+
+	ctx->sampler_task = (struct Task *) CreateNewProcTags(
+		NP_Entry, sampler,
+		NP_Name, "CPU Watcher sampler",
+		NP_Priority, SAMPLER_PRI,
+		NP_StackSize, 16384,
+		NP_UserData, ctx,
+		NP_Output, Output(),
+		NP_CloseOutput, FALSE,
+		NP_Child, TRUE,
+		TAG_DONE);
+
+	if (!ctx->sampler_task) {
+		puts("Couldn't create sampler process");
+		ctx->sampler_running = FALSE;
+		ctx->running = FALSE;
 	}
 }
 
-static UBYTE clamp100(UBYTE value)
+static void stop_sampler(Context *ctx)
 {
-	if (value > 100) {
-		//printf("%d\n", value);
-		value = 100;
+	if (ctx->sampler_task) {
+		ctx->sampler_running = FALSE;
+
+		Signal(ctx->sampler_task, SIGBREAKF_CTRL_C);
+
+		// The queue is freed below, so nothing but the sampler's own exit
+		// signal will do
+		Wait(1L << ctx->sampler_exit_sig);
+
+		// The process has exited by now
+		ctx->sampler_task = NULL;
 	}
 
-	return value;
+	if (ctx->queued) {
+		my_free(ctx->queued);
+		ctx->queued = NULL;
+	}
+
+	if (ctx->sample_sig != -1) {
+		FreeSignal(ctx->sample_sig);
+		ctx->sample_sig = -1;
+	}
+
+	if (ctx->sampler_exit_sig != -1) {
+		FreeSignal(ctx->sampler_exit_sig);
+		ctx->sampler_exit_sig = -1;
+	}
 }
 
-static void measure_cpu(Context *ctx)
+static void shrink_job(void *data)
 {
-	UBYTE value = 100;
+	shrink_bitmap((Context *)data);
+}
 
-	if (ctx->simple_mode) {
-		value -= ctx->run_count;
-	} else {
-		value -= roundf(100.0f * (idle_time.total.Seconds * 1000000 + idle_time.total.Microseconds) / 1000000.0f);
-	}
+// Runs once, when no new size has arrived for RESIZE_SETTLE
+static void resize_job(void *data)
+{
+	Context *ctx = (Context *)data;
 
-	ctx->run_count = 0;
-	idle_time.total.Seconds = 0;
-	idle_time.total.Microseconds = 0;
+	wheel_remove(&ctx->resize_job);
 
-	ctx->samples[ctx->iter].cpu = clamp100(value);
+	if (ctx->window) {
+		ctx->last_resize = ctx->stats.seconds;
+		realloc_bitmap(ctx);
+		refresh_window(ctx);
+	}
 }
 
-static void measure_memory(Context *ctx)
-{
-	UBYTE value = roundf(100.0f * (float)AvailMem(MEMF_VIRTUAL) / (float)AvailMem(MEMF_VIRTUAL|MEMF_TOTAL));
+/*
 
-	ctx->samples[ctx->iter].virtual_mem = clamp100(value);
+Every new size during a drag pushes the deadline forward, so the bitmap is
+reallocated and the graphs redrawn once after the drag has settled.
 
-	uint64 total_vid, free_vid;
+*/
+static void resize_later(Context *ctx)
+{
+	struct TimeVal now;
 
-	if (GetBoardDataTags(0,
-		GBD_TotalMemory, &total_vid,
-		GBD_FreeMemory, &free_vid,
-		TAG_DONE) == 2) {
+	GetSysTime(&now);
 
-		value = roundf(100.0f * (float)free_vid / (float)total_vid);
+	wheel_remove(&ctx->resize_job);
 
-		ctx->samples[ctx->iter].video_mem = clamp100(value);
-	}
+	ctx->resize_job.run = resize_job;
+	ctx->resize_job.data = ctx;
+	wheel_add(&ctx->wheel, &ctx->resize_job, RESIZE_SETTLE, time_us(&now));
+
+	arm_timer(ctx);
 }
 
-static void measure_network(Context *ctx, float *dl_speed, float *ul_speed)
+// Live samples come from the sampler task and viewers get batches
+static void replay_job(void *data)
 {
-	float dl_mult = 1.0f, ul_mult = 1.0f;
-	UBYTE dl_p, ul_p;
+	Context *ctx = (Context *)data;
 
-	if (update_netstats(&dl_p, &ul_p, &dl_mult, &ul_mult, dl_speed, ul_speed)) {
-
-		int i;
-		for (i = 0; i < XSIZE; i++) {
-			ctx->samples[i].download *= dl_mult;
-			ctx->samples[i].upload *= ul_mult;
-		}
+	if (replay_next(ctx) && ctx->window) {
+		refresh_window(ctx);
 	}
-
-	ctx->samples[ctx->iter].download = dl_p;
-	ctx->samples[ctx->iter].upload = ul_p;
 }
 
-static void start_timer(Context *ctx)
+static void start_jobs(Context *ctx)
 {
-	struct TimeVal increment;
+	struct TimeVal now;
 
-	GetSysTime(&ctx->tv);
+	GetSysTime(&now);
 
-	increment.Seconds = 1;
-	increment.Microseconds = 0;
+	wheel_init(&ctx->wheel, WHEEL_TICK, time_us(&now));
 
-	AddTime(&ctx->tv, &increment);
+	ctx->shrink_job.run = shrink_job;
+	ctx->shrink_job.data = ctx;
+	wheel_add(&ctx->wheel, &ctx->shrink_job, JOB_PERIOD, time_us(&now));
 
-	ctx->timer_req->Request.io_Command = TR_ADDREQUEST;
-	ctx->timer_req->Time.Seconds = ctx->tv.Seconds;
-	ctx->timer_req->Time.Microseconds = ctx->tv.Microseconds;
+	// Fast replay doesn't wait for the timer
+	if (ctx->replay.file && !ctx->replay_fast) {
+		ctx->replay_job.run = replay_job;
+		ctx->replay_job.data = ctx;
+		wheel_add(&ctx->wheel, &ctx->replay_job, JOB_PERIOD, time_us(&now));
+	}
 
-	SendIO((struct IORequest *) ctx->timer_req);
+	arm_timer(ctx);
 }
 
 static void handle_timer_events(Context *ctx)
 {
+	const uint64 due = ctx->timer_due;
 	struct Message *msg;
+	struct TimeVal now;
 
 	while ((msg = GetMsg(ctx->timer_port))) {
 		int8 error = ((struct IORequest *)msg)->io_Error;
@@ -1242,27 +5804,58 @@ static void handle_timer_events(Context *ctx)
 		if (error) {
 			printf("message received with code %d\n", error);
 		}
+
+		ctx->timer_due = 0;
+	}
+
+	GetSysTime(&now);
+
+	if (due && time_us(&now) > due) {
+		ctx->stats.timer_late_max = MAX(ctx->stats.timer_late_max, time_us(&now) - due);
 	}
 
-	start_timer(ctx);
+	wheel_run(&ctx->wheel, time_us(&now));
+
+	arm_timer(ctx);
+}
 
-	++ctx->iter;
-	ctx->iter %= XSIZE;
+/*
 
-	measure_cpu(ctx);
-	measure_memory(ctx);
-	measure_network(ctx, &ctx->dl_speed, &ctx->ul_speed);
+Fast replay renders trace records back to back, only polling for window
+events, timer jobs and CTRL-C in between, and reports the frame rate at
+the end.
 
-	if (ctx->window) {
-		refresh_window(ctx);
+*/
+static void replay_loop(Context *ctx)
+{
+	while (ctx->running && replay_next(ctx)) {
+		if (ctx->window) {
+			refresh_window(ctx);
+		}
+
+		const ULONG timer_sig = 1L << ctx->timer_port->mp_SigBit;
+		const ULONG sigs = SetSignal(0L, SIGBREAKF_CTRL_C | ctx->window_sig | timer_sig);
+
+		if (sigs & ctx->window_sig) {
+			handle_window_events(ctx);
+		}
+
+		if (sigs & timer_sig) {
+			handle_timer_events(ctx);
+		}
+
+		if (sigs & SIGBREAKF_CTRL_C) {
+			ctx->running = FALSE;
+		}
 	}
 }
 
 static void stop_timer(Context *ctx)
 {
-	if (!CheckIO((struct IORequest *) ctx->timer_req)) {
+	if (ctx->timer_due) {
 		AbortIO((struct IORequest *) ctx->timer_req);
 		WaitIO((struct IORequest *) ctx->timer_req);
+		ctx->timer_due = 0;
 	}
 }
 
@@ -1278,8 +5871,175 @@ static void wait_for_idler(Context *ctx)
 	}
 }
 
+/*
+
+Metrics for the scrape endpoint. Graph levels are labelled by the metric
+name like the tooltypes, the rest are raw values of the latest sample.
+
+*/
+static void write_metrics(Formatter *f, void *data)
+{
+	Context *ctx = (Context *)data;
+	const ULONG recent = ctx->stored;
+	ULONG sum[METRIC_COUNT] = { 0 };
+	UBYTE peak[METRIC_COUNT] = { 0 };
+	ULONG age;
+	int i;
+
+	for (age = 0; age < recent; age++) {
+		const Sample *sample = &ctx->samples[ring_slot(ctx, age)];
+
+		for (i = 0; i < METRIC_COUNT; i++) {
+			sum[i] += sample->values[i];
+			peak[i] = MAX(peak[i], sample->values[i]);
+		}
+	}
+
+	scrape_metric(f, "cpuwatcher_level", "gauge", "Latest graph level, 0-100");
+
+	for (i = 0; recent && i < METRIC_COUNT; i++) {
+		scrape_value(f, "cpuwatcher_level", "metric", metrics[i].name, get_cur(i));
+	}
+
+	scrape_metric(f, "cpuwatcher_level_avg", "gauge", "Average graph level over the graph's span");
+
+	for (i = 0; recent && i < METRIC_COUNT; i++) {
+		scrape_value(f, "cpuwatcher_level_avg", "metric", metrics[i].name, (sum[i] + recent / 2) / recent);
+	}
+
+	scrape_metric(f, "cpuwatcher_level_max", "gauge", "Highest graph level over the graph's span");
+
+	for (i = 0; recent && i < METRIC_COUNT; i++) {
+		scrape_value(f, "cpuwatcher_level_max", "metric", metrics[i].name, peak[i]);
+	}
+
+	const SampleInfo *info = &ctx->info;
+
+	scrape_metric(f, "cpuwatcher_network_receive_bytes_total", "counter", "Bytes received by all interfaces");
+	scrape_value(f, "cpuwatcher_network_receive_bytes_total", NULL, NULL, info->net_in);
+	scrape_metric(f, "cpuwatcher_network_transmit_bytes_total", "counter", "Bytes sent by all interfaces");
+	scrape_value(f, "cpuwatcher_network_transmit_bytes_total", NULL, NULL, info->net_out);
+
+	scrape_metric(f, "cpuwatcher_network_bytes_per_second", "gauge", "Network rate of the latest sample");
+	scrape_value(f, "cpuwatcher_network_bytes_per_second", "direction", "receive", (uint64)(info->dl_speed * 1024.0f + 0.5f));
+	scrape_value(f, "cpuwatcher_network_bytes_per_second", "direction", "transmit", (uint64)(info->ul_speed * 1024.0f + 0.5f));
+
+	if (info->disk) {
+		scrape_metric(f, "cpuwatcher_disk_bytes_per_second", "gauge", "Disk rate of the latest sample");
+		scrape_value(f, "cpuwatcher_disk_bytes_per_second", "direction", "read", info->disk_read_rate);
+		scrape_value(f, "cpuwatcher_disk_bytes_per_second", "direction", "write", info->disk_write_rate);
+	}
+
+	if (info->latency) {
+		scrape_metric(f, "cpuwatcher_latency_p99_microseconds", "gauge", "99th percentile wake-up latency");
+		scrape_value(f, "cpuwatcher_latency_p99_microseconds", NULL, NULL, info->latency_p99);
+	}
+
+	scrape_metric(f, "cpuwatcher_idle_dispatches_per_second", "gauge", "Idle task dispatch rate");
+	scrape_value(f, "cpuwatcher_idle_dispatches_per_second", NULL, NULL, info->dispatch_rate);
+
+	scrape_metric(f, "cpuwatcher_memory_exhausted_seconds", "gauge", "Forecast until free memory runs out, 0 if not declining");
+	scrape_value(f, "cpuwatcher_memory_exhausted_seconds", NULL, NULL, ctx->memory_eta);
+
+	scrape_metric(f, "cpuwatcher_samples_total", "counter", "Samples taken");
+	scrape_value(f, "cpuwatcher_samples_total", NULL, NULL, ctx->taken);
+	scrape_metric(f, "cpuwatcher_samples_dropped_total", "counter", "Samples lost because the main task fell behind");
+	scrape_value(f, "cpuwatcher_samples_dropped_total", NULL, NULL, ctx->samples_dropped);
+}
+
+static void start_scraper(Context *ctx)
+{
+	ctx->scraper = my_alloc(sizeof(Scraper));
+
+	if (!ctx->scraper) {
+		puts("Couldn't allocate metrics buffers");
+		return;
+	}
+
+	if (!scrape_open(ctx->scraper, ctx->metrics_port, write_metrics, ctx)) {
+		my_free(ctx->scraper);
+		ctx->scraper = NULL;
+	}
+}
+
+static void stop_scraper(Context *ctx)
+{
+	if (ctx->scraper) {
+		scrape_close(ctx->scraper);
+		my_free(ctx->scraper);
+		ctx->scraper = NULL;
+	}
+}
+
+/*
+
+The prefs file is watched with a DOS notification, so there's no polling.
+Editors may replace the file instead of writing it, the notification is
+bound to the name and follows that too.
+
+*/
+static void start_prefs_watch(Context *ctx)
+{
+	ctx->prefs_sig = AllocSignal(-1);
+
+	if (ctx->prefs_sig == -1) {
+		puts("Couldn't allocate prefs signal");
+		return;
+	}
+
+	ctx->prefs_notify = AllocDosObject(DOS_NOTIFYREQUEST, NULL);
+
+	if (!ctx->prefs_notify) {
+		puts("Couldn't allocate prefs notification");
+		return;
+	}
+
+	ctx->prefs_notify->nr_Name = ctx->prefs_file;
+	ctx->prefs_notify->nr_Flags = NRF_SEND_SIGNAL;
+	ctx->prefs_notify->nr_stuff.nr_Signal.nr_Task = FindTask(NULL);
+	ctx->prefs_notify->nr_stuff.nr_Signal.nr_SignalNum = ctx->prefs_sig;
+
+	if (!StartNotify(ctx->prefs_notify)) {
+		printf("Couldn't watch prefs file '%s'\n", ctx->prefs_file);
+		FreeDosObject(DOS_NOTIFYREQUEST, ctx->prefs_notify);
+		ctx->prefs_notify = NULL;
+	}
+}
+
+static void stop_prefs_watch(Context *ctx)
+{
+	if (ctx->prefs_notify) {
+		EndNotify(ctx->prefs_notify);
+		FreeDosObject(DOS_NOTIFYREQUEST, ctx->prefs_notify);
+		ctx->prefs_notify = NULL;
+	}
+
+	if (ctx->prefs_sig != -1) {
+		FreeSignal(ctx->prefs_sig);
+		ctx->prefs_sig = -1;
+	}
+}
+
 static void free_resources(Context *ctx)
 {
+	stop_sampler(ctx);
+	stop_service(ctx);
+
+	stop_load(ctx);
+	stop_latency_probe(ctx);
+
+	if (ctx->disk_patched) {
+		disk_patch_remove();
+	}
+
+	trace_close(&ctx->record);
+	trace_close(&ctx->replay);
+
+	stop_stream(ctx);
+	stop_scraper(ctx);
+	stop_collect(ctx);
+	stop_prefs_watch(ctx);
+
 	wait_for_idler(ctx);
 
 	if (ITimer) {
@@ -1310,6 +6070,14 @@ static void free_resources(Context *ctx)
 		DisposeObject(ctx->windowObject);
 	}
 
+	if (ctx->menu) {
+		DisposeObject(ctx->menu);
+	}
+
+	if (ctx->icon) {
+		FreeDiskObject(ctx->icon);
+	}
+
 	if (ctx->user_port) {
 		FreeSysObject(ASOT_PORT, ctx->user_port);
 	}
@@ -1322,16 +6090,13 @@ static void free_resources(Context *ctx)
 		FreeBitMap(ctx->bm);
 	}
 
-	if (ctx->window_title) {
-		my_free(ctx->window_title);
-	}
-
-	if (ctx->screen_title) {
-		my_free(ctx->screen_title);
+	// Titles, history and the startup ring
+	if (ctx->arena) {
+		my_free(ctx->arena);
 	}
 
-	if (ctx->samples) {
-		my_free(ctx->samples);
+	if (ctx->ring_block) {
+		my_free(ctx->ring_block);
 	}
 
     CloseClasses();
@@ -1345,10 +6110,13 @@ static void init_context(Context *ctx)
 
 	ctx->main_sig = -1;
 	ctx->idle_sig = -1;
+	ctx->stress_sig = -1;
+	ctx->sample_sig = -1;
+	ctx->sampler_exit_sig = -1;
+	ctx->prefs_sig = -1;
+	ctx->load_sig = -1;
+	ctx->latency_sig = -1;
 
-	ctx->features.cpu = TRUE;
-	ctx->features.virtual_mem = TRUE;
-	ctx->features.video_mem = TRUE;
 	ctx->features.solid_draw = TRUE;
 	ctx->features.dragbar = TRUE;
 	ctx->features.grid = TRUE;
@@ -1357,34 +6125,120 @@ static void init_context(Context *ctx)
 	ctx->running = TRUE;
 	ctx->timer_device = -1;
 
-	ctx->colors.cpu = CPU_COL;
-	ctx->colors.virtual_mem = VIRT_COL;
-	ctx->colors.video_mem = VID_COL;
 	ctx->colors.grid = GRID_COL;
 	ctx->colors.background = BG_COL;
-	ctx->colors.upload = UL_COL;
-	ctx->colors.download = DL_COL;
 
 	ctx->opaqueness = 255;
 
 	ctx->scaleX = 1.0f;
 	ctx->scaleY = 1.0f;
+
+	ctx->titles_invalid = TRUE;
+
+	ctx->shrink_delay = SHRINK_DELAY;
+	ctx->history_kib = HISTORY_KIB;
+	ctx->latency_hz = LATENCY_HZ;
+	ctx->heat_hz = HEAT_HZ;
+	ctx->capacity = XSIZE;
+	ctx->stream_kib = STREAM_KIB;
+	ctx->collect_port = COLLECT_PORT;
+	ctx->send_batch = SEND_BATCH;
+	ctx->send_socket = -1;
+	ctx->collect_socket = -1;
+
+	clear_multipliers(&ctx->measured);
+
+	strcpy(ctx->alarm_log, ALARM_LOG_FILE);
+
+	int i;
+	for (i = 0; i < METRIC_COUNT; i++) {
+		ctx->features.graph[i] = TRUE;
+		ctx->colors.metric[i] = metrics[i].color;
+		ctx->export_names[i] = metrics[i].name;
+
+		init_probe(&ctx->probes[i], 1, metrics[i].max_period);
+	}
+}
+
+// Waits for the signals, and for the sockets of the scrape endpoint and the collector
+static ULONG wait_events(Context *ctx, ULONG mask)
+{
+	fd_set readable, writable;
+	LONG nfds = 0;
+
+	if (!ctx->scraper && ctx->collect_socket == -1) {
+		return Wait(mask);
+	}
+
+	FD_ZERO(&readable);
+	FD_ZERO(&writable);
+
+	if (ctx->scraper) {
+		nfds = scrape_fds(ctx->scraper, &readable, &writable, nfds);
+	}
+
+	if (ctx->collect_socket != -1) {
+		FD_SET(ctx->collect_socket, &readable);
+		nfds = MAX(nfds, ctx->collect_socket + 1);
+	}
+
+	ULONG sigs = mask;
+
+	const LONG ready = WaitSelect(nfds, &readable, &writable, NULL, NULL, &sigs);
+
+	if (ready > 0) {
+		if (ctx->scraper) {
+			scrape_handle(ctx->scraper, &readable, &writable);
+		}
+
+		if (ctx->collect_socket != -1 && FD_ISSET(ctx->collect_socket, &readable)) {
+			receive_datagrams(ctx);
+		}
+	} else if (ready < 0) {
+		puts("Waiting for the sockets failed, closing them");
+		stop_scraper(ctx);
+		stop_collect(ctx);
+		sigs = SetSignal(0L, mask) & mask;
+	}
+
+	return sigs;
 }
 
 static void main_loop(Context *ctx)
 {
 	while ( ctx->running ) {
-		uint32 winSig = 0;
-		if (!GetAttr(WINDOW_SigMask, ctx->windowObject, &winSig)) {
-			puts("GetAttr failed");
+		const ULONG winSig = ctx->window_sig;
+
+		// The port we receive service messages on, if any
+		struct MsgPort *port = ctx->service_port ? ctx->service_port : ctx->viewer_port;
+		const ULONG serviceSig = port ? 1L << port->mp_SigBit : 0;
+
+		const ULONG sampleSig = (ctx->sample_sig != -1) ? 1L << ctx->sample_sig : 0;
+
+		const ULONG prefsSig = ctx->prefs_notify ? 1L << ctx->prefs_sig : 0;
+
+		const ULONG sigs = wait_events(ctx, SIGBREAKF_CTRL_C | 1L << ctx->timer_port->mp_SigBit | winSig | serviceSig | sampleSig | prefsSig);
+
+		if (sigs & prefsSig) {
+			reload_prefs(ctx);
 		}
 
-		const ULONG sigs = Wait(SIGBREAKF_CTRL_C | 1L << ctx->timer_port->mp_SigBit | winSig);
+		if (sigs & sampleSig) {
+			handle_samples(ctx);
+		}
 
 		if (sigs & (1L << ctx->timer_port->mp_SigBit)) {
 			handle_timer_events(ctx);
 		}
 
+		if (sigs & serviceSig) {
+			if (ctx->service_port) {
+				handle_service_port(ctx);
+			} else {
+				handle_viewer_port(ctx);
+			}
+		}
+
 		if (sigs & winSig) {
 			handle_window_events(ctx);
 		}
@@ -1395,10 +6249,39 @@ static void main_loop(Context *ctx)
 	}
 }
 
+// Runs while the sampler takes the first samples
+static void open_display(Context *ctx)
+{
+	if (ctx->headless) {
+		return;
+	}
+
+	OpenClasses();
+
+	ctx->window = open_window(ctx, ctx->x_pos, ctx->y_pos);
+
+	if (!ctx->window) {
+		puts("Couldn't open window");
+		ctx->running = FALSE;
+		return;
+	}
+
+	if (!realloc_bitmap(ctx)) {
+		ctx->running = FALSE;
+		return;
+	}
+
+	refresh_window(ctx);
+}
+
 static BOOL sync_to_idler_task(Context *ctx)
 {
 	BOOL result = FALSE;
 
+	if (!ctx->idle_task) {
+		return TRUE;
+	}
+
 	Wait(1L << ctx->main_sig);
 
 	if (ctx->idler_trouble) {
@@ -1421,18 +6304,71 @@ int main(int argc, char ** argv)
 
 	if (GfxBase->lib_Version < 54) {
 		puts("graphics.library V54 needed");
-	} else {
+	} else if (open_timer(&ctx)) {
+		GetSysTime(&ctx.stats.started);
+
 		handle_args(&ctx, argc, argv);
 
-		if (allocate_resources(&ctx) && sync_to_idler_task(&ctx)) {
+		choose_role(&ctx);
+
+		if (allocate_resources(&ctx) && sync_to_idler_task(&ctx) && start_service(&ctx)) {
+
+			if (ctx.replay_file[0] && start_replay(&ctx)) {
+				// Replayed samples don't come from the live probes
+				ctx.compare = ctx.calibrate = FALSE;
+			}
+
+			if (ctx.record_file[0]) {
+				start_recording(&ctx);
+			}
+
+			if (ctx.stream_file[0]) {
+				start_stream(&ctx);
+			}
+
+			if (ctx.role != ROLE_VIEWER) {
+				start_disk_stats(&ctx);
+				start_latency_probe(&ctx);
+			}
+
+			// Live samples are taken by the sampler task
+			if (!ctx.replay.file && ctx.role != ROLE_VIEWER) {
+				start_sampler(&ctx);
+			}
+
+			open_display(&ctx);
+
+			ctx.stats.startup_us = elapsed_us(&ctx.stats.started);
+
+			if (ctx.stats.report) {
+				DebugPrintF("%s: started in %lu us\n", NAME_STRING, ctx.stats.startup_us);
+			}
+
+			if (ctx.compare || ctx.calibrate) {
+				start_sweep(&ctx);
+			}
+
+			start_jobs(&ctx);
+
+			if (ctx.metrics_port > 0) {
+				start_scraper(&ctx);
+			}
 
-			refresh_window(&ctx);
+			if (ctx.collect) {
+				start_collector(&ctx);
+			}
 
-			init_netstats();
+			start_sender(&ctx);
 
-			start_timer(&ctx);
+			if (ctx.prefs_file[0]) {
+				start_prefs_watch(&ctx);
+			}
 
-			main_loop(&ctx);
+			if (ctx.replay.file && ctx.replay_fast) {
+				replay_loop(&ctx);
+			} else {
+				main_loop(&ctx);
+			}
 
 			stop_timer(&ctx);
 		}
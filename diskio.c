@@ -0,0 +1,152 @@
+#include "diskio.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void disk_init(DiskStats *stats)
+{
+	memset(stats, 0, sizeof(*stats));
+}
+
+static DiskDevice *find_device(DiskStats *stats, const DiskCounters *counters, int *is_new)
+{
+	int i;
+
+	*is_new = 0;
+
+	for (i = 0; i < stats->count; i++) {
+		if (strcmp(stats->devices[i].last.name, counters->name) == 0) {
+			return &stats->devices[i];
+		}
+	}
+
+	if (stats->count == DISK_MAX_DEVICES) {
+		return NULL;
+	}
+
+	*is_new = 1;
+
+	return &stats->devices[stats->count++];
+}
+
+// A counter that went backwards was reset, count it as no activity
+static uint32_t rate(uint64_t now, uint64_t last, uint32_t elapsed_us)
+{
+	if (now < last || !elapsed_us) {
+		return 0;
+	}
+
+	const uint64_t result = (now - last) * 1000000 / elapsed_us;
+
+	return result > UINT32_MAX ? UINT32_MAX : (uint32_t)result;
+}
+
+static uint8_t scale(uint32_t value, uint32_t max, uint32_t *new_max, float *multiplier)
+{
+	*new_max = max;
+
+	if (value > max) {
+		*multiplier = (float)max / value;
+		*new_max = value;
+	}
+
+	return *new_max ? (uint8_t)(100.0f * value / *new_max) : 0;
+}
+
+int disk_update(DiskStats *stats, DiskSource *source, uint32_t elapsed_us,
+	uint8_t *read, uint8_t *write, float *read_multiplier, float *write_multiplier)
+{
+	const int count = source->poll(source, stats->polled, DISK_MAX_DEVICES);
+	int i;
+
+	stats->read_rate = stats->write_rate = 0;
+	stats->read_ops = stats->write_ops = 0;
+
+	if (count < 0) {
+		*read = *write = 0;
+		return -1;
+	}
+
+	for (i = 0; i < count; i++) {
+		const DiskCounters *now = &stats->polled[i];
+		int is_new;
+
+		DiskDevice *device = find_device(stats, now, &is_new);
+
+		if (!device) {
+			continue;
+		}
+
+		// The first poll of a device is only the baseline
+		if (!is_new) {
+			device->read_rate = rate(now->read_bytes, device->last.read_bytes, elapsed_us);
+			device->write_rate = rate(now->write_bytes, device->last.write_bytes, elapsed_us);
+			device->read_ops = rate(now->reads, device->last.reads, elapsed_us);
+			device->write_ops = rate(now->writes, device->last.writes, elapsed_us);
+
+			stats->read_rate += device->read_rate;
+			stats->write_rate += device->write_rate;
+			stats->read_ops += device->read_ops;
+			stats->write_ops += device->write_ops;
+		}
+
+		device->last = *now;
+	}
+
+	return disk_scale(stats, read, write, read_multiplier, write_multiplier);
+}
+
+int disk_scale(DiskStats *stats, uint8_t *read, uint8_t *write, float *read_multiplier, float *write_multiplier)
+{
+	const uint32_t max_read = stats->max_read;
+	const uint32_t max_write = stats->max_write;
+
+	*read = scale(stats->read_rate, max_read, &stats->max_read, read_multiplier);
+	*write = scale(stats->write_rate, max_write, &stats->max_write, write_multiplier);
+
+	return stats->max_read != max_read || stats->max_write != max_write;
+}
+
+/*
+
+File-backed source, for replaying counters captured elsewhere and for
+exercising the rate logic without real devices.
+
+*/
+static int poll_file(DiskSource *source, DiskCounters *counters, int max)
+{
+	FILE *file = fopen((const char *)source->data, "r");
+	char line[128];
+	int count = 0;
+
+	if (!file) {
+		return -1;
+	}
+
+	while (count < max && fgets(line, sizeof(line), file)) {
+		DiskCounters *c = &counters[count];
+		unsigned long long reads, read_bytes, writes, write_bytes;
+		char name[DISK_NAME_LEN];
+
+		if (sscanf(line, "%31s %llu %llu %llu %llu", name, &reads, &read_bytes, &writes, &write_bytes) != 5) {
+			continue;
+		}
+
+		strcpy(c->name, name);
+		c->reads = reads;
+		c->read_bytes = read_bytes;
+		c->writes = writes;
+		c->write_bytes = write_bytes;
+		count++;
+	}
+
+	fclose(file);
+
+	return count;
+}
+
+void disk_file_source(DiskSource *source, const char *path)
+{
+	source->poll = poll_file;
+	source->data = (void *)path;
+}
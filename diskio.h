@@ -0,0 +1,82 @@
+#ifndef DISKIO_H
+#define DISKIO_H
+
+/*
+
+Disk activity statistics. Per-device read/write byte and request counters
+come from a counter source and are turned into per-second rates and
+autoscaled 0...100 graph values, the same way network.c does for network
+traffic. The device table has a fixed capacity and nothing is allocated
+while sampling.
+
+*/
+
+#include <stdint.h>
+
+#define DISK_MAX_DEVICES 8
+#define DISK_NAME_LEN 32
+
+typedef struct {
+	char name[DISK_NAME_LEN];
+	uint64_t read_bytes;
+	uint64_t write_bytes;
+	uint64_t reads;
+	uint64_t writes;
+} DiskCounters;
+
+typedef struct DiskSource DiskSource;
+
+struct DiskSource {
+	// Fills at most 'max' entries, returns how many or -1 on failure
+	int (*poll)(DiskSource *source, DiskCounters *counters, int max);
+	void *data;
+};
+
+typedef struct {
+	DiskCounters last;
+
+	// Per second over the last interval
+	uint32_t read_rate;
+	uint32_t write_rate;
+	uint32_t read_ops;
+	uint32_t write_ops;
+} DiskDevice;
+
+typedef struct {
+	DiskDevice devices[DISK_MAX_DEVICES];
+	int count;
+
+	// Scratch space for the source
+	DiskCounters polled[DISK_MAX_DEVICES];
+
+	// Sums over all devices
+	uint32_t read_rate;
+	uint32_t write_rate;
+	uint32_t read_ops;
+	uint32_t write_ops;
+
+	// Peak rates the graph is scaled to
+	uint32_t max_read;
+	uint32_t max_write;
+} DiskStats;
+
+void disk_init(DiskStats *stats);
+
+/*
+
+Polls the source and updates the rates. 'read' and 'write' get the total
+rates as 0...100 of the peak. Returns 1 when a new peak was reached and
+the graph history should be multiplied by the given factors, 0 otherwise
+and -1 if the source failed.
+
+*/
+int disk_update(DiskStats *stats, DiskSource *source, uint32_t elapsed_us,
+	uint8_t *read, uint8_t *write, float *read_multiplier, float *write_multiplier);
+
+// Scales total rates set from elsewhere, a replayed trace. Returns like disk_update.
+int disk_scale(DiskStats *stats, uint8_t *read, uint8_t *write, float *read_multiplier, float *write_multiplier);
+
+// Reads "name reads read_bytes writes write_bytes" lines from the file 'path'
+void disk_file_source(DiskSource *source, const char *path);
+
+#endif
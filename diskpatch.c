@@ -0,0 +1,333 @@
+/*
+
+Disk counter source for AmigaOS. There is no system-wide I/O accounting,
+so the BeginIO method of each named device is patched to count read and
+write requests and their lengths before passing them on.
+
+The patch only does atomic additions, it never blocks or allocates.
+
+BeginIO doesn't point at our code directly but at a small stub in memory
+of its own. The stub passes the device entry on and jumps to whatever
+its target word holds. Removing the patch first points the target back
+at the original BeginIO, so a stub that can't be taken out of the chain
+can stay behind after we have quit.
+
+*/
+
+#include <proto/exec.h>
+#include <proto/dos.h>
+#include <exec/io.h>
+#include <devices/trackdisk.h>
+#include <devices/newstyle.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "diskio.h"
+
+typedef void APICALL (*BeginIOFunc)(struct DeviceManagerInterface *, struct IORequest *);
+
+// Words of the stub, the last one is the jump target
+#define STUB_WORDS 7
+#define STUB_TARGET 6
+
+// Tries one second apart, while someone else's patch is on top of ours
+#define REMOVE_TRIES 10
+
+// Ticks for a task that was preempted in the stub to get past it
+#define REMOVE_GRACE 5
+
+typedef struct {
+	struct Device *device;
+	struct DeviceManagerInterface *iface;
+	BeginIOFunc old_begin_io;
+	uint32 *stub;
+	BOOL restored; // BeginIO is the original again, the stub can go
+	char name[DISK_NAME_LEN];
+
+	// Updated by the patch from any task, 32-bit so that additions are atomic
+	volatile uint32 reads;
+	volatile uint32 writes;
+	volatile uint32 read_bytes;
+	volatile uint32 write_bytes;
+
+	// Widened copies, updated by the poller only
+	uint32 last[4];
+	uint64 total[4];
+} PatchedDevice;
+
+// Entries stay in place until the patch calls have drained
+static PatchedDevice patched[DISK_MAX_DEVICES];
+static int patched_count;
+
+// Patch calls in progress, the code must not be unloaded while non-zero
+static volatile uint32 users;
+
+// Set once removal starts, calls that still get here only pass through
+static volatile BOOL removing;
+
+static BOOL is_read(UWORD command)
+{
+	return command == CMD_READ || command == TD_READ64 ||
+		command == NSCMD_TD_READ64 || command == NSCMD_ETD_READ64;
+}
+
+static BOOL is_write(UWORD command)
+{
+	return command == CMD_WRITE || command == TD_WRITE64 ||
+		command == NSCMD_TD_WRITE64 || command == NSCMD_ETD_WRITE64;
+}
+
+// Called through the stub, which passes the entry as the third argument
+static void APICALL counting_begin_io(struct DeviceManagerInterface *self, struct IORequest *io, PatchedDevice *device)
+{
+	__sync_fetch_and_add(&users, 1);
+
+	if (!removing) {
+		const ULONG length = ((struct IOStdReq *)io)->io_Length;
+
+		if (is_read(io->io_Command)) {
+			__sync_fetch_and_add(&device->reads, 1);
+			__sync_fetch_and_add(&device->read_bytes, length);
+		} else if (is_write(io->io_Command)) {
+			__sync_fetch_and_add(&device->writes, 1);
+			__sync_fetch_and_add(&device->write_bytes, length);
+		}
+	}
+
+	// Always passed on, whatever state the patch is in
+	device->old_begin_io(self, io);
+
+	__sync_fetch_and_sub(&users, 1);
+}
+
+#define HA(x) ((((x) + 0x8000) >> 16) & 0xFFFF)
+#define LO(x) ((x) & 0xFFFF)
+
+static void set_stub_target(uint32 *stub, APTR target)
+{
+	stub[STUB_TARGET] = (uint32)target;
+	CacheClearE(&stub[STUB_TARGET], sizeof(uint32), CACRF_ClearD);
+}
+
+/*
+
+	lis   r5, device@ha
+	addi  r5, r5, device@l
+	lis   r12, target@ha
+	lwz   r12, target@l(r12)
+	mtctr r12
+	bctr
+
+r3 and r4 are left as BeginIO got them and the link register still points
+back to the caller.
+
+*/
+static uint32 *make_stub(PatchedDevice *device)
+{
+	uint32 *stub = AllocVecTags(STUB_WORDS * sizeof(uint32),
+		AVT_Type, MEMF_EXECUTABLE,
+		TAG_DONE);
+
+	if (!stub) {
+		return NULL;
+	}
+
+	const uint32 entry = (uint32)device;
+	const uint32 target = (uint32)&stub[STUB_TARGET];
+
+	stub[0] = 0x3CA00000 | HA(entry);
+	stub[1] = 0x38A50000 | LO(entry);
+	stub[2] = 0x3D800000 | HA(target);
+	stub[3] = 0x818C0000 | LO(target);
+	stub[4] = 0x7D8903A6;
+	stub[5] = 0x4E800420;
+	stub[STUB_TARGET] = (uint32)counting_begin_io;
+
+	CacheClearE(stub, STUB_WORDS * sizeof(uint32), CACRF_ClearI | CACRF_ClearD);
+
+	return stub;
+}
+
+static BOOL patch_device(const char *name)
+{
+	PatchedDevice *device = &patched[patched_count];
+
+	Forbid();
+	device->device = (struct Device *)FindName(&SysBase->DeviceList, name);
+	Permit();
+
+	if (!device->device) {
+		printf("Device '%s' not found\n", name);
+		return FALSE;
+	}
+
+	device->iface = (struct DeviceManagerInterface *)GetInterface((struct Library *)device->device, "__device", 1, NULL);
+
+	if (!device->iface) {
+		printf("Couldn't get interface of '%s'\n", name);
+		return FALSE;
+	}
+
+	device->stub = make_stub(device);
+
+	if (!device->stub) {
+		printf("Couldn't allocate BeginIO stub for '%s'\n", name);
+		DropInterface((struct Interface *)device->iface);
+		return FALSE;
+	}
+
+	snprintf(device->name, sizeof(device->name), "%s", name);
+	device->restored = FALSE;
+
+	// Nothing can call the stub before the old method is stored
+	Forbid();
+	device->old_begin_io = (BeginIOFunc)SetMethod((struct Interface *)device->iface,
+		offsetof(struct DeviceManagerInterface, BeginIO), (APTR)device->stub);
+	Permit();
+
+	patched_count++;
+
+	return TRUE;
+}
+
+// Comma separated device names, for example "a1ide.device,sii3114ide.device"
+BOOL disk_patch_install(const char *names)
+{
+	char name[DISK_NAME_LEN];
+	const char *start = names;
+
+	while (*start && patched_count < DISK_MAX_DEVICES) {
+		const char *end = strchr(start, ',');
+		const size_t length = end ? (size_t)(end - start) : strlen(start);
+
+		snprintf(name, sizeof(name), "%.*s", (int)length, start);
+
+		if (name[0]) {
+			patch_device(name);
+		}
+
+		start += length;
+
+		if (*start == ',') {
+			start++;
+		}
+	}
+
+	return patched_count > 0;
+}
+
+/*
+
+Someone else may have patched the same method after us, their patch then
+calls our stub. In that case we wait a while for them to go first, and if
+they don't, the stub is left in memory forwarding to the original BeginIO.
+
+*/
+static void unpatch_device(PatchedDevice *device)
+{
+	int tries;
+
+	for (tries = 0; ; tries++) {
+		Forbid();
+
+		const APTR current = SetMethod((struct Interface *)device->iface,
+			offsetof(struct DeviceManagerInterface, BeginIO), (APTR)device->old_begin_io);
+
+		if (current == (APTR)device->stub) {
+			Permit();
+			device->restored = TRUE;
+			break;
+		}
+
+		SetMethod((struct Interface *)device->iface,
+			offsetof(struct DeviceManagerInterface, BeginIO), current);
+		Permit();
+
+		if (tries == REMOVE_TRIES) {
+			printf("BeginIO of '%s' is still patched by someone else, leaving a forwarding stub in memory\n", device->name);
+			break;
+		}
+
+		if (!tries) {
+			printf("BeginIO of '%s' was patched by someone else, waiting\n", device->name);
+		}
+
+		Delay(50);
+	}
+
+	// New calls through the stub don't reach our code any more
+	set_stub_target(device->stub, (APTR)device->old_begin_io);
+}
+
+void disk_patch_remove(void)
+{
+	int i;
+
+	if (!patched_count) {
+		return;
+	}
+
+	removing = TRUE;
+
+	for (i = patched_count - 1; i >= 0; i--) {
+		unpatch_device(&patched[i]);
+	}
+
+	// A task may have been preempted after entering the stub but before
+	// counting itself in, the grace period lets it run past that point
+	do {
+		while (users) {
+			Delay(1);
+		}
+
+		Delay(REMOVE_GRACE);
+	} while (users);
+
+	for (i = 0; i < patched_count; i++) {
+		PatchedDevice *device = &patched[i];
+
+		if (device->restored) {
+			FreeVec(device->stub);
+		}
+
+		device->stub = NULL;
+		DropInterface((struct Interface *)device->iface);
+	}
+
+	patched_count = 0;
+}
+
+static uint64 widen(PatchedDevice *device, int index, uint32 now)
+{
+	device->total[index] += (uint32)(now - device->last[index]);
+	device->last[index] = now;
+
+	return device->total[index];
+}
+
+static int poll_patched(DiskSource *source, DiskCounters *counters, int max)
+{
+	int i;
+
+	(void)source;
+
+	for (i = 0; i < patched_count && i < max; i++) {
+		PatchedDevice *device = &patched[i];
+		DiskCounters *c = &counters[i];
+
+		strcpy(c->name, device->name);
+		c->reads = widen(device, 0, device->reads);
+		c->writes = widen(device, 1, device->writes);
+		c->read_bytes = widen(device, 2, device->read_bytes);
+		c->write_bytes = widen(device, 3, device->write_bytes);
+	}
+
+	return i;
+}
+
+void disk_patch_source(DiskSource *source)
+{
+	source->poll = poll_patched;
+	source->data = NULL;
+}
@@ -0,0 +1,168 @@
+#include "export.h"
+#include "format.h"
+
+#include <strings.h>
+
+void export_init(Exporter *e, EExportFormat format, const char *const *names, int columns,
+	ExportWrite write, void *handle)
+{
+	e->format = format;
+	e->names = names;
+	e->columns = columns;
+	e->write = write;
+	e->handle = handle;
+	e->failed = 0;
+	e->used = 0;
+	e->written = 0;
+}
+
+static void write_block(Exporter *e)
+{
+	if (e->used) {
+		if (!e->failed && !e->write(e->handle, e->buffer, e->used)) {
+			e->failed = 1;
+		}
+
+		e->written += e->used;
+		e->used = 0;
+	}
+}
+
+// Starts a line in the free end of the block, flushing it first when full
+static void begin_line(Exporter *e, Formatter *f)
+{
+	if (EXPORT_BLOCK_SIZE - e->used < EXPORT_LINE_MAX) {
+		write_block(e);
+	}
+
+	fmt_init(f, e->buffer + e->used, EXPORT_BLOCK_SIZE - e->used);
+}
+
+static void end_line(Exporter *e, Formatter *f)
+{
+	fmt_char(f, '\n');
+	e->used += fmt_length(f, e->buffer + e->used);
+}
+
+void export_header(Exporter *e)
+{
+	Formatter f;
+	int i;
+
+	if (e->format != EXPORT_CSV) {
+		return;
+	}
+
+	begin_line(e, &f);
+	fmt_str(&f, "time");
+
+	for (i = 0; i < e->columns; i++) {
+		fmt_char(&f, ',');
+		fmt_str(&f, e->names[i]);
+	}
+
+	fmt_str(&f, ",download,upload");
+	end_line(e, &f);
+}
+
+static void put_time(Formatter *f, const ExportRow *row)
+{
+	fmt_uint(f, row->seconds, 0);
+	fmt_char(f, '.');
+	fmt_zeros(f, row->micros, 6);
+}
+
+static void put_csv(Formatter *f, const Exporter *e, const ExportRow *row)
+{
+	int i;
+
+	put_time(f, row);
+
+	for (i = 0; i < e->columns; i++) {
+		fmt_char(f, ',');
+		fmt_uint(f, row->values[i], 0);
+	}
+
+	// Empty fields for unknown rates
+	fmt_char(f, ',');
+
+	if (row->rates) {
+		fmt_uint(f, row->download, 0);
+	}
+
+	fmt_char(f, ',');
+
+	if (row->rates) {
+		fmt_uint(f, row->upload, 0);
+	}
+}
+
+static void put_key(Formatter *f, const char *name)
+{
+	fmt_str(f, ",\"");
+	fmt_str(f, name);
+	fmt_str(f, "\":");
+}
+
+static void put_json(Formatter *f, const Exporter *e, const ExportRow *row)
+{
+	int i;
+
+	fmt_str(f, "{\"time\":");
+	put_time(f, row);
+
+	for (i = 0; i < e->columns; i++) {
+		put_key(f, e->names[i]);
+		fmt_uint(f, row->values[i], 0);
+	}
+
+	// Unknown rates are left out
+	if (row->rates) {
+		put_key(f, "download");
+		fmt_uint(f, row->download, 0);
+		put_key(f, "upload");
+		fmt_uint(f, row->upload, 0);
+	}
+
+	fmt_char(f, '}');
+}
+
+void export_row(Exporter *e, const ExportRow *row)
+{
+	Formatter f;
+
+	begin_line(e, &f);
+
+	if (e->format == EXPORT_JSON) {
+		put_json(&f, e, row);
+	} else {
+		put_csv(&f, e, row);
+	}
+
+	end_line(e, &f);
+}
+
+int export_flush(Exporter *e)
+{
+	write_block(e);
+
+	return !e->failed;
+}
+
+uint32_t export_size(const Exporter *e)
+{
+	return e->written + e->used;
+}
+
+int export_parse_format(const char *name, EExportFormat *format)
+{
+	if (!strcasecmp(name, "csv")) {
+		*format = EXPORT_CSV;
+	} else if (!strcasecmp(name, "json")) {
+		*format = EXPORT_JSON;
+	} else {
+		return 0;
+	}
+
+	return 1;
+}
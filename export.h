@@ -0,0 +1,65 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+/*
+
+Sample export as CSV or JSON lines. Rows are formatted straight into a
+block buffer and handed to the write callback one full block at a time,
+so a file gets a few large writes instead of one per sample, and nothing
+is allocated while exporting.
+
+*/
+
+#include <stdint.h>
+
+#define EXPORT_BLOCK_SIZE 4096
+
+// Enough for a timestamp, 16 metrics and the raw rates in JSON
+#define EXPORT_LINE_MAX 512
+
+typedef enum {
+	EXPORT_CSV,
+	EXPORT_JSON
+} EExportFormat;
+
+typedef struct {
+	uint32_t seconds; // Unix time
+	uint32_t micros;
+	const uint8_t *values;
+	int rates; // Raw network rates known, older history rows don't have them
+	uint32_t download; // Bytes per second
+	uint32_t upload;
+} ExportRow;
+
+// Returns 0 on failure
+typedef int (*ExportWrite)(void *handle, const char *data, uint32_t length);
+
+typedef struct {
+	EExportFormat format;
+	const char *const *names;
+	int columns;
+	ExportWrite write;
+	void *handle;
+	int failed;
+	uint32_t used;
+	uint32_t written; // Bytes passed to the write callback
+	char buffer[EXPORT_BLOCK_SIZE];
+} Exporter;
+
+void export_init(Exporter *e, EExportFormat format, const char *const *names, int columns,
+	ExportWrite write, void *handle);
+
+// Column names for CSV, JSON lines have none
+void export_header(Exporter *e);
+void export_row(Exporter *e, const ExportRow *row);
+
+// Writes the partial block, returns 0 if any write has failed
+int export_flush(Exporter *e);
+
+// Bytes exported so far, buffered ones included
+uint32_t export_size(const Exporter *e);
+
+// Parses "csv" or "json", returns 0 for unknown names
+int export_parse_format(const char *name, EExportFormat *format);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+
+Per-viewer sample queue of the sampling service, see feed.h. Doesn't
+depend on AmigaOS, the service passes the batches on as exec messages.
+
+*/
+
+#include "feed.h"
+
+#include <string.h>
+
+void feed_init(Feed *feed, void *pending, uint32_t metrics, uint32_t capacity)
+{
+	uint32_t i;
+
+	memset(feed, 0, sizeof(*feed));
+
+	feed->pending = pending;
+	feed->metrics = (metrics > FEED_MAX_METRICS) ? FEED_MAX_METRICS : metrics;
+	feed->capacity = capacity;
+
+	for (i = 0; i < FEED_MAX_METRICS; i++) {
+		feed->multiplier[i] = 1.0f;
+	}
+}
+
+static uint8_t *row(Feed *feed, uint32_t sequence)
+{
+	return feed->pending + (sequence % feed->capacity) * feed->metrics;
+}
+
+int feed_push(Feed *feed, uint32_t sequence, const uint8_t *values)
+{
+	if (feed->detached) {
+		return 0;
+	}
+
+	memcpy(row(feed, sequence), values, feed->metrics);
+
+	if (feed->count == 0) {
+		feed->first = sequence;
+	}
+
+	if (feed->count == feed->capacity) {
+		// Stalled viewer, the oldest queued sample is lost
+		feed->first++;
+		feed->lost++;
+	} else {
+		feed->count++;
+	}
+
+	return !feed->in_flight;
+}
+
+void feed_rescale(Feed *feed, int metric, float multiplier)
+{
+	uint32_t i;
+
+	for (i = 0; i < feed->count; i++) {
+		row(feed, feed->first + i)[metric] *= multiplier;
+	}
+
+	feed->multiplier[metric] *= multiplier;
+}
+
+uint32_t feed_take(Feed *feed, uint32_t *first, uint8_t *rows, float *multiplier)
+{
+	const uint32_t count = feed->count;
+	uint32_t i;
+
+	*first = feed->first;
+
+	for (i = 0; i < count; i++) {
+		memcpy(rows + i * feed->metrics, row(feed, feed->first + i), feed->metrics);
+	}
+
+	for (i = 0; i < feed->metrics; i++) {
+		multiplier[i] = feed->multiplier[i];
+		feed->multiplier[i] = 1.0f;
+	}
+
+	feed->count = 0;
+	feed->in_flight = 1;
+
+	return count;
+}
+
+int feed_returned(Feed *feed)
+{
+	feed->in_flight = 0;
+
+	return !feed->detached && feed->count;
+}
+
+int feed_detach(Feed *feed)
+{
+	feed->detached = 1;
+
+	return !feed->in_flight;
+}
@@ -0,0 +1,57 @@
+#ifndef FEED_H
+#define FEED_H
+
+/*
+
+Service side of one viewer attached to the sampling service. Samples queue
+here, in sequence order, while the viewer's batch message is out and go
+with the next batch when it comes back. Rescales are applied to the queued
+samples in place and collected for the samples the viewer already has.
+
+The caller does the messaging. It sends a batch whenever a call below
+returns nonzero and reports the batch coming back. A viewer that holds its
+batch for longer than the feed has room for loses the oldest samples, which
+shows up as a gap in the sequence numbers of its next batch.
+
+*/
+
+#include <stdint.h>
+
+#define FEED_MAX_METRICS 16
+
+typedef struct {
+	uint8_t *pending; // capacity * metrics values, caller provided
+	uint32_t metrics;
+	uint32_t capacity;
+
+	// Samples waiting for the next batch, indexed by sequence number
+	uint32_t first;
+	uint32_t count;
+	uint32_t lost;
+
+	float multiplier[FEED_MAX_METRICS];
+
+	int in_flight;
+	int detached; // Freed when the batch comes back
+} Feed;
+
+void feed_init(Feed *feed, void *pending, uint32_t metrics, uint32_t capacity);
+
+// Queues a sample, returns nonzero when a batch should be sent now
+int feed_push(Feed *feed, uint32_t sequence, const uint8_t *values);
+
+void feed_rescale(Feed *feed, int metric, float multiplier);
+
+// Moves the queued samples into 'rows', oldest first, and marks the batch
+// as out. Returns how many there were, 'first' gets the sequence number of
+// the first one and 'multiplier' the rescales collected since the last batch.
+uint32_t feed_take(Feed *feed, uint32_t *first, uint8_t *rows, float *multiplier);
+
+// The batch came back, returns nonzero when samples are waiting for it
+int feed_returned(Feed *feed);
+
+// Returns nonzero when the feed can be freed now, otherwise it's freed
+// when the batch comes back
+int feed_detach(Feed *feed);
+
+#endif
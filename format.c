@@ -0,0 +1,130 @@
+/*
+
+Integer formatting without the stdio machinery. Used by the title builder,
+which runs every second, so it mustn't allocate or parse format strings.
+
+*/
+
+#include "format.h"
+
+void fmt_init(Formatter *f, char *buffer, size_t size)
+{
+	f->pos = buffer;
+	f->end = buffer + size - 1;
+	*f->pos = '\0';
+}
+
+size_t fmt_length(const Formatter *f, const char *buffer)
+{
+	return f->pos - buffer;
+}
+
+void fmt_char(Formatter *f, char c)
+{
+	if (f->pos < f->end) {
+		*f->pos++ = c;
+		*f->pos = '\0';
+	}
+}
+
+void fmt_str(Formatter *f, const char *str)
+{
+	while (*str && f->pos < f->end) {
+		*f->pos++ = *str++;
+	}
+
+	*f->pos = '\0';
+}
+
+static void put_digits(Formatter *f, const char *digits, int count, int width, int negative)
+{
+	int pad = width - count - negative;
+
+	while (pad-- > 0) {
+		fmt_char(f, ' ');
+	}
+
+	if (negative) {
+		fmt_char(f, '-');
+	}
+
+	// Digits are stored in reverse order
+	while (count-- > 0) {
+		fmt_char(f, digits[count]);
+	}
+}
+
+static int to_digits(char *digits, unsigned long value, int min_count)
+{
+	int count = 0;
+
+	do {
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value || count < min_count);
+
+	return count;
+}
+
+void fmt_uint(Formatter *f, unsigned long value, int width)
+{
+	char digits[24];
+
+	put_digits(f, digits, to_digits(digits, value, 1), width, 0);
+}
+
+// 64-bit division is slow on 32-bit CPUs, so this is kept apart from fmt_uint
+void fmt_uint64(Formatter *f, uint64_t value, int width)
+{
+	char digits[24];
+	int count = 0;
+
+	do {
+		digits[count++] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+
+	put_digits(f, digits, count, width, 0);
+}
+
+void fmt_int(Formatter *f, long value, int width)
+{
+	char digits[24];
+	const int negative = value < 0;
+	const unsigned long magnitude = negative ? 0UL - (unsigned long)value : (unsigned long)value;
+
+	put_digits(f, digits, to_digits(digits, magnitude, 1), width, negative);
+}
+
+void fmt_zeros(Formatter *f, unsigned long value, int digits)
+{
+	char buffer[24];
+
+	put_digits(f, buffer, to_digits(buffer, value, digits), 0, 0);
+}
+
+void fmt_fixed(Formatter *f, unsigned long value, int decimals, int width)
+{
+	char digits[24];
+
+	if (decimals <= 0) {
+		fmt_uint(f, value, width);
+		return;
+	}
+
+	const int count = to_digits(digits, value, decimals + 1);
+	int pad = width - count - 1;
+
+	while (pad-- > 0) {
+		fmt_char(f, ' ');
+	}
+
+	int i;
+	for (i = count - 1; i >= 0; i--) {
+		fmt_char(f, digits[i]);
+
+		if (i == decimals) {
+			fmt_char(f, '.');
+		}
+	}
+}
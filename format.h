@@ -0,0 +1,37 @@
+#ifndef FORMAT_H
+#define FORMAT_H
+
+/*
+
+Small allocation-free text formatter for the hot paths (titles, exports).
+Output is truncated at the end of the buffer like snprintf, and the buffer
+is always NUL-terminated.
+
+*/
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct {
+	char *pos;
+	char *end; // Last usable byte is reserved for the terminator
+} Formatter;
+
+void fmt_init(Formatter *f, char *buffer, size_t size);
+size_t fmt_length(const Formatter *f, const char *buffer);
+
+void fmt_char(Formatter *f, char c);
+void fmt_str(Formatter *f, const char *str);
+
+// Right-aligned to at least 'width' characters, padded with spaces
+void fmt_uint(Formatter *f, unsigned long value, int width);
+void fmt_int(Formatter *f, long value, int width);
+void fmt_uint64(Formatter *f, uint64_t value, int width);
+
+// Padded with leading zeros to 'digits' characters, for fractions
+void fmt_zeros(Formatter *f, unsigned long value, int digits);
+
+// Prints value / 10^decimals with a fixed number of decimals
+void fmt_fixed(Formatter *f, unsigned long value, int decimals, int width);
+
+#endif
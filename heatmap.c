@@ -0,0 +1,128 @@
+#include "heatmap.h"
+
+#include <string.h>
+
+void heat_clear(HeatColumn *c)
+{
+	memset(c, 0, sizeof(*c));
+}
+
+void heat_add(HeatColumn *c, int level, uint32_t count)
+{
+	uint16_t *slot = &c->counts[level < 0 ? 0 : (level > 100 ? 100 : level)];
+
+	*slot = (*slot + count > UINT16_MAX) ? UINT16_MAX : *slot + count;
+
+	if (*slot > c->max) {
+		c->max = *slot;
+	}
+
+	c->total += count;
+}
+
+void heat_slicer_init(HeatSlicer *s, uint32_t slice_us)
+{
+	memset(s, 0, sizeof(*s));
+	s->slice = slice_us;
+}
+
+static uint64_t overlap(uint64_t start, uint64_t end, uint64_t from, uint64_t to)
+{
+	const uint64_t a = start > from ? start : from;
+	const uint64_t b = end < to ? end : to;
+
+	return b > a ? b - a : 0;
+}
+
+/*
+
+Only a call made after the open slice has ended does any work. Any earlier
+idle time since the previous such call therefore fell into the open slice,
+except the current run, which is split by overlap. The slices in between
+saw no idle time at all, however many there are.
+
+*/
+void heat_slice(HeatSlicer *s, uint64_t now, uint64_t idle, uint64_t run_start, HeatColumn *column)
+{
+	const uint64_t observed = idle + (now > run_start ? now - run_start : 0);
+
+	if (!s->started || now < s->checked) {
+		s->open = now;
+		s->checked = now;
+		s->idle_checked = observed;
+		s->idle_open = 0;
+		s->started = 1;
+		return;
+	}
+
+	if (now < s->open + s->slice) {
+		return;
+	}
+
+	const uint64_t current_from = run_start > s->checked ? run_start : s->checked;
+	const uint64_t current = now - current_from;
+	const uint64_t total = observed - s->idle_checked;
+	const uint64_t before = s->idle_open + (total > current ? total - current : 0);
+	uint64_t start = s->open;
+
+	while (start + s->slice <= now) {
+		const uint64_t end = start + s->slice;
+
+		// Fully busy, added at once as the sampler calls in Forbid
+		if (start != s->open && end <= current_from) {
+			const uint64_t busy = ((current_from < now ? current_from : now) - start) / s->slice;
+
+			heat_add(column, 100, busy < UINT16_MAX ? busy : UINT16_MAX);
+			start += busy * s->slice;
+			continue;
+		}
+
+		uint64_t idle_in = overlap(start, end, current_from, now);
+
+		if (start == s->open) {
+			idle_in += before;
+		}
+
+		if (idle_in > s->slice) {
+			idle_in = s->slice;
+		}
+
+		heat_add(column, 100 - (int)(((uint32_t)idle_in * 100 + s->slice / 2) / s->slice), 1);
+		start = end;
+	}
+
+	s->open = start;
+	s->idle_open = overlap(start, now, current_from, now);
+	s->checked = now;
+	s->idle_checked = observed;
+}
+
+uint32_t heat_color(const HeatColumn *c, int first, int last, uint32_t color, uint32_t background)
+{
+	uint32_t count = 0;
+	int level;
+
+	for (level = first; level <= last; level++) {
+		if (c->counts[level] > count) {
+			count = c->counts[level];
+		}
+	}
+
+	if (!count) {
+		return background;
+	}
+
+	// Faint bands stay visible
+	const uint32_t weight = 64 + 191 * count / c->max;
+	uint32_t result = 0xFF000000;
+	int shift;
+
+	for (shift = 0; shift < 24; shift += 8) {
+		const uint32_t from = (background >> shift) & 0xFF;
+		const uint32_t to = (color >> shift) & 0xFF;
+
+		result |= ((from * (255 - weight) + to * weight) / 255) << shift;
+	}
+
+	return result;
+}
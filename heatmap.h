@@ -0,0 +1,62 @@
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+/*
+
+CPU load heatmap. Every column is a histogram of the load levels 0...100
+seen during one sample, so a column can summarise thousands of sub-second
+samples where a line graph would only show their average.
+
+The slicer turns the run time of the idle task into those sub-samples. It
+is called by the idle task itself while it runs, so it needs no wake-ups
+of its own: every slice that closed since the previous call is added at
+once, with the idle time split between the slices it belongs to. Under
+full load the idle task doesn't run at all, so the sampler closes the
+slices too before it takes the column, and they come out fully busy.
+
+*/
+
+#include <stdint.h>
+
+#define HEAT_LEVELS 101
+
+typedef struct {
+	uint16_t counts[HEAT_LEVELS]; // Saturate instead of wrapping
+	uint16_t max; // Largest count, the full colour
+	uint32_t total;
+} HeatColumn;
+
+typedef struct {
+	uint32_t slice; // Microseconds
+	uint64_t open; // Start of the slice being filled
+	uint64_t checked; // Last call that closed slices
+	uint64_t idle_checked; // Idle time seen by then
+	uint64_t idle_open; // Idle time of the open slice before 'checked'
+	int started;
+} HeatSlicer;
+
+void heat_clear(HeatColumn *c);
+void heat_add(HeatColumn *c, int level, uint32_t count);
+
+void heat_slicer_init(HeatSlicer *s, uint32_t slice_us);
+
+/*
+
+'idle' is the run time of the idle task in its completed runs and
+'run_start' the start of the current one, all in microseconds. A caller
+other than the idle task passes 'now' as 'run_start'. Closed slices are
+added to 'column'.
+
+*/
+void heat_slice(HeatSlicer *s, uint64_t now, uint64_t idle, uint64_t run_start, HeatColumn *column);
+
+/*
+
+ARGB between the background and 'color' by the share of the column maximum.
+Levels first...last share a pixel row in a low window, the largest count of
+them is shown.
+
+*/
+uint32_t heat_color(const HeatColumn *c, int first, int last, uint32_t color, uint32_t background);
+
+#endif
@@ -0,0 +1,303 @@
+#include "history.h"
+#include "varint.h"
+
+#include <string.h>
+
+// Longest run a 3-byte token can hold
+#define MAX_RUN ((1 << 20) - 1)
+
+#define RUN_TOKEN_MAX 3
+
+// Change mask and a delta of at most two bytes per metric
+#define VARINT_BYTES(value) ((value) < 0x80 ? 1 : 2)
+#define ROW_MAX (VARINT_BYTES(1 << HISTORY_METRICS) + 2 * HISTORY_METRICS)
+
+void history_init(History *history, HistoryBlock *blocks, int capacity)
+{
+	memset(history, 0, sizeof(*history));
+
+	history->blocks = blocks;
+	history->capacity = capacity;
+}
+
+static void start_block(History *history, const uint8_t *values, uint64_t time, const float *scale)
+{
+	if (history->used) {
+		history->head = (history->head + 1) % history->capacity;
+	}
+
+	if (history->used < history->capacity) {
+		history->used++;
+	} else {
+		// Dropping the oldest block
+		const int tail = (history->head + 1) % history->capacity;
+		history->oldest = history->blocks[tail].first;
+	}
+
+	HistoryBlock *block = &history->blocks[history->head];
+
+	block->first = history->next;
+	block->count = 1;
+	block->length = 0;
+	block->start_time = block->end_time = time;
+	memcpy(block->scale, scale, sizeof(block->scale));
+	memcpy(block->start, values, HISTORY_METRICS);
+	memcpy(history->last, values, HISTORY_METRICS);
+}
+
+static void flush_run(History *history)
+{
+	if (history->run) {
+		HistoryBlock *block = &history->blocks[history->head];
+		block->length += varint_put(block->data + block->length, (uint64_t)history->run << 1 | 1);
+		history->run = 0;
+	}
+}
+
+/*
+
+Every write leaves room for one more run token, so the pending run can
+always be flushed when the block is closed.
+
+*/
+static int has_room(const History *history, int bytes)
+{
+	const HistoryBlock *block = &history->blocks[history->head];
+	const int run = history->run ? RUN_TOKEN_MAX : 0;
+
+	return block->length + run + bytes + RUN_TOKEN_MAX <= HISTORY_DATA_SIZE
+		&& block->count < UINT16_MAX;
+}
+
+static void close_block(History *history, const uint8_t *values, uint64_t time, const float *scale)
+{
+	flush_run(history);
+	start_block(history, values, time, scale);
+}
+
+// The sample keeps the scale and the spacing of the block
+static int fits_block(const HistoryBlock *block, uint64_t time, const float *scale)
+{
+	if (memcmp(block->scale, scale, sizeof(block->scale)) != 0 || time < block->end_time) {
+		return 0;
+	}
+
+	if (block->count < 2) {
+		return 1;
+	}
+
+	const uint64_t spacing = (block->end_time - block->start_time) / (block->count - 1);
+	const uint64_t step = time - block->end_time;
+
+	return step >= spacing / 2 && step <= spacing + spacing / 2;
+}
+
+void history_add(History *history, const uint8_t *values, uint64_t time, const float *scale)
+{
+	if (!history->capacity) {
+		return;
+	}
+
+	if (!history->used) {
+		start_block(history, values, time, scale);
+		history->next++;
+		return;
+	}
+
+	HistoryBlock *block = &history->blocks[history->head];
+	unsigned mask = 0;
+	int i;
+
+	if (!fits_block(block, time, scale)) {
+		close_block(history, values, time, scale);
+		history->next++;
+		return;
+	}
+
+	for (i = 0; i < HISTORY_METRICS; i++) {
+		if (values[i] != history->last[i]) {
+			mask |= 1 << i;
+		}
+	}
+
+	if (!mask) {
+		if (history->run == MAX_RUN || !has_room(history, 0)) {
+			close_block(history, values, time, scale);
+		} else {
+			history->run++;
+			block->count++;
+			block->end_time = time;
+		}
+	} else if (!has_room(history, ROW_MAX)) {
+		close_block(history, values, time, scale);
+	} else {
+		flush_run(history);
+
+		unsigned char *out = block->data + block->length;
+
+		out += varint_put(out, mask << 1);
+
+		for (i = 0; i < HISTORY_METRICS; i++) {
+			if (mask & (1 << i)) {
+				out += varint_put(out, zigzag_encode((int)values[i] - history->last[i]));
+			}
+		}
+
+		block->length = out - block->data;
+		block->count++;
+		block->end_time = time;
+
+		memcpy(history->last, values, HISTORY_METRICS);
+	}
+
+	history->next++;
+}
+
+enum {
+	READ_START,
+	READ_DATA,
+	READ_PENDING, // The run not yet written to the block
+	READ_DONE
+};
+
+void history_read_block(HistoryReader *reader, const History *history, const HistoryBlock *block)
+{
+	reader->history = history;
+	reader->block = block;
+	reader->in = block->data;
+	reader->end = block->data + block->length;
+	reader->run = 0;
+	reader->state = block->count ? READ_START : READ_DONE;
+
+	memcpy(reader->row, block->start, HISTORY_METRICS);
+}
+
+int history_read(HistoryReader *reader, uint8_t *values)
+{
+	while (!reader->run) {
+		switch (reader->state) {
+			case READ_START:
+				reader->state = READ_DATA;
+				memcpy(values, reader->row, HISTORY_METRICS);
+				return 1;
+
+			case READ_DATA:
+				if (reader->in < reader->end) {
+					uint64_t token;
+					int n = varint_get(reader->in, reader->end - reader->in, &token);
+
+					if (n) {
+						reader->in += n;
+
+						if (token & 1) {
+							reader->run = token >> 1;
+							break;
+						}
+
+						const unsigned mask = token >> 1;
+						int i;
+
+						for (i = 0; i < HISTORY_METRICS; i++) {
+							if (mask & (1 << i)) {
+								uint64_t delta;
+
+								n = varint_get(reader->in, reader->end - reader->in, &delta);
+
+								if (!n) {
+									reader->state = READ_DONE;
+									return 0;
+								}
+
+								reader->in += n;
+								reader->row[i] += zigzag_decode(delta);
+							}
+						}
+
+						memcpy(values, reader->row, HISTORY_METRICS);
+						return 1;
+					}
+				}
+
+				reader->state = READ_PENDING;
+				break;
+
+			case READ_PENDING:
+				reader->state = READ_DONE;
+
+				if (reader->block == &reader->history->blocks[reader->history->head]) {
+					reader->run = reader->history->run;
+				}
+				break;
+
+			default:
+				return 0;
+		}
+	}
+
+	reader->run--;
+	memcpy(values, reader->row, HISTORY_METRICS);
+	return 1;
+}
+
+int history_decode(const History *history, const HistoryBlock *block, uint8_t *values, int max_rows)
+{
+	HistoryReader reader;
+	int rows = 0;
+
+	history_read_block(&reader, history, block);
+
+	while (rows < max_rows && history_read(&reader, values + rows * HISTORY_METRICS)) {
+		rows++;
+	}
+
+	return rows;
+}
+
+uint64_t history_time(const HistoryBlock *block, int row)
+{
+	if (block->count < 2) {
+		return block->start_time;
+	}
+
+	return block->start_time + (block->end_time - block->start_time) * row / (block->count - 1);
+}
+
+const HistoryBlock *history_block(const History *history, int index)
+{
+	const int tail = (history->head + history->capacity - history->used + 1) % history->capacity;
+
+	return &history->blocks[(tail + index) % history->capacity];
+}
+
+const HistoryBlock *history_find(const History *history, uint32_t sample)
+{
+	if (!history->used || sample < history->oldest || sample >= history->next) {
+		return NULL;
+	}
+
+	// Blocks are in sample order, binary search them
+	int low = 0;
+	int high = history->used - 1;
+
+	while (low < high) {
+		const int mid = (low + high + 1) / 2;
+
+		if (history_block(history, mid)->first <= sample) {
+			low = mid;
+		} else {
+			high = mid - 1;
+		}
+	}
+
+	return history_block(history, low);
+}
+
+uint32_t history_samples(const History *history)
+{
+	return history->next - history->oldest;
+}
+
+uint32_t history_bytes(const History *history)
+{
+	return history->used * sizeof(HistoryBlock);
+}
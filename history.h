@@ -0,0 +1,87 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+/*
+
+Compressed long-term sample history. Samples are appended into fixed-size
+blocks which can be decoded on their own: each block starts with the full
+sample, the rest are deltas. A row lists the changed metrics in a bit mask
+followed by their zigzag varint deltas, and runs of unchanged rows collapse
+into a single run length, which covers the flat stretches of a mostly idle
+machine.
+
+The blocks form a ring in caller supplied memory. When it is full the
+oldest block is dropped.
+
+Each block keeps the time of its first and last sample and the scale the
+values were taken at. A new block is started when the scale changes or the
+time between samples does, by more than half, so the samples in a block
+are evenly spaced and the time of each follows from its place.
+
+*/
+
+#include <stdint.h>
+
+#define HISTORY_METRICS 11
+#define HISTORY_BLOCK_SIZE 512
+#define HISTORY_DATA_SIZE (HISTORY_BLOCK_SIZE - 24 - 5 * HISTORY_METRICS)
+
+typedef struct {
+	uint32_t first; // Sequence number of the first sample
+	uint16_t count; // Samples in the block
+	uint16_t length; // Bytes used in data
+	uint64_t start_time; // Of the first and the last sample, in the caller's unit
+	uint64_t end_time;
+	float scale[HISTORY_METRICS];
+	uint8_t start[HISTORY_METRICS];
+	uint8_t data[HISTORY_DATA_SIZE];
+} HistoryBlock;
+
+typedef struct {
+	HistoryBlock *blocks;
+	int capacity;
+	int head; // Block being written
+	int used;
+
+	uint8_t last[HISTORY_METRICS];
+	uint32_t run; // Unchanged rows not yet written
+	uint32_t next; // Sequence number of the next sample
+	uint32_t oldest;
+} History;
+
+// Walks one block row by row, for callers that can't hold a decoded block
+typedef struct {
+	const History *history;
+	const HistoryBlock *block;
+	const unsigned char *in;
+	const unsigned char *end;
+	uint8_t row[HISTORY_METRICS];
+	uint32_t run; // Copies of row still to return
+	int state;
+} HistoryReader;
+
+void history_init(History *history, HistoryBlock *blocks, int capacity);
+void history_add(History *history, const uint8_t *values, uint64_t time, const float *scale);
+
+// Decodes one block into rows of HISTORY_METRICS values, returns the row count
+int history_decode(const History *history, const HistoryBlock *block, uint8_t *values, int max_rows);
+
+// Time of the given row of a block
+uint64_t history_time(const HistoryBlock *block, int row);
+
+// Returns the blocks oldest first, index from 0 to used - 1
+const HistoryBlock *history_block(const History *history, int index);
+
+void history_read_block(HistoryReader *reader, const History *history, const HistoryBlock *block);
+
+// Copies the next row to values, returns 0 at the end of the block
+int history_read(HistoryReader *reader, uint8_t *values);
+
+// Finds the block holding the given sample, NULL if it has been dropped
+const HistoryBlock *history_find(const History *history, uint32_t sample);
+
+// Samples stored and bytes of memory they take, for the compression ratio
+uint32_t history_samples(const History *history);
+uint32_t history_bytes(const History *history);
+
+#endif
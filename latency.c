@@ -0,0 +1,79 @@
+#include "latency.h"
+
+#include <math.h>
+#include <string.h>
+
+void latency_reset(LatencyHistogram *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+static int bucket_of(uint32_t value)
+{
+	if (value < LATENCY_SUB_BUCKETS) {
+		return value;
+	}
+
+	const int msb = 31 - __builtin_clz(value);
+	const int shift = msb - LATENCY_SUB_BITS;
+
+	// The top bit is implied, the next LATENCY_SUB_BITS select the sub-bucket
+	return (shift + 1) * LATENCY_SUB_BUCKETS + ((value >> shift) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+static uint32_t bucket_limit(int bucket)
+{
+	if (bucket < LATENCY_SUB_BUCKETS) {
+		return bucket;
+	}
+
+	const int shift = bucket / LATENCY_SUB_BUCKETS - 1;
+	const uint64_t base = (uint64_t)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << shift;
+	const uint64_t limit = base + ((uint64_t)1 << shift) - 1;
+
+	return limit > UINT32_MAX ? UINT32_MAX : (uint32_t)limit;
+}
+
+void latency_add(LatencyHistogram *h, uint32_t value)
+{
+	h->buckets[bucket_of(value)]++;
+	h->count++;
+
+	if (value > h->max) {
+		h->max = value;
+	}
+}
+
+uint32_t latency_percentile(const LatencyHistogram *h, unsigned percent)
+{
+	// Rank of the sample, rounded up
+	const uint32_t rank = ((uint64_t)h->count * percent + 99) / 100;
+	uint32_t seen = 0;
+	int i;
+
+	if (!h->count) {
+		return 0;
+	}
+
+	for (i = 0; i < LATENCY_BUCKETS; i++) {
+		seen += h->buckets[i];
+
+		if (seen >= rank && seen) {
+			const uint32_t limit = bucket_limit(i);
+			return limit < h->max ? limit : h->max;
+		}
+	}
+
+	return h->max;
+}
+
+uint8_t latency_level(uint32_t us)
+{
+	if (us <= 1) {
+		return 0;
+	}
+
+	const float level = 20.0f * log10f((float)us);
+
+	return level >= 100.0f ? 100 : (uint8_t)(level + 0.5f);
+}
@@ -0,0 +1,33 @@
+#ifndef LATENCY_H
+#define LATENCY_H
+
+/*
+
+Log-scale latency histogram with a fixed number of buckets. Every power of
+two is split into LATENCY_SUB_BUCKETS linear buckets, so the relative error
+of a percentile is at most 1 / LATENCY_SUB_BUCKETS whatever the magnitude.
+
+*/
+
+#include <stdint.h>
+
+#define LATENCY_SUB_BITS 2
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((32 - LATENCY_SUB_BITS + 1) * LATENCY_SUB_BUCKETS)
+
+typedef struct {
+	uint32_t buckets[LATENCY_BUCKETS];
+	uint32_t count;
+	uint32_t max;
+} LatencyHistogram;
+
+void latency_reset(LatencyHistogram *h);
+void latency_add(LatencyHistogram *h, uint32_t value);
+
+// Upper bound of the bucket holding the given percentile (0...100)
+uint32_t latency_percentile(const LatencyHistogram *h, unsigned percent);
+
+// Maps microseconds to 0...100 on a log scale, 20 steps per decade from 1 us
+uint8_t latency_level(uint32_t us);
+
+#endif
@@ -4,33 +4,22 @@ This code piece is heavily influenced by Olaf Barthel's "sample.c" example code.
 
 */
 
+#include <proto/exec.h>
 #include <proto/bsdsocket.h>
 #include <stdio.h>
 
-static ULONG quad_delta(const SBQUAD_T *a, const SBQUAD_T *b)
+static ULONG quad_delta(uint64 a, uint64 b)
 {
 	ULONG result = 0;
-	SBQUAD_T delta;
 
-	delta = (*a);
-
-	if (delta.sbq_Low < b->sbq_Low) {
-		if (delta.sbq_High == 0)
-			goto out;
-
-		delta.sbq_High--;
-
-		delta.sbq_Low = (~0UL) - b->sbq_Low + 1 + a->sbq_Low;
-	} else {
-		delta.sbq_Low -= b->sbq_Low;
-	}
-
-	if (delta.sbq_High < b->sbq_High)
+	// Counters may have been reset
+	if (a < b)
 		goto out;
 
-	/*delta.sbq_High -= b->sbq_High;*/
+	if (a - b > 0xFFFFFFFFULL)
+		goto out;
 
-	result = delta.sbq_Low;
+	result = a - b;
 
 out:
 
@@ -38,31 +27,87 @@ out:
 }
 
 typedef struct {
-	SBQUAD_T in;
-	SBQUAD_T out;
+	uint64 in;
+	uint64 out;
 } Sample;
 
 static Sample last_sample;
 
-static BOOL get_counters(SBQUAD_T *in, SBQUAD_T *out)
+/*
+
+A bsdsocket.library base belongs to the task that opened it and the
+counters are queried from the sampler task, so it opens a base of its own.
+
+*/
+static struct Library *counter_base;
+static struct SocketIFace *counter_iface;
+
+BOOL open_netcounters(void)
+{
+	counter_base = OpenLibrary("bsdsocket.library", 4);
+
+	if (counter_base) {
+		counter_iface = (struct SocketIFace *) GetInterface(counter_base, "main", 1, NULL);
+	}
+
+	return counter_iface != NULL;
+}
+
+void close_netcounters(void)
+{
+	if (counter_iface) {
+		DropInterface((struct Interface *) counter_iface);
+		counter_iface = NULL;
+	}
+
+	if (counter_base) {
+		CloseLibrary(counter_base);
+		counter_base = NULL;
+	}
+}
+
+static uint64 to_uint64(const SBQUAD_T *quad)
+{
+	return ((uint64)quad->sbq_High << 32) | quad->sbq_Low;
+}
+
+/*
+
+Raw byte counters are exposed so that they can be recorded into a trace
+and fed back to update_netstats on replay.
+
+*/
+BOOL get_netcounters(uint64 *in, uint64 *out)
 {
 	BOOL result = TRUE;
+	SBQUAD_T received, sent;
+
+	// The inline macro calls through whatever ISocket is in scope
+	struct SocketIFace *ISocket = counter_iface;
+
+	if (!ISocket) {
+		return FALSE;
+	}
 
 	if (SocketBaseTags(
-		SBTM_GETREF(SBTC_GET_BYTES_RECEIVED), in,
-		SBTM_GETREF(SBTC_GET_BYTES_SENT), out,
+		SBTM_GETREF(SBTC_GET_BYTES_RECEIVED), &received,
+		SBTM_GETREF(SBTC_GET_BYTES_SENT), &sent,
 		TAG_END)) {
 
 		printf("Could not query data throughput statistics.\n");
 		result = FALSE;
+	} else {
+		*in = to_uint64(&received);
+		*out = to_uint64(&sent);
 	}
 
 	return result;
 }
 
-void init_netstats(void)
+void init_netstats(uint64 in, uint64 out)
 {
-	get_counters(&last_sample.in, &last_sample.out);
+	last_sample.in = in;
+	last_sample.out = out;
 }
 
 /*
@@ -74,6 +119,7 @@ Recalculation should happen when a new peak in the transfers has happened.
 
 */
 BOOL update_netstats(
+	uint64 in, uint64 out,
 	UBYTE *download, UBYTE *upload,
 	float *dl_multiplier, float *ul_multiplier,
 	float *dl_speed, float *ul_speed)
@@ -81,26 +127,15 @@ BOOL update_netstats(
 	static ULONG max_sent;
 	static ULONG max_received;
 
-	Sample sample;
-
 	ULONG received, sent;
 
 	BOOL redraw = FALSE;
 
-	if (!get_counters(&sample.in, &sample.out)) {
-			
-		*upload = 0;
-		*download = 0;
-		*ul_speed = 0;
-		*dl_speed = 0;
-			
-		return FALSE;
-	}
-
-	received = quad_delta(&sample.in, &last_sample.in);
-	sent = quad_delta(&sample.out, &last_sample.out);
+	received = quad_delta(in, last_sample.in);
+	sent = quad_delta(out, last_sample.out);
 
-	last_sample = sample;
+	last_sample.in = in;
+	last_sample.out = out;
 
 	if (sent > max_sent) {
 		//printf("max_sent changes to %ld\n", sent);
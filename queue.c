@@ -0,0 +1,44 @@
+#include "queue.h"
+
+#include <string.h>
+
+void queue_init(Queue *queue, void *items, uint32_t item_size, uint32_t capacity)
+{
+	queue->items = items;
+	queue->item_size = item_size;
+	queue->mask = capacity - 1;
+	queue->head = 0;
+	queue->tail = 0;
+}
+
+int queue_push(Queue *queue, const void *item)
+{
+	const uint32_t head = queue->head;
+	const uint32_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+	if (head - tail > queue->mask) {
+		return 0;
+	}
+
+	memcpy(queue->items + (head & queue->mask) * queue->item_size, item, queue->item_size);
+
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
+
+int queue_pop(Queue *queue, void *item)
+{
+	const uint32_t tail = queue->tail;
+	const uint32_t head = __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE);
+
+	if (head == tail) {
+		return 0;
+	}
+
+	memcpy(item, queue->items + (tail & queue->mask) * queue->item_size, queue->item_size);
+
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+
+	return 1;
+}
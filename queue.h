@@ -0,0 +1,31 @@
+#ifndef QUEUE_H
+#define QUEUE_H
+
+/*
+
+Lock-free queue of fixed-size items for one producer and one consumer
+task. The indices run freely and wrap around at 2^32, the capacity must
+be a power of two. Each index is written by one side only; the release
+store that publishes it comes after the item copy, so the other side
+never sees a slot before its contents.
+
+*/
+
+#include <stdint.h>
+
+typedef struct {
+	uint8_t *items;
+	uint32_t item_size;
+	uint32_t mask; // Capacity - 1
+
+	uint32_t head; // Next slot to write, producer only
+	uint32_t tail; // Next slot to read, consumer only
+} Queue;
+
+void queue_init(Queue *queue, void *items, uint32_t item_size, uint32_t capacity);
+
+// Return 0 if the queue is full or empty
+int queue_push(Queue *queue, const void *item);
+int queue_pop(Queue *queue, void *item);
+
+#endif
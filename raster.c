@@ -0,0 +1,134 @@
+/*
+
+Software rasteriser used by the direct rendering mode. It writes into a plain
+32-bit pixel buffer and doesn't depend on any AmigaOS headers.
+
+Span fills use an unrolled loop, which compilers turn into wide stores on
+their own where the target has them.
+
+*/
+
+#include "raster.h"
+
+#define SWAP(a, b) do { const int t = (a); (a) = (b); (b) = t; } while (0)
+
+static void fill_span(uint32_t *dst, int count, const uint32_t color)
+{
+	while (count >= 4) {
+		dst[0] = color;
+		dst[1] = color;
+		dst[2] = color;
+		dst[3] = color;
+		dst += 4;
+		count -= 4;
+	}
+
+	while (count-- > 0) {
+		*dst++ = color;
+	}
+}
+
+void raster_fill(Raster *r, int x0, int y0, int x1, int y1, uint32_t color)
+{
+	if (x0 > x1) {
+		SWAP(x0, x1);
+	}
+
+	if (y0 > y1) {
+		SWAP(y0, y1);
+	}
+
+	if (x0 < 0) x0 = 0;
+	if (y0 < 0) y0 = 0;
+	if (x1 >= r->width) x1 = r->width - 1;
+	if (y1 >= r->height) y1 = r->height - 1;
+
+	if (x0 > x1 || y0 > y1) {
+		return;
+	}
+
+	uint32_t *row = r->pixels + y0 * r->stride + x0;
+	const int count = x1 - x0 + 1;
+
+	int y;
+	for (y = y0; y <= y1; y++) {
+		fill_span(row, count, color);
+		row += r->stride;
+	}
+}
+
+void raster_hline(Raster *r, int y, int x0, int x1, uint32_t color)
+{
+	raster_fill(r, x0, y, x1, y, color);
+}
+
+void raster_vline(Raster *r, int x, int y0, int y1, uint32_t color)
+{
+	if (y0 > y1) {
+		SWAP(y0, y1);
+	}
+
+	if (x < 0 || x >= r->width) {
+		return;
+	}
+
+	if (y0 < 0) y0 = 0;
+	if (y1 >= r->height) y1 = r->height - 1;
+
+	uint32_t *dst = r->pixels + y0 * r->stride + x;
+
+	int y;
+	for (y = y0; y <= y1; y++) {
+		*dst = color;
+		dst += r->stride;
+	}
+}
+
+/*
+
+Bresenham's line algorithm, integer arithmetic only. Axis-aligned lines are
+forwarded to the span routines. Pixels outside the buffer are skipped, which
+is cheap enough for the short segments of a graph.
+
+*/
+void raster_line(Raster *r, int x0, int y0, int x1, int y1, uint32_t color)
+{
+	if (y0 == y1) {
+		raster_hline(r, y0, x0, x1, color);
+		return;
+	}
+
+	if (x0 == x1) {
+		raster_vline(r, x0, y0, y1, color);
+		return;
+	}
+
+	const int dx = (x1 > x0) ? x1 - x0 : x0 - x1;
+	const int dy = (y1 > y0) ? y0 - y1 : y1 - y0; // Negative
+	const int sx = (x1 > x0) ? 1 : -1;
+	const int sy = (y1 > y0) ? 1 : -1;
+
+	int err = dx + dy;
+
+	for (;;) {
+		if (x0 >= 0 && x0 < r->width && y0 >= 0 && y0 < r->height) {
+			r->pixels[y0 * r->stride + x0] = color;
+		}
+
+		if (x0 == x1 && y0 == y1) {
+			break;
+		}
+
+		const int e2 = 2 * err;
+
+		if (e2 >= dy) {
+			err += dy;
+			x0 += sx;
+		}
+
+		if (e2 <= dx) {
+			err += dx;
+			y0 += sy;
+		}
+	}
+}
@@ -0,0 +1,27 @@
+#ifndef RASTER_H
+#define RASTER_H
+
+/*
+
+Platform-neutral software rasteriser for 32-bit ARGB pixel buffers.
+
+All coordinates are inclusive and clipped against the buffer, so callers
+can pass the same values they would give to graphics.library.
+
+*/
+
+#include <stdint.h>
+
+typedef struct {
+	uint32_t *pixels;
+	int width;
+	int height;
+	int stride; // In pixels, not bytes
+} Raster;
+
+void raster_fill(Raster *r, int x0, int y0, int x1, int y1, uint32_t color);
+void raster_hline(Raster *r, int y, int x0, int x1, uint32_t color);
+void raster_vline(Raster *r, int x, int y0, int y1, uint32_t color);
+void raster_line(Raster *r, int x0, int y0, int x1, int y1, uint32_t color);
+
+#endif
@@ -0,0 +1,311 @@
+#include <proto/exec.h>
+#include <proto/bsdsocket.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <netinet/in.h>
+#include <errno.h>
+
+#include <stdio.h>
+#include <string.h>
+
+#include "scrape.h"
+
+static void set_nonblocking(LONG socket)
+{
+	LONG on = 1;
+
+	IoctlSocket(socket, FIONBIO, (char *)&on);
+}
+
+BOOL scrape_open(Scraper *s, int port, ScrapeBody body, void *data)
+{
+	struct sockaddr_in addr;
+	LONG on = 1;
+	int i;
+
+	memset(s, 0, sizeof(*s));
+
+	s->body = body;
+	s->data = data;
+
+	for (i = 0; i < SCRAPE_MAX_CLIENTS; i++) {
+		s->clients[i].socket = -1;
+	}
+
+	// CTRL-C comes back in the signal mask instead of failing WaitSelect
+	SocketBaseTags(SBTM_SETVAL(SBTC_BREAKMASK), 0, TAG_END);
+
+	s->listener = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (s->listener < 0) {
+		puts("Couldn't create metrics socket");
+		return FALSE;
+	}
+
+	setsockopt(s->listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(s->listener, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(s->listener, 4) < 0) {
+		printf("Couldn't listen on metrics port %d\n", port);
+		CloseSocket(s->listener);
+		s->listener = -1;
+		return FALSE;
+	}
+
+	set_nonblocking(s->listener);
+
+	return TRUE;
+}
+
+static void drop_client(ScrapeClient *c)
+{
+	CloseSocket(c->socket);
+	c->socket = -1;
+}
+
+void scrape_close(Scraper *s)
+{
+	int i;
+
+	for (i = 0; i < SCRAPE_MAX_CLIENTS; i++) {
+		if (s->clients[i].socket != -1) {
+			drop_client(&s->clients[i]);
+		}
+	}
+
+	if (s->listener != -1) {
+		CloseSocket(s->listener);
+		s->listener = -1;
+	}
+}
+
+LONG scrape_fds(Scraper *s, fd_set *read, fd_set *write, LONG nfds)
+{
+	int i;
+
+	FD_SET(s->listener, read);
+
+	if (s->listener >= nfds) {
+		nfds = s->listener + 1;
+	}
+
+	for (i = 0; i < SCRAPE_MAX_CLIENTS; i++) {
+		const ScrapeClient *c = &s->clients[i];
+
+		if (c->socket == -1) {
+			continue;
+		}
+
+		FD_SET(c->socket, c->out ? write : read);
+
+		if (c->socket >= nfds) {
+			nfds = c->socket + 1;
+		}
+	}
+
+	return nfds;
+}
+
+// A free slot, or the one held longest by a client too slow to finish
+static ScrapeClient *free_slot(Scraper *s)
+{
+	ScrapeClient *oldest = &s->clients[0];
+	int i;
+
+	for (i = 0; i < SCRAPE_MAX_CLIENTS; i++) {
+		ScrapeClient *c = &s->clients[i];
+
+		if (c->socket == -1) {
+			return c;
+		}
+
+		if (c->accepted < oldest->accepted) {
+			oldest = c;
+		}
+	}
+
+	drop_client(oldest);
+	s->dropped++;
+
+	return oldest;
+}
+
+static void accept_clients(Scraper *s)
+{
+	LONG socket;
+
+	while ((socket = accept(s->listener, NULL, NULL)) >= 0) {
+		ScrapeClient *c = free_slot(s);
+
+		set_nonblocking(socket);
+
+		c->socket = socket;
+		c->accepted = s->accepts++;
+		c->received = 0;
+		c->out = NULL;
+	}
+}
+
+// Matches the path of a request line, ignoring any query
+static BOOL is_path(const char *target, const char *path)
+{
+	const size_t length = strlen(path);
+
+	return strncmp(target, path, length) == 0 && (target[length] == ' ' || target[length] == '?');
+}
+
+/*
+
+The body is built after the space reserved for the header, and the header
+goes right in front of it once the body length is known.
+
+*/
+static void respond(Scraper *s, ScrapeClient *c)
+{
+	char *body = c->response + SCRAPE_HEADER_SIZE;
+	const char *status = "200 OK";
+	Formatter f;
+
+	fmt_init(&f, body, SCRAPE_BODY_SIZE);
+
+	if (strncmp(c->request, "GET ", 4) != 0) {
+		status = "405 Method Not Allowed";
+	} else if (!is_path(c->request + 4, "/metrics") && !is_path(c->request + 4, "/")) {
+		status = "404 Not Found";
+	} else {
+		s->body(&f, s->data);
+
+		if (f.pos == f.end) {
+			status = "500 Internal Server Error";
+			fmt_init(&f, body, SCRAPE_BODY_SIZE);
+		} else {
+			s->scrapes++;
+		}
+	}
+
+	if (status[0] != '2') {
+		fmt_str(&f, status);
+		fmt_char(&f, '\n');
+	}
+
+	const size_t length = fmt_length(&f, body);
+	char header[SCRAPE_HEADER_SIZE];
+	Formatter h;
+
+	fmt_init(&h, header, sizeof(header));
+	fmt_str(&h, "HTTP/1.0 ");
+	fmt_str(&h, status);
+	fmt_str(&h, "\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: ");
+	fmt_uint(&h, length, 0);
+	fmt_str(&h, "\r\nConnection: close\r\n\r\n");
+
+	const size_t header_length = fmt_length(&h, header);
+
+	c->out = body - header_length;
+	c->left = header_length + length;
+
+	memcpy(c->out, header, header_length);
+}
+
+static void send_response(ScrapeClient *c)
+{
+	const LONG n = send(c->socket, c->out, c->left, 0);
+
+	if (n < 0) {
+		if (Errno() != EWOULDBLOCK) {
+			drop_client(c);
+		}
+		return;
+	}
+
+	c->out += n;
+	c->left -= n;
+
+	if (!c->left) {
+		drop_client(c);
+	}
+}
+
+static void read_request(Scraper *s, ScrapeClient *c)
+{
+	const LONG n = recv(c->socket, c->request + c->received, SCRAPE_REQUEST_SIZE - 1 - c->received, 0);
+
+	if (n == 0 || (n < 0 && Errno() != EWOULDBLOCK)) {
+		drop_client(c);
+		return;
+	}
+
+	if (n < 0) {
+		return;
+	}
+
+	c->received += n;
+	c->request[c->received] = '\0';
+
+	// Headers aren't needed, only their end. A request too long is answered as it is.
+	if (strstr(c->request, "\r\n\r\n") || strstr(c->request, "\n\n") || c->received == SCRAPE_REQUEST_SIZE - 1) {
+		respond(s, c);
+
+		// Usually the whole response fits the socket buffer right away
+		send_response(c);
+	}
+}
+
+void scrape_handle(Scraper *s, fd_set *read, fd_set *write)
+{
+	int i;
+
+	for (i = 0; i < SCRAPE_MAX_CLIENTS; i++) {
+		ScrapeClient *c = &s->clients[i];
+
+		if (c->socket == -1) {
+			continue;
+		}
+
+		if (c->out) {
+			if (FD_ISSET(c->socket, write)) {
+				send_response(c);
+			}
+		} else if (FD_ISSET(c->socket, read)) {
+			read_request(s, c);
+		}
+	}
+
+	if (FD_ISSET(s->listener, read)) {
+		accept_clients(s);
+	}
+}
+
+void scrape_metric(Formatter *f, const char *name, const char *type, const char *help)
+{
+	fmt_str(f, "# HELP ");
+	fmt_str(f, name);
+	fmt_char(f, ' ');
+	fmt_str(f, help);
+	fmt_str(f, "\n# TYPE ");
+	fmt_str(f, name);
+	fmt_char(f, ' ');
+	fmt_str(f, type);
+	fmt_char(f, '\n');
+}
+
+void scrape_value(Formatter *f, const char *name, const char *label, const char *label_value, uint64 value)
+{
+	fmt_str(f, name);
+
+	if (label) {
+		fmt_char(f, '{');
+		fmt_str(f, label);
+		fmt_str(f, "=\"");
+		fmt_str(f, label_value);
+		fmt_str(f, "\"}");
+	}
+
+	fmt_char(f, ' ');
+	fmt_uint64(f, value, 0);
+	fmt_char(f, '\n');
+}
@@ -0,0 +1,59 @@
+#ifndef SCRAPE_H
+#define SCRAPE_H
+
+/*
+
+Prometheus scrape endpoint over bsdsocket.library. A non-blocking listener
+on the loopback interface answers each GET with the text exposition format
+and closes the connection. The caller waits on the sockets with WaitSelect
+together with its own signals, so a slow client never holds up sampling.
+
+Responses are built in buffers allocated once with the endpoint.
+
+*/
+
+#include <exec/types.h>
+#include <sys/select.h>
+
+#include "format.h"
+
+#define SCRAPE_MAX_CLIENTS 4
+#define SCRAPE_REQUEST_SIZE 1024
+#define SCRAPE_HEADER_SIZE 128
+#define SCRAPE_BODY_SIZE 8192
+
+// Writes the metrics into the response body
+typedef void (*ScrapeBody)(Formatter *f, void *data);
+
+typedef struct {
+	LONG socket; // -1 when the slot is free
+	ULONG accepted; // Order of acceptance, the oldest is dropped when full
+	ULONG received;
+	char *out; // Response being sent, NULL while reading the request
+	ULONG left;
+	char request[SCRAPE_REQUEST_SIZE];
+	char response[SCRAPE_HEADER_SIZE + SCRAPE_BODY_SIZE];
+} ScrapeClient;
+
+typedef struct {
+	LONG listener;
+	ULONG accepts;
+	ULONG scrapes;
+	ULONG dropped; // Clients closed to make room for a new one
+	ScrapeBody body;
+	void *data;
+	ScrapeClient clients[SCRAPE_MAX_CLIENTS];
+} Scraper;
+
+BOOL scrape_open(Scraper *s, int port, ScrapeBody body, void *data);
+void scrape_close(Scraper *s);
+
+// Adds the sockets to wait on, returns nfds raised to cover them
+LONG scrape_fds(Scraper *s, fd_set *read, fd_set *write, LONG nfds);
+void scrape_handle(Scraper *s, fd_set *read, fd_set *write);
+
+// Exposition format helpers for the body callback. The label is optional.
+void scrape_metric(Formatter *f, const char *name, const char *type, const char *help);
+void scrape_value(Formatter *f, const char *name, const char *label, const char *label_value, uint64 value);
+
+#endif
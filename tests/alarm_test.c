@@ -0,0 +1,178 @@
+/*
+
+Tests of the alarm rule parser and evaluator. Synthetic traces are fed one
+sample per second and the ticks on which a rule fires ('F') or clears ('C')
+are compared against the expected pattern.
+
+*/
+
+#include "test.h"
+#include "../alarm.h"
+
+#include <string.h>
+
+static const char *const metrics[] = { "cpu", "mem", "net" };
+
+#define METRIC_COUNT 3
+#define MAX_TRACE 64
+
+// One character per tick for rule 'index', '.' when nothing happened
+static void run_trace(AlarmEngine *engine, int index, int metric, const int *trace, int length, char *events)
+{
+	unsigned char values[METRIC_COUNT] = { 0 };
+	int t;
+
+	for (t = 0; t < length; t++) {
+		unsigned fired, cleared;
+
+		values[metric] = trace[t];
+		alarm_evaluate(engine, values, t, &fired, &cleared);
+
+		CHECK(!(fired & cleared));
+		events[t] = (fired >> index & 1) ? 'F' : (cleared >> index & 1) ? 'C' : '.';
+	}
+
+	events[length] = '\0';
+}
+
+static void check_trace(const char *rule, const int *trace, int length, const char *expected)
+{
+	AlarmEngine engine;
+	char events[MAX_TRACE + 1];
+
+	alarm_init(&engine);
+
+	const int index = alarm_add(&engine, rule, metrics, METRIC_COUNT);
+
+	CHECK_EQ(index, 0);
+	run_trace(&engine, index, engine.rules[0].metric, trace, length, events);
+
+	if (strcmp(events, expected) != 0) {
+		printf("%s: expected %s, got %s\n", rule, expected, events);
+		test_failures++;
+	}
+}
+
+#define TRACE(rule, expected, ...) do { \
+	static const int trace[] = { __VA_ARGS__ }; \
+	CHECK_EQ(sizeof(trace) / sizeof(trace[0]), strlen(expected)); \
+	check_trace(rule, trace, sizeof(trace) / sizeof(trace[0]), expected); \
+} while (0)
+
+static void test_parse(void)
+{
+	AlarmEngine engine;
+	int i;
+
+	alarm_init(&engine);
+
+	CHECK_EQ(alarm_add(&engine, "cpu>90,30,5,flash+log", metrics, METRIC_COUNT), 0);
+
+	const AlarmRule *rule = &engine.rules[0];
+	CHECK_EQ(rule->metric, 0);
+	CHECK_EQ(rule->compare, ALARM_ABOVE);
+	CHECK_EQ(rule->threshold, 90);
+	CHECK_EQ(rule->duration, 30);
+	CHECK_EQ(rule->hysteresis, 5);
+	CHECK_EQ(rule->actions, ALARM_ACTION_FLASH | ALARM_ACTION_LOG);
+
+	CHECK_EQ(alarm_add(&engine, " net < 10 ", metrics, METRIC_COUNT), 1);
+	rule = &engine.rules[1];
+	CHECK_EQ(rule->metric, 2);
+	CHECK_EQ(rule->compare, ALARM_BELOW);
+	CHECK_EQ(rule->duration, 0);
+	CHECK_EQ(rule->actions, ALARM_ACTION_FLASH);
+
+	CHECK_EQ(alarm_add(&engine, "mem>50,1,0,run", metrics, METRIC_COUNT), 2);
+	CHECK_EQ(engine.rules[2].actions, ALARM_ACTION_RUN);
+
+	// Invalid rules leave the table as it was
+	CHECK_EQ(alarm_add(&engine, "disk>50", metrics, METRIC_COUNT), -1);
+	CHECK_EQ(alarm_add(&engine, "cp>50", metrics, METRIC_COUNT), -1);
+	CHECK_EQ(alarm_add(&engine, "cpu=50", metrics, METRIC_COUNT), -1);
+	CHECK_EQ(alarm_add(&engine, "cpu>", metrics, METRIC_COUNT), -1);
+	CHECK_EQ(alarm_add(&engine, "cpu>50,", metrics, METRIC_COUNT), -1);
+	CHECK_EQ(alarm_add(&engine, "cpu>50,1,2,beep", metrics, METRIC_COUNT), -1);
+	CHECK_EQ(alarm_add(&engine, "cpu>50 junk", metrics, METRIC_COUNT), -1);
+	CHECK_EQ(engine.count, 3);
+
+	for (i = engine.count; i < ALARM_MAX_RULES; i++) {
+		CHECK_EQ(alarm_add(&engine, "cpu>1", metrics, METRIC_COUNT), i);
+	}
+
+	CHECK_EQ(alarm_add(&engine, "cpu>1", metrics, METRIC_COUNT), -1);
+}
+
+static void test_traces(void)
+{
+	// Fires after holding for the duration, clears below threshold - hysteresis
+	TRACE("cpu>90,3,5",
+		"....F.....C..",
+		50, 95, 95, 95, 95, 99, 90, 86, 85, 87, 84, 50, 50);
+
+	// A dip before the duration has passed starts the wait over
+	TRACE("cpu>90,3",
+		"...........F",
+		95, 95, 95, 80, 95, 95, 91, 80, 95, 95, 95, 95);
+
+	// Exactly at the threshold is not above it
+	TRACE("cpu>90",
+		"..F.C",
+		90, 90, 91, 90, 89);
+
+	// Zero duration fires on the first sample, no repeats while active
+	TRACE("cpu>50,0,10",
+		"F.....C.F",
+		60, 100, 45, 41, 60, 40, 39, 20, 51);
+
+	// Below rules mirror the hysteresis upwards
+	TRACE("mem<20,2,10",
+		"...F....C",
+		50, 10, 10, 10, 5, 29, 30, 25, 31);
+
+	// A condition that keeps coming back fires again only after clearing
+	TRACE("net>10,1,0",
+		"..F.C.F.",
+		0, 20, 20, 20, 5, 20, 20, 20);
+}
+
+// Rules on different metrics change state on the same tick independently
+static void test_multiple(void)
+{
+	AlarmEngine engine;
+	unsigned char values[METRIC_COUNT] = { 0 };
+	unsigned fired, cleared;
+
+	alarm_init(&engine);
+	CHECK_EQ(alarm_add(&engine, "cpu>50", metrics, METRIC_COUNT), 0);
+	CHECK_EQ(alarm_add(&engine, "mem<20", metrics, METRIC_COUNT), 1);
+	CHECK_EQ(alarm_add(&engine, "net>10,5", metrics, METRIC_COUNT), 2);
+
+	values[0] = 60;
+	values[1] = 10;
+	values[2] = 20;
+	alarm_evaluate(&engine, values, 100, &fired, &cleared);
+	CHECK_EQ(fired, 3);
+	CHECK_EQ(cleared, 0);
+
+	values[0] = 10;
+	alarm_evaluate(&engine, values, 105, &fired, &cleared);
+	CHECK_EQ(fired, 4);
+	CHECK_EQ(cleared, 1);
+
+	values[1] = 50;
+	values[2] = 0;
+	alarm_evaluate(&engine, values, 106, &fired, &cleared);
+	CHECK_EQ(fired, 0);
+	CHECK_EQ(cleared, 6);
+	CHECK(!engine.rules[0].active && !engine.rules[1].active && !engine.rules[2].active);
+}
+
+int main(void)
+{
+	test_parse();
+	test_traces();
+	test_multiple();
+
+	return test_result("alarm");
+}
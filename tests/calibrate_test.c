@@ -0,0 +1,235 @@
+/*
+
+Tests of the calibration curve: the isotonic fit is compared against the
+max-min formula of the least-squares monotone fit, and the correction
+table is checked against hand-worked curves and for being monotone.
+
+*/
+
+#include "test.h"
+#include "../calibrate.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// One reading per step, measured for one second so the result is the reading
+static void sweep_with(Sweep *sweep, const int *readings, int steps)
+{
+	int i;
+
+	sweep_init(sweep, 1, 100 / (steps - 1), 0, 1);
+	CHECK_EQ(sweep->steps, steps);
+
+	for (i = 0; i < steps; i++) {
+		CHECK_EQ(sweep_duty(sweep), i * 100 / (steps - 1));
+		CHECK(sweep_feed(sweep, readings[i]));
+	}
+
+	CHECK(sweep->done);
+}
+
+/*
+
+Reference fit: the value at i is the largest over blocks starting at or
+before i of the smallest mean of the blocks ending at or after i.
+
+*/
+static void reference_fit(const int *readings, int steps, unsigned char *curve)
+{
+	int i, j, k;
+
+	for (i = 0; i < steps; i++) {
+		double best = -1.0;
+
+		for (k = 0; k <= i; k++) {
+			double smallest = 1e9;
+
+			for (j = i; j < steps; j++) {
+				double sum = 0.0;
+				int n;
+
+				for (n = k; n <= j; n++) {
+					sum += readings[n];
+				}
+
+				if (sum / (j - k + 1) < smallest) {
+					smallest = sum / (j - k + 1);
+				}
+			}
+
+			if (smallest > best) {
+				best = smallest;
+			}
+		}
+
+		curve[i] = (unsigned char)(best + 0.5);
+	}
+}
+
+static void test_fit_examples(void)
+{
+	static const int readings[] = { 0, 30, 20, 40, 100 };
+	static const int monotone[] = { 0, 5, 5, 60, 100 };
+	unsigned char curve[CALIB_MAX_POINTS];
+	Sweep sweep;
+
+	sweep_with(&sweep, readings, 5);
+	calib_fit(&sweep, 0, curve);
+
+	// 30 and 20 are pooled to their mean
+	CHECK_EQ(curve[0], 0);
+	CHECK_EQ(curve[1], 25);
+	CHECK_EQ(curve[2], 25);
+	CHECK_EQ(curve[3], 40);
+	CHECK_EQ(curve[4], 100);
+
+	// Already monotone input is returned as it is
+	sweep_with(&sweep, monotone, 5);
+	calib_fit(&sweep, 0, curve);
+	CHECK(curve[0] == 0 && curve[1] == 5 && curve[2] == 5 && curve[3] == 60 && curve[4] == 100);
+}
+
+static void test_fit_random(void)
+{
+	int round;
+
+	srand(33);
+
+	for (round = 0; round < 2000; round++) {
+		const int steps = (round % 2) ? 21 : 11;
+		int readings[CALIB_MAX_POINTS];
+		unsigned char curve[CALIB_MAX_POINTS];
+		unsigned char expected[CALIB_MAX_POINTS];
+		Sweep sweep;
+		int i;
+
+		// A noisy rising curve, sometimes with a long dip
+		for (i = 0; i < steps; i++) {
+			readings[i] = i * 100 / (steps - 1) + rand() % 41 - 20;
+
+			if (round % 5 == 0 && i > steps / 2) {
+				readings[i] -= 40;
+			}
+
+			readings[i] = readings[i] < 0 ? 0 : readings[i] > 100 ? 100 : readings[i];
+		}
+
+		sweep_with(&sweep, readings, steps);
+		calib_fit(&sweep, 0, curve);
+		reference_fit(readings, steps, expected);
+
+		for (i = 0; i < steps; i++) {
+			// Float and double means may round differently at .5
+			CHECK(abs(curve[i] - expected[i]) <= 1);
+
+			if (i) {
+				CHECK(curve[i] >= curve[i - 1]);
+			}
+		}
+	}
+}
+
+static void test_table(void)
+{
+	unsigned char identity[11], table[101];
+	int i;
+
+	for (i = 0; i < 11; i++) {
+		identity[i] = i * 10;
+	}
+
+	calib_table(identity, 11, table);
+
+	for (i = 0; i <= 100; i++) {
+		CHECK_EQ(table[i], i);
+	}
+
+	// Reports 80% at a true 50%, and saturates above it
+	static const unsigned char high[] = { 0, 80, 100 };
+	calib_table(high, 3, table);
+	CHECK_EQ(table[0], 0);
+	CHECK_EQ(table[40], 25);
+	CHECK_EQ(table[80], 50);
+	CHECK_EQ(table[90], 75);
+	CHECK_EQ(table[100], 100);
+
+	// Never reaches 100, the top of the range maps to full load
+	static const unsigned char low[] = { 10, 30, 50, 70, 90 };
+	calib_table(low, 5, table);
+	CHECK_EQ(table[0], 0);
+	CHECK_EQ(table[10], 0);
+	CHECK_EQ(table[20], 13);
+	CHECK_EQ(table[50], 50);
+	CHECK_EQ(table[90], 100);
+	CHECK_EQ(table[100], 100);
+
+	// Flat segments from pooling keep the table monotone
+	static const unsigned char flat[] = { 0, 25, 25, 25, 100 };
+	calib_table(flat, 5, table);
+
+	for (i = 1; i <= 100; i++) {
+		CHECK(table[i] >= table[i - 1]);
+	}
+
+	CHECK_EQ(table[25], 75);
+	CHECK_EQ(table[100], 100);
+}
+
+static void test_text(void)
+{
+	unsigned char curve[CALIB_MAX_POINTS], parsed[CALIB_MAX_POINTS];
+	char text[96];
+	int i;
+
+	for (i = 0; i < 21; i++) {
+		curve[i] = i * 5;
+	}
+
+	calib_format(curve, 21, text, sizeof(text));
+	CHECK_EQ(calib_parse(text, parsed), 21);
+	CHECK(memcmp(curve, parsed, 21) == 0);
+
+	CHECK_EQ(calib_parse("0,50,100", parsed), 3);
+	CHECK_EQ(calib_parse("0,50,101", parsed), 0);
+	CHECK_EQ(calib_parse("0,30,60,100", parsed), 0); // Three steps don't split 100 evenly
+	CHECK_EQ(calib_parse("0,,100", parsed), 0);
+	CHECK_EQ(calib_parse("50", parsed), 0);
+	CHECK_EQ(calib_parse("", parsed), 0);
+
+	// A trailing comma isn't taken as the end
+	CHECK_EQ(calib_parse("0,50,100,", parsed), 0);
+	CHECK_EQ(calib_parse("0,50,100,,", parsed), 0);
+	CHECK_EQ(calib_parse(",0,100", parsed), 0);
+
+	// A curve longer than fits isn't cut short: its first 21 points would split 0...100 evenly
+	char *end = text;
+
+	for (i = 0; i <= 100; i++) {
+		end += sprintf(end, i ? ",%d" : "%d", i);
+
+		if (end - text > (int)sizeof(text) - 8) {
+			break;
+		}
+	}
+
+	CHECK(i > CALIB_MAX_POINTS);
+	CHECK_EQ(calib_parse(text, parsed), 0);
+
+	// One point more than fits, with the values of a valid curve
+	calib_format(curve, 21, text, sizeof(text));
+	strcat(text, ",100");
+	CHECK_EQ(calib_parse(text, parsed), 0);
+
+	// Digits past any valid value don't overflow
+	CHECK_EQ(calib_parse("0,99999999999999999999,100", parsed), 0);
+}
+
+int main(void)
+{
+	test_fit_examples();
+	test_fit_random();
+	test_table();
+	test_text();
+
+	return test_result("calibrate");
+}
@@ -0,0 +1,301 @@
+/*
+
+Tests of the sample collector. A simulated sender batches a stream whose
+values follow from the sequence number, the network loses, duplicates and
+resends overlapping batches, and the rings are compared against the stream:
+every slot holds its own sample, or the last one taken before it when it
+was lost. Samples behind the newest one taken can't be filled in any more,
+even when a resend brings them. Reordering, restarts, the host limit and
+malformed datagrams are checked on their own.
+
+*/
+
+#include "test.h"
+#include "../collect.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define STREAM 100000
+
+static uint8_t value(uint32_t sequence, int metric)
+{
+	return (sequence * 7 + metric * 13) % 101;
+}
+
+static void make_batch(uint32_t sequence, int count, uint8_t *samples)
+{
+	int i, m;
+
+	for (i = 0; i < count; i++) {
+		for (m = 0; m < COLLECT_METRICS; m++) {
+			samples[i * COLLECT_METRICS + m] = value(sequence + i, m);
+		}
+	}
+}
+
+static CollectHost *deliver(Collector *c, const char *name, uint32_t sequence, int count)
+{
+	uint8_t samples[COLLECT_MAX_BATCH * COLLECT_METRICS];
+	uint8_t packet[COLLECT_PACKET_MAX];
+
+	make_batch(sequence, count, samples);
+
+	const int length = collect_encode(packet, name, sequence, samples, count);
+
+	CHECK(length > 0);
+
+	return collect_receive(c, packet, length, sequence);
+}
+
+// The ring oldest first as sequence numbers: each slot should hold 'shown'
+static void check_ring(const CollectHost *host, const uint32_t *shown)
+{
+	int i, m;
+
+	for (i = 0; i < COLLECT_SAMPLES; i++) {
+		const uint8_t *sample = host->samples[(host->newest + 1 + i) % COLLECT_SAMPLES];
+		int same = 1;
+
+		for (m = 0; m < COLLECT_METRICS; m++) {
+			same &= sample[m] == value(shown[i], m);
+		}
+
+		if (!same) {
+			printf("ring slot %d doesn't hold sample %u\n", i, (unsigned)shown[i]);
+			test_failures++;
+			return;
+		}
+	}
+}
+
+static void test_stream(int loss, int duplicates, int overlaps)
+{
+	static uint8_t taken[STREAM + COLLECT_MAX_BATCH];
+	static uint32_t shown[COLLECT_SAMPLES];
+	const uint32_t base = 1500000000;
+	uint32_t sent = 0, newest = 0, received = 0, rejected = 0;
+	CollectHost *host = NULL;
+	Collector c;
+	int i;
+
+	collect_init(&c);
+	memset(taken, 0, sizeof(taken));
+
+	while (sent < STREAM) {
+		const int count = 1 + rand() % COLLECT_MAX_BATCH;
+		int back = 0;
+
+		// A resend that starts with samples already sent
+		if (sent && rand() % overlaps == 0) {
+			back = 1 + rand() % (sent < COLLECT_MAX_BATCH - 1 ? sent : COLLECT_MAX_BATCH - 1);
+			back = back < count ? back : count - 1;
+		}
+
+		const uint32_t first = sent - back;
+
+		sent = first + count;
+
+		// The first batch always arrives, so the ring has a start
+		if (first && rand() % loss == 0) {
+			continue;
+		}
+
+		for (i = newest > first ? newest - first : 0; i < count; i++) {
+			taken[first + i] = 1;
+			received++;
+		}
+
+		newest = first + count;
+
+		CollectHost *from = deliver(&c, "amiga", base + first, count);
+
+		CHECK(from != NULL);
+		host = host ? host : from;
+		CHECK(from == host);
+
+		// Arrives again, and is turned away as old
+		if (rand() % duplicates == 0) {
+			CHECK(deliver(&c, "amiga", base + first, count) == NULL);
+			rejected++;
+		}
+	}
+
+	CHECK_EQ(c.used, 1);
+	CHECK_EQ(c.rejected, rejected);
+	CHECK_EQ(host->expected, base + newest);
+	CHECK_EQ(host->received, received);
+	CHECK_EQ(host->lost, newest - received);
+
+	// Lost samples show as the last one taken before them
+	uint32_t last = 0;
+	uint32_t sequence;
+
+	for (sequence = 0; sequence < newest; sequence++) {
+		if (taken[sequence]) {
+			last = sequence;
+		}
+
+		if (sequence >= newest - COLLECT_SAMPLES) {
+			shown[sequence - (newest - COLLECT_SAMPLES)] = base + last;
+		}
+	}
+
+	check_ring(host, shown);
+}
+
+static void test_order(void)
+{
+	static uint32_t shown[COLLECT_SAMPLES];
+	CollectHost *host;
+	Collector c;
+	int i;
+
+	collect_init(&c);
+
+	host = deliver(&c, "a1200", 1000, 10);
+	CHECK(host != NULL);
+	CHECK_EQ(host->heard, 1000);
+
+	// 1010...1019 is overtaken by the next batch and comes in late
+	CHECK(deliver(&c, "a1200", 1020, 10) == host);
+	CHECK_EQ(host->lost, 10);
+	CHECK(deliver(&c, "a1200", 1010, 10) == NULL);
+	CHECK_EQ(c.rejected, 1);
+
+	// Partly new: only the part past what's been seen is taken
+	CHECK(deliver(&c, "a1200", 1025, 10) == host);
+	CHECK_EQ(host->expected, 1035);
+	CHECK_EQ(host->received, 25);
+	CHECK_EQ(host->lost, 10);
+
+	// A gap of more than the ring repeats the last sample through all of it
+	CHECK(deliver(&c, "a1200", 5000, 1) == host);
+	CHECK_EQ(host->lost, 10 + 5000 - 1035);
+
+	for (i = 0; i < COLLECT_SAMPLES; i++) {
+		shown[i] = i < COLLECT_SAMPLES - 1 ? 1034 : 5000;
+	}
+
+	check_ring(host, shown);
+
+	// A sender that restarted from far behind is taken as it is
+	CHECK(deliver(&c, "a1200", 10, 5) == host);
+	CHECK_EQ(host->expected, 15);
+	CHECK_EQ(host->lost, 10 + 5000 - 1035);
+	CHECK_EQ(c.rejected, 1);
+}
+
+static void test_hosts(void)
+{
+	char name[COLLECT_NAME_LEN];
+	Collector c;
+	int round, i;
+
+	collect_init(&c);
+
+	// Hosts take turns, each keeps to its own stream
+	for (round = 0; round < 20; round++) {
+		for (i = 0; i < COLLECT_MAX_HOSTS; i++) {
+			snprintf(name, sizeof(name), "host%d", i);
+
+			CollectHost *host = deliver(&c, name, 100 * i + round * 5, 5);
+
+			CHECK(host == &c.hosts[i]);
+			CHECK(strcmp(host->name, name) == 0);
+		}
+	}
+
+	CHECK_EQ(c.used, COLLECT_MAX_HOSTS);
+
+	for (i = 0; i < COLLECT_MAX_HOSTS; i++) {
+		CHECK_EQ(c.hosts[i].received, 100);
+		CHECK_EQ(c.hosts[i].lost, 0);
+		CHECK_EQ(c.hosts[i].expected, 100 * i + 100);
+	}
+
+	// One more is turned away, the others are still heard
+	CHECK(deliver(&c, "latecomer", 0, 1) == NULL);
+	CHECK_EQ(c.rejected, 1);
+	CHECK_EQ(c.used, COLLECT_MAX_HOSTS);
+	CHECK(deliver(&c, "host7", 800, 1) == &c.hosts[7]);
+
+	// Names that share a prefix are different hosts, also when they hash to the same slot
+	collect_init(&c);
+	CHECK(deliver(&c, "amiga4", 0, 1) == &c.hosts[0]);
+	CHECK(deliver(&c, "amiga", 0, 1) == &c.hosts[1]);
+	CHECK(deliver(&c, "amigat", 0, 1) == &c.hosts[2]);
+	CHECK(deliver(&c, "amiga", 1, 1) == &c.hosts[1]);
+	CHECK(deliver(&c, "amiga4", 1, 1) == &c.hosts[0]);
+}
+
+static void test_malformed(void)
+{
+	uint8_t samples[(COLLECT_MAX_BATCH + 1) * COLLECT_METRICS];
+	uint8_t packet[COLLECT_PACKET_MAX + 16];
+	uint8_t bad[COLLECT_PACKET_MAX + 16];
+	char name[COLLECT_NAME_LEN + 1];
+	Collector c;
+	int length, i;
+
+	collect_init(&c);
+	make_batch(0, COLLECT_MAX_BATCH + 1, samples);
+
+	// What won't fit a datagram isn't encoded
+	memset(name, 'n', COLLECT_NAME_LEN);
+	name[COLLECT_NAME_LEN] = '\0';
+	CHECK_EQ(collect_encode(packet, name, 0, samples, 1), 0);
+	CHECK_EQ(collect_encode(packet, "", 0, samples, 1), 0);
+	CHECK_EQ(collect_encode(packet, "x", 0, samples, 0), 0);
+	CHECK_EQ(collect_encode(packet, "x", 0, samples, COLLECT_MAX_BATCH + 1), 0);
+
+	// The largest datagram fits the buffer
+	name[COLLECT_NAME_LEN - 1] = '\0';
+	length = collect_encode(packet, name, 0, samples, COLLECT_MAX_BATCH);
+	CHECK(length > 0 && length <= COLLECT_PACKET_MAX);
+
+	length = collect_encode(packet, "x", 7, samples, 3);
+	CHECK_EQ(length, 6 + 1 + 5 + 3 * COLLECT_METRICS);
+
+	// Cut short anywhere, or with a byte too many
+	for (i = 0; i < length; i++) {
+		CHECK(collect_receive(&c, packet, i, 0) == NULL);
+	}
+
+	memcpy(bad, packet, length);
+	bad[length] = 0;
+	CHECK(collect_receive(&c, bad, length + 1, 0) == NULL);
+
+	// Wrong magic, version, name length and sample count
+	const int fields[][2] = { { 0, 'X' }, { 3, 'X' }, { 4, 2 }, { 5, 0 }, { 5, 2 }, { 5, COLLECT_NAME_LEN }, { 11, 0 }, { 11, 2 }, { 11, 4 } };
+
+	for (i = 0; i < (int)(sizeof(fields) / sizeof(fields[0])); i++) {
+		memcpy(bad, packet, length);
+		bad[fields[i][0]] = fields[i][1];
+		CHECK(collect_receive(&c, bad, length, 0) == NULL);
+	}
+
+	CHECK_EQ(c.rejected, length + 1 + sizeof(fields) / sizeof(fields[0]));
+	CHECK_EQ(c.used, 0);
+
+	// Nothing of that was filed, the datagram itself is fine
+	CHECK(collect_receive(&c, packet, length, 0) == &c.hosts[0]);
+	CHECK_EQ(c.hosts[0].expected, 10);
+}
+
+int main(void)
+{
+	srand(46);
+
+	// One in this many batches is lost, duplicated and overlaps the previous one
+	test_stream(1000000, 1000000, 1000000);
+	test_stream(10, 1000000, 1000000);
+	test_stream(5, 7, 3);
+	test_stream(2, 2, 2);
+
+	test_order();
+	test_hosts();
+	test_malformed();
+
+	return test_result("collect");
+}
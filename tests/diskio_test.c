@@ -0,0 +1,180 @@
+/*
+
+Tests of the disk rate logic through the file-backed counter source. Each
+step writes the counters a device would have reached and checks the rates,
+graph levels and rescaling that disk_update derives from them.
+
+*/
+
+#include "test.h"
+#include "../diskio.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define COUNTERS "tests/diskio_test.tmp"
+
+typedef struct {
+	int result;
+	uint8_t read;
+	uint8_t write;
+	float read_multiplier;
+	float write_multiplier;
+} Update;
+
+static void write_counters(const char *text)
+{
+	FILE *file = fopen(COUNTERS, "w");
+
+	CHECK(file != NULL);
+
+	if (file) {
+		fputs(text, file);
+		fclose(file);
+	}
+}
+
+static Update update(DiskStats *stats, DiskSource *source, uint32_t elapsed_us, const char *text)
+{
+	Update u;
+
+	write_counters(text);
+
+	u.read_multiplier = u.write_multiplier = 1.0f;
+	u.result = disk_update(stats, source, elapsed_us, &u.read, &u.write, &u.read_multiplier, &u.write_multiplier);
+
+	return u;
+}
+
+static void test_rates(void)
+{
+	DiskStats stats;
+	DiskSource source;
+	Update u;
+
+	disk_init(&stats);
+	disk_file_source(&source, COUNTERS);
+
+	// Name, reads, read bytes, writes, write bytes. The first poll is the baseline.
+	u = update(&stats, &source, 1000000, "dh0 100 409600 50 204800\n");
+	CHECK_EQ(u.result, 0);
+	CHECK_EQ(stats.count, 1);
+	CHECK_EQ(stats.read_rate, 0);
+	CHECK_EQ(u.read, 0);
+
+	u = update(&stats, &source, 1000000, "dh0 110 419840 55 206848\n");
+	CHECK_EQ(u.result, 1);
+	CHECK_EQ(stats.read_rate, 10240);
+	CHECK_EQ(stats.write_rate, 2048);
+	CHECK_EQ(stats.read_ops, 10);
+	CHECK_EQ(stats.write_ops, 5);
+	CHECK_EQ(stats.max_read, 10240);
+	CHECK_EQ(u.read, 100);
+	CHECK_EQ(u.write, 100);
+
+	// Half the peak, nothing written
+	u = update(&stats, &source, 1000000, "dh0 115 424960 55 206848\n");
+	CHECK_EQ(u.result, 0);
+	CHECK_EQ(u.read, 50);
+	CHECK_EQ(u.write, 0);
+	CHECK(u.read_multiplier == 1.0f);
+
+	// Rates are per second, a new peak rescales the history
+	u = update(&stats, &source, 500000, "dh0 125 445440 55 206848\n");
+	CHECK_EQ(u.result, 1);
+	CHECK_EQ(stats.read_rate, 40960);
+	CHECK_EQ(stats.max_read, 40960);
+	CHECK_EQ(u.read, 100);
+	CHECK(u.read_multiplier > 0.2499f && u.read_multiplier < 0.2501f);
+	CHECK(u.write_multiplier == 1.0f);
+
+	// A counter that went backwards was reset and counts as idle
+	u = update(&stats, &source, 1000000, "dh0 0 0 0 0\n");
+	CHECK_EQ(u.result, 0);
+	CHECK_EQ(stats.read_rate, 0);
+	CHECK_EQ(u.read, 0);
+
+	// No time passed, no rate
+	u = update(&stats, &source, 0, "dh0 10 10240 0 0\n");
+	CHECK_EQ(stats.read_rate, 0);
+
+	// Rates that don't fit 32 bits are clamped
+	u = update(&stats, &source, 1, "dh0 10 10000010240 0 0\n");
+	CHECK_EQ(stats.read_rate, UINT32_MAX);
+	CHECK_EQ(u.read, 100);
+}
+
+static void test_devices(void)
+{
+	DiskStats stats;
+	DiskSource source;
+	Update u;
+
+	disk_init(&stats);
+	disk_file_source(&source, COUNTERS);
+
+	u = update(&stats, &source, 1000000, "dh0 0 0 0 0\ndh1 0 0 0 0\n");
+	CHECK_EQ(stats.count, 2);
+
+	// Totals sum the devices, a device that appears later starts from a baseline
+	u = update(&stats, &source, 1000000,
+		"dh1 1 1000 1 3000\n"
+		"dh0 1 2000 0 0\n"
+		"cd0 99 99999 0 0\n");
+	CHECK_EQ(stats.count, 3);
+	CHECK_EQ(stats.read_rate, 3000);
+	CHECK_EQ(stats.write_rate, 3000);
+	CHECK_EQ(stats.read_ops, 2);
+	CHECK_EQ(stats.devices[0].read_rate, 2000);
+	CHECK_EQ(stats.devices[1].read_rate, 1000);
+	CHECK_EQ(stats.devices[2].read_rate, 0);
+
+	u = update(&stats, &source, 1000000,
+		"dh1 1 1000 1 3000\n"
+		"cd0 100 100999 0 0\n"
+		"dh0 1 2000 0 0\n");
+	CHECK_EQ(stats.read_rate, 1000);
+	CHECK_EQ(stats.devices[2].read_rate, 1000);
+	CHECK_EQ(u.read, 33);
+
+	// Malformed lines are skipped
+	u = update(&stats, &source, 1000000,
+		"dh1 2 2000\n"
+		"garbage\n"
+		"dh0 2 5000 0 0\n");
+	CHECK_EQ(u.result, 0);
+	CHECK_EQ(stats.read_rate, 3000);
+
+	// The table is full at DISK_MAX_DEVICES, the rest is ignored
+	char text[1024] = "";
+	int i;
+
+	for (i = 0; i < DISK_MAX_DEVICES + 4; i++) {
+		char line[64];
+
+		snprintf(line, sizeof(line), "d%d %d 0 0 0\n", i, i);
+		strcat(text, line);
+	}
+
+	update(&stats, &source, 1000000, text);
+	update(&stats, &source, 1000000, text);
+	CHECK_EQ(stats.count, DISK_MAX_DEVICES);
+
+	// Without the file the source fails and the graphs drop to zero
+	remove(COUNTERS);
+	u.read = u.write = 55;
+	u.result = disk_update(&stats, &source, 1000000, &u.read, &u.write, &u.read_multiplier, &u.write_multiplier);
+	CHECK_EQ(u.result, -1);
+	CHECK_EQ(u.read, 0);
+	CHECK_EQ(u.write, 0);
+}
+
+int main(void)
+{
+	test_rates();
+	test_devices();
+
+	remove(COUNTERS);
+
+	return test_result("diskio");
+}
@@ -0,0 +1,258 @@
+/*
+
+Tests of the text formatter and the exporter. Formatted numbers are
+compared against snprintf over random values, widths and truncating
+buffers. Thousands of CSV and JSON rows are exported through a write
+callback that collects the blocks, and the result must match the same rows
+printed with snprintf, handed over in few large writes.
+
+*/
+
+#include "test.h"
+#include "../export.h"
+#include "../format.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define ROWS 5000
+#define COLUMNS 11
+
+static const char *const names[COLUMNS] = {
+	"cpu", "vmem", "gmem", "upload", "download", "dread", "dwrite", "lat50", "lat99", "latmax", "disp"
+};
+
+static char output[ROWS * EXPORT_LINE_MAX];
+static uint32_t output_length;
+static int writes;
+static int fail_after; // Writes that succeed before the rest fail, -1 for all
+
+static int collect(void *handle, const char *data, uint32_t length)
+{
+	CHECK(handle == output);
+	CHECK(length <= EXPORT_BLOCK_SIZE);
+
+	if (fail_after >= 0 && writes >= fail_after) {
+		return 0;
+	}
+
+	memcpy(output + output_length, data, length);
+	output_length += length;
+	writes++;
+
+	return 1;
+}
+
+static unsigned long random_value(void)
+{
+	switch (rand() % 4) {
+		case 0:
+			return rand() % 10;
+		case 1:
+			return 0xFFFFFFFFUL;
+		default:
+			return (unsigned long)rand() * rand() % 0xFFFFFFFFUL;
+	}
+}
+
+static void test_numbers(void)
+{
+	char buffer[64], expected[64];
+	Formatter f;
+	int i;
+
+	for (i = 0; i < 100000; i++) {
+		const unsigned long value = random_value();
+		const int width = rand() % 14;
+		const uint64_t wide = (uint64_t)value << (rand() % 33) | (i % 7 == 0 ? 0xFFFFFFFF00000000ULL : 0);
+		const long negative = -(long)(value & 0x7FFFFFFF);
+
+		fmt_init(&f, buffer, sizeof(buffer));
+		fmt_uint(&f, value, width);
+		fmt_char(&f, '|');
+		fmt_uint64(&f, wide, width);
+		fmt_char(&f, '|');
+		fmt_int(&f, negative, width);
+		fmt_char(&f, '|');
+		fmt_zeros(&f, value % 1000000, 6);
+
+		snprintf(expected, sizeof(expected), "%*lu|%*llu|%*ld|%06lu", width, value,
+			width, (unsigned long long)wide, width, negative, value % 1000000);
+
+		if (strcmp(buffer, expected) != 0 || fmt_length(&f, buffer) != strlen(expected)) {
+			printf("'%s' instead of '%s'\n", buffer, expected);
+			test_failures++;
+			return;
+		}
+
+		// Tenths and hundredths
+		fmt_init(&f, buffer, sizeof(buffer));
+		fmt_fixed(&f, value, 2, width);
+		snprintf(expected, sizeof(expected), "%*lu.%02lu", width > 3 ? width - 3 : 0, value / 100, value % 100);
+		CHECK(strcmp(buffer, expected) == 0);
+	}
+
+	// Cut at the end of the buffer, always terminated
+	fmt_init(&f, buffer, 6);
+	fmt_str(&f, "abc");
+	fmt_uint(&f, 12345, 0);
+	fmt_char(&f, 'x');
+	CHECK(strcmp(buffer, "abc12") == 0);
+	CHECK_EQ(fmt_length(&f, buffer), 5);
+
+	fmt_init(&f, buffer, 1);
+	fmt_str(&f, "abc");
+	CHECK_EQ(buffer[0], '\0');
+
+	fmt_init(&f, buffer, sizeof(buffer));
+	fmt_fixed(&f, 5, 3, 0);
+	fmt_char(&f, ' ');
+	fmt_fixed(&f, 42, 0, 4);
+	fmt_char(&f, ' ');
+	fmt_int(&f, -2147483647L - 1, 0);
+	CHECK(strcmp(buffer, "0.005   42 -2147483648") == 0);
+}
+
+static void make_row(ExportRow *row, uint8_t *values, int i)
+{
+	int c;
+
+	for (c = 0; c < COLUMNS; c++) {
+		values[c] = rand() % 4 ? rand() % 101 : 255;
+	}
+
+	row->seconds = 1700000000 + i;
+	row->micros = i % 3 ? (uint32_t)rand() % 1000000 : 0;
+	row->values = values;
+	row->rates = i % 5 != 0;
+	row->download = random_value();
+	row->upload = random_value();
+}
+
+static int print_row(char *out, int size, EExportFormat format, const ExportRow *row)
+{
+	int n = 0;
+	int c;
+
+	if (format == EXPORT_CSV) {
+		n += snprintf(out + n, size - n, "%u.%06u", (unsigned)row->seconds, (unsigned)row->micros);
+
+		for (c = 0; c < COLUMNS; c++) {
+			n += snprintf(out + n, size - n, ",%u", row->values[c]);
+		}
+
+		if (row->rates) {
+			n += snprintf(out + n, size - n, ",%u,%u\n", (unsigned)row->download, (unsigned)row->upload);
+		} else {
+			n += snprintf(out + n, size - n, ",,\n");
+		}
+	} else {
+		n += snprintf(out + n, size - n, "{\"time\":%u.%06u", (unsigned)row->seconds, (unsigned)row->micros);
+
+		for (c = 0; c < COLUMNS; c++) {
+			n += snprintf(out + n, size - n, ",\"%s\":%u", names[c], row->values[c]);
+		}
+
+		if (row->rates) {
+			n += snprintf(out + n, size - n, ",\"download\":%u,\"upload\":%u",
+				(unsigned)row->download, (unsigned)row->upload);
+		}
+
+		n += snprintf(out + n, size - n, "}\n");
+	}
+
+	return n;
+}
+
+static void test_export(EExportFormat format)
+{
+	static char expected[ROWS * EXPORT_LINE_MAX];
+	uint8_t values[COLUMNS];
+	Exporter e;
+	ExportRow row;
+	int length = 0;
+	int i;
+
+	output_length = 0;
+	writes = 0;
+	fail_after = -1;
+
+	export_init(&e, format, names, COLUMNS, collect, output);
+	export_header(&e);
+
+	if (format == EXPORT_CSV) {
+		length += snprintf(expected, sizeof(expected),
+			"time,cpu,vmem,gmem,upload,download,dread,dwrite,lat50,lat99,latmax,disp,download,upload\n");
+	}
+
+	for (i = 0; i < ROWS; i++) {
+		make_row(&row, values, i);
+		export_row(&e, &row);
+		length += print_row(expected + length, sizeof(expected) - length, format, &row);
+
+		// Nothing is written before a block fills
+		CHECK(e.used < EXPORT_BLOCK_SIZE);
+	}
+
+	CHECK_EQ(export_size(&e), length);
+	CHECK(export_flush(&e));
+	CHECK_EQ(output_length, length);
+	CHECK(memcmp(output, expected, length) == 0);
+
+	// Whole blocks but the last, as few as the line limit allows
+	CHECK(writes <= length / (EXPORT_BLOCK_SIZE - EXPORT_LINE_MAX) + 1);
+
+	// Flushing again writes nothing
+	CHECK(export_flush(&e));
+	CHECK_EQ(output_length, length);
+}
+
+static void test_failure(void)
+{
+	uint8_t values[COLUMNS];
+	Exporter e;
+	ExportRow row;
+	int i;
+
+	output_length = 0;
+	writes = 0;
+	fail_after = 2;
+
+	export_init(&e, EXPORT_JSON, names, COLUMNS, collect, output);
+
+	for (i = 0; i < ROWS; i++) {
+		make_row(&row, values, i);
+		export_row(&e, &row);
+	}
+
+	// The failed write is remembered, and nothing is written after it
+	CHECK(!export_flush(&e));
+	CHECK_EQ(writes, 2);
+	CHECK(export_size(&e) > output_length);
+}
+
+static void test_formats(void)
+{
+	EExportFormat format = EXPORT_JSON;
+
+	CHECK(export_parse_format("csv", &format));
+	CHECK_EQ(format, EXPORT_CSV);
+	CHECK(export_parse_format("JSON", &format));
+	CHECK_EQ(format, EXPORT_JSON);
+	CHECK(!export_parse_format("xml", &format));
+	CHECK(!export_parse_format("", &format));
+	CHECK_EQ(format, EXPORT_JSON);
+}
+
+int main(void)
+{
+	srand(44);
+
+	test_numbers();
+	test_export(EXPORT_CSV);
+	test_export(EXPORT_JSON);
+	test_failure();
+	test_formats();
+
+	return test_result("export");
+}
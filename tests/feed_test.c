@@ -0,0 +1,291 @@
+/*
+
+Tests of the viewer feed behind the sampling service. The test plays the
+service and a group of viewers: samples are published every tick, viewers
+hold on to their batch for a random time, attach and detach at random and
+the graphs are rescaled now and then. Every batch is checked against what
+was published, and gaps in the sequence numbers must match the samples the
+feed reports as lost: none at all unless a viewer stalls for longer than
+the feed holds.
+
+*/
+
+#include "test.h"
+#include "../feed.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define METRICS 11
+#define CAPACITY 300
+#define VIEWERS 8
+#define TICKS 200000
+
+typedef struct {
+	int attached; // Service side
+	Feed feed;
+	uint8_t pending[CAPACITY * METRICS];
+	float rescaled[METRICS]; // Product of the rescales since the last batch
+
+	// The batch while it's out, as the viewer sees it
+	int holding;
+	int hold;
+	uint32_t first;
+	uint32_t count;
+	uint32_t lost; // Feed's count when the batch was sent
+	uint8_t rows[CAPACITY * METRICS];
+	float multiplier[METRICS];
+
+	// Viewer side
+	int detaching;
+	int batches; // Since attaching
+	uint32_t expected;
+	uint32_t seen_lost;
+} SimViewer;
+
+static uint8_t ring[CAPACITY][METRICS]; // Published samples, rescaled like the graph
+static uint32_t published;
+static SimViewer viewers[VIEWERS];
+
+static uint32_t total_gaps, total_lost, total_batches, total_attaches;
+
+static int max_hold;
+static int stall_chance; // One in this many batches is held past the capacity
+
+static void send(SimViewer *v)
+{
+	uint32_t i;
+
+	v->lost = v->feed.lost;
+	v->count = feed_take(&v->feed, &v->first, v->rows, v->multiplier);
+
+	CHECK(v->count > 0 && v->count <= CAPACITY);
+	CHECK(v->feed.in_flight);
+	CHECK_EQ(v->first + v->count - 1, published);
+
+	// The rows are what was published, with every rescale since applied
+	for (i = 0; i < v->count; i++) {
+		CHECK(memcmp(&v->rows[i * METRICS], ring[(v->first + i) % CAPACITY], METRICS) == 0);
+	}
+
+	for (i = 0; i < METRICS; i++) {
+		CHECK(v->multiplier[i] > v->rescaled[i] * 0.9999f && v->multiplier[i] < v->rescaled[i] * 1.0001f);
+		v->rescaled[i] = 1.0f;
+	}
+
+	v->holding = 1;
+	v->hold = (stall_chance && rand() % stall_chance == 0) ? CAPACITY + rand() % CAPACITY : rand() % (max_hold + 1);
+}
+
+static void attach(SimViewer *v)
+{
+	const uint32_t stored = published < CAPACITY ? published : CAPACITY;
+	uint32_t i;
+
+	feed_init(&v->feed, v->pending, METRICS, CAPACITY);
+
+	for (i = 0; i < METRICS; i++) {
+		v->rescaled[i] = 1.0f;
+	}
+
+	// A new viewer starts with the whole ring
+	for (i = 0; i < stored; i++) {
+		const uint32_t sequence = published - (stored - 1 - i);
+
+		CHECK(feed_push(&v->feed, sequence, ring[sequence % CAPACITY]));
+	}
+
+	v->attached = 1;
+	v->detaching = 0;
+	v->batches = 0;
+	v->expected = 0;
+	v->seen_lost = 0;
+	total_attaches++;
+
+	if (v->feed.count) {
+		send(v);
+	}
+}
+
+static void detach(SimViewer *v)
+{
+	v->detaching = 1;
+
+	if (feed_detach(&v->feed)) {
+		total_lost += v->feed.lost;
+		v->attached = 0;
+	}
+}
+
+// The viewer is done with the batch and replies to it
+static void batch_back(SimViewer *v)
+{
+	if (!v->detaching) {
+		if (v->batches++) {
+			const uint32_t gap = v->first - v->expected;
+
+			CHECK_EQ(gap, v->lost - v->seen_lost);
+			total_gaps += gap;
+		}
+
+		v->expected = v->first + v->count;
+		v->seen_lost = v->lost;
+		total_batches++;
+	}
+
+	v->holding = 0;
+
+	const int waiting = feed_returned(&v->feed);
+
+	CHECK(!v->feed.in_flight);
+
+	if (v->feed.detached) {
+		CHECK(!waiting);
+		total_lost += v->feed.lost;
+		v->attached = 0;
+	} else if (waiting) {
+		send(v);
+	}
+}
+
+static void publish(void)
+{
+	int i, j;
+
+	published++;
+
+	for (j = 0; j < METRICS; j++) {
+		ring[published % CAPACITY][j] = rand() % 101;
+	}
+
+	for (i = 0; i < VIEWERS; i++) {
+		SimViewer *v = &viewers[i];
+
+		if (v->attached && feed_push(&v->feed, published, ring[published % CAPACITY])) {
+			CHECK(!v->holding);
+			send(v);
+		}
+	}
+}
+
+static void rescale(void)
+{
+	const int metric = rand() % METRICS;
+	const float multiplier = 0.5f + (rand() % 50) / 100.0f;
+	int i;
+
+	for (i = 0; i < CAPACITY; i++) {
+		ring[i][metric] *= multiplier;
+	}
+
+	for (i = 0; i < VIEWERS; i++) {
+		if (viewers[i].attached) {
+			feed_rescale(&viewers[i].feed, metric, multiplier);
+			viewers[i].rescaled[metric] *= multiplier;
+		}
+	}
+}
+
+static void run(int hold, int stalls)
+{
+	int tick, i;
+
+	memset(viewers, 0, sizeof(viewers));
+	memset(ring, 0, sizeof(ring));
+	published = 0;
+	total_gaps = total_lost = total_batches = total_attaches = 0;
+	max_hold = hold;
+	stall_chance = stalls;
+
+	for (tick = 0; tick < TICKS; tick++) {
+		publish();
+
+		if (rand() % 50 == 0) {
+			rescale();
+		}
+
+		for (i = 0; i < VIEWERS; i++) {
+			SimViewer *v = &viewers[i];
+
+			if (v->holding && v->hold-- <= 0) {
+				batch_back(v);
+			}
+
+			if (v->attached && !v->detaching && rand() % 500 == 0) {
+				detach(v);
+			} else if (!v->attached && rand() % 100 == 0) {
+				attach(v);
+			}
+		}
+	}
+
+	// Everyone detaches, nothing stays in flight
+	for (i = 0; i < VIEWERS; i++) {
+		SimViewer *v = &viewers[i];
+
+		if (v->attached && !v->detaching) {
+			detach(v);
+		}
+
+		if (v->holding) {
+			batch_back(v);
+		}
+
+		CHECK(!v->attached);
+	}
+
+	CHECK(total_attaches > 1000);
+	CHECK(total_batches > 10000);
+}
+
+static void test_overflow(void)
+{
+	uint8_t pending[4 * 2], rows[4 * 2];
+	uint8_t values[2] = { 0, 0 };
+	float multiplier[2];
+	uint32_t first, sequence;
+	Feed feed;
+
+	feed_init(&feed, pending, 2, 4);
+
+	values[0] = 1;
+	CHECK(feed_push(&feed, 1, values));
+	CHECK_EQ(feed_take(&feed, &first, rows, multiplier), 1);
+	CHECK_EQ(first, 1);
+
+	// Six samples while the batch is out, the two oldest don't fit
+	for (sequence = 2; sequence <= 7; sequence++) {
+		values[0] = sequence;
+		CHECK(!feed_push(&feed, sequence, values));
+	}
+
+	CHECK_EQ(feed.lost, 2);
+	CHECK(feed_returned(&feed));
+	CHECK_EQ(feed_take(&feed, &first, rows, multiplier), 4);
+	CHECK_EQ(first, 4);
+	CHECK(rows[0] == 4 && rows[2] == 5 && rows[4] == 6 && rows[6] == 7);
+
+	// Detaching while the batch is out waits for it, nothing more is queued
+	CHECK(!feed_detach(&feed));
+	CHECK(!feed_push(&feed, 8, values));
+	CHECK_EQ(feed.count, 0);
+	CHECK(!feed_returned(&feed));
+}
+
+int main(void)
+{
+	srand(41);
+
+	test_overflow();
+
+	// Batches come back well within the capacity: no gaps at all
+	run(CAPACITY / 2, 0);
+	CHECK_EQ(total_gaps, 0);
+	CHECK_EQ(total_lost, 0);
+
+	// Some viewers stall, every lost sample shows as a gap
+	run(20, 200);
+	CHECK(total_gaps > 0);
+
+	return test_result("feed");
+}
@@ -0,0 +1,195 @@
+/*
+
+Tests of the heatmap slicer. A load pattern decides for every millisecond
+whether the idle task runs. While it runs it calls the slicer at the start
+of every millisecond, and once a second the sampler preempts it, closes the
+slices and takes the column. The columns must hold exactly the histogram of
+the slices in the pattern: fully busy stretches, where only the sampler
+calls, and a sampler that stalls for seconds included.
+
+*/
+
+#include "test.h"
+#include "../heatmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define MS 1000
+#define SLICE (10 * MS)
+#define SAMPLE (1000 * MS)
+#define SECONDS 60
+#define STALL_FROM 40 // The sampler misses the samples after this one...
+#define STALL_TO 45 // ...up to this one
+
+static uint8_t idle[SECONDS * 1000]; // Per millisecond
+static HeatColumn columns[SECONDS + 1];
+
+static void make_pattern(void)
+{
+	int ms;
+
+	for (ms = 0; ms < SECONDS * 1000; ms++) {
+		const int second = ms / 1000;
+
+		switch (second / 4 % 5) {
+			case 0: // Full load
+				idle[ms] = 0;
+				break;
+			case 1: // No load
+				idle[ms] = 1;
+				break;
+			case 2: // Light load
+				idle[ms] = rand() % 10 < 7;
+				break;
+			case 3: // Heavy load
+				idle[ms] = rand() % 10 < 2;
+				break;
+			default: // Bursts that straddle the slices
+				idle[ms] = ms / 7 % 2;
+				break;
+		}
+
+		// Full load while the sampler stalls
+		if (second >= STALL_FROM && second < STALL_TO) {
+			idle[ms] = 0;
+		}
+	}
+}
+
+// The slices that end after one sample and by the next
+static void expected_column(int from, int to, HeatColumn *column)
+{
+	int end;
+
+	heat_clear(column);
+
+	for (end = from + SLICE - from % SLICE; end <= to; end += SLICE) {
+		int idle_ms = 0;
+		int ms;
+
+		for (ms = (end - SLICE) / MS; ms < end / MS; ms++) {
+			idle_ms += idle[ms];
+		}
+
+		heat_add(column, 100 - idle_ms * MS * 100 / SLICE, 1);
+	}
+}
+
+static void test_pattern(void)
+{
+	HeatSlicer slicer;
+	HeatColumn live, expected;
+	uint64_t run_us = 0, run_start = 0;
+	int running = 0, taken = 0, last_sample = 0;
+	int ms, i;
+
+	heat_slicer_init(&slicer, SLICE);
+	heat_clear(&live);
+
+	for (ms = 0; ms <= SECONDS * 1000; ms++) {
+		const uint64_t now = (uint64_t)ms * MS;
+		const int second = ms / 1000;
+
+		if (ms % 1000 == 0 && !(second > STALL_FROM && second < STALL_TO)) {
+			// The sampler preempts the idle task
+			if (running) {
+				run_us += now - run_start;
+				running = 0;
+			}
+
+			heat_slice(&slicer, now, run_us, now, &live);
+
+			columns[taken++] = live;
+			heat_clear(&live);
+
+			if (taken > 1) {
+				expected_column(last_sample, ms * MS, &expected);
+
+				if (memcmp(&columns[taken - 1], &expected, sizeof(expected)) != 0) {
+					printf("column at %d s differs\n", second);
+					test_failures++;
+				}
+			}
+
+			last_sample = ms * MS;
+		}
+
+		if (ms == SECONDS * 1000) {
+			break;
+		}
+
+		if (idle[ms]) {
+			if (!running) {
+				run_start = now;
+				running = 1;
+			}
+
+			heat_slice(&slicer, now, run_us, run_start, &live);
+		} else if (running) {
+			run_us += now - run_start;
+			running = 0;
+		}
+	}
+
+	// The first call starts the slicer, then one column per sample
+	CHECK_EQ(taken, SECONDS + 1 - (STALL_TO - STALL_FROM - 1));
+	CHECK_EQ(columns[0].total, 0);
+
+	for (i = 1; i < taken; i++) {
+		CHECK(columns[i].total >= SAMPLE / SLICE);
+	}
+
+	// Full load, the first columns are only the sampler's
+	CHECK_EQ(columns[1].counts[100], SAMPLE / SLICE);
+	CHECK_EQ(columns[1].max, SAMPLE / SLICE);
+
+	// No load
+	CHECK_EQ(columns[6].counts[0], SAMPLE / SLICE);
+
+	// The stall comes out as one column of busy slices
+	CHECK_EQ(columns[STALL_FROM + 1].counts[100], (STALL_TO - STALL_FROM) * SAMPLE / SLICE);
+}
+
+static void test_restart(void)
+{
+	HeatSlicer slicer;
+	HeatColumn column;
+
+	heat_slicer_init(&slicer, SLICE);
+	heat_clear(&column);
+
+	heat_slice(&slicer, 5 * SAMPLE, 0, 5 * SAMPLE, &column);
+	heat_slice(&slicer, 6 * SAMPLE, 0, 6 * SAMPLE, &column);
+	CHECK_EQ(column.counts[100], SAMPLE / SLICE);
+
+	// Stopped while the heatmap wasn't measured: the time since doesn't count
+	slicer.started = 0;
+	heat_clear(&column);
+	heat_slice(&slicer, 60 * SAMPLE, 0, 60 * SAMPLE, &column);
+	CHECK_EQ(column.total, 0);
+
+	// A clock that went backwards starts over as well
+	heat_slice(&slicer, 59 * SAMPLE, 0, 59 * SAMPLE, &column);
+	CHECK_EQ(column.total, 0);
+
+	// A half idle current run is split between the slices it overlaps
+	heat_slice(&slicer, 59 * SAMPLE + SLICE + SLICE / 2, 0, 59 * SAMPLE + SLICE, &column);
+	CHECK_EQ(column.total, 1);
+	CHECK_EQ(column.counts[100], 1);
+
+	heat_slice(&slicer, 59 * SAMPLE + 2 * SLICE, 0, 59 * SAMPLE + SLICE, &column);
+	CHECK_EQ(column.total, 2);
+	CHECK_EQ(column.counts[0], 1);
+}
+
+int main(void)
+{
+	srand(47);
+
+	make_pattern();
+	test_pattern();
+	test_restart();
+
+	return test_result("heatmap");
+}
@@ -0,0 +1,260 @@
+/*
+
+Tests of the compressed history. Streams of samples with flat stretches,
+small changes and the largest possible jumps are added and every block is
+decoded again, whole and row by row, and compared against the stream. With
+a ring too small for the stream the oldest blocks must be dropped and the
+rest still decode to the newest samples. Gaps and rescales must start new
+blocks, and every sample must get its own time back.
+
+*/
+
+#include "test.h"
+#include "../history.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define SAMPLES 100000
+#define BLOCKS 8192
+
+static uint8_t stream[SAMPLES][HISTORY_METRICS];
+static uint8_t decoded[UINT16_MAX][HISTORY_METRICS];
+static HistoryBlock blocks[BLOCKS];
+static const float unscaled[HISTORY_METRICS] = { 1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 1 };
+
+// One sample per second
+static void add(History *history, uint32_t sample, const uint8_t *values)
+{
+	history_add(history, values, (uint64_t)sample * 1000000, unscaled);
+}
+
+static void make_stream(void)
+{
+	int i, m;
+
+	for (i = 0; i < SAMPLES; i++) {
+		const int stretch = i / 1000 % 4;
+
+		for (m = 0; m < HISTORY_METRICS; m++) {
+			uint8_t value = i ? stream[i - 1][m] : 0;
+
+			switch (stretch) {
+				case 0: // Idle
+					break;
+				case 1: // Small changes to some metrics
+					if (rand() % 3 == 0) {
+						value += rand() % 7 - 3;
+					}
+					break;
+				case 2: // Anything
+					value = rand();
+					break;
+				default: // The largest deltas, both ways
+					value = (i + m) % 2 ? 255 : 0;
+					break;
+			}
+
+			stream[i][m] = value;
+		}
+	}
+}
+
+// Decodes every block oldest first and compares against the stream from 'first' on
+static void compare(const History *history, uint32_t first, uint32_t count)
+{
+	HistoryReader reader;
+	uint8_t row[HISTORY_METRICS];
+	uint32_t sample = first;
+	int i, r;
+
+	CHECK_EQ(history_samples(history), count);
+	CHECK_EQ(history->oldest, first);
+
+	for (i = 0; i < history->used; i++) {
+		const HistoryBlock *block = history_block(history, i);
+		const int rows = history_decode(history, block, &decoded[0][0], UINT16_MAX);
+
+		CHECK_EQ(block->first, sample);
+		CHECK(block->length <= HISTORY_DATA_SIZE);
+
+		if (memcmp(decoded, stream[sample], rows * HISTORY_METRICS) != 0) {
+			printf("block %d differs\n", i);
+			test_failures++;
+			return;
+		}
+
+		// The same rows one at a time
+		history_read_block(&reader, history, block);
+
+		for (r = 0; r < rows; r++) {
+			CHECK(history_read(&reader, row));
+			CHECK(memcmp(row, stream[sample + r], HISTORY_METRICS) == 0);
+		}
+
+		CHECK(!history_read(&reader, row));
+
+		// Every sample is found in its block, and has its time
+		CHECK(history_find(history, sample) == block);
+		CHECK(history_find(history, sample + rows - 1) == block);
+		CHECK_EQ(history_time(block, 0), (uint64_t)sample * 1000000);
+		CHECK_EQ(history_time(block, rows - 1), (uint64_t)(sample + rows - 1) * 1000000);
+
+		sample += rows;
+	}
+
+	CHECK_EQ(sample, first + count);
+	CHECK(history_find(history, sample) == NULL);
+}
+
+static void test_round_trip(void)
+{
+	History history;
+	int i;
+
+	history_init(&history, blocks, BLOCKS);
+
+	for (i = 0; i < SAMPLES; i++) {
+		add(&history, i, stream[i]);
+
+		// The idle start is a single run
+		if (i == 999) {
+			CHECK_EQ(history.used, 1);
+			CHECK(history.blocks[0].length == 0 && history.run == 999);
+		}
+
+		// Also while a run is still pending
+		if (i == 999 || i == 1500 || i == 3999) {
+			compare(&history, 0, i + 1);
+		}
+	}
+
+	CHECK(history.used > 100 && history.used < BLOCKS);
+	compare(&history, 0, SAMPLES);
+}
+
+static void test_eviction(void)
+{
+	const int capacity = 8;
+	History history;
+	int i;
+
+	history_init(&history, blocks, capacity);
+
+	for (i = 0; i < SAMPLES; i++) {
+		add(&history, i, stream[i]);
+
+		if (history.used == capacity && i % 997 == 0) {
+			const uint32_t first = history_block(&history, 0)->first;
+
+			CHECK(first > 0);
+			compare(&history, first, i + 1 - first);
+			CHECK(history_find(&history, first - 1) == NULL);
+		}
+	}
+
+	CHECK_EQ(history.used, capacity);
+	CHECK_EQ(history.next, SAMPLES);
+	compare(&history, history.oldest, SAMPLES - history.oldest);
+
+	// Without memory nothing is kept
+	history_init(&history, blocks, 0);
+	add(&history, 0, stream[0]);
+	CHECK_EQ(history.used, 0);
+	CHECK(history_find(&history, 0) == NULL);
+}
+
+// Every row jumps between 0 and 255 in every metric, the most a row can take
+static void test_max_deltas(void)
+{
+	static uint8_t jumps[2000][HISTORY_METRICS];
+	History history;
+	int i;
+
+	for (i = 0; i < 2000; i++) {
+		memset(jumps[i], i % 2 ? 255 : 0, HISTORY_METRICS);
+	}
+
+	history_init(&history, blocks, BLOCKS);
+
+	for (i = 0; i < 2000; i++) {
+		add(&history, i, jumps[i]);
+	}
+
+	for (i = 0; i < history.used; i++) {
+		const HistoryBlock *block = history_block(&history, i);
+		const int rows = history_decode(&history, block, &decoded[0][0], UINT16_MAX);
+
+		CHECK(block->length <= HISTORY_DATA_SIZE);
+		CHECK(memcmp(decoded, jumps[block->first], rows * HISTORY_METRICS) == 0);
+	}
+
+	CHECK_EQ(history_samples(&history), 2000);
+}
+
+// Samples that don't keep the spacing or the scale of their block start a new one
+static void test_stamps(void)
+{
+	static const uint64_t times[] = {
+		0, 1000000, 2000000, 3000000, // Every second
+		9000000, 10000000, 11010000, 11990000, // After a gap, with some jitter
+		12250000, 12500000, 12750000, // Faster
+		12750000, // The same time again
+		12000000, // Backwards
+		13000000, 14000000 // Rescaled
+	};
+	static const int splits[] = { 4, 8, 11, 12 };
+	const int count = sizeof(times) / sizeof(times[0]);
+	float scale[HISTORY_METRICS];
+	uint8_t values[HISTORY_METRICS];
+	History history;
+	int i, b, row;
+
+	memcpy(scale, unscaled, sizeof(scale));
+	memset(values, 42, sizeof(values));
+	history_init(&history, blocks, BLOCKS);
+
+	for (i = 0; i < count; i++) {
+		if (i == 13) {
+			scale[3] = 0.5f;
+		}
+
+		history_add(&history, values, times[i], scale);
+	}
+
+	CHECK_EQ(history.used, 6);
+	CHECK_EQ(history_block(&history, 5)->scale[3], 0.5f);
+	CHECK_EQ(history_block(&history, 4)->scale[3], 1.0f);
+
+	// Every time comes back, to within the jitter
+	for (b = 0, i = 0; b < history.used; b++) {
+		const HistoryBlock *block = history_block(&history, b);
+
+		CHECK_EQ(block->first, i);
+
+		if (b < 4) {
+			CHECK_EQ(block->count, splits[b] - i);
+		}
+
+		for (row = 0; row < block->count; row++, i++) {
+			const uint64_t time = history_time(block, row);
+
+			CHECK(time + 20000 >= times[i] && time <= times[i] + 20000);
+		}
+	}
+
+	CHECK_EQ(i, count);
+}
+
+int main(void)
+{
+	srand(35);
+
+	make_stream();
+	test_round_trip();
+	test_eviction();
+	test_max_deltas();
+	test_stamps();
+
+	return test_result("history");
+}
@@ -0,0 +1,198 @@
+/*
+
+Golden image tests for raster.c. Each scene is drawn into a small buffer
+and compared against a stored image in tests/data, one character per pixel.
+Run with "update" as the argument to rewrite the stored images after an
+intended change, and check the difference before committing it.
+
+*/
+
+#include "test.h"
+#include "../raster.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define WIDTH 40
+#define HEIGHT 24
+#define STRIDE 44 // Padding must stay untouched
+
+#define BACKGROUND 0xFF000000
+#define PADDING 0xDEADBEEF
+
+static const uint32_t palette[] = { BACKGROUND, 0xFFFF0000, 0xFF00FF00, 0xFF0000FF, 0xFFFFFFFF };
+static const char symbols[] = ".RGBW";
+
+static uint32_t pixels[HEIGHT * STRIDE];
+static int update;
+
+static void clear(Raster *r)
+{
+	int x, y;
+
+	for (y = 0; y < HEIGHT; y++) {
+		for (x = 0; x < STRIDE; x++) {
+			pixels[y * STRIDE + x] = x < WIDTH ? BACKGROUND : PADDING;
+		}
+	}
+
+	r->pixels = pixels;
+	r->width = WIDTH;
+	r->height = HEIGHT;
+	r->stride = STRIDE;
+}
+
+static char symbol(uint32_t pixel)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(palette) / sizeof(palette[0]); i++) {
+		if (palette[i] == pixel) {
+			return symbols[i];
+		}
+	}
+
+	return '?';
+}
+
+static void render(char *image)
+{
+	int x, y;
+
+	for (y = 0; y < HEIGHT; y++) {
+		for (x = 0; x < WIDTH; x++) {
+			*image++ = symbol(pixels[y * STRIDE + x]);
+		}
+
+		*image++ = '\n';
+	}
+
+	*image = '\0';
+}
+
+static void compare(const char *name)
+{
+	char actual[HEIGHT * (WIDTH + 1) + 1];
+	char expected[sizeof(actual) + 1];
+	char path[128];
+	int x, y;
+
+	for (y = 0; y < HEIGHT; y++) {
+		for (x = WIDTH; x < STRIDE; x++) {
+			CHECK(pixels[y * STRIDE + x] == PADDING);
+		}
+	}
+
+	render(actual);
+	snprintf(path, sizeof(path), "tests/data/raster_%s.txt", name);
+
+	if (update) {
+		FILE *file = fopen(path, "w");
+
+		CHECK(file != NULL);
+
+		if (file) {
+			fputs(actual, file);
+			fclose(file);
+		}
+
+		return;
+	}
+
+	FILE *file = fopen(path, "r");
+	size_t length = 0;
+
+	if (file) {
+		length = fread(expected, 1, sizeof(expected) - 1, file);
+		fclose(file);
+	}
+
+	expected[length] = '\0';
+
+	if (strcmp(actual, expected) != 0) {
+		printf("%s differs from the stored image, got:\n%s", path, actual);
+		test_failures++;
+	}
+}
+
+static void scene_fills(Raster *r)
+{
+	clear(r);
+
+	raster_fill(r, 2, 1, 9, 4, palette[1]);
+	raster_fill(r, 20, 6, 12, 3, palette[2]); // Swapped corners
+	raster_fill(r, -5, 18, 3, 30, palette[3]); // Clipped bottom left
+	raster_fill(r, 35, -3, 60, 2, palette[4]); // Clipped top right
+	raster_fill(r, 41, 5, 50, 8, palette[1]); // Fully outside
+	raster_fill(r, 10, 10, 10, 10, palette[4]); // Single pixel
+
+	// Span lengths 1...17 cover the unrolled loop and its tail
+	int i;
+	for (i = 1; i <= 17; i++) {
+		raster_hline(r, 5 + i, 20, 20 + i - 1, palette[i % 4 + 1]);
+	}
+
+	compare("fills");
+}
+
+static void scene_lines(Raster *r)
+{
+	clear(r);
+
+	// One line per octant from the centre
+	const int cx = 20, cy = 12;
+	raster_line(r, cx, cy, cx + 15, cy + 4, palette[1]);
+	raster_line(r, cx, cy, cx + 4, cy + 10, palette[2]);
+	raster_line(r, cx, cy, cx - 4, cy + 10, palette[3]);
+	raster_line(r, cx, cy, cx - 15, cy + 4, palette[4]);
+	raster_line(r, cx, cy, cx - 15, cy - 4, palette[1]);
+	raster_line(r, cx, cy, cx - 4, cy - 10, palette[2]);
+	raster_line(r, cx, cy, cx + 4, cy - 10, palette[3]);
+	raster_line(r, cx, cy, cx + 15, cy - 4, palette[4]);
+
+	// Axis-aligned and clipped lines
+	raster_line(r, -10, 0, 50, 0, palette[1]);
+	raster_line(r, 39, -5, 39, 30, palette[2]);
+	raster_line(r, -8, 30, 12, 15, palette[3]);
+	raster_vline(r, 45, 0, 10, palette[4]); // Outside
+
+	compare("lines");
+}
+
+// The graph style the direct rendering mode draws: a grid and a polyline
+static void scene_graph(Raster *r)
+{
+	static const int values[] = { 0, 10, 35, 80, 100, 95, 40, 40, 60, 5, 0, 20, 100 };
+	const int count = sizeof(values) / sizeof(values[0]);
+	int i;
+
+	clear(r);
+
+	for (i = 0; i < HEIGHT; i += 6) {
+		raster_hline(r, i, 0, WIDTH - 1, palette[3]);
+	}
+
+	for (i = 1; i < count; i++) {
+		const int x0 = (i - 1) * (WIDTH - 1) / (count - 1);
+		const int x1 = i * (WIDTH - 1) / (count - 1);
+		const int y0 = (HEIGHT - 1) - values[i - 1] * (HEIGHT - 1) / 100;
+		const int y1 = (HEIGHT - 1) - values[i] * (HEIGHT - 1) / 100;
+
+		raster_line(r, x0, y0, x1, y1, palette[2]);
+	}
+
+	compare("graph");
+}
+
+int main(int argc, char **argv)
+{
+	Raster r;
+
+	update = argc > 1 && strcmp(argv[1], "update") == 0;
+
+	scene_fills(&r);
+	scene_lines(&r);
+	scene_graph(&r);
+
+	return test_result("raster");
+}
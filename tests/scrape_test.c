@@ -0,0 +1,308 @@
+/*
+
+Tests of the scrape endpoint over loopback sockets, built against the POSIX
+stand-ins in tests/shim. Clients connect to the endpoint and the test plays
+the main loop, waiting on the endpoint's sockets and handing them over, until
+each client has read its whole response.
+
+*/
+
+#include "test.h"
+#include "../scrape.h"
+
+#include <proto/bsdsocket.h>
+#include <netinet/in.h>
+
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUNDS 200 // Main loop rounds before a client gives up
+
+static int port;
+static int bodies;
+static int oversized; // The body doesn't fit the response
+
+static void body(Formatter *f, void *data)
+{
+	int *count = data;
+	int i;
+
+	(*count)++;
+
+	scrape_metric(f, "cpuwatcher_sample", "gauge", "Latest sample");
+	scrape_value(f, "cpuwatcher_sample", "metric", "cpu", 42);
+	scrape_value(f, "cpuwatcher_network_receive_bytes_total", NULL, NULL, 12345678901234ULL);
+
+	for (i = 0; oversized && i < SCRAPE_BODY_SIZE; i++) {
+		fmt_char(f, '#');
+	}
+}
+
+static const char expected_body[] =
+	"# HELP cpuwatcher_sample Latest sample\n"
+	"# TYPE cpuwatcher_sample gauge\n"
+	"cpuwatcher_sample{metric=\"cpu\"} 42\n"
+	"cpuwatcher_network_receive_bytes_total 12345678901234\n";
+
+// One round of the main loop
+static void pump(Scraper *s)
+{
+	struct timeval timeout = { 0, 10000 };
+	fd_set read, write;
+
+	FD_ZERO(&read);
+	FD_ZERO(&write);
+
+	const LONG nfds = scrape_fds(s, &read, &write, 0);
+
+	if (select(nfds, &read, &write, NULL, &timeout) > 0) {
+		scrape_handle(s, &read, &write);
+	}
+}
+
+static int connect_client(void)
+{
+	struct sockaddr_in addr;
+	const int client = socket(AF_INET, SOCK_STREAM, 0);
+
+	CHECK(client >= 0);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	CHECK(connect(client, (struct sockaddr *)&addr, sizeof(addr)) == 0);
+
+	return client;
+}
+
+static void send_text(int client, const char *text)
+{
+	CHECK_EQ(send(client, text, strlen(text), 0), strlen(text));
+}
+
+// Reads until the endpoint closes the connection, returns the length or -1
+static int read_response(Scraper *s, int client, char *response, int size)
+{
+	int received = 0;
+	int round;
+
+	for (round = 0; round < ROUNDS; round++) {
+		pump(s);
+
+		const ssize_t n = recv(client, response + received, size - 1 - received, MSG_DONTWAIT);
+
+		if (n == 0) {
+			response[received] = '\0';
+			close(client);
+			return received;
+		}
+
+		if (n > 0) {
+			received += n;
+		} else if (errno != EWOULDBLOCK) {
+			break;
+		}
+	}
+
+	close(client);
+	return -1;
+}
+
+static int exchange(Scraper *s, const char *request, char *response, int size)
+{
+	const int client = connect_client();
+
+	send_text(client, request);
+
+	return read_response(s, client, response, size);
+}
+
+// Status line, Content-Length and where the body starts
+static const char *check_response(const char *response, int length, const char *status)
+{
+	const char *body = strstr(response, "\r\n\r\n");
+	const char *field = strstr(response, "Content-Length: ");
+
+	CHECK(length > 0);
+	CHECK(strncmp(response, "HTTP/1.0 ", 9) == 0);
+	CHECK(strncmp(response + 9, status, strlen(status)) == 0);
+	CHECK(strstr(response, "Content-Type: text/plain; version=0.0.4\r\n") != NULL);
+	CHECK(strstr(response, "Connection: close\r\n") != NULL);
+	CHECK(body != NULL && field != NULL);
+
+	if (!body || !field) {
+		return "";
+	}
+
+	body += 4;
+	CHECK_EQ(atoi(field + 16), length - (body - response));
+
+	return body;
+}
+
+static void test_requests(Scraper *s)
+{
+	static char response[SCRAPE_HEADER_SIZE + 2 * SCRAPE_BODY_SIZE];
+	const char *text;
+	int length;
+
+	length = exchange(s, "GET /metrics HTTP/1.1\r\nHost: localhost\r\nAccept: */*\r\n\r\n", response, sizeof(response));
+	text = check_response(response, length, "200 OK\r\n");
+	CHECK(strcmp(text, expected_body) == 0);
+	CHECK_EQ(bodies, 1);
+	CHECK_EQ(s->scrapes, 1);
+
+	// The root, a query and bare newlines do as well
+	length = exchange(s, "GET / HTTP/1.0\r\n\r\n", response, sizeof(response));
+	CHECK(strcmp(check_response(response, length, "200 OK\r\n"), expected_body) == 0);
+
+	length = exchange(s, "GET /metrics?name[]=cpu HTTP/1.0\n\n", response, sizeof(response));
+	CHECK(strcmp(check_response(response, length, "200 OK\r\n"), expected_body) == 0);
+	CHECK_EQ(s->scrapes, 3);
+
+	// Other paths, and other methods, aren't served
+	length = exchange(s, "GET /metricsx HTTP/1.0\r\n\r\n", response, sizeof(response));
+	CHECK(strcmp(check_response(response, length, "404 Not Found\r\n"), "404 Not Found\n") == 0);
+
+	length = exchange(s, "GET /favicon.ico HTTP/1.0\r\n\r\n", response, sizeof(response));
+	check_response(response, length, "404 Not Found\r\n");
+
+	length = exchange(s, "POST /metrics HTTP/1.0\r\nContent-Length: 0\r\n\r\n", response, sizeof(response));
+	CHECK(strcmp(check_response(response, length, "405 Method Not Allowed\r\n"), "405 Method Not Allowed\n") == 0);
+
+	length = exchange(s, "HEAD /metrics HTTP/1.0\r\n\r\n", response, sizeof(response));
+	check_response(response, length, "405 Method Not Allowed\r\n");
+
+	CHECK_EQ(bodies, 3);
+	CHECK_EQ(s->scrapes, 3);
+
+	// A body that doesn't fit isn't sent cut short
+	oversized = 1;
+	length = exchange(s, "GET /metrics HTTP/1.0\r\n\r\n", response, sizeof(response));
+	check_response(response, length, "500 Internal Server Error\r\n");
+	CHECK_EQ(s->scrapes, 3);
+	oversized = 0;
+}
+
+static void test_partial(Scraper *s)
+{
+	static char response[SCRAPE_HEADER_SIZE + SCRAPE_BODY_SIZE];
+	static char request[SCRAPE_REQUEST_SIZE];
+	int client, length, i;
+
+	// The request comes in pieces, nothing is sent before its end
+	client = connect_client();
+	send_text(client, "GET /met");
+	pump(s);
+	pump(s);
+	CHECK(recv(client, response, sizeof(response), MSG_DONTWAIT) < 0);
+
+	send_text(client, "rics HTTP/1.0\r\n");
+	pump(s);
+	send_text(client, "\r\n");
+	length = read_response(s, client, response, sizeof(response));
+	CHECK(strcmp(check_response(response, length, "200 OK\r\n"), expected_body) == 0);
+
+	// A request that fills the buffer without ending is answered as it is.
+	// Anything past that would be unread when the endpoint closes, and the
+	// client would get a reset instead of the response.
+	strcpy(request, "GET /");
+
+	for (i = strlen(request); i < SCRAPE_REQUEST_SIZE - 1; i++) {
+		request[i] = 'x';
+	}
+
+	request[i] = '\0';
+
+	length = exchange(s, request, response, sizeof(response));
+	check_response(response, length, "404 Not Found\r\n");
+
+	// A client that leaves early frees its slot
+	client = connect_client();
+	pump(s);
+	close(client);
+	pump(s);
+	pump(s);
+
+	for (i = 0; i < SCRAPE_MAX_CLIENTS; i++) {
+		CHECK_EQ(s->clients[i].socket, -1);
+	}
+}
+
+static void test_eviction(Scraper *s)
+{
+	static char response[SCRAPE_HEADER_SIZE + SCRAPE_BODY_SIZE];
+	int clients[SCRAPE_MAX_CLIENTS + 2];
+	const ULONG accepts = s->accepts;
+	int i, round;
+
+	// Idle clients fill every slot
+	for (i = 0; i < SCRAPE_MAX_CLIENTS; i++) {
+		clients[i] = connect_client();
+	}
+
+	for (round = 0; round < ROUNDS && s->accepts < accepts + SCRAPE_MAX_CLIENTS; round++) {
+		pump(s);
+	}
+
+	CHECK_EQ(s->accepts, accepts + SCRAPE_MAX_CLIENTS);
+	CHECK_EQ(s->dropped, 0);
+
+	// Each new one takes the slot of the oldest
+	for (i = SCRAPE_MAX_CLIENTS; i < SCRAPE_MAX_CLIENTS + 2; i++) {
+		clients[i] = connect_client();
+
+		for (round = 0; round < ROUNDS && s->accepts < accepts + i + 1; round++) {
+			pump(s);
+		}
+
+		CHECK_EQ(s->dropped, i - SCRAPE_MAX_CLIENTS + 1);
+	}
+
+	// The first two were closed without a response
+	CHECK_EQ(read_response(s, clients[0], response, sizeof(response)), 0);
+	CHECK_EQ(read_response(s, clients[1], response, sizeof(response)), 0);
+
+	// The rest are still served, newest first
+	for (i = SCRAPE_MAX_CLIENTS + 1; i >= 2; i--) {
+		send_text(clients[i], "GET /metrics HTTP/1.0\r\n\r\n");
+
+		const int length = read_response(s, clients[i], response, sizeof(response));
+
+		CHECK(strcmp(check_response(response, length, "200 OK\r\n"), expected_body) == 0);
+	}
+
+	CHECK_EQ(s->dropped, 2);
+}
+
+int main(void)
+{
+	static Scraper s;
+	struct sockaddr_in addr;
+	socklen_t size = sizeof(addr);
+	int i;
+
+	// A client closing early must not stop the test
+	signal(SIGPIPE, SIG_IGN);
+
+	// Any free port
+	CHECK(scrape_open(&s, 0, body, &bodies));
+	CHECK(getsockname(s.listener, (struct sockaddr *)&addr, &size) == 0);
+	port = ntohs(addr.sin_port);
+
+	test_requests(&s);
+	test_partial(&s);
+	test_eviction(&s);
+
+	scrape_close(&s);
+	CHECK_EQ(s.listener, -1);
+
+	for (i = 0; i < SCRAPE_MAX_CLIENTS; i++) {
+		CHECK_EQ(s.clients[i].socket, -1);
+	}
+
+	return test_result("scrape");
+}
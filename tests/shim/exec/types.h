@@ -0,0 +1,23 @@
+#ifndef EXEC_TYPES_H
+#define EXEC_TYPES_H
+
+/*
+
+Host stand-in for the AmigaOS types, so the networking modules can be
+built and tested with the host compiler. Only what they use is here.
+
+*/
+
+#include <stdint.h>
+
+typedef int32_t LONG;
+typedef uint32_t ULONG;
+typedef int16_t BOOL;
+typedef uint64_t uint64;
+
+#define TRUE 1
+#define FALSE 0
+
+#define TAG_END 0
+
+#endif
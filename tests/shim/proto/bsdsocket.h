@@ -0,0 +1,35 @@
+#ifndef PROTO_BSDSOCKET_H
+#define PROTO_BSDSOCKET_H
+
+/*
+
+Host stand-in for bsdsocket.library: the BSD calls are the POSIX ones, and
+the Amiga-only ones map to their POSIX counterparts or do nothing.
+
+*/
+
+#include <exec/types.h>
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+
+#define CloseSocket(socket) close(socket)
+#define IoctlSocket(socket, request, argp) ioctl(socket, request, argp)
+#define WaitSelect(nfds, read, write, except, timeout, signals) select(nfds, read, write, except, timeout)
+#define Errno() errno
+
+// There are no signals to break on
+#define SBTM_SETVAL(tag) (tag)
+#define SBTC_BREAKMASK 0
+
+static inline LONG SocketBaseTags(ULONG tag, ...)
+{
+	(void)tag;
+
+	return 0;
+}
+
+#endif
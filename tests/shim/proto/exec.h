@@ -0,0 +1,6 @@
+#ifndef PROTO_EXEC_H
+#define PROTO_EXEC_H
+
+#include <exec/types.h>
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef TEST_H
+#define TEST_H
+
+/*
+
+Minimal assertion helpers for the host-side unit tests. A failed check is
+reported with its location and the test keeps going, main() returns the
+failure count through test_result().
+
+*/
+
+#include <stdio.h>
+
+static int test_failures;
+
+#define CHECK(cond) do { \
+	if (!(cond)) { \
+		printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+		test_failures++; \
+	} \
+} while (0)
+
+#define CHECK_EQ(a, b) do { \
+	const long long _a = (long long)(a); \
+	const long long _b = (long long)(b); \
+	if (_a != _b) { \
+		printf("%s:%d: %s == %s failed: %lld != %lld\n", __FILE__, __LINE__, #a, #b, _a, _b); \
+		test_failures++; \
+	} \
+} while (0)
+
+static inline int test_result(const char *name)
+{
+	printf("%s: %s\n", name, test_failures ? "FAILED" : "ok");
+	return test_failures ? 1 : 0;
+}
+
+#endif
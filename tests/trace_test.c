@@ -0,0 +1,224 @@
+/*
+
+Tests of the trace codec. Records with edge values, counters that go
+backwards and every combination of the optional fields are written to a
+file and read back, and must come out exactly as they went in. Records cut
+short, malformed ones and traces of the first version are checked on their
+own.
+
+*/
+
+#include "test.h"
+#include "../trace.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#define TRACE "tests/trace_test.tmp"
+#define RECORDS 20000
+
+static TraceRecord records[RECORDS];
+
+static uint32_t edge32(void)
+{
+	switch (rand() % 4) {
+		case 0:
+			return 0;
+		case 1:
+			return UINT32_MAX;
+		default:
+			return (uint32_t)rand() << (rand() % 16);
+	}
+}
+
+static uint64_t edge64(uint64_t last)
+{
+	switch (rand() % 6) {
+		case 0:
+			return 0;
+		case 1:
+			return UINT64_MAX;
+		case 2: // Reset counter
+			return last - rand() % 1000;
+		default:
+			return last + rand() % 100000;
+	}
+}
+
+static void make_records(void)
+{
+	uint64_t time = 0;
+	int i;
+
+	memset(records, 0, sizeof(records));
+
+	for (i = 0; i < RECORDS; i++) {
+		TraceRecord *r = &records[i];
+
+		time += rand() % 4 ? 1000000 : (uint64_t)rand() * rand();
+		r->time = i == RECORDS - 1 ? UINT64_MAX : time;
+		r->cpu = rand() % 101;
+		r->virtual_mem = i % 2 ? 255 : 0;
+		r->video_mem = rand();
+		r->net_in = edge64(i ? records[i - 1].net_in : 0);
+		r->net_out = edge64(i ? records[i - 1].net_out : 0);
+		r->fields = i % (TRACE_FIELDS + 1);
+
+		// Absent fields read back as zero
+		if (r->fields & TRACE_DISK) {
+			r->disk_read = edge32();
+			r->disk_write = edge32();
+		}
+
+		if (r->fields & TRACE_LATENCY) {
+			r->latency_p50 = edge32();
+			r->latency_p99 = edge32();
+			r->latency_max = edge32();
+		}
+
+		if (r->fields & TRACE_DISPATCHES) {
+			r->dispatches = edge32();
+		}
+	}
+}
+
+static int same(const TraceRecord *a, const TraceRecord *b)
+{
+	return a->time == b->time && a->cpu == b->cpu && a->virtual_mem == b->virtual_mem &&
+		a->video_mem == b->video_mem && a->net_in == b->net_in && a->net_out == b->net_out &&
+		a->fields == b->fields && a->disk_read == b->disk_read && a->disk_write == b->disk_write &&
+		a->latency_p50 == b->latency_p50 && a->latency_p99 == b->latency_p99 &&
+		a->latency_max == b->latency_max && a->dispatches == b->dispatches;
+}
+
+static void test_round_trip(void)
+{
+	TraceRecord record;
+	Trace trace;
+	int i;
+
+	CHECK(trace_create(&trace, TRACE));
+
+	for (i = 0; i < RECORDS; i++) {
+		CHECK(trace_write(&trace, &records[i]));
+	}
+
+	trace_close(&trace);
+
+	CHECK(trace_open(&trace, TRACE));
+	CHECK_EQ(trace.version, TRACE_VERSION);
+
+	for (i = 0; i < RECORDS; i++) {
+		if (!trace_read(&trace, &record) || !same(&record, &records[i])) {
+			printf("record %d differs\n", i);
+			test_failures++;
+			break;
+		}
+	}
+
+	CHECK(!trace_read(&trace, &record));
+	CHECK_EQ(trace.records, RECORDS);
+
+	trace_close(&trace);
+}
+
+static void test_codec(void)
+{
+	unsigned char out[TRACE_MAX_RECORD + 1];
+	TraceRecord last, record, decoded;
+	int length, i;
+
+	// The largest record fits
+	memset(&last, 0, sizeof(last));
+	memset(&record, 0, sizeof(record));
+	record.time = UINT64_MAX;
+	record.net_in = (uint64_t)INT64_MAX + 1;
+	record.net_out = INT64_MAX;
+	record.fields = TRACE_FIELDS;
+	record.disk_read = record.disk_write = UINT32_MAX;
+	record.latency_p50 = record.latency_p99 = record.latency_max = UINT32_MAX;
+	record.dispatches = UINT32_MAX;
+
+	length = trace_encode(&last, &record, out);
+	CHECK_EQ(length, TRACE_MAX_RECORD);
+	CHECK_EQ(trace_decode(&last, TRACE_VERSION, out, length, &decoded), length);
+	CHECK(same(&decoded, &record));
+
+	// Cut short anywhere
+	for (i = 0; i < length; i++) {
+		CHECK_EQ(trace_decode(&last, TRACE_VERSION, out, i, &decoded), 0);
+	}
+
+	// Fields this version doesn't know
+	out[length - 31] = 0x08;
+	CHECK_EQ(trace_decode(&last, TRACE_VERSION, out, length, &decoded), -1);
+
+	// A field too large for its type
+	memset(&record, 0, sizeof(record));
+	record.fields = TRACE_DISPATCHES;
+	length = trace_encode(&last, &record, out);
+	out[length - 1] = 0x80;
+	memcpy(out + length, "\x80\x80\x80\x80\x01", 5);
+	CHECK_EQ(trace_decode(&last, TRACE_VERSION, out, length + 5, &decoded), -1);
+}
+
+// The first version ends records after the network counters
+static void test_version1(void)
+{
+	static const unsigned char v1[] = {
+		'C', 'P', 'W', 'T', 1, 0, 0, 0,
+		0xc0, 0x84, 0x3d, 50, 60, 70, 0x02, 0x01,
+		0xc0, 0x84, 0x3d, 51, 61, 71, 0x03, 0x00
+	};
+	TraceRecord record;
+	Trace trace;
+	FILE *file;
+
+	file = fopen(TRACE, "wb");
+	CHECK(file != NULL);
+	fwrite(v1, sizeof(v1), 1, file);
+	fclose(file);
+
+	CHECK(trace_open(&trace, TRACE));
+	CHECK_EQ(trace.version, 1);
+
+	CHECK(trace_read(&trace, &record));
+	CHECK_EQ(record.time, 1000000);
+	CHECK_EQ(record.cpu, 50);
+	CHECK_EQ(record.net_in, 1);
+	CHECK_EQ(record.net_out, (uint64_t)-1);
+	CHECK_EQ(record.fields, 0);
+
+	CHECK(trace_read(&trace, &record));
+	CHECK_EQ(record.time, 2000000);
+	CHECK_EQ(record.video_mem, 71);
+	CHECK_EQ(record.net_in, 1 - 2);
+	CHECK_EQ(record.net_out, (uint64_t)-1);
+
+	CHECK(!trace_read(&trace, &record));
+	trace_close(&trace);
+
+	// Versions not known yet aren't read
+	file = fopen(TRACE, "wb");
+	CHECK(file != NULL);
+	fwrite(v1, sizeof(v1), 1, file);
+	fseek(file, 4, SEEK_SET);
+	fputc(TRACE_VERSION + 1, file);
+	fclose(file);
+
+	CHECK(!trace_open(&trace, TRACE));
+}
+
+int main(void)
+{
+	srand(34);
+
+	make_records();
+	test_round_trip();
+	test_codec();
+	test_version1();
+
+	remove(TRACE);
+
+	return test_result("trace");
+}
@@ -0,0 +1,168 @@
+/*
+
+Tests of the sliding least-squares trend. Millions of samples are pushed
+through the window and every few thousand the running sums are compared
+exactly, and the fit closely, against a direct refit of the samples that
+are in the window at that point.
+
+*/
+
+#include "test.h"
+#include "../trend.h"
+
+#include <math.h>
+#include <stdlib.h>
+
+#define SLIDE_SAMPLES 5000000
+#define CHECK_EVERY 9973
+
+static int close_to(double a, double b, double tolerance)
+{
+	return fabs(a - b) <= tolerance * fmax(1.0, fmax(fabs(a), fabs(b)));
+}
+
+// Two passes over the window in doubles, the textbook way. Returns the residual sum of squares.
+static double refit(const int *window, int n, double *slope, double *current, double *t)
+{
+	double mean_x = (n - 1) / 2.0, mean_y = 0.0, sxx = 0.0, sxy = 0.0, sse = 0.0;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		mean_y += window[i];
+	}
+
+	mean_y /= n;
+
+	for (i = 0; i < n; i++) {
+		sxx += (i - mean_x) * (i - mean_x);
+		sxy += (i - mean_x) * (window[i] - mean_y);
+	}
+
+	*slope = sxy / sxx;
+	*current = mean_y + *slope * (n - 1 - mean_x);
+
+	for (i = 0; i < n; i++) {
+		const double residual = window[i] - (mean_y + *slope * (i - mean_x));
+		sse += residual * residual;
+	}
+
+	*t = *slope / sqrt(sse / (n - 2) / sxx);
+
+	return sse;
+}
+
+static void compare(const Trend *trend, const int *ring, int capacity, int newest)
+{
+	static int window[4096];
+	const int n = trend->count;
+	int64_t sum_x = 0, sum_y = 0, sum_xx = 0, sum_xy = 0, sum_yy = 0;
+	double slope, current, t;
+	double ref_slope, ref_current, ref_t;
+	int i;
+
+	// Oldest first
+	for (i = 0; i < n; i++) {
+		window[i] = ring[(newest - n + 1 + i + capacity) % capacity];
+
+		sum_x += i;
+		sum_y += window[i];
+		sum_xx += (int64_t)i * i;
+		sum_xy += (int64_t)i * window[i];
+		sum_yy += (int64_t)window[i] * window[i];
+	}
+
+	CHECK_EQ(trend->sum_x, sum_x);
+	CHECK_EQ(trend->sum_y, sum_y);
+	CHECK_EQ(trend->sum_xx, sum_xx);
+	CHECK_EQ(trend->sum_xy, sum_xy);
+	CHECK_EQ(trend->sum_yy, sum_yy);
+
+	CHECK(trend_fit(trend, &slope, &current, &t));
+	const double sse = refit(window, n, &ref_slope, &ref_current, &ref_t);
+
+	CHECK(close_to(slope, ref_slope, 1e-9));
+	CHECK(close_to(current, ref_current, 1e-9));
+
+	// A window on a straight line has no meaningful t to compare
+	if (sse > 1e-6) {
+		CHECK(close_to(t, ref_t, 1e-6));
+	}
+}
+
+// A random walk with occasional jumps, clamped to 0...max
+static void slide(int capacity, int max)
+{
+	static int ring[4096];
+	Trend trend;
+	int value = max / 2;
+	long i;
+
+	trend_init(&trend, capacity);
+
+	for (i = 0; i < SLIDE_SAMPLES; i++) {
+		const int slot = i % capacity;
+
+		value += rand() % 7 - 3;
+
+		if (rand() % 1000 == 0) {
+			value = rand() % (max + 1);
+		}
+
+		value = value < 0 ? 0 : value > max ? max : value;
+
+		trend_add(&trend, value, ring[slot]);
+		ring[slot] = value;
+
+		if (i % CHECK_EVERY == CHECK_EVERY - 1 || i == capacity - 1) {
+			compare(&trend, ring, capacity, slot);
+		}
+	}
+
+	CHECK_EQ(trend.count, capacity);
+}
+
+static void test_small(void)
+{
+	Trend trend;
+	double slope, current, t;
+	int i;
+
+	trend_init(&trend, 10);
+
+	trend_add(&trend, 5, 0);
+	trend_add(&trend, 7, 0);
+	CHECK(!trend_fit(&trend, &slope, &current, &t));
+
+	// An exact line has no residual, the slope is infinitely significant
+	trend_add(&trend, 9, 0);
+	CHECK(trend_fit(&trend, &slope, &current, &t));
+	CHECK(close_to(slope, 2.0, 1e-12));
+	CHECK(close_to(current, 9.0, 1e-12));
+	CHECK(isinf(t) && t > 0);
+
+	// A flat line has no slope and no significance
+	trend_init(&trend, 4);
+
+	for (i = 0; i < 20; i++) {
+		trend_add(&trend, 42, 42);
+	}
+
+	CHECK(trend_fit(&trend, &slope, &current, &t));
+	CHECK(slope == 0.0);
+	CHECK(close_to(current, 42.0, 1e-12));
+	CHECK(t == 0.0);
+}
+
+int main(void)
+{
+	srand(40);
+
+	test_small();
+
+	// Graph levels over the longest span, and wide values in a short window
+	slide(3600, 100);
+	slide(600, 65535);
+	slide(3, 100);
+
+	return test_result("trend");
+}
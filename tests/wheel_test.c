@@ -0,0 +1,257 @@
+/*
+
+Tests of the timer wheel. Thousands of jobs with periods from below one tick
+to many revolutions are dispatched while the clock jumps to the earliest
+deadline, steps at random and stalls. Every run is checked against the
+deadline the job had: never early, late by no more than the step, and the
+earliest deadline reported is compared against a search of all the jobs.
+
+*/
+
+#include "test.h"
+#include "../wheel.h"
+
+#include <stdlib.h>
+
+#define JOBS 5000
+#define TICK 10000
+#define COMPARE_EVERY 61 // Steps between searches of all the jobs
+
+typedef struct {
+	WheelJob job;
+	uint64_t expected; // Deadline of the next run
+	long runs;
+} TestJob;
+
+static TestJob jobs[JOBS];
+static Wheel wheel;
+static uint64_t now;
+
+static uint64_t latest; // Largest lateness seen
+static long early;
+static int removing; // A run removes the job this many places on, and itself after a few runs
+
+static void run_job(void *data)
+{
+	TestJob *j = data;
+	const uint64_t next = j->expected + j->job.period;
+
+	if (now < j->expected) {
+		early++;
+	} else if (now - j->expected > latest) {
+		latest = now - j->expected;
+	}
+
+	// Already requeued for the next run, on the same phase unless that was missed
+	CHECK(j->job.prev != NULL);
+	CHECK_EQ(j->job.due, next > now ? next : now + j->job.period);
+
+	j->expected = j->job.due;
+	j->runs++;
+
+	if (removing) {
+		wheel_remove(&jobs[(j - jobs + removing) % JOBS].job);
+
+		if (j->runs == 3) {
+			wheel_remove(&j->job);
+		}
+	}
+}
+
+static int brute_next(uint64_t *due)
+{
+	int found = 0;
+	int i;
+
+	for (i = 0; i < JOBS; i++) {
+		if (jobs[i].job.prev && (!found || jobs[i].job.due < *due)) {
+			*due = jobs[i].job.due;
+			found = 1;
+		}
+	}
+
+	return found;
+}
+
+static int queued(void)
+{
+	int count = 0;
+	int i;
+
+	for (i = 0; i < JOBS; i++) {
+		count += jobs[i].job.prev != NULL;
+	}
+
+	return count;
+}
+
+static void setup(void)
+{
+	// Below a tick and a few ticks. These always share the nearest slots, so there are only a few.
+	static const uint32_t fast[] = { 7000, 10000, 15000 };
+
+	// Up to a revolution and many revolutions
+	static const uint32_t slow[] = { 100000, 250000, 1000000, 2560000, 3000000, 60000000 };
+	int i;
+
+	now = 123456789;
+	wheel_init(&wheel, TICK, now);
+	removing = 0;
+
+	for (i = 0; i < JOBS; i++) {
+		const uint32_t period = (i % 50 ? slow[i % 6] : fast[i / 50 % 3]) + rand() % 1000;
+
+		jobs[i].job.run = run_job;
+		jobs[i].job.data = &jobs[i];
+		jobs[i].runs = 0;
+
+		// As if added at some point during the last period
+		wheel_add(&wheel, &jobs[i].job, period, now - rand() % period);
+		jobs[i].expected = jobs[i].job.due;
+	}
+}
+
+// Sleep to the earliest deadline every time, like the timer does
+static void test_exact(void)
+{
+	const uint64_t end = now + 20000000;
+	uint64_t due, expected = 0;
+	long total = 0, steps = 0;
+	int i;
+
+	latest = 0;
+	early = 0;
+
+	while (now < end) {
+		CHECK(wheel_next(&wheel, &due));
+
+		if (steps++ % COMPARE_EVERY == 0) {
+			CHECK(brute_next(&expected));
+			CHECK_EQ(due, expected);
+		}
+
+		now = due;
+		const int ran = wheel_run(&wheel, now);
+
+		CHECK(ran > 0);
+		total += ran;
+
+		// Nothing left behind that was due
+		CHECK(wheel_next(&wheel, &due));
+		CHECK(due > now);
+	}
+
+	CHECK_EQ(early, 0);
+	CHECK_EQ(latest, 0);
+
+	// Every job ran once per period, up to the one it waits for now
+	for (i = 0; i < JOBS; i++) {
+		const uint64_t first = jobs[i].job.due - (uint64_t)jobs[i].runs * jobs[i].job.period;
+
+		CHECK(first > end - 20000000 && first <= end - 20000000 + jobs[i].job.period);
+		CHECK(jobs[i].job.due > now && jobs[i].job.due <= now + jobs[i].job.period);
+	}
+
+	CHECK(total > 100000);
+}
+
+// Coarse random steps: a run is late by less than the step
+static void test_stepped(void)
+{
+	const uint64_t end = now + 20000000;
+	const uint64_t step = 50000;
+	long total = 0;
+
+	latest = 0;
+	early = 0;
+
+	while (now < end) {
+		now += 1 + rand() % step;
+		total += wheel_run(&wheel, now);
+	}
+
+	CHECK_EQ(early, 0);
+	CHECK(latest < step);
+	CHECK(total > 100000);
+}
+
+// After a stall every job runs once and skips the missed runs
+static void test_stall(void)
+{
+	int i;
+
+	for (i = 0; i < JOBS; i++) {
+		jobs[i].runs = 0;
+	}
+
+	now += 100000000;
+	CHECK_EQ(wheel_run(&wheel, now), JOBS);
+
+	for (i = 0; i < JOBS; i++) {
+		CHECK_EQ(jobs[i].runs, 1);
+
+		// A job keeps its phase when that's still ahead
+		CHECK(jobs[i].job.due > now && jobs[i].job.due <= now + jobs[i].job.period);
+	}
+
+	CHECK_EQ(wheel_run(&wheel, now), 0);
+}
+
+// Jobs that remove each other while the wheel runs them
+static void test_remove(void)
+{
+	uint64_t due, expected = 0;
+	int steps = 0;
+	int i;
+
+	setup();
+
+	// Some are removed up front and must never run
+	for (i = 0; i < JOBS; i += 3) {
+		wheel_remove(&jobs[i].job);
+		CHECK(jobs[i].job.prev == NULL);
+	}
+
+	// Removing twice is harmless
+	wheel_remove(&jobs[0].job);
+	CHECK_EQ(queued(), JOBS - (JOBS + 2) / 3);
+
+	removing = 1;
+	latest = 0;
+	early = 0;
+
+	while (wheel_next(&wheel, &due)) {
+		if (steps++ % COMPARE_EVERY == 0) {
+			CHECK(brute_next(&expected));
+			CHECK_EQ(due, expected);
+		}
+
+		now = due;
+		wheel_run(&wheel, now);
+	}
+
+	CHECK(!brute_next(&expected));
+	CHECK_EQ(early, 0);
+	CHECK(steps > 100);
+
+	for (i = 0; i < JOBS; i++) {
+		CHECK(jobs[i].runs <= 3);
+
+		if (i % 3 == 0) {
+			CHECK_EQ(jobs[i].runs, 0);
+		}
+	}
+}
+
+int main(void)
+{
+	srand(43);
+
+	setup();
+	test_exact();
+	test_stepped();
+	test_stall();
+	test_remove();
+
+	return test_result("wheel");
+}
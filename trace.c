@@ -0,0 +1,263 @@
+/*
+
+Trace file writer and reader. Uses only stdio, so traces recorded on the
+Amiga can be inspected and replayed on any host.
+
+*/
+
+#include "trace.h"
+#include "varint.h"
+
+#include <string.h>
+
+static const unsigned char trace_magic[8] = { 'C', 'P', 'W', 'T', TRACE_VERSION, 0, 0, 0 };
+
+#define VERSION_BYTE 4
+
+int trace_encode(const TraceRecord *last, const TraceRecord *record, unsigned char *out)
+{
+	int n = 0;
+
+	n += varint_put(out + n, record->time - last->time);
+
+	out[n++] = record->cpu;
+	out[n++] = record->virtual_mem;
+	out[n++] = record->video_mem;
+
+	// Counters can be reset (interface restarted), hence signed deltas
+	n += varint_put(out + n, zigzag_encode((int64_t)(record->net_in - last->net_in)));
+	n += varint_put(out + n, zigzag_encode((int64_t)(record->net_out - last->net_out)));
+
+	out[n++] = record->fields;
+
+	if (record->fields & TRACE_DISK) {
+		n += varint_put(out + n, record->disk_read);
+		n += varint_put(out + n, record->disk_write);
+	}
+
+	if (record->fields & TRACE_LATENCY) {
+		n += varint_put(out + n, record->latency_p50);
+		n += varint_put(out + n, record->latency_p99);
+		n += varint_put(out + n, record->latency_max);
+	}
+
+	if (record->fields & TRACE_DISPATCHES) {
+		n += varint_put(out + n, record->dispatches);
+	}
+
+	return n;
+}
+
+// Returns the bytes consumed like trace_decode
+static int get_field(const unsigned char *in, int length, uint32_t *field)
+{
+	uint64_t value;
+	const int used = varint_get(in, length, &value);
+
+	if (!used) {
+		return length < VARINT_MAX_BYTES ? 0 : -1;
+	}
+
+	if (value > UINT32_MAX) {
+		return -1;
+	}
+
+	*field = (uint32_t)value;
+
+	return used;
+}
+
+int trace_decode(const TraceRecord *last, int version, const unsigned char *in, int length, TraceRecord *record)
+{
+	uint32_t *fields[6];
+	uint64_t value;
+	int count = 0;
+	int n = 0;
+	int used;
+	int i;
+
+	if (!(used = varint_get(in, length, &value))) {
+		return 0;
+	}
+
+	n += used;
+	record->time = last->time + value;
+
+	if (length - n < 3) {
+		return 0;
+	}
+
+	record->cpu = in[n++];
+	record->virtual_mem = in[n++];
+	record->video_mem = in[n++];
+
+	if (!(used = varint_get(in + n, length - n, &value))) {
+		return 0;
+	}
+
+	n += used;
+	record->net_in = last->net_in + zigzag_decode(value);
+
+	if (!(used = varint_get(in + n, length - n, &value))) {
+		return 0;
+	}
+
+	n += used;
+	record->net_out = last->net_out + zigzag_decode(value);
+
+	record->fields = 0;
+	record->disk_read = record->disk_write = 0;
+	record->latency_p50 = record->latency_p99 = record->latency_max = 0;
+	record->dispatches = 0;
+
+	if (version < 2) {
+		return n;
+	}
+
+	if (length - n < 1) {
+		return 0;
+	}
+
+	record->fields = in[n++];
+
+	if (record->fields & ~TRACE_FIELDS) {
+		return -1;
+	}
+
+	if (record->fields & TRACE_DISK) {
+		fields[count++] = &record->disk_read;
+		fields[count++] = &record->disk_write;
+	}
+
+	if (record->fields & TRACE_LATENCY) {
+		fields[count++] = &record->latency_p50;
+		fields[count++] = &record->latency_p99;
+		fields[count++] = &record->latency_max;
+	}
+
+	if (record->fields & TRACE_DISPATCHES) {
+		fields[count++] = &record->dispatches;
+	}
+
+	for (i = 0; i < count; i++) {
+		if ((used = get_field(in + n, length - n, fields[i])) <= 0) {
+			return used;
+		}
+
+		n += used;
+	}
+
+	return n;
+}
+
+static void trace_reset(Trace *trace, FILE *file)
+{
+	memset(trace, 0, sizeof(Trace));
+	trace->file = file;
+}
+
+int trace_create(Trace *trace, const char *file_name)
+{
+	FILE *file = fopen(file_name, "wb");
+
+	if (!file) {
+		return 0;
+	}
+
+	trace_reset(trace, file);
+	trace->version = TRACE_VERSION;
+
+	// Records are small, let stdio collect them into whole blocks
+	setvbuf(file, NULL, _IOFBF, TRACE_BUFFER_SIZE);
+
+	if (fwrite(trace_magic, sizeof(trace_magic), 1, file) != 1) {
+		trace_close(trace);
+		return 0;
+	}
+
+	return 1;
+}
+
+int trace_open(Trace *trace, const char *file_name)
+{
+	unsigned char header[sizeof(trace_magic)];
+	FILE *file = fopen(file_name, "rb");
+
+	if (!file) {
+		return 0;
+	}
+
+	trace_reset(trace, file);
+
+	// Older versions are read as well
+	if (fread(header, sizeof(header), 1, file) != 1 ||
+		memcmp(header, trace_magic, VERSION_BYTE) != 0 ||
+		header[VERSION_BYTE] < 1 || header[VERSION_BYTE] > TRACE_VERSION ||
+		memcmp(header + VERSION_BYTE + 1, trace_magic + VERSION_BYTE + 1, sizeof(header) - VERSION_BYTE - 1) != 0) {
+
+		trace_close(trace);
+		return 0;
+	}
+
+	trace->version = header[VERSION_BYTE];
+
+	return 1;
+}
+
+int trace_write(Trace *trace, const TraceRecord *record)
+{
+	unsigned char out[TRACE_MAX_RECORD];
+	const int length = trace_encode(&trace->last, record, out);
+
+	if (fwrite(out, length, 1, trace->file) != 1) {
+		return 0;
+	}
+
+	trace->last = *record;
+	trace->records++;
+
+	return 1;
+}
+
+int trace_read(Trace *trace, TraceRecord *record)
+{
+	int used;
+
+	while (!(used = trace_decode(&trace->last, trace->version, trace->buffer + trace->pos,
+		trace->length - trace->pos, record))) {
+
+		// Move the partial record to the front and refill
+		const int rest = trace->length - trace->pos;
+
+		memmove(trace->buffer, trace->buffer + trace->pos, rest);
+
+		trace->length = rest;
+		trace->pos = 0;
+
+		const size_t got = fread(trace->buffer + rest, 1, TRACE_BUFFER_SIZE - rest, trace->file);
+
+		if (got == 0) {
+			return 0;
+		}
+
+		trace->length += got;
+	}
+
+	if (used < 0) {
+		return 0;
+	}
+
+	trace->pos += used;
+	trace->last = *record;
+	trace->records++;
+
+	return 1;
+}
+
+void trace_close(Trace *trace)
+{
+	if (trace->file) {
+		fclose(trace->file);
+		trace->file = NULL;
+	}
+}
@@ -0,0 +1,77 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+
+Binary sample traces for deterministic replay. A trace is an 8-byte header
+followed by delta-coded records: timestamp and network counters as varints
+relative to the previous record, the percentages as plain bytes.
+
+The fifth header byte is the version. From version 2 on a record goes on
+with a byte listing the optional fields it has, and those as varints: the
+disk rates, the latency percentiles and the dispatch rate. They are raw
+values, the replay scales them like the live probes do. Fields can't be
+skipped by a reader that doesn't know them, so new ones need a new version.
+Version 1 traces have none of them.
+
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define TRACE_VERSION 2
+
+// Optional fields
+#define TRACE_DISK 0x01
+#define TRACE_LATENCY 0x02
+#define TRACE_DISPATCHES 0x04
+#define TRACE_FIELDS (TRACE_DISK | TRACE_LATENCY | TRACE_DISPATCHES)
+
+#define TRACE_MAX_RECORD (3 * 10 + 3 + 1 + 6 * 5)
+#define TRACE_BUFFER_SIZE 4096
+
+typedef struct {
+	uint64_t time; // Microseconds
+	uint8_t cpu;
+	uint8_t virtual_mem;
+	uint8_t video_mem;
+	uint64_t net_in; // Raw byte counters
+	uint64_t net_out;
+
+	uint8_t fields; // Which of the rest were measured
+	uint32_t disk_read; // Bytes per second
+	uint32_t disk_write;
+	uint32_t latency_p50; // Microseconds
+	uint32_t latency_p99;
+	uint32_t latency_max;
+	uint32_t dispatches; // Per second
+} TraceRecord;
+
+typedef struct {
+	FILE *file;
+	int version;
+	TraceRecord last;
+	uint32_t records;
+
+	// Read buffer
+	unsigned char buffer[TRACE_BUFFER_SIZE];
+	int length;
+	int pos;
+} Trace;
+
+// Always in the current version
+int trace_encode(const TraceRecord *last, const TraceRecord *record, unsigned char *out);
+
+// Returns the number of bytes consumed, 0 if the record is incomplete and -1 if it is malformed
+int trace_decode(const TraceRecord *last, int version, const unsigned char *in, int length, TraceRecord *record);
+
+int trace_create(Trace *trace, const char *file_name);
+int trace_open(Trace *trace, const char *file_name);
+int trace_write(Trace *trace, const TraceRecord *record);
+
+// Returns 1 when a record was read, 0 at the end of the trace or a malformed record
+int trace_read(Trace *trace, TraceRecord *record);
+
+void trace_close(Trace *trace);
+
+#endif
@@ -0,0 +1,73 @@
+#include "trend.h"
+
+#include <math.h>
+#include <string.h>
+
+void trend_init(Trend *trend, int capacity)
+{
+	memset(trend, 0, sizeof(*trend));
+
+	trend->capacity = capacity;
+}
+
+void trend_add(Trend *trend, int value, int oldest)
+{
+	if (trend->count == trend->capacity) {
+		// Drop the sample at x = 0, then move the rest from x to x - 1
+		const int64_t n = trend->count - 1;
+
+		trend->sum_y -= oldest;
+		trend->sum_yy -= (int64_t)oldest * oldest;
+
+		trend->sum_xx -= 2 * trend->sum_x - n;
+		trend->sum_x -= n;
+		trend->sum_xy -= trend->sum_y;
+
+		trend->count--;
+	}
+
+	const int64_t x = trend->count;
+
+	trend->sum_x += x;
+	trend->sum_y += value;
+	trend->sum_xx += x * x;
+	trend->sum_xy += x * value;
+	trend->sum_yy += (int64_t)value * value;
+
+	trend->count++;
+}
+
+int trend_fit(const Trend *trend, double *slope, double *current, double *t)
+{
+	const int64_t n = trend->count;
+
+	if (n < 3) {
+		return 0;
+	}
+
+	// Centered sums, n times over to stay in integers
+	const int64_t sxx = n * trend->sum_xx - trend->sum_x * trend->sum_x;
+	const int64_t sxy = n * trend->sum_xy - trend->sum_x * trend->sum_y;
+	const int64_t syy = n * trend->sum_yy - trend->sum_y * trend->sum_y;
+
+	if (sxx == 0) {
+		return 0;
+	}
+
+	const double b = (double)sxy / sxx;
+	const double a = ((double)trend->sum_y - b * trend->sum_x) / n;
+
+	*slope = b;
+	*current = a + b * (n - 1);
+
+	// Residual sum of squares, clamped against rounding
+	const double sse = fmax(((double)syy - b * sxy) / n, 0.0);
+
+	if (sse == 0.0) {
+		*t = (b == 0.0) ? 0.0 : copysign(HUGE_VAL, b);
+	} else {
+		*t = b / sqrt(sse / (n - 2) / ((double)sxx / n));
+	}
+
+	return 1;
+}
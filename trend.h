@@ -0,0 +1,36 @@
+#ifndef TREND_H
+#define TREND_H
+
+/*
+
+Least-squares line over a sliding window of samples, updated in O(1) per
+sample. The x coordinates are window positions, oldest first, so when the
+window slides every x drops by one and the sums are shifted accordingly.
+Values are integers and the sums are kept in 64-bit integers, so they
+stay exact however long the window keeps sliding.
+
+*/
+
+#include <stdint.h>
+
+typedef struct {
+	int capacity;
+	int count;
+
+	int64_t sum_x;
+	int64_t sum_y;
+	int64_t sum_xx;
+	int64_t sum_xy;
+	int64_t sum_yy;
+} Trend;
+
+void trend_init(Trend *trend, int capacity);
+
+// 'oldest' is the value leaving the window, ignored until the window is full
+void trend_add(Trend *trend, int value, int oldest);
+
+// Returns 0 if there are too few samples, otherwise fills in the slope per
+// sample, the fitted value at the newest sample and the t statistic of the slope
+int trend_fit(const Trend *trend, double *slope, double *current, double *t);
+
+#endif
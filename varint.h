@@ -0,0 +1,62 @@
+#ifndef VARINT_H
+#define VARINT_H
+
+/*
+
+LEB128-style variable length integers: 7 bits per byte, high bit set on all
+but the last byte. Zigzag encoding maps small signed deltas to small codes.
+
+*/
+
+#include <stdint.h>
+
+#define VARINT_MAX_BYTES 10
+
+static inline int varint_put(unsigned char *out, uint64_t value)
+{
+	int n = 0;
+
+	while (value >= 0x80) {
+		out[n++] = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+
+	out[n++] = (unsigned char)value;
+
+	return n;
+}
+
+// Returns the number of bytes consumed, 0 if the input ends too early
+static inline int varint_get(const unsigned char *in, int length, uint64_t *value)
+{
+	uint64_t result = 0;
+	int shift = 0;
+	int n = 0;
+
+	while (n < length && n < VARINT_MAX_BYTES) {
+		const unsigned char byte = in[n++];
+
+		result |= (uint64_t)(byte & 0x7F) << shift;
+
+		if (!(byte & 0x80)) {
+			*value = result;
+			return n;
+		}
+
+		shift += 7;
+	}
+
+	return 0;
+}
+
+static inline uint64_t zigzag_encode(int64_t value)
+{
+	return ((uint64_t)value << 1) ^ (uint64_t)(value >> 63);
+}
+
+static inline int64_t zigzag_decode(uint64_t value)
+{
+	return (int64_t)(value >> 1) ^ -(int64_t)(value & 1);
+}
+
+#endif
@@ -0,0 +1,131 @@
+#include "wheel.h"
+
+#include <string.h>
+
+void wheel_init(Wheel *wheel, uint32_t tick, uint64_t now)
+{
+	memset(wheel, 0, sizeof(*wheel));
+
+	wheel->tick = tick;
+	wheel->next_tick = now / tick;
+}
+
+static void insert(Wheel *wheel, WheelJob *job)
+{
+	WheelJob **head = &wheel->slots[(job->due / wheel->tick) % WHEEL_SLOTS];
+
+	job->next = *head;
+	job->prev = head;
+
+	if (*head) {
+		(*head)->prev = &job->next;
+	}
+
+	*head = job;
+}
+
+void wheel_add(Wheel *wheel, WheelJob *job, uint32_t period, uint64_t now)
+{
+	job->period = period ? period : 1;
+	job->due = now + job->period;
+
+	insert(wheel, job);
+}
+
+void wheel_remove(WheelJob *job)
+{
+	if (!job->prev) {
+		return;
+	}
+
+	*job->prev = job->next;
+
+	if (job->next) {
+		job->next->prev = job->prev;
+	}
+
+	job->next = NULL;
+	job->prev = NULL;
+}
+
+int wheel_run(Wheel *wheel, uint64_t now)
+{
+	const uint64_t last = now / wheel->tick;
+	uint64_t t = wheel->next_tick;
+	int ran = 0;
+
+	// After a long gap every slot is visited once
+	if (last >= t + WHEEL_SLOTS) {
+		t = last - WHEEL_SLOTS + 1;
+	}
+
+	for (; t <= last; t++) {
+		WheelJob **link = &wheel->slots[t % WHEEL_SLOTS];
+
+		while (*link) {
+			WheelJob *job = *link;
+
+			if (job->due > now) {
+				link = &job->next;
+				continue;
+			}
+
+			wheel_remove(job);
+
+			job->due += job->period;
+
+			if (job->due <= now) {
+				job->due = now + job->period;
+			}
+
+			insert(wheel, job);
+
+			job->run(job->data);
+			ran++;
+
+			// The job may have removed others, so start the slot over.
+			// The ones that already ran aren't due any more.
+			link = &wheel->slots[t % WHEEL_SLOTS];
+		}
+	}
+
+	// Jobs may still fall due later within the current tick
+	wheel->next_tick = last;
+
+	return ran;
+}
+
+int wheel_next(const Wheel *wheel, uint64_t *due)
+{
+	const WheelJob *job;
+	int found = 0;
+	int i;
+
+	// Nearest tick first, a job found within one revolution is the earliest
+	for (i = 0; i < WHEEL_SLOTS; i++) {
+		const uint64_t t = wheel->next_tick + i;
+
+		for (job = wheel->slots[t % WHEEL_SLOTS]; job; job = job->next) {
+			if (job->due / wheel->tick <= t && (!found || job->due < *due)) {
+				*due = job->due;
+				found = 1;
+			}
+		}
+
+		if (found) {
+			return 1;
+		}
+	}
+
+	// Everything is further away than that
+	for (i = 0; i < WHEEL_SLOTS; i++) {
+		for (job = wheel->slots[i]; job; job = job->next) {
+			if (!found || job->due < *due) {
+				*due = job->due;
+				found = 1;
+			}
+		}
+	}
+
+	return found;
+}
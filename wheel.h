@@ -0,0 +1,47 @@
+#ifndef WHEEL_H
+#define WHEEL_H
+
+/*
+
+Hashed timer wheel for periodic jobs. A job is linked into the slot of the
+tick its deadline falls on. Jobs more than one revolution away share the
+slot with nearer ones and are skipped until their turn comes. Times are
+microseconds on any clock that doesn't go backwards.
+
+*/
+
+#include <stdint.h>
+
+#define WHEEL_SLOTS 256
+
+typedef struct WheelJob {
+	struct WheelJob *next;
+	struct WheelJob **prev; // Link that points to this job, NULL if not queued
+
+	uint64_t due;
+	uint32_t period;
+
+	void (*run)(void *data);
+	void *data;
+} WheelJob;
+
+typedef struct {
+	WheelJob *slots[WHEEL_SLOTS];
+	uint32_t tick; // Slot width in microseconds
+	uint64_t next_tick; // First tick that may still have due jobs
+} Wheel;
+
+void wheel_init(Wheel *wheel, uint32_t tick, uint64_t now);
+
+// The first run is one period from now
+void wheel_add(Wheel *wheel, WheelJob *job, uint32_t period, uint64_t now);
+void wheel_remove(WheelJob *job);
+
+// Runs the jobs that are due by now and returns how many ran. A job that
+// fell more than a period behind skips the missed runs.
+int wheel_run(Wheel *wheel, uint64_t now);
+
+// Returns 0 if there are no jobs, otherwise fills in the earliest deadline
+int wheel_next(const Wheel *wheel, uint64_t *due);
+
+#endif